@@ -0,0 +1,175 @@
+// Compressed transfer benchmark: effective download throughput of text and of incompressible data over links of different speeds
+// Build from the repository root with 'gcc -O2 -march=native -pthread -o bench/compress_bench bench/compress_bench.c' and run './bench/compress_bench [MB]'
+
+/* DEFINITIONS */
+// The peer as a library, and prepareFile for the files to transfer
+#include "peer_bench.h"
+
+#include <sys/wait.h>
+
+#define BENCH_CONTENT_NAME "bench"
+#define BENCH_TEXT_PATH "/tmp/compress_bench.log"
+#define BENCH_RANDOM_PATH "/tmp/compress_bench.dat"
+#define CODEC_ROUNDS 256
+
+
+/* UTILITY FUNCTIONS */
+int prepareText(const char *path, off_t size)
+{ // Fill path with size bytes of made up log lines unless it is already that big
+    struct stat info;
+    const char *levels[] = {"INFO", "WARN", "DEBUG", "ERROR"};
+    const char *events[] = {"connection accepted from", "request served for", "cache miss on", "retrying upload to", "checkpoint written for"};
+    if (stat(path, &info) == 0 && info.st_size == size)
+        return 1;
+    FILE *text = fopen(path, "w");
+    if (text == NULL)
+        return 0;
+    unsigned int seed = 1;
+    long second = 0;
+    while (ftello(text) < size)
+    {
+        second += rand_r(&seed) % 3;
+        fprintf(text, "2026-10-17T%02ld:%02ld:%02ld %s [worker-%d] %s 10.0.%d.%d id=%08x\n", second / 3600 % 24, second / 60 % 60, second % 60,
+            levels[rand_r(&seed) % 4], 1 + rand_r(&seed) % 16, events[rand_r(&seed) % 5], rand_r(&seed) % 256, rand_r(&seed) % 256, rand_r(&seed));
+    }
+    fflush(text);
+    int cut = ftruncate(fileno(text), size);
+    fclose(text);
+    return cut == 0;
+}
+int prepareRandom(const char *path, off_t size)
+{ // Fill path with size bytes of random binary data unless it is already that big
+    struct stat info;
+    char *buffer = (char*)malloc(TRANSFER_BUFFER_SIZE);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || buffer == NULL || fstat(fd, &info) < 0)
+        return 0;
+    if (info.st_size != size)
+    {
+        unsigned int seed = 1;
+        for (off_t written = 0; written < size; written += TRANSFER_BUFFER_SIZE)
+        {
+            for (size_t i = 0; i < TRANSFER_BUFFER_SIZE; i++)
+                buffer[i] = rand_r(&seed);
+            if (pwrite(fd, buffer, size - written < TRANSFER_BUFFER_SIZE ? size - written : TRANSFER_BUFFER_SIZE, written) <= 0)
+                return 0;
+        }
+        ftruncate(fd, size);
+    }
+    free(buffer);
+    close(fd);
+    return 1;
+}
+int startUploader(const char *path, double rate, struct sockaddr_in *addr)
+{ // Fork a peer that hosts path as BENCH_CONTENT_NAME and uploads at most rate bytes per second (0 for no limit), which stands in
+  // for the link. Its loopback address goes to addr. Returns its pid. It runs until killed
+    socklen_t length = sizeof(*addr);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    bzero(addr, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener < 0 || bind(listener, (struct sockaddr*)addr, sizeof(*addr)) < 0 || listen(listener, SOMAXCONN) < 0 ||
+        getsockname(listener, (struct sockaddr*)addr, &length) < 0)
+        return -1;
+
+    fflush(stdout); // or the child prints our buffer again
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        upload_rate = rate;
+        if (!startUploadEngine())
+            exit(1);
+        struct rpdu hosted;
+        bzero(&hosted, sizeof(hosted));
+        strcpy(hosted.content_name, BENCH_CONTENT_NAME);
+        addToHostedFiles(hosted, strdup(path), NULL);
+        watchListener(listener);
+        while (1)
+            pause();
+    }
+    close(listener);
+    return pid;
+}
+double timeDownload(const char *path, double rate, int compressed)
+{ // Download path over a link of rate bytes per second, compressed or not, into the working directory. Returns the effective MB/s,
+  // file bytes over time, 0 on failure
+    struct sockaddr_in addr;
+    struct stat info;
+    pid_t pid = startUploader(path, rate, &addr);
+    if (pid < 0)
+        return 0;
+    download_compressed = compressed;
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO), null = open("/dev/null", O_WRONLY); // downloadFile reports every file, the table does that here
+    dup2(null, STDOUT_FILENO);
+    double start = nowSeconds();
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    int downloaded = sockfd >= 0 && connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == 0 && downloadFile(sockfd, BENCH_CONTENT_NAME, NULL);
+    double elapsed = nowSeconds() - start;
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(null);
+    close(sockfd);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    downloaded = downloaded && stat(BENCH_CONTENT_NAME, &info) == 0;
+    unlink(BENCH_CONTENT_NAME);
+    return downloaded ? info.st_size / elapsed / 1e6 : 0;
+}
+void measureCodec(const char *path, const char *label)
+{ // Ratio and single-core speed of compressing and unpacking the first frames of path
+    unsigned char *raw = (unsigned char*)malloc(COMPRESS_FRAME_SIZE), *packed = (unsigned char*)malloc(COMPRESS_FRAME_SIZE);
+    unsigned char *back = (unsigned char*)malloc(COMPRESS_FRAME_SIZE);
+    int fd = open(path, O_RDONLY);
+    size_t stored = 0;
+    if (fd < 0 || pread(fd, raw, COMPRESS_FRAME_SIZE, 0) != COMPRESS_FRAME_SIZE)
+        return;
+    close(fd);
+    double start = nowSeconds();
+    for (int i = 0; i < CODEC_ROUNDS; i++)
+        stored = compressBlock(raw, COMPRESS_FRAME_SIZE, packed, COMPRESS_FRAME_SIZE - COMPRESS_FRAME_SIZE / 8 - 1);
+    double packing = nowSeconds() - start;
+    start = nowSeconds();
+    for (int i = 0; stored > 0 && i < CODEC_ROUNDS; i++)
+        decompressBlock(packed, stored, back, COMPRESS_FRAME_SIZE);
+    double unpacking = nowSeconds() - start;
+    if (stored == 0)
+        printf("%8s %10s %12.0f %12s\n", label, "stored", (double)CODEC_ROUNDS * COMPRESS_FRAME_SIZE / packing / 1e6, "-");
+    else
+        printf("%8s %10.2f %12.0f %12.0f\n", label, (double)COMPRESS_FRAME_SIZE / stored, (double)CODEC_ROUNDS * COMPRESS_FRAME_SIZE / packing / 1e6,
+            (double)CODEC_ROUNDS * COMPRESS_FRAME_SIZE / unpacking / 1e6);
+    free(raw);
+    free(packed);
+    free(back);
+}
+
+
+/* MAIN */
+int main(int argc, char *argv[])
+{ // The uploader's rate cap counts bytes on the wire, so a compressed transfer moves more of the file per second of link
+    double rates[] = {10, 100, 1000, 0};
+    off_t size = (off_t)(argc > 1 ? atof(argv[1]) : 32) << 20;
+    signal(SIGPIPE, SIG_IGN);
+    if (size <= 0 || !prepareText(BENCH_TEXT_PATH, size) || !prepareRandom(BENCH_RANDOM_PATH, size) || chdir("/tmp") < 0)
+    {
+        printf("Cannot prepare %s and %s...\n", BENCH_TEXT_PATH, BENCH_RANDOM_PATH);
+        return 1;
+    }
+
+    printf("%8s %10s %12s %12s\n", "frame", "ratio", "pack MB/s", "unpack MB/s");
+    measureCodec(BENCH_TEXT_PATH, "text");
+    measureCodec(BENCH_RANDOM_PATH, "random");
+
+    printf("\n%lld MB files, effective MB/s\n%10s %10s %10s %10s %10s\n", (long long)(size >> 20), "link MB/s", "text", "text -Z",
+        "random", "random -Z");
+    for (int i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+    {
+        char link[16];
+        snprintf(link, sizeof(link), rates[i] > 0 ? "%.0f" : "loopback", rates[i]);
+        printf("%10s %10.1f %10.1f %10.1f %10.1f\n", link, timeDownload(BENCH_TEXT_PATH, rates[i] * 1e6, 0),
+            timeDownload(BENCH_TEXT_PATH, rates[i] * 1e6, 1), timeDownload(BENCH_RANDOM_PATH, rates[i] * 1e6, 0),
+            timeDownload(BENCH_RANDOM_PATH, rates[i] * 1e6, 1));
+    }
+    return 0;
+}
@@ -0,0 +1,62 @@
+// Hashing benchmark for registration: BLAKE3 on one core, a whole file across cores, and registering it again from its cache
+// Build from the repository root with 'gcc -O2 -march=native -pthread -o bench/hash_bench bench/hash_bench.c' and run './bench/hash_bench [MB] [FILE]'
+
+/* DEFINITIONS */
+// The peer as a library, and prepareFile for the files to transfer
+#include "peer_bench.h"
+
+#define SINGLE_ROUNDS 8
+
+
+/* UTILITY FUNCTIONS */
+double timePiece()
+{ // BLAKE3 of one piece in memory, on this thread only. Returns GB/s
+    unsigned char *piece = (unsigned char*)malloc(PIECE_SIZE), hash[HASH_SIZE];
+    for (size_t i = 0; i < PIECE_SIZE; i++)
+        piece[i] = i * 31;
+    double start = nowSeconds();
+    for (int i = 0; i < SINGLE_ROUNDS; i++)
+        blake3(NULL, piece, PIECE_SIZE, hash);
+    double elapsed = nowSeconds() - start;
+    free(piece);
+    return (double)SINGLE_ROUNDS * PIECE_SIZE / elapsed / 1e9;
+}
+double timeHashFile(const char *path, off_t size, unsigned char root[HASH_SIZE])
+{ // Hash the file at path the way registering it does and copy out its root. Returns GB/s, 0 on failure
+    double start = nowSeconds();
+    struct piece_hashes *hashes = hashFile(path);
+    double elapsed = nowSeconds() - start;
+    if (hashes == NULL)
+        return 0;
+    memcpy(root, hashes->root, HASH_SIZE);
+    freePieceHashes(hashes);
+    return size / elapsed / 1e9;
+}
+
+
+/* MAIN */
+int main(int argc, char *argv[])
+{ // The cold run hashes every piece, the second one only reads the .hashes file the first one left and must agree with it
+    double megabytes = argc > 1 ? atof(argv[1]) : 1024;
+    char *path = argc > 2 ? argv[2] : "/tmp/hash_bench.dat";
+    char cache[PATH_MAX];
+    unsigned char cold[HASH_SIZE], cached[HASH_SIZE];
+    off_t size = (off_t)(megabytes * (1 << 20));
+    snprintf(cache, sizeof(cache), "%s%s", path, HASH_CACHE_SUFFIX);
+    if (size <= 0 || !prepareFile(path, size, 1, 1))
+    {
+        printf("Cannot prepare %s...\n", path);
+        return 1;
+    }
+
+    unlink(cache);
+    printf("%.0f MB file %s, %ld cores\n", megabytes, path, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%12s %10s\n", "hashing", "GB/s");
+    printf("%12s %10.2f\n", "one piece", timePiece());
+    printf("%12s %10.2f\n", "cold file", timeHashFile(path, size, cold));
+    printf("%12s %10.2f\n", "cached file", timeHashFile(path, size, cached));
+    if (memcmp(cold, cached, HASH_SIZE) != 0)
+        printf("The cached root differs from the computed one...\n");
+    unlink(cache);
+    return 0;
+}
@@ -0,0 +1,468 @@
+// Index server load generator: thousands of simulated peers over loopback send a mix of R/S/T/O/L requests at a fixed rate,
+// with throughput and latency percentiles for each registry size
+// Build from the repository root with 'gcc -O2 -pthread -o bench/load_bench bench/load_bench.c' and run
+// './bench/load_bench [REQUESTS_PER_SECOND] [SECONDS] [MIX] [WORKERS]', where MIX weighs the request types like R20,S60,T15,O4,L1
+
+/* DEFINITIONS */
+// Pull in the index server as a library. Its main is renamed so this file can provide its own
+#define main server_main
+#include "../server/server.c"
+#undef main
+
+#include <sys/wait.h>
+#include <poll.h>
+
+#define LOAD_THREADS 4
+#define FILES_PER_PEER 100
+#define FILES_PER_TRANSIENT_PEER 8
+#define PENDING_SLOTS (1 << 16)
+#define PREFILL_WINDOW 8
+#define REPLY_TIMEOUT 1.0
+#define LISTING_LIMIT 32
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_BUCKETS (28 << HISTOGRAM_SUB_BITS)
+#define LOAD_TYPES 5
+#define LOAD_CAPACITY 4
+
+const char load_types[LOAD_TYPES] = {'R', 'S', 'T', 'O', 'L'};
+
+struct pending {
+    // A request waiting for its reply, in the slot its request_id picks. intended is when the schedule said to send it, which
+    // is what latency is counted from, so a generator or server that falls behind shows up in the numbers instead of hiding it
+    uint32_t request_id;
+    int type;
+    double intended;
+};
+struct load_thread {
+    // One sender with its own socket and its own share of the rate. Its R and T requests churn registrations of transient peers
+    // "t<index>_<n>" kept apart from the prefilled ones: registered counts what R added, removed everything below it is gone again
+    int index;
+    int sockfd;
+    unsigned int seed;
+    uint32_t next_request_id;
+    long entries;
+    double rate;
+    double seconds;
+    long registered, removed;
+    long outstanding;
+    uint64_t sent[LOAD_TYPES], answered[LOAD_TYPES], errors[LOAD_TYPES], lost;
+    uint64_t histogram[LOAD_TYPES][HISTOGRAM_BUCKETS];
+    struct pending *pending;
+    pthread_t thread;
+};
+
+int load_weights[LOAD_TYPES] = {20, 60, 15, 4, 1}; // out of their sum, see parseMix
+struct sockaddr_in server_address;
+
+
+/* UTILITY FUNCTIONS */
+double nowSeconds()
+{ // Monotonic wall clock in seconds
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+int bucketOf(uint64_t us)
+{ // Histogram bucket of a latency in microseconds. Every power of two is cut into 1 << HISTOGRAM_SUB_BITS buckets, so a bucket is
+  // at most 12.5% wide whatever the scale, like an HDR histogram
+    if (us < (1 << HISTOGRAM_SUB_BITS))
+        return us;
+    int top = 63 - __builtin_clzll(us);
+    int bucket = ((top - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + ((us >> (top - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1));
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+uint64_t bucketLimit(int bucket)
+{ // The largest latency in microseconds that falls into bucket
+    if (bucket < (1 << HISTOGRAM_SUB_BITS))
+        return bucket;
+    int top = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+    uint64_t low = (uint64_t)((1 << HISTOGRAM_SUB_BITS) + (bucket & ((1 << HISTOGRAM_SUB_BITS) - 1))) << (top - HISTOGRAM_SUB_BITS);
+    return low + (1ULL << (top - HISTOGRAM_SUB_BITS)) - 1;
+}
+uint64_t percentile(const uint64_t *histogram, double fraction)
+{ // The latency in microseconds that fraction of the samples in histogram stay under, 0 if it is empty
+    uint64_t total = 0, seen = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+        total += histogram[b];
+    uint64_t rank = (uint64_t)(fraction * total + 0.999999);
+    for (int b = 0; b < HISTOGRAM_BUCKETS && total > 0; b++)
+        if ((seen += histogram[b]) >= rank)
+            return bucketLimit(b);
+    return 0;
+}
+int parseMix(const char *mix)
+{ // Read weights like "R20,S60,T15,O4,L1" into load_weights. Types left out get none. Returns 0 if it makes no sense
+    int total = 0;
+    bzero(load_weights, sizeof(load_weights));
+    for (const char *p = mix; *p != '\0'; p++)
+    {
+        const char *type = memchr(load_types, *p, LOAD_TYPES);
+        if (type == NULL)
+            return 0;
+        char *end;
+        long weight = strtol(p + 1, &end, 10);
+        if (end == p + 1 || weight < 0)
+            return 0;
+        load_weights[type - load_types] = weight;
+        total += weight;
+        p = end;
+        if (*p == '\0')
+            break;
+        if (*p != ',')
+            return 0;
+    }
+    return total > 0;
+}
+int openLoadSocket()
+{ // A UDP socket for one sender with room for bursts of replies. Returns -1 on failure
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0), size = 4 << 20;
+    if (sockfd >= 0)
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    return sockfd;
+}
+uint32_t sendLoadRequest(struct load_thread *t, char type, const void *payload, size_t length)
+{ // Send one request to the server the way a peer does. Returns its request_id
+    struct message request;
+    uint32_t request_id = t->next_request_id++;
+    request.header.version = PROTOCOL_VERSION;
+    request.header.type = type;
+    request.header.request_id = htonl(request_id);
+    request.header.length = htons(length);
+    memcpy(request.payload, payload, length);
+    sendto(t->sockfd, &request, sizeof(request.header) + length, 0, (struct sockaddr*)&server_address, sizeof(server_address));
+    return request_id;
+}
+int waitReadable(int sockfd, double seconds)
+{ // Wait up to seconds, with microsecond precision, for sockfd to have a datagram. Returns 1 if it has
+    struct pollfd readable = { .fd = sockfd, .events = POLLIN };
+    struct timespec wait = { .tv_sec = (time_t)seconds, .tv_nsec = (long)((seconds - (time_t)seconds) * 1e9) };
+    return seconds > 0 && ppoll(&readable, 1, &wait, NULL) > 0;
+}
+void makeAddress(char address[ADDRESS_SIZE], long peer)
+{ // The listener simulated peer number peer claims to serve on. Always the same, or the server would log it moving
+    snprintf(address, ADDRESS_SIZE, "10.%ld.%ld.%ld:%ld", (peer >> 16) & 255, (peer >> 8) & 255, peer & 255, 1024 + peer % 60000);
+}
+
+// PREFILL
+void *prefillPeers(void *arg)
+{ // Register FILES_PER_PEER files "c<id>" for every peer "p<n>" of this thread's share of the entries, with B requests, at most
+  // PREFILL_WINDOW of them unanswered at a time. Counts what the server accepted in registered
+    struct load_thread *t = (struct load_thread*)arg;
+    struct message reply;
+    struct bpdu batch;
+    long peers = (t->entries + FILES_PER_PEER - 1) / FILES_PER_PEER, outstanding = 0;
+    t->registered = 0;
+    for (long peer = t->index; peer < peers || outstanding > 0; peer += LOAD_THREADS)
+    {
+        for (long first = peer * FILES_PER_PEER; peer < peers && first < (peer + 1) * FILES_PER_PEER && first < t->entries; first += MAX_BATCH_ITEMS)
+        {
+            bzero(&batch, sizeof(batch));
+            snprintf(batch.peer_name, DEFAULT_NAME_SIZE, "p%ld", peer);
+            makeAddress(batch.address, peer);
+            batch.capacity = htons(LOAD_CAPACITY);
+            while (batch.count < MAX_BATCH_ITEMS && first + batch.count < (peer + 1) * FILES_PER_PEER && first + batch.count < t->entries)
+            {
+                snprintf(batch.items[batch.count].content_name, DEFAULT_NAME_SIZE, "c%ld", first + batch.count);
+                batch.count++;
+            }
+            sendLoadRequest(t, 'B', &batch, offsetof(struct bpdu, items) + batch.count * sizeof(struct batch_item));
+            outstanding++;
+        }
+        while (outstanding >= (peer < peers ? PREFILL_WINDOW : 1))
+        {
+            if (!waitReadable(t->sockfd, REPLY_TIMEOUT))
+            { // lost, the total will say so
+                outstanding = 0;
+                break;
+            }
+            ssize_t size = recv(t->sockfd, &reply, sizeof(reply), 0);
+            outstanding--;
+            if (size < (ssize_t)(sizeof(reply.header) + sizeof(struct batch_status)) || reply.header.type != 'B')
+                continue;
+            struct batch_status status;
+            memcpy(&status, reply.payload, sizeof(status));
+            for (int i = 0; i < status.count && i < MAX_BATCH_ITEMS; i++)
+                t->registered += (status.registered[i / 8] >> (i % 8)) & 1;
+        }
+    }
+    return NULL;
+}
+
+// LOAD
+void sendScheduled(struct load_thread *t, double intended)
+{ // Send the next request of the mix, drawn at random by weight, as if it had gone out at intended
+    int total = 0, pick, type = 0;
+    for (int i = 0; i < LOAD_TYPES; i++)
+        total += load_weights[i];
+    pick = rand_r(&t->seed) % total;
+    while (pick >= load_weights[type])
+        pick -= load_weights[type++];
+
+    uint32_t request_id = 0;
+    char text[MAX_PAYLOAD_SIZE];
+    long id = rand_r(&t->seed) % (t->entries > 0 ? t->entries : 1);
+    switch (load_types[type])
+    {
+        case 'R':
+        { // a new file of the current transient peer
+            struct rpdu r;
+            long peer = t->registered / FILES_PER_TRANSIENT_PEER;
+            bzero(&r, sizeof(r));
+            r.type = 'R';
+            snprintf(r.peer_name, DEFAULT_NAME_SIZE, "t%d_%ld", t->index, peer);
+            snprintf(r.content_name, DEFAULT_NAME_SIZE, "t%d_%ld", t->index, t->registered++);
+            makeAddress(r.address, (long)(t->index + 1) << 20 | (peer & 0xfffff));
+            r.capacity = htons(LOAD_CAPACITY);
+            request_id = sendLoadRequest(t, 'R', &r, sizeof(r));
+            break;
+        }
+        case 'S':
+        {
+            struct spdu s;
+            bzero(&s, sizeof(s));
+            s.type = 'S';
+            snprintf(s.peer_name, DEFAULT_NAME_SIZE, "t%d_client", t->index);
+            snprintf(s.content_name, DEFAULT_NAME_SIZE, "c%ld", id);
+            request_id = sendLoadRequest(t, 'S', &s, sizeof(s));
+            break;
+        }
+        case 'T':
+        { // the oldest transient file still registered, or one that never was once they are all gone
+            long file = t->removed < t->registered ? t->removed++ : t->registered;
+            int length = snprintf(text, sizeof(text), "t%d_%ld:t%d_%ld", t->index, file, t->index, file / FILES_PER_TRANSIENT_PEER);
+            request_id = sendLoadRequest(t, 'T', text, length);
+            break;
+        }
+        case 'O':
+        { // one datagram of the listing somewhere in the prefilled names
+            struct opdu o;
+            bzero(&o, sizeof(o));
+            o.limit = htonl(LISTING_LIMIT);
+            snprintf(o.prefix, DEFAULT_NAME_SIZE, "c%ld", id);
+            request_id = sendLoadRequest(t, 'O', &o, sizeof(o));
+            break;
+        }
+        case 'L':
+        { // the oldest transient peer leaves with all of its files
+            long peer = t->removed / FILES_PER_TRANSIENT_PEER;
+            bzero(text, DEFAULT_NAME_SIZE);
+            snprintf(text, DEFAULT_NAME_SIZE, "t%d_%ld", t->index, peer);
+            t->removed = (peer + 1) * FILES_PER_TRANSIENT_PEER < t->registered ? (peer + 1) * FILES_PER_TRANSIENT_PEER : t->registered;
+            request_id = sendLoadRequest(t, 'L', text, DEFAULT_NAME_SIZE);
+            break;
+        }
+    }
+
+    struct pending *slot = &t->pending[request_id % PENDING_SLOTS];
+    if (slot->request_id != 0)
+    { // never answered and now too old to wait for
+        t->lost++;
+        t->outstanding--;
+    }
+    slot->request_id = request_id;
+    slot->type = type;
+    slot->intended = intended;
+    t->sent[type]++;
+    t->outstanding++;
+}
+void receiveReplies(struct load_thread *t)
+{ // Take every reply that arrived and time it. Only the first datagram of a reply counts. Downloads the server charged are
+  // reported finished right away so its tickets do not pile up
+    struct message reply;
+    ssize_t size;
+    while ((size = recv(t->sockfd, &reply, sizeof(reply), MSG_DONTWAIT)) >= (ssize_t)sizeof(reply.header))
+    {
+        double now = nowSeconds();
+        uint32_t request_id = ntohl(reply.header.request_id);
+        struct pending *slot = &t->pending[request_id % PENDING_SLOTS];
+        if (slot->request_id != request_id)
+            continue;
+        double latency = now - slot->intended;
+        t->histogram[slot->type][bucketOf(latency > 0 ? (uint64_t)(latency * 1e6) : 0)]++;
+        t->answered[slot->type]++;
+        t->errors[slot->type] += reply.header.type == 'E';
+        slot->request_id = 0;
+        t->outstanding--;
+        if (reply.header.type == 'S' && size >= (ssize_t)(sizeof(reply.header) + sizeof(uint32_t)))
+        {
+            struct fpdu report;
+            memcpy(&report.ticket, reply.payload, sizeof(report.ticket));
+            report.status = 'A';
+            sendLoadRequest(t, 'F', &report, sizeof(report));
+        }
+    }
+}
+void *generateLoad(void *arg)
+{ // Send at a constant rate for the whole run whatever the replies do, an open loop like many independent peers, then wait up to
+  // REPLY_TIMEOUT for the last replies. A sender that cannot keep up sends late and its latencies say so
+    struct load_thread *t = (struct load_thread*)arg;
+    double interval = 1 / t->rate, start = nowSeconds(), next = start, end = start + t->seconds;
+    while (1)
+    {
+        double now = nowSeconds();
+        while (next <= now && next < end)
+        {
+            sendScheduled(t, next);
+            next += interval;
+        }
+        receiveReplies(t);
+        if (now >= end && (t->outstanding == 0 || now >= end + REPLY_TIMEOUT))
+            break;
+        waitReadable(t->sockfd, (next < end ? next : end + REPLY_TIMEOUT) - now);
+    }
+    t->lost += t->outstanding;
+    return NULL;
+}
+
+// SERVER
+pid_t startServer(int workers)
+{ // Fork an index server built from this source on a free loopback port, which goes to server_address. Returns its pid, -1 if it
+  // did not come up. Its per-request printing goes to /dev/null
+    socklen_t length = sizeof(server_address);
+    int probe = socket(AF_INET, SOCK_DGRAM, 0);
+    bzero(&server_address, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (probe < 0 || bind(probe, (struct sockaddr*)&server_address, sizeof(server_address)) < 0 ||
+        getsockname(probe, (struct sockaddr*)&server_address, &length) < 0)
+        return -1;
+    close(probe);
+
+    fflush(stdout); // or the child prints our buffer again
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        char port[16], threads[16];
+        char *args[] = {"server", port, "--workers", threads, NULL};
+        snprintf(port, sizeof(port), "%u", ntohs(server_address.sin_port));
+        snprintf(threads, sizeof(threads), "%d", workers);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        exit(server_main(4, args));
+    }
+
+    struct load_thread probe_thread = { .next_request_id = 1 };
+    if ((probe_thread.sockfd = openLoadSocket()) < 0)
+        return -1;
+    for (int tries = 0; tries < 50; tries++)
+    { // an H from nobody gets an E as soon as a worker runs
+        sendLoadRequest(&probe_thread, 'H', "nobody", DEFAULT_NAME_SIZE);
+        if (waitReadable(probe_thread.sockfd, 0.1))
+        {
+            close(probe_thread.sockfd);
+            return pid;
+        }
+    }
+    close(probe_thread.sockfd);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+int runSize(long entries, double rate, double seconds, int workers)
+{ // Start a fresh server, fill it with entries registrations, run the load against it and print a line for the whole mix and one
+  // for each type in it. Returns 0 if the server could not be started
+    struct load_thread *threads = (struct load_thread*)calloc(LOAD_THREADS, sizeof(struct load_thread));
+    pid_t pid = startServer(workers);
+    if (threads == NULL || pid < 0)
+        return 0;
+    long prefilled = 0;
+    for (int i = 0; i < LOAD_THREADS; i++)
+    {
+        struct load_thread *t = &threads[i];
+        t->index = i;
+        t->seed = 7919 * (i + 1);
+        t->next_request_id = 1;
+        t->entries = entries;
+        t->rate = rate / LOAD_THREADS;
+        t->seconds = seconds;
+        t->sockfd = openLoadSocket();
+        t->pending = (struct pending*)calloc(PENDING_SLOTS, sizeof(struct pending));
+        pthread_create(&t->thread, NULL, prefillPeers, t);
+    }
+    for (int i = 0; i < LOAD_THREADS; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        prefilled += threads[i].registered;
+        threads[i].registered = 0;
+    }
+    for (int i = 0; i < LOAD_THREADS; i++)
+        pthread_create(&threads[i].thread, NULL, generateLoad, &threads[i]);
+
+    static uint64_t merged[LOAD_TYPES + 1][HISTOGRAM_BUCKETS];
+    uint64_t sent[LOAD_TYPES + 1] = {0}, answered[LOAD_TYPES + 1] = {0}, errors[LOAD_TYPES + 1] = {0}, lost = 0;
+    bzero(merged, sizeof(merged));
+    for (int i = 0; i < LOAD_THREADS; i++)
+    {
+        struct load_thread *t = &threads[i];
+        pthread_join(t->thread, NULL);
+        lost += t->lost;
+        for (int type = 0; type < LOAD_TYPES; type++)
+        {
+            sent[type] += t->sent[type];
+            answered[type] += t->answered[type];
+            errors[type] += t->errors[type];
+            sent[LOAD_TYPES] += t->sent[type];
+            answered[LOAD_TYPES] += t->answered[type];
+            errors[LOAD_TYPES] += t->errors[type];
+            for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+            {
+                merged[type][b] += t->histogram[type][b];
+                merged[LOAD_TYPES][b] += t->histogram[type][b];
+            }
+        }
+        close(t->sockfd);
+        free(t->pending);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    free(threads);
+
+    if (prefilled != entries)
+        printf("Only %ld of %ld prefilled registrations were accepted...\n", prefilled, entries);
+    for (int row = 0; row <= LOAD_TYPES; row++)
+    { // the whole mix first, then every type in it
+        int type = row == 0 ? LOAD_TYPES : row - 1;
+        if (sent[type] == 0)
+            continue;
+        char label[24];
+        if (type == LOAD_TYPES)
+            snprintf(label, sizeof(label), "%ld", entries);
+        else
+            snprintf(label, sizeof(label), "%c", load_types[type]);
+        printf("%10s %10.0f %8.2f %8.2f %9llu %9llu %9llu %9llu\n", label, answered[type] / seconds, 100.0 * errors[type] / sent[type],
+            type == LOAD_TYPES ? 100.0 * lost / sent[type] : 100.0 * (sent[type] - answered[type]) / sent[type],
+            (unsigned long long)percentile(merged[type], 0.5), (unsigned long long)percentile(merged[type], 0.99),
+            (unsigned long long)percentile(merged[type], 0.999), (unsigned long long)percentile(merged[type], 1));
+    }
+    return 1;
+}
+
+
+/* MAIN */
+int main(int argc, char *argv[])
+{ // The same offered load against growing registries, each in a fresh server, so a change to a hot path shows up as a shift in
+  // throughput or in the tail at the sizes it matters for
+    long sizes[] = {1000, 10000, 100000, 1000000};
+    double rate = argc > 1 ? atof(argv[1]) : 20000, seconds = argc > 2 ? atof(argv[2]) : 5;
+    int workers = argc > 4 ? atoi(argv[4]) : 1;
+    if (rate <= 0 || seconds <= 0 || workers < 1 || workers > MAX_WORKERS || (argc > 3 && !parseMix(argv[3])))
+    {
+        printf("Run as './bench/load_bench [REQUESTS_PER_SECOND] [SECONDS] [MIX] [WORKERS]' with MIX like R20,S60,T15,O4,L1\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%.0f requests/s offered for %.0f s by %d senders, mix", rate, seconds, LOAD_THREADS);
+    for (int type = 0; type < LOAD_TYPES; type++)
+        if (load_weights[type] > 0)
+            printf(" %c%d", load_types[type], load_weights[type]);
+    printf(", %d server worker%s\n", workers, workers == 1 ? "" : "s");
+    printf("%10s %10s %8s %8s %9s %9s %9s %9s\n", "entries", "answered/s", "error %", "lost %", "p50 us", "p99 us", "p999 us", "max us");
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        if (!runSize(sizes[s], rate, seconds, workers))
+        {
+            printf("Cannot start the index server...\n");
+            return 1;
+        }
+    return 0;
+}
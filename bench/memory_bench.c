@@ -0,0 +1,69 @@
+// Registry memory benchmark for the index server
+// Build from the repository root with 'gcc -O2 -pthread -o bench/memory_bench bench/memory_bench.c' and run './bench/memory_bench'.
+// To compare with another version of the server, extract it and add -DSERVER_SOURCE='"/path/to/server.c"'
+
+/* DEFINITIONS */
+#ifndef SERVER_SOURCE
+#define SERVER_SOURCE "../server/server.c"
+#endif
+// Pull in the index server as a library. Its main is renamed so this file can provide its own
+#define main server_main
+#include SERVER_SOURCE
+#undef main
+
+#include <malloc.h>
+
+#define FILES_PER_PEER 100
+
+
+/* UTILITY FUNCTIONS */
+size_t heapBytes()
+{ // Bytes malloc has handed out and not had back, including large blocks it mapped directly
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+size_t residentBytes()
+{ // Resident set size of this process
+    long pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL)
+        return 0;
+    if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(statm);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+void makeRegistration(struct rpdu *r, long i)
+{ // Registration number i. Every FILES_PER_PEER consecutive files belong to the same peer
+    bzero(r, sizeof(*r));
+    r->type = 'R';
+    snprintf(r->peer_name, DEFAULT_NAME_SIZE, "peer%ld", i / FILES_PER_PEER);
+    snprintf(r->content_name, DEFAULT_NAME_SIZE, "file%ld", i);
+    snprintf(r->address, sizeof(r->address), "10.0.%ld.%ld:%ld", (i / FILES_PER_PEER >> 8) & 255, i / FILES_PER_PEER & 255, 1024 + i % 60000);
+}
+
+
+/* MAIN */
+int main(int argc, char *argv[])
+{ // Register a growing number of distinct files and report what each one costs on the heap and in resident memory
+    long sizes[] = {1000, 10000, 100000, 1000000};
+    struct rpdu r;
+    int duplicate;
+    long registered = 0;
+
+    initRegistry();
+    size_t heap_before = heapBytes(), resident_before = residentBytes();
+    printf("sizeof(struct hosted_file) = %zu\n", sizeof(struct hosted_file));
+    printf("%10s %16s %16s\n", "entries", "heap B/file", "resident B/file");
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        for (; registered < sizes[s]; registered++)
+        {
+            makeRegistration(&r, registered);
+            addHostedFile(&r, &duplicate);
+        }
+        printf("%10ld %16.1f %16.1f\n", registered, (double)(heapBytes() - heap_before) / registered,
+            (double)(residentBytes() - resident_before) / registered);
+    }
+    return 0;
+}
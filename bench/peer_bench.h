@@ -0,0 +1,45 @@
+// Shared by the benchmarks that drive the peer. Include it before anything else: it pulls in the peer as a library and makes the
+// files they transfer
+#ifndef PEER_BENCH_H
+#define PEER_BENCH_H
+
+/* DEFINITIONS */
+// Pull in the peer as a library. Its main is renamed so the benchmark can provide its own
+#define main client_main
+#include "../client/client.c"
+#undef main
+
+
+/* UTILITY FUNCTIONS */
+int prepareFile(const char *path, off_t size, unsigned int seed, int warm)
+{ // Fill path with size bytes of random binary data made from seed unless it is already that big. With warm set, read it once
+  // afterwards so it sits in the page cache. Returns 0 on failure
+    struct stat info;
+    int fd = open(path, O_RDWR | O_CREAT, 0644), prepared = 0;
+    char *buffer = (char*)malloc(TRANSFER_BUFFER_SIZE);
+    if (fd < 0 || buffer == NULL || fstat(fd, &info) < 0)
+        goto done;
+    if (info.st_size != size)
+    {
+        for (size_t i = 0; i < TRANSFER_BUFFER_SIZE; i++)
+            buffer[i] = rand_r(&seed);
+        for (off_t written = 0; written < size; written += TRANSFER_BUFFER_SIZE)
+        {
+            buffer[0] = written >> 20; // no two blocks alike
+            if (pwrite(fd, buffer, size - written < TRANSFER_BUFFER_SIZE ? size - written : TRANSFER_BUFFER_SIZE, written) <= 0)
+                goto done;
+        }
+        if (ftruncate(fd, size) < 0)
+            goto done;
+    }
+    while (warm && read(fd, buffer, TRANSFER_BUFFER_SIZE) > 0)
+        ;
+    prepared = 1;
+done:
+    free(buffer);
+    if (fd >= 0)
+        close(fd);
+    return prepared;
+}
+
+#endif
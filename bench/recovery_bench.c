@@ -0,0 +1,112 @@
+// Recovery benchmark for the index server's snapshot and write-ahead log
+// Build from the repository root with 'gcc -O2 -pthread -o bench/recovery_bench bench/recovery_bench.c' and run './bench/recovery_bench [DIRECTORY]'
+
+/* DEFINITIONS */
+// Pull in the index server as a library. Its main is renamed so this file can provide its own
+#define main server_main
+#include "../server/server.c"
+#undef main
+
+#include <sys/wait.h>
+
+#define FILES_PER_PEER 100
+#define LOGGED_CHANGES_PERCENT 10
+#define READY_LOOKUPS 1000
+
+
+/* UTILITY FUNCTIONS */
+double nowSeconds()
+{ // Monotonic wall clock in seconds
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+void makeRegistration(struct rpdu *r, long i)
+{ // Registration number i. Every FILES_PER_PEER consecutive files belong to the same peer
+    bzero(r, sizeof(*r));
+    r->type = 'R';
+    snprintf(r->peer_name, DEFAULT_NAME_SIZE, "peer%ld", i / FILES_PER_PEER);
+    snprintf(r->content_name, DEFAULT_NAME_SIZE, "file%ld", i);
+    snprintf(r->address, sizeof(r->address), "10.0.%ld.%ld:%ld", (i >> 8) & 255, i & 255, 1024 + i % 60000);
+    r->capacity = htons(4);
+}
+void writeState(long n)
+{ // First server life: n registrations cut into a snapshot, then LOGGED_CHANGES_PERCENT more that only reach the log
+    struct rpdu r;
+    int duplicate;
+    openState();
+    loadState();
+    for (long i = 0; i < n; i++)
+    {
+        makeRegistration(&r, i);
+        addHostedFile(&r, &duplicate);
+    }
+    takeSnapshot();
+    for (long i = n; i < n + n * LOGGED_CHANGES_PERCENT / 100; i++)
+    {
+        makeRegistration(&r, i);
+        addHostedFile(&r, &duplicate);
+    }
+}
+void recoverState(long n)
+{ // Second server life: time until S can be answered from the mapped snapshot and until the registry is fully rebuilt
+    struct spdu query;
+    struct source_list hit;
+    unsigned int seed = 12345;
+    long found = 0;
+    bzero(&query, sizeof(query));
+
+    double start = nowSeconds();
+    openState();
+    for (int i = 0; i < READY_LOOKUPS; i++)
+    { // what a worker does for S while the loader has not reached this content yet
+        snprintf(query.content_name, DEFAULT_NAME_SIZE, "file%ld", (long)(rand_r(&seed) % n));
+        found += findSnapshotSources(&query, &hit);
+    }
+    double ready_ms = (nowSeconds() - start) * 1e3;
+    loadState();
+    double loaded_ms = (nowSeconds() - start) * 1e3;
+
+    long expected = n + n * LOGGED_CHANGES_PERCENT / 100;
+    printf("%10ld %12.1f %12.2f %14.1f\n", n, (sizeof(struct snapshot_header) + n * sizeof(struct rpdu)) / 1e6, ready_ms, loaded_ms);
+    if (found != READY_LOOKUPS || registry_size != (size_t)expected)
+        printf("Unexpected result: %ld of %d lookups hit, %zu of %ld registrations recovered\n", found, READY_LOOKUPS, registry_size, expected);
+}
+int runChild(void (*phase)(long), long n)
+{ // Each server life is its own process so the second one starts from an empty registry like a restarted server would
+    fflush(stdout); // or the child prints our buffer again
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        initRegistry();
+        phase(n);
+        exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+
+/* MAIN */
+int main(int argc, char *argv[])
+{ // For each registry size, write a snapshot plus a log tail and time a restart from them
+    long sizes[] = {1000, 10000, 100000, 1000000};
+    char directory[PATH_MAX];
+    snprintf(directory, sizeof(directory), "%s", argc > 1 ? argv[1] : "/tmp/recovery_bench");
+    state_dir = directory;
+
+    printf("%10s %12s %12s %14s\n", "entries", "snapshot MB", "S ready ms", "recovered ms");
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        char command[PATH_MAX + 16];
+        snprintf(command, sizeof(command), "rm -rf '%s'", directory);
+        system(command);
+        if (!runChild(writeState, sizes[s]) || !runChild(recoverState, sizes[s]))
+        {
+            printf("Benchmark failed at %ld entries...\n", sizes[s]);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,142 @@
+// Registry micro-benchmark for the index server
+// Build from the repository root with 'gcc -O2 -pthread -o bench/registry_bench bench/registry_bench.c' and run './bench/registry_bench'
+
+/* DEFINITIONS */
+// Pull in the index server as a library. Its main is renamed so this file can provide its own
+#define main server_main
+#include "../server/server.c"
+#undef main
+
+#include <time.h>
+
+#define LOOKUP_THREADS_MAX 8
+#define THREAD_SWEEP_ENTRIES 100000
+
+#define LOOKUPS 1000000
+#define SEARCHES 10000
+#define FILES_PER_PEER 100
+
+
+/* UTILITY FUNCTIONS */
+struct lookup_worker {
+    // Per-thread arguments and result of the concurrent lookup sweep
+    pthread_t thread;
+    unsigned int seed;
+    long found;
+};
+double nowSeconds()
+{ // Monotonic wall clock in seconds
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+void* lookupWorker(void *arg)
+{ // S lookups against a registry of THREAD_SWEEP_ENTRIES files, like a server worker would run them
+    struct lookup_worker *w = (struct lookup_worker*)arg;
+    struct spdu query;
+    struct source_list hit;
+    bzero(&query, sizeof(query));
+    for (long i = 0; i < LOOKUPS; i++)
+    {
+        snprintf(query.content_name, DEFAULT_NAME_SIZE, "file%ld", (long)(rand_r(&w->seed) % THREAD_SWEEP_ENTRIES));
+        w->found += getHostedFile(query, &hit);
+    }
+    return NULL;
+}
+void makeRegistration(struct rpdu *r, long i)
+{ // Registration number i. Every FILES_PER_PEER consecutive files belong to the same peer
+    bzero(r, sizeof(*r));
+    r->type = 'R';
+    snprintf(r->peer_name, DEFAULT_NAME_SIZE, "peer%ld", i / FILES_PER_PEER);
+    snprintf(r->content_name, DEFAULT_NAME_SIZE, "file%ld", i);
+    snprintf(r->address, sizeof(r->address), "10.0.%ld.%ld:%ld", (i >> 8) & 255, i & 255, 1024 + i % 60000);
+}
+
+
+/* MAIN */
+int main(int argc, char *argv[])
+{ // For each registry size, time registration, S lookups of random registered names and a peer leaving with FILES_PER_PEER files
+    long sizes[] = {1000, 10000, 100000, 1000000};
+    struct rpdu r;
+    struct spdu query;
+    struct source_list hit;
+    unsigned int seed = 12345;
+    int duplicate;
+
+    initRegistry();
+
+    printf("%10s %14s %14s %14s %16s\n", "entries", "register ns", "lookup ns", "search us", "peer leave us");
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        long n = sizes[s];
+        double start = nowSeconds();
+        for (long i = 0; i < n; i++)
+        {
+            makeRegistration(&r, i);
+            addHostedFile(&r, &duplicate);
+        }
+        double register_ns = (nowSeconds() - start) * 1e9 / n;
+
+        long found = 0;
+        bzero(&query, sizeof(query));
+        start = nowSeconds();
+        for (long i = 0; i < LOOKUPS; i++)
+        {
+            snprintf(query.content_name, DEFAULT_NAME_SIZE, "file%ld", (long)(rand_r(&seed) % n));
+            found += getHostedFile(query, &hit);
+        }
+        double lookup_ns = (nowSeconds() - start) * 1e9 / LOOKUPS;
+
+        // Q for names containing a random three digit run, with at most one page of results
+        struct qpdu search;
+        struct query_reply result;
+        bzero(&search, sizeof(search));
+        search.mode = 'C';
+        rebuildNameIndex();
+        start = nowSeconds();
+        for (long i = 0; i < SEARCHES; i++)
+        {
+            snprintf(search.pattern, DEFAULT_NAME_SIZE, "e%03ld", (long)(rand_r(&seed) % 1000));
+            searchNames(&search, &result, MAX_QUERY_RESULTS);
+        }
+        double search_us = (nowSeconds() - start) * 1e6 / SEARCHES;
+
+        start = nowSeconds();
+        int removed = removePeerFiles("peer0");
+        double leave_us = (nowSeconds() - start) * 1e6;
+
+        printf("%10ld %14.1f %14.1f %14.2f %16.1f\n", n, register_ns, lookup_ns, search_us, leave_us);
+        if (found != LOOKUPS || removed != FILES_PER_PEER)
+            printf("Unexpected result: %ld of %d lookups hit, %d files removed\n", found, LOOKUPS, removed);
+
+        for (long p = 1; p < n / FILES_PER_PEER; p++)
+        { // Empty the registry for the next size
+            char peer[DEFAULT_NAME_SIZE];
+            snprintf(peer, DEFAULT_NAME_SIZE, "peer%ld", p);
+            removePeerFiles(peer);
+        }
+    }
+
+    // Concurrent readers only share read locks on the content shards so lookups per second should scale with cores
+    for (long i = 0; i < THREAD_SWEEP_ENTRIES; i++)
+    {
+        makeRegistration(&r, i);
+        addHostedFile(&r, &duplicate);
+    }
+    printf("\n%10s %16s\n", "threads", "lookups/s");
+    for (int threads = 1; threads <= LOOKUP_THREADS_MAX; threads *= 2)
+    {
+        struct lookup_worker workers[LOOKUP_THREADS_MAX];
+        double start = nowSeconds();
+        for (int t = 0; t < threads; t++)
+        {
+            workers[t].seed = t + 1;
+            workers[t].found = 0;
+            pthread_create(&workers[t].thread, NULL, lookupWorker, &workers[t]);
+        }
+        for (int t = 0; t < threads; t++)
+            pthread_join(workers[t].thread, NULL);
+        printf("%10d %16.0f\n", threads, threads * (double)LOOKUPS / (nowSeconds() - start));
+    }
+    return 0;
+}
@@ -0,0 +1,164 @@
+// Upload engine benchmark: many downloaders of distinct files at once, served with sendfile, with read/send and through io_uring,
+// from a cold and from a warm page cache
+// Build from the repository root with 'gcc -O2 -march=native -pthread -o bench/ring_bench bench/ring_bench.c' and run './bench/ring_bench [FILES] [MB]'
+
+/* DEFINITIONS */
+// The peer as a library, and prepareFile for the files to transfer
+#include "peer_bench.h"
+
+#include <sys/wait.h>
+
+#define BENCH_PATH_FORMAT "/tmp/ring_bench.%d.dat"
+#define BENCH_NAME_FORMAT "ring%d"
+#define UPLOAD_SENDFILE 0
+#define UPLOAD_READ_SEND 1
+#define UPLOAD_RING 2
+
+
+/* UTILITY FUNCTIONS */
+void setCache(int files, int warm)
+{ // Read every benchmark file so it sits in the page cache, or write it back and drop it from there so uploads go to the disk
+    char path[PATH_MAX];
+    char *buffer = (char*)malloc(TRANSFER_BUFFER_SIZE);
+    for (int i = 0; i < files; i++)
+    {
+        snprintf(path, sizeof(path), BENCH_PATH_FORMAT, i);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            continue;
+        if (warm)
+            while (read(fd, buffer, TRANSFER_BUFFER_SIZE) > 0)
+                ;
+        else
+        {
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        close(fd);
+    }
+    free(buffer);
+}
+int startUploader(int files, int mode, struct sockaddr_in *addr)
+{ // Fork a peer that hosts every benchmark file, with a slot for each, and uploads them the way mode says on a loopback address
+  // it writes to addr. Returns its pid. It runs until killed
+    socklen_t length = sizeof(*addr);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    bzero(addr, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener < 0 || bind(listener, (struct sockaddr*)addr, sizeof(*addr)) < 0 || listen(listener, SOMAXCONN) < 0 ||
+        getsockname(listener, (struct sockaddr*)addr, &length) < 0)
+        return -1;
+
+    fflush(stdout); // or the child prints our buffer again
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        upload_slots = files;
+        upload_with_sendfile = mode == UPLOAD_SENDFILE;
+        upload_with_ring = mode == UPLOAD_RING;
+        if (!startUploadEngine() || (upload_with_ring && upload_ring.fd < 0))
+            exit(1);
+        for (int i = 0; i < files; i++)
+        {
+            char path[PATH_MAX];
+            struct rpdu hosted;
+            bzero(&hosted, sizeof(hosted));
+            snprintf(hosted.content_name, DEFAULT_NAME_SIZE, BENCH_NAME_FORMAT, i);
+            snprintf(path, sizeof(path), BENCH_PATH_FORMAT, i);
+            addToHostedFiles(hosted, strdup(path), NULL);
+        }
+        watchListener(listener);
+        while (1)
+            pause();
+    }
+    close(listener);
+    return pid;
+}
+struct downloader {
+    // One of many simultaneous downloaders, each draining its own file
+    struct sockaddr_in *addr;
+    int file;
+    uint64_t received;
+};
+void *runDownloader(void *arg)
+{ // Thread body of one downloader: ask for its file the way a downloading peer does and throw the bytes away
+    struct downloader *d = (struct downloader*)arg;
+    struct pdu request = {'D'};
+    struct transfer_header header;
+    char *buffer = (char*)malloc(UPLOAD_BUFFER_SIZE);
+    ssize_t n;
+    bzero(request.data, STANDARD_BUF_SIZE);
+    snprintf(request.data, DEFAULT_NAME_SIZE, BENCH_NAME_FORMAT, d->file);
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd >= 0 && connect(sockfd, (struct sockaddr*)d->addr, sizeof(*d->addr)) == 0 && sendAll(sockfd, &request, sizeof(request)) &&
+        recvAll(sockfd, &header, sizeof(header)) && header.type == 'C')
+    {
+        uint64_t expected = be64toh(header.length), received = 0;
+        while (received < expected && (n = recv(sockfd, buffer, UPLOAD_BUFFER_SIZE, 0)) > 0)
+            received += n;
+        d->received = received == expected ? received : 0;
+    }
+    close(sockfd);
+    free(buffer);
+    return NULL;
+}
+double timeUploads(int files, off_t size, int mode, int warm)
+{ // Aggregate upload throughput with one downloader per file, all at once. Returns GB/s, 0 if any download failed
+    struct sockaddr_in addr;
+    setCache(files, warm);
+    pid_t pid = startUploader(files, mode, &addr);
+    if (pid < 0)
+        return 0;
+    struct downloader *d = (struct downloader*)calloc(files, sizeof(struct downloader));
+    pthread_t *threads = (pthread_t*)malloc(files * sizeof(pthread_t));
+    uint64_t received = 0;
+    double start = nowSeconds();
+    for (int i = 0; i < files; i++)
+    {
+        d[i].addr = &addr;
+        d[i].file = i;
+        pthread_create(&threads[i], NULL, runDownloader, &d[i]);
+    }
+    for (int i = 0; i < files; i++)
+    {
+        pthread_join(threads[i], NULL);
+        received += d[i].received;
+    }
+    double elapsed = nowSeconds() - start;
+    int status = 0;
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    free(threads);
+    free(d);
+    if (WIFEXITED(status)) // the child gave up before serving anything, io_uring is not available here
+        return 0;
+    return received == (uint64_t)size * files ? received / elapsed / 1e9 : 0;
+}
+
+
+/* MAIN */
+int main(int argc, char *argv[])
+{ // With a cold cache sendfile blocks the one engine thread on every disk read in turn, the ring keeps reads for all of them in
+  // flight. With a warm one it shows what the extra copy into the ring buffers costs
+    int files = argc > 1 ? atoi(argv[1]) : 64;
+    off_t size = (off_t)(argc > 2 ? atof(argv[2]) : 16) << 20;
+    signal(SIGPIPE, SIG_IGN);
+    for (int i = 0; i < files; i++)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), BENCH_PATH_FORMAT, i);
+        if (size <= 0 || !prepareFile(path, size, i + 1, 0))
+        {
+            printf("Cannot prepare %s...\n", path);
+            return 1;
+        }
+    }
+
+    printf("%d downloaders of distinct %lld MB files, aggregate GB/s (0 means not available)\n", files, (long long)(size >> 20));
+    printf("%8s %10s %10s %10s\n", "cache", "sendfile", "read/send", "io_uring");
+    for (int warm = 0; warm <= 1; warm++)
+        printf("%8s %10.2f %10.2f %10.2f\n", warm ? "warm" : "cold", timeUploads(files, size, UPLOAD_SENDFILE, warm),
+            timeUploads(files, size, UPLOAD_READ_SEND, warm), timeUploads(files, size, UPLOAD_RING, warm));
+    return 0;
+}
@@ -0,0 +1,99 @@
+// Swarm download benchmark: one downloader, a growing number of rate-limited seeders of the same file over loopback
+// Build from the repository root with 'gcc -O2 -pthread -o bench/swarm_bench bench/swarm_bench.c' and run './bench/swarm_bench [MB] [SEEDER_MB_PER_SECOND]'
+
+/* DEFINITIONS */
+// The peer as a library, and prepareFile for the files to transfer
+#include "peer_bench.h"
+
+#include <sys/wait.h>
+
+#define BENCH_DIRECTORY "/tmp"
+#define BENCH_CONTENT_NAME "swarm_bench"
+#define BENCH_SOURCE_PATH "/tmp/swarm_bench.dat"
+
+struct piece_hashes *bench_hashes; // of the benchmark file, so every piece is checked like in a real swarm
+
+
+/* UTILITY FUNCTIONS */
+pid_t startSeeder(double rate, struct source *source)
+{ // Fork a peer that hosts the benchmark file and uploads at most rate bytes per second, and describe it in source. Returns its pid.
+  // It runs until killed
+    struct sockaddr_in addr;
+    socklen_t length = sizeof(addr);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, SOMAXCONN) < 0 ||
+        getsockname(listener, (struct sockaddr*)&addr, &length) < 0)
+        return -1;
+    bzero(source, sizeof(*source));
+    snprintf(source->peer_name, DEFAULT_NAME_SIZE, "seeder%u", ntohs(addr.sin_port));
+    snprintf(source->address, sizeof(source->address), "127.0.0.1:%u", ntohs(addr.sin_port));
+
+    fflush(stdout); // or the child prints our buffer again
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        upload_rate = rate;
+        if (!startUploadEngine())
+            exit(1);
+        struct rpdu hosted;
+        bzero(&hosted, sizeof(hosted));
+        strcpy(hosted.content_name, BENCH_CONTENT_NAME);
+        memcpy(hosted.root, bench_hashes->root, HASH_SIZE);
+        addToHostedFiles(hosted, strdup(BENCH_SOURCE_PATH), bench_hashes);
+        watchListener(listener);
+        while (1)
+            pause();
+    }
+    close(listener);
+    return pid;
+}
+double timeSwarm(int seeders, double rate, off_t size)
+{ // Download the benchmark file from this many seeders at once and check it arrived whole. Returns MB/s, 0 on failure
+    struct source_list list;
+    pid_t pids[MAX_SOURCES];
+    struct stat info;
+    bzero(&list, sizeof(list));
+    for (int i = 0; i < seeders; i++)
+        pids[i] = startSeeder(rate, &list.sources[i]);
+    list.count = seeders;
+    memcpy(list.root, bench_hashes->root, HASH_SIZE);
+
+    double start = nowSeconds();
+    int downloaded = downloadSwarm(BENCH_CONTENT_NAME, &list);
+    double elapsed = nowSeconds() - start;
+    for (int i = 0; i < seeders; i++)
+    {
+        if (pids[i] > 0)
+            kill(pids[i], SIGKILL);
+        waitpid(pids[i], NULL, 0);
+    }
+    if (!downloaded || stat(BENCH_CONTENT_NAME, &info) < 0 || info.st_size != size)
+        return 0;
+    unlink(BENCH_CONTENT_NAME);
+    unlink(BENCH_CONTENT_NAME HASH_CACHE_SUFFIX);
+    return size / elapsed / 1e6;
+}
+
+
+/* MAIN */
+int main(int argc, char *argv[])
+{ // Seeders are throttled so each one stands for a peer with a limited uplink, which is what a swarm is meant to add up
+    off_t size = (off_t)(argc > 1 ? atof(argv[1]) : 256) << 20;
+    double rate = (argc > 2 ? atof(argv[2]) : 100) * 1e6;
+    signal(SIGPIPE, SIG_IGN);
+    if (size <= 0 || rate <= 0 || !prepareFile(BENCH_SOURCE_PATH, size, 1, 0) || (bench_hashes = hashFile(BENCH_SOURCE_PATH)) == NULL ||
+        chdir(BENCH_DIRECTORY) < 0)
+    {
+        printf("Cannot prepare %s...\n", BENCH_SOURCE_PATH);
+        return 1;
+    }
+
+    printf("%lld MB file, every seeder limited to %.0f MB/s\n", (long long)(size >> 20), rate / 1e6);
+    printf("%8s %10s\n", "seeders", "MB/s");
+    for (int seeders = 1; seeders <= MAX_SOURCES; seeders *= 2)
+        printf("%8d %10.1f\n", seeders, timeSwarm(seeders, rate, size));
+    return 0;
+}
@@ -0,0 +1,208 @@
+// Transfer throughput benchmark for the upload and download sides of the peer
+// Build from the repository root with 'gcc -O2 -pthread -o bench/transfer_bench bench/transfer_bench.c' and run './bench/transfer_bench [GB] [FILE]'
+
+/* DEFINITIONS */
+// The peer as a library, and prepareFile for the files to transfer
+#include "peer_bench.h"
+
+#include <sys/wait.h>
+
+#define BENCH_CONTENT_NAME "bench"
+#define CONCURRENT_FILE_SIZE (32 << 20)
+#define CONCURRENT_TOTAL_BYTES (4LL << 30)
+
+
+/* UTILITY FUNCTIONS */
+int startUploader(char *path, int with_sendfile, int slots, struct sockaddr_in *addr)
+{ // Fork a peer that hosts path as BENCH_CONTENT_NAME and serves it from its upload engine on a loopback address it writes to addr.
+  // Returns its pid. It runs until killed
+    socklen_t length = sizeof(*addr);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    bzero(addr, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener < 0 || bind(listener, (struct sockaddr*)addr, sizeof(*addr)) < 0 || listen(listener, SOMAXCONN) < 0 ||
+        getsockname(listener, (struct sockaddr*)addr, &length) < 0)
+        return -1;
+
+    fflush(stdout); // or the child prints our buffer again
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        upload_with_sendfile = with_sendfile;
+        upload_slots = slots;
+        if (!startUploadEngine())
+            exit(1);
+        struct rpdu hosted;
+        bzero(&hosted, sizeof(hosted));
+        strcpy(hosted.content_name, BENCH_CONTENT_NAME);
+        addToHostedFiles(hosted, strdup(path), NULL);
+        watchListener(listener);
+        while (1)
+            pause();
+    }
+    close(listener);
+    return pid;
+}
+void stopUploader(pid_t pid)
+{ // Kill an uploader started above and reap it
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+int requestDownload(struct sockaddr_in *addr)
+{ // Connect to the uploader and ask for its file the way a downloading peer does. Returns the socket, -1 on failure
+    struct pdu request = {'D'};
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    bzero(request.data, STANDARD_BUF_SIZE);
+    strcpy(request.data, BENCH_CONTENT_NAME);
+    if (sockfd >= 0 && (connect(sockfd, (struct sockaddr*)addr, sizeof(*addr)) < 0 || !sendAll(sockfd, &request, sizeof(request))))
+    {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+uint64_t drainDownload(int sockfd, char *buffer, size_t size)
+{ // Receive a whole upload and throw it away. Returns its length, 0 on failure
+    struct transfer_header header;
+    uint64_t received = 0, expected = 0;
+    ssize_t n;
+    if (!recvAll(sockfd, &header, sizeof(header)) || header.type != 'C')
+        return 0;
+    expected = be64toh(header.length);
+    while (received < expected && (n = recv(sockfd, buffer, size, 0)) > 0)
+        received += n;
+    return received == expected ? received : 0;
+}
+double timeUpload(char *path, int with_sendfile)
+{ // Time how long it takes to drain path from an uploader into nothing. Returns GB/s, 0 on failure
+    struct sockaddr_in addr;
+    pid_t pid = startUploader(path, with_sendfile, 1, &addr);
+    if (pid < 0)
+        return 0;
+    char *buffer = (char*)malloc(TRANSFER_BUFFER_SIZE);
+    uint64_t received = 0;
+    double start = nowSeconds();
+    int sockfd = requestDownload(&addr);
+    if (sockfd >= 0)
+        received = drainDownload(sockfd, buffer, TRANSFER_BUFFER_SIZE);
+    double elapsed = nowSeconds() - start;
+    close(sockfd);
+    free(buffer);
+    stopUploader(pid);
+    return received / elapsed / 1e9;
+}
+double timeDownload(char *path, int with_splice)
+{ // Time a full download of path into a directory next to it, with sendfile on the other end. Returns GB/s, 0 on failure
+    struct sockaddr_in addr;
+    struct stat info;
+    char copies[PATH_MAX], cwd[PATH_MAX];
+    snprintf(copies, sizeof(copies), "%s.copies", path);
+    if ((mkdir(copies, 0755) < 0 && errno != EEXIST) || getcwd(cwd, sizeof(cwd)) == NULL || chdir(copies) < 0)
+        return 0;
+    pid_t pid = startUploader(path, 1, 1, &addr);
+    if (pid < 0)
+        return 0;
+    download_with_splice = with_splice;
+    double start = nowSeconds();
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    int downloaded = sockfd >= 0 && connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == 0 && downloadFile(sockfd, BENCH_CONTENT_NAME, NULL);
+    double elapsed = nowSeconds() - start;
+    close(sockfd);
+    stopUploader(pid);
+    downloaded = downloaded && stat(BENCH_CONTENT_NAME, &info) == 0;
+    unlink(BENCH_CONTENT_NAME);
+    chdir(cwd);
+    rmdir(copies);
+    return downloaded ? info.st_size / elapsed / 1e9 : 0;
+}
+struct downloader {
+    // One of many simultaneous downloaders, fetching the same file rounds times in a row
+    struct sockaddr_in *addr;
+    int rounds;
+    uint64_t received;
+};
+void *runDownloader(void *arg)
+{ // Thread body of one downloader
+    struct downloader *d = (struct downloader*)arg;
+    char *buffer = (char*)malloc(UPLOAD_BUFFER_SIZE);
+    for (int i = 0; i < d->rounds; i++)
+    {
+        int sockfd = requestDownload(d->addr);
+        if (sockfd < 0)
+            break;
+        d->received += drainDownload(sockfd, buffer, UPLOAD_BUFFER_SIZE);
+        close(sockfd);
+    }
+    free(buffer);
+    return NULL;
+}
+double timeConcurrentUploads(char *path, off_t size, int downloaders, int slots)
+{ // Aggregate upload throughput with this many downloaders at once, each fetching path until CONCURRENT_TOTAL_BYTES moved
+  // overall (more if every downloader fetching it once is already more). Returns GB/s, 0 if any download failed
+    struct sockaddr_in addr;
+    pid_t pid = startUploader(path, 1, slots, &addr);
+    if (pid < 0)
+        return 0;
+    struct downloader *d = (struct downloader*)calloc(downloaders, sizeof(struct downloader));
+    pthread_t *threads = (pthread_t*)malloc(downloaders * sizeof(pthread_t));
+    int rounds = CONCURRENT_TOTAL_BYTES / size / downloaders;
+    uint64_t received = 0;
+    double start = nowSeconds();
+    for (int i = 0; i < downloaders; i++)
+    {
+        d[i].addr = &addr;
+        d[i].rounds = rounds > 0 ? rounds : 1;
+        pthread_create(&threads[i], NULL, runDownloader, &d[i]);
+    }
+    for (int i = 0; i < downloaders; i++)
+    {
+        pthread_join(threads[i], NULL);
+        received += d[i].received;
+    }
+    double elapsed = nowSeconds() - start;
+    stopUploader(pid);
+    int complete = received == (uint64_t)size * d[0].rounds * downloaders;
+    free(threads);
+    free(d);
+    return complete ? received / elapsed / 1e9 : 0;
+}
+
+
+/* MAIN */
+int main(int argc, char *argv[])
+{ // Move one multi-GB binary file over loopback. Uploads go to a receiver that discards the data, downloads are written to disk.
+  // Then serve many downloaders at once
+    double gigabytes = argc > 1 ? atof(argv[1]) : 2;
+    char *path = argc > 2 ? argv[2] : "/tmp/transfer_bench.dat";
+    signal(SIGPIPE, SIG_IGN);
+    if (gigabytes <= 0 || !prepareFile(path, (off_t)(gigabytes * (1 << 30)), 1, 1))
+    {
+        printf("Cannot prepare %s...\n", path);
+        return 1;
+    }
+
+    printf("%.1f GB file %s\n", gigabytes, path);
+    printf("%12s %10s\n", "upload", "GB/s");
+    printf("%12s %10.2f\n", "sendfile", timeUpload(path, 1));
+    printf("%12s %10.2f\n", "read/send", timeUpload(path, 0));
+    timeDownload(path, 0); // warm up, the first copy on a fresh disk pays for block allocation
+    printf("\n%12s %10s\n", "download", "GB/s");
+    printf("%12s %10.2f\n", "splice", timeDownload(path, 1));
+    printf("%12s %10.2f\n", "recv/write", timeDownload(path, 0));
+
+    // Many downloaders of a smaller file at once, every one with a slot and with the default number of slots so the rest queue
+    int downloaders[] = {1, 16, 256};
+    char small[PATH_MAX];
+    snprintf(small, sizeof(small), "%s.small", path);
+    if (!prepareFile(small, CONCURRENT_FILE_SIZE, 1, 1))
+    {
+        printf("Cannot prepare %s...\n", small);
+        return 1;
+    }
+    printf("\n%d MB file %s, GB/s with\n%12s %10s %8d slots\n", CONCURRENT_FILE_SIZE >> 20, small, "downloaders", "N slots", DEFAULT_UPLOAD_SLOTS);
+    for (int i = 0; i < sizeof(downloaders) / sizeof(downloaders[0]); i++)
+        printf("%12d %10.2f %10.2f\n", downloaders[i], timeConcurrentUploads(small, CONCURRENT_FILE_SIZE, downloaders[i], downloaders[i]),
+            timeConcurrentUploads(small, CONCURRENT_FILE_SIZE, downloaders[i], DEFAULT_UPLOAD_SLOTS));
+    return 0;
+}
@@ -1,9 +1,11 @@
 // UDP Peer and TCP File Peer
 
 /* DEFINITIONS */
+#define _GNU_SOURCE // splice, fallocate, accept4
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <string.h>
@@ -12,13 +14,202 @@
 #include <pthread.h>
 #include <errno.h>
 #include <arpa/inet.h>
+#include <stdint.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <stdarg.h>
 
 #define DEFAULT_NAME_SIZE 20
 #define STANDARD_BUF_SIZE 99
 #define CONTENT_BUF_SIZE 1280
+#define PROTOCOL_VERSION 3
+#define MAX_PAYLOAD_SIZE 1400
+#define MAX_SOURCES 8
+#define DEFAULT_UPLOAD_SLOTS 4
+#define HEARTBEAT_INTERVAL 30
+#define MAX_QUERY_RESULTS 63
+#define MAX_BATCH_ITEMS 24
+#define ADDRESS_SIZE 54
+#define TRANSFER_BUFFER_SIZE (1 << 20)
+#define PARTIAL_SUFFIX ".part"
+#define INITIAL_HOSTED_BUCKETS 64
+#define INITIAL_STORE_BUCKETS 64
+#define UPLOAD_BUFFER_SIZE (64 * 1024)
+#define UPLOAD_TURN_SIZE (1 << 20)
+#define UPLOAD_EVENTS 64
+#define UPLOAD_BURST_SECONDS 0.1
+#define PIECE_SIZE (4 << 20)
+#define CHECKPOINT_SUFFIX ".ckpt"
+#define CHECKPOINT_MAGIC "P2PPART2"
+#define CHECKPOINT_SECONDS 1
+#define MAX_LISTING_DATAGRAMS 64
+#define SENT_REQUESTS 8
+#define CONTROL_INITIAL_RTO 1.0
+#define CONTROL_MIN_RTO 0.05
+#define CONTROL_MAX_RTO 4.0
+#define CONTROL_MAX_TRIES 6
+#define STATS_BUCKETS 16
+#define METRICS_INTERVAL 10
+#define DAEMON_CONNECTIONS 32
+#define DAEMON_LINE_SIZE (PATH_MAX + 64)
+#define DAEMON_PROGRESS_SECONDS 1
+#define DAEMON_SEND_TIMEOUT 5
+#define SWARM_STALL_SECONDS 15
+#define MAX_CORRUPT_PIECES 3
+#define PIECE_RETRIES 3
+#define HASH_SIZE 32
+#define HASH_LANES 8
+#define MAX_HASH_THREADS 16
+#define HASH_CACHE_SUFFIX ".hashes"
+#define HASH_CACHE_MAGIC "P2PHASH1"
+#define STORE_OBJECTS "objects"
+#define STORE_NAMES "names"
+#define STORE_INCOMING "incoming"
+#define STORE_TOUCH_SECONDS 60
+#define BLAKE3_CHUNK_SIZE 1024
+#define BLAKE3_CHUNK_START 1
+#define BLAKE3_CHUNK_END 2
+#define BLAKE3_PARENT 4
+#define BLAKE3_ROOT 8
+#define BLAKE3_KEYED_HASH 16
+#define DOWNLOAD_COMPRESSED 1
+#define COMPRESS_FRAME_SIZE (64 * 1024)
+#define COMPRESS_HASH_BITS 13
+#define COMPRESS_MIN_MATCH 4
+#define COMPRESS_LAST_LITERALS 5
+#define COMPRESS_SKIP_SHIFT 5
+#define COMPRESS_GIVE_UP 8
+#define COMPRESS_PROBE_INTERVAL 16
+#define RING_ENTRIES 256
+#define RING_CHUNKS 4
+#define RING_BUFFER_SIZE (128 * 1024)
+#define RING_EVENT_TAG 2
+#define RING_READING 1
+#define RING_READ 2
+#define RING_SENDING 3
+#define UPLOAD_REQUEST 0
+#define UPLOAD_WAITING 1
+#define UPLOAD_SENDING 2
 
 
 /* STRUCTS */
+struct __attribute__((__packed__)) message_header {
+    // Header of every control datagram to and from the index server. request_id is picked by us and echoed in every reply,
+    // length counts the payload bytes after the header. Multi-byte fields are in network byte order
+    unsigned char version;
+    char type;
+    uint32_t request_id;
+    uint16_t length;
+};
+struct __attribute__((__packed__)) message {
+    // One complete request or reply. The extra byte keeps room for a terminator so text replies can be printed directly
+    struct message_header header;
+    char payload[MAX_PAYLOAD_SIZE + 1];
+};
+struct sent_request {
+    // A request kept until its reply arrives so it can be sent again word for word, which is how the server's reply cache knows it
+    // for a retransmission. sent is when it first went out and answered is set once a reply came back, see receiveReply
+    uint32_t request_id;
+    int tries;
+    int answered;
+    double sent;
+    size_t size;
+    struct sockaddr_in to;
+    int to_size;
+    struct message datagram;
+};
+struct __attribute__((__packed__)) source {
+    // One candidate content server in an S reply
+    char peer_name[DEFAULT_NAME_SIZE];
+    char address[ADDRESS_SIZE];
+    uint16_t in_flight;
+    uint16_t capacity;
+};
+struct __attribute__((__packed__)) source_list {
+    // Payload of an S reply: count holders of the content ranked least loaded first. ticket is handed back in an F request
+    // once the download ends so the index stops counting it against its sources. root is the Merkle root of the content
+    // as it was registered, all zeros if the index does not know it
+    uint32_t ticket;
+    unsigned char count;
+    unsigned char root[HASH_SIZE];
+    struct source sources[MAX_SOURCES];
+};
+struct __attribute__((__packed__)) fpdu {
+    // Payload of an F request. status is 'A' if the download succeeded and 'E' if it failed
+    uint32_t ticket;
+    char status;
+};
+struct __attribute__((__packed__)) opdu {
+    // Payload of an O request. Lists registrations whose content name starts with prefix, sorted by content then peer name,
+    // beginning after the cursor entry (empty cursor for the first page), at most limit entries (0 for the server's page size)
+    uint32_t limit;
+    char prefix[DEFAULT_NAME_SIZE];
+    char cursor_content[DEFAULT_NAME_SIZE];
+    char cursor_peer[DEFAULT_NAME_SIZE];
+};
+struct __attribute__((__packed__)) qpdu {
+    // Payload of a Q request. Finds content names that start with (mode 'P') or contain (mode 'C') pattern, in name order after
+    // cursor (empty for the first page), at most limit of them (0 for as many as fit in one reply)
+    char mode;
+    unsigned char limit;
+    char pattern[DEFAULT_NAME_SIZE];
+    char cursor[DEFAULT_NAME_SIZE];
+};
+struct __attribute__((__packed__)) name_match {
+    // One content name found by a Q request and how many peers hold it
+    char content_name[DEFAULT_NAME_SIZE];
+    uint16_t holders;
+};
+struct __attribute__((__packed__)) query_reply {
+    // Payload of a Q reply. more is set when further names match, and the last one here is the cursor for the next page
+    unsigned char count;
+    unsigned char more;
+    struct name_match matches[MAX_QUERY_RESULTS];
+};
+struct __attribute__((__packed__)) stats_page {
+    // Payload of an X request, and start of an X reply followed by the metrics text from offset on. total is the length of the
+    // whole text, so the next request asks for what follows until it is all in. Network byte order
+    uint32_t offset;
+    uint32_t total;
+};
+struct transfer_stats {
+    // Counters of one direction of transfers, each in cache lines of its own. Uploads are counted by the upload engine, downloads by
+    // the terminal side or by any of the daemon's fetch threads, once per transfer. rate is a histogram of the throughput of single
+    // transfers, bucket b counting those under 2^b MB/s, and rate_sum adds them up in kB/s
+    uint64_t bytes;
+    uint64_t completed;
+    uint64_t failed;
+    uint64_t rate[STATS_BUCKETS];
+    uint64_t rate_sum;
+} __attribute__((aligned(64)));
+struct __attribute__((__packed__)) listing_header {
+    // Start of every O reply payload, followed by entries "peer:content\n". One page is count datagrams. more is set when
+    // matching entries remain, and the last entry of datagram count-1 is the cursor for the next page
+    uint16_t index;
+    uint16_t count;
+    uint16_t entries;
+    unsigned char more;
+};
 struct __attribute__((__packed__)) pdu {
     // Struct for standard datagram 
     char type; 
@@ -36,482 +227,4049 @@ struct __attribute__((__packed__)) spdu {
     char content_name[DEFAULT_NAME_SIZE];
 };
 struct __attribute__((__packed__)) rpdu {
-    // Struct for registering new files
+    // Struct for registering new files. root is the Merkle root of the file's piece hashes, see HASHING
     char type;
     char peer_name[DEFAULT_NAME_SIZE];
     char content_name[DEFAULT_NAME_SIZE];
-    char address[30];
+    char address[ADDRESS_SIZE];
+    uint16_t capacity;
+    unsigned char root[HASH_SIZE];
+};
+struct __attribute__((__packed__)) batch_item {
+    // One file of a B request
+    char content_name[DEFAULT_NAME_SIZE];
+    unsigned char root[HASH_SIZE];
+};
+struct __attribute__((__packed__)) bpdu {
+    // Payload of a B request: count files registered at once by peer_name, all served on address. Only the used part of items is sent
+    char peer_name[DEFAULT_NAME_SIZE];
+    char address[ADDRESS_SIZE];
+    uint16_t capacity;
+    unsigned char count;
+    struct batch_item items[MAX_BATCH_ITEMS];
+};
+struct __attribute__((__packed__)) batch_status {
+    // Payload of a B reply. Bit i of registered, least significant bit of byte 0 first, is set if item i is now
+    // registered to the peer, which includes one it had registered before
+    unsigned char count;
+    unsigned char registered[(MAX_BATCH_ITEMS + 7) / 8];
+};
+struct __attribute__((__packed__)) dpdu {
+    // What a downloader sends on an upload connection. Type 'D' asks for length bytes of content_name starting at offset, or everything
+    // from offset on if length is 0, compressed if flags has DOWNLOAD_COMPRESSED. Type 'H' asks for the piece hashes of content_name
+    // instead and leaves offset and length at 0. As long as a pdu, which is what a plain 'D' with just the name in it looks like.
+    // Numbers in network byte order
+    char type;
+    char content_name[DEFAULT_NAME_SIZE];
+    uint64_t offset;
+    uint64_t length;
+    unsigned char flags;
+    char unused[STANDARD_BUF_SIZE - DEFAULT_NAME_SIZE - 2 * sizeof(uint64_t) - 1];
+};
+struct __attribute__((__packed__)) transfer_header {
+    // Sent by a content server ahead of the data. type 'C' is followed by exactly length bytes of content, the requested range of a
+    // file that is size bytes long, or for an 'H' request by the HASH_SIZE byte hash of each of its pieces. 'Z' answers a compressed
+    // 'D' and is followed by the same length bytes cut into frames, see frame_header. 'E' is followed by a reason of length bytes
+    // when the request cannot be served. Network byte order
+    char type;
+    uint64_t length;
+    uint64_t size;
+};
+struct __attribute__((__packed__)) frame_header {
+    // Ahead of every frame of a 'Z' transfer, which covers the next raw_length bytes of the range, at most COMPRESS_FRAME_SIZE.
+    // stored_length bytes follow: the bytes themselves if it equals raw_length, otherwise them compressed, see compressBlock.
+    // Frames start every COMPRESS_FRAME_SIZE bytes from the start of the range, so one never spans two pieces. Network byte order
+    uint32_t raw_length;
+    uint32_t stored_length;
+};
+struct piece_hashes {
+    // BLAKE3 hash of every PIECE_SIZE piece of a file of size bytes, count * HASH_SIZE bytes in pieces, and the Merkle root over them
+    uint64_t size;
+    uint32_t count;
+    unsigned char root[HASH_SIZE];
+    unsigned char *pieces;
+};
+struct __attribute__((__packed__)) hash_cache_header {
+    // Start of the cache kept next to a hosted file, followed by its piece hashes. Only used while the file still has the size and
+    // modification time it was hashed at. Host byte order
+    char magic[8];
+    uint64_t size;
+    int64_t mtime_seconds;
+    int64_t mtime_nanoseconds;
+    uint32_t piece_size;
+    uint32_t count;
+    unsigned char root[HASH_SIZE];
+};
+struct hash_job {
+    // One input for hashLanes: a chunk of up to BLAKE3_CHUNK_SIZE bytes numbered counter, or with BLAKE3_PARENT in flags two
+    // chaining values to merge
+    const unsigned char *data;
+    size_t length;
+    uint64_t counter;
+    uint32_t flags;
+};
+struct hash_work {
+    // Pieces of one file shared out among hashing threads. next is the next piece nobody has taken
+    int fd;
+    struct piece_hashes *hashes;
+    uint32_t next;
+    int failed;
+};
+struct store_object {
+    // One content in the store, see STORE. size counts against the quota unless pinned, which means a file outside the store is a hard
+    // link to it so it takes no space of its own. last_used is when it was last stored or served, touched when that was last
+    // written to the mtime of its hash cache, which is how the order survives a restart
+    unsigned char root[HASH_SIZE];
+    off_t size;
+    int pinned;
+    time_t last_used;
+    time_t touched;
+    struct store_object *next_in_bucket;
 };
 struct __attribute__((__packed__)) File {
-    // Struct for tracking which files we have active
-    int s;
+    // Struct for tracking which files we have active. path is where the file lives when it is not content_name in the working directory.
+    // Every file is also chained in its bucket of the hosted table, which is how a downloader's request finds it. hashes is what
+    // an 'H' request is answered with. object is the store content it is served from, NULL for a file of our own
     struct rpdu file_descriptor;
+    char *path;
+    struct piece_hashes *hashes;
+    struct store_object *object;
     struct File *next;
+    struct File *next_in_bucket;
+};
+struct ring_chunk {
+    // One buffer of an upload on the io_uring path, for bytes [offset, offset + length) of its file of which sent went out already.
+    // state is RING_READING while the disk read is in flight, RING_READ once the bytes are in and RING_SENDING while they are sent
+    int state;
+    off_t offset;
+    size_t length;
+    size_t sent;
+};
+struct ring {
+    // The upload engine's io_uring, mapped into our memory. Entries are queued at sq_tail and handed to the kernel together by the
+    // next submitRing. buffers holds one group of RING_CHUNKS buffers of RING_BUFFER_SIZE per upload slot, registered with the
+    // kernel unless it would not pin them. free_groups is a stack of the groups no upload holds
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned queued;
+    char *buffers;
+    int registered;
+    int *free_groups;
+    int free_count;
+};
+struct upload {
+    // One downloader's connection in the upload engine, sending [offset, end) of the file open at fd. pending points at bytes still to
+    // go out: the transfer header (and the reason, for an 'E') in header_space, a piece of the file in buffer when uploads cannot
+    // use sendfile, or with compressed set the next frame in frame. incompressible counts the frames in a row that did not shrink.
+    // With a ring_group the range goes through the io_uring instead: chunks is a circle of chunk_count buffers from chunk_head in
+    // file order, read_offset is where the next read starts and ring_ops counts operations the kernel still has. closing is set
+    // once the connection is done with but some of them are not. events is what epoll watches for.
+    // next_waiting chains it in the slot queue or, with throttled set, among connections waiting for upload budget
+    int sockfd;
+    int fd;
+    int state;
+    int throttled;
+    int compressed;
+    int incompressible;
+    uint32_t events;
+    int ring_group;
+    struct ring_chunk chunks[RING_CHUNKS];
+    int chunk_head;
+    int chunk_count;
+    off_t read_offset;
+    int ring_ops;
+    int ring_error;
+    int closing;
+    struct dpdu request;
+    size_t request_received;
+    off_t offset;
+    off_t end;
+    off_t first;
+    double started;
+    char header_space[sizeof(struct transfer_header) + STANDARD_BUF_SIZE];
+    char *pending;
+    size_t pending_length;
+    size_t pending_sent;
+    char *buffer;
+    unsigned char *frame;
+    struct upload *next_waiting;
+};
+struct __attribute__((__packed__)) checkpoint_header {
+    // Start of the sidecar kept next to content_name.part, followed by a bitmap of which PIECE_SIZE pieces of the size byte file are
+    // on disk, least significant bit of byte 0 first. It is only rewritten after the data it vouches for was flushed, and replaced
+    // with a rename so it is never torn. checksum covers the bitmap. root is the Merkle root of the content being downloaded, zeros
+    // if it is unknown. Host byte order, the file never leaves this machine
+    char magic[8];
+    uint64_t size;
+    uint32_t piece_size;
+    uint32_t checksum;
+    unsigned char root[HASH_SIZE];
+};
+struct swarm_piece {
+    // One PIECE_SIZE range of a swarm download. active counts the workers fetching it, started is when the last one began
+    int done;
+    int active;
+    double started;
+};
+struct swarm {
+    // One download from several content servers at once. The file is cut into pieces that worker threads, one per source, claim
+    // lowest first and write into place with pwrite. Once none are left unclaimed, an idle worker also fetches a piece that is still
+    // running somewhere else, so a slow or stalled source cannot hold up the end, and the first copy to arrive wins. A source that
+    // fails gives its piece back, and so does one that sent a piece that does not match hashes. lock covers the pieces and counters,
+    // finished is signalled when a piece is done or a worker stops
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    char *content_name;
+    struct piece_hashes *hashes;
+    int fd;
+    uint64_t size;
+    uint32_t count;
+    uint32_t done;
+    int running;
+    struct swarm_piece *pieces;
+};
+struct swarm_worker {
+    // One source of a swarm download and the connection to it, -1 while there is none. received counts what it delivered and
+    // corrupt the pieces of it that failed their check
+    struct swarm *swarm;
+    struct source *source;
+    int sockfd;
+    uint64_t received;
+    int corrupt;
+    pthread_t thread;
+};
+struct bulk_item {
+    // One file found for a bulk registration
+    char content_name[DEFAULT_NAME_SIZE];
+    char *path;
+    struct piece_hashes *hashes;
+};
+struct download_progress {
+    // How much of the file a download has so far, pieces already there when it resumed included, and how big it is. Only the thread
+    // running the download writes it
+    uint64_t have;
+    uint64_t size;
+};
+struct control {
+    // A connection to the daemon's control socket, -1 when the slot is free. Commands arrive one per line, line holds what was
+    // received of the next one so far
+    int fd;
+    size_t length;
+    char line[DAEMON_LINE_SIZE];
+};
+struct fetch {
+    // A download the daemon runs on a thread of its own so any number of them can be in flight. The index server was asked for the
+    // sources already, the thread only downloads, and once finished is set the main loop reports to the index server, registers the
+    // file and tells control, NULL if that connection is gone
+    char content_name[DEFAULT_NAME_SIZE];
+    struct source_list sources;
+    struct download_progress progress;
+    struct control *control;
+    int downloaded;
+    int finished;
+    pthread_t thread;
+    struct fetch *next;
 };
 struct File* head = NULL;
+struct File **hosted_table = NULL; // hash of head by content name, doubled whenever it holds as many files as buckets
+size_t hosted_buckets = 0, hosted_count = 0;
 
 // Global client name to be passed as a command line argument to identify this user with and debug flag for showing for print messages
 int debug = 0;
 char client_name[DEFAULT_NAME_SIZE];
+uint32_t next_request_id = 1; // started somewhere random so a restarted peer's requests are not taken for retransmissions
+struct sent_request sent_requests[SENT_REQUESTS]; // the last requests sent, by request_id modulo SENT_REQUESTS
+double control_srtt = 0, control_rttvar = 0; // smoothed round trip time to the index server and its mean deviation, 0 until measured
+double control_rto = CONTROL_INITIAL_RTO; // how long to wait for a reply before sending the request again
+int upload_slots = DEFAULT_UPLOAD_SLOTS; // simultaneous uploads, advertised to the index server and enforced by the upload engine
+int upload_epoll = -1; // everything the upload engine waits on: our listener and the connections of downloaders
+int upload_listener = -1; // the one TCP socket every hosted file is served on, opened with the first registration
+char upload_address[ADDRESS_SIZE] = ""; // its "ip:port" or "[ipv6]:port" as registered with the index server
+uint16_t upload_port = 0; // the port of upload_listener
+pthread_mutex_t upload_lock = PTHREAD_MUTEX_INITIALIZER; // between the upload engine and the terminal side, covers head and the engine's state
+int uploads_active = 0; // connections holding a slot
+struct upload *upload_queue = NULL, *upload_queue_tail = NULL; // connections waiting for a slot, oldest first
+double upload_rate = 0; // bytes per second all uploads together may send, 0 for no limit
+double upload_budget = 0, upload_budget_time = 0; // token bucket for upload_rate, bytes that may still be sent as of upload_budget_time
+struct upload *upload_throttled = NULL; // connections with a slot that wait for the budget to refill
+uint32_t heartbeat_request_id = 0; // the heartbeat whose reply we are still expecting, 0 for none
+char local_host[INET6_ADDRSTRLEN] = ""; // the host we advertise, see findLocalHost, or what --advertise pinned it to
+int interface_watch = -1; // netlink socket that is readable when our addresses change, -1 if the host is pinned
+int upload_with_sendfile = 1; // cleared the first time the kernel cannot sendfile for us, after which uploads copy through a buffer
+int download_with_splice = 1; // the same for splicing downloads from the socket into the file
+int download_compressed = 0; // ask content servers to compress what they send us, set with --compress
+int upload_with_ring = 0; // upload through io_uring, set with --io-uring. Falls back to epoll alone if the kernel has none for us
+struct ring upload_ring = { .fd = -1 };
+char *store_directory = NULL; // with --store, downloads go into the content store there instead of the working directory
+off_t store_quota = 0; // bytes the store may hold before the least recently used content is evicted, 0 for no limit
+off_t store_used = 0; // bytes it holds, kept up to date as content comes and goes, pinned content not counted
+struct store_object **store_table = NULL; // the store's content by root, doubled whenever it holds as many as buckets. Changed under
+size_t store_buckets = 0, store_count = 0; // upload_lock, the engine reaches the content through hosted files
+struct transfer_stats upload_stats, download_stats; // see transfer_stats
+char *metrics_path = NULL; // with --metrics, where our counters are written every METRICS_INTERVAL seconds
+char *daemon_path = NULL; // with --daemon, the Unix socket commands arrive on instead of the terminal
+__thread struct download_progress *download_progress = NULL; // where the download this thread runs reports to, only set for fetches
+struct control controls[DAEMON_CONNECTIONS];
+struct fetch *fetches = NULL; // the daemon's downloads in flight, only touched by the main loop apart from what each thread reports
+int fetch_wakeup[2] = { -1, -1 }; // a fetch thread writes a byte here when it is done, to wake the main loop
+volatile sig_atomic_t daemon_stopping = 0;
 
 /* UTILITY FUNCTIONS */
 
-// MISC
-void processFileDownload(int sockfd, char *content_name)
-{ // This file processes the TCP upload of the content_server. We open the file, write it to a buffer byte by byte until there is nothing left to read, 
-  // and then we tell the content_client that there is nothing left to receive before exiting
-    FILE *fp = fopen(content_name, "r");
+// REQUESTS
+// Requests and replies are single UDP datagrams and either may be lost. A request that is not answered within control_rto is sent
+// again with the same request_id, and the wait doubles each time up to CONTROL_MAX_TRIES sends. control_rto follows the round trip
+// time the way TCP's retransmission timer does (RFC 6298), measured only on requests that were answered the first time they were
+// sent. The server answers a retransmission from its reply cache, so nothing is registered or charged twice
+double nowSeconds();
+uint32_t sendRequest(int sockfd, char type, const void *payload, size_t length, struct sockaddr_in socket_addr, int socket_addr_size)
+{ // Send a whole request to the index server in one datagram. Returns the request id to wait on, or 0 if it could not be sent
+    if (length > MAX_PAYLOAD_SIZE)
+        return 0;
+    uint32_t request_id = next_request_id++;
+    if (next_request_id == 0) // 0 is reserved for failure
+        next_request_id = 1;
 
-    struct cpdu file_content_packet;
-    bzero(&file_content_packet, sizeof(file_content_packet));
-    file_content_packet.type = 'C';
-    while (fgets(file_content_packet.data, CONTENT_BUF_SIZE, fp) != NULL)
+    struct sent_request *r = &sent_requests[request_id % SENT_REQUESTS];
+    r->request_id = request_id;
+    r->tries = 1;
+    r->answered = 0;
+    r->sent = nowSeconds();
+    r->size = sizeof(r->datagram.header) + length;
+    r->to = socket_addr;
+    r->to_size = socket_addr_size;
+    r->datagram.header.version = PROTOCOL_VERSION;
+    r->datagram.header.type = type;
+    r->datagram.header.request_id = htonl(request_id);
+    r->datagram.header.length = htons(length);
+    memcpy(r->datagram.payload, payload, length);
+    if (sendto(sockfd, &r->datagram, r->size, 0, (struct sockaddr*)&r->to, r->to_size) < 0)
+        return 0;
+    return request_id;
+}
+void sampleRoundTrip(double rtt)
+{ // Fold one measured round trip into control_srtt and control_rttvar and set control_rto from them
+    if (control_srtt == 0)
     {
-        if (send(sockfd, &file_content_packet, sizeof(file_content_packet), 0) == -1)
+        control_srtt = rtt;
+        control_rttvar = rtt / 2;
+    } else
+    {
+        control_rttvar = 0.75 * control_rttvar + 0.25 * (control_srtt > rtt ? control_srtt - rtt : rtt - control_srtt);
+        control_srtt = 0.875 * control_srtt + 0.125 * rtt;
+    }
+    control_rto = control_srtt + 4 * control_rttvar;
+    if (control_rto < CONTROL_MIN_RTO)
+        control_rto = CONTROL_MIN_RTO;
+    if (control_rto > CONTROL_MAX_RTO)
+        control_rto = CONTROL_MAX_RTO;
+}
+int receiveReply(int sockfd, uint32_t request_id, struct message *reply)
+{ // Wait for a reply to request_id, sending the request again whenever control_rto passes without one. Replies to any other request
+  // (e.g. a late answer to one we already gave up on) are dropped, so requests can be pipelined without their answers getting mixed
+  // up. May be called again for the next datagram of a reply that spans several. Returns 0 with errno ETIMEDOUT once the server
+  // did not answer CONTROL_MAX_TRIES sends, or on a socket error
+    struct sent_request *r = &sent_requests[request_id % SENT_REQUESTS];
+    if (r->request_id != request_id)
+        r = NULL; // too old to send again, it can only be waited on
+    double deadline = nowSeconds() + control_rto;
+    while (1)
+    {
+        double left = deadline - nowSeconds();
+        struct pollfd readable = { .fd = sockfd, .events = POLLIN };
+        int ready = left > 0 ? poll(&readable, 1, (int)(left * 1000) + 1) : 0;
+        if (ready < 0 && errno != EINTR)
+            return 0;
+        if (ready == 0)
+        { // lost on the way there or back
+            if (r == NULL || r->tries >= CONTROL_MAX_TRIES)
+            {
+                errno = ETIMEDOUT;
+                return 0;
+            }
+            control_rto = control_rto * 2 < CONTROL_MAX_RTO ? control_rto * 2 : CONTROL_MAX_RTO;
+            r->tries++;
+            if (debug)
+                printf("Sending request %u again, try %d...\n", request_id, r->tries);
+            if (sendto(sockfd, &r->datagram, r->size, 0, (struct sockaddr*)&r->to, r->to_size) < 0)
+                return 0;
+            deadline = nowSeconds() + control_rto;
+            continue;
+        }
+        if (ready < 0)
+            continue;
+
+        ssize_t size = recvfrom(sockfd, reply, sizeof(struct message) - 1, MSG_DONTWAIT, NULL, NULL);
+        if (size < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        if (size < 0)
+            return 0;
+        if (size < (ssize_t)sizeof(reply->header) || reply->header.version != PROTOCOL_VERSION)
+            continue;
+        if (ntohl(reply->header.request_id) != request_id)
         {
-            perror("Error while sending file contents...\n");
-            return;
+            if (debug)
+                printf("Dropping reply to stale request %u...\n", ntohl(reply->header.request_id));
+            continue;
         }
-        bzero(file_content_packet.data, CONTENT_BUF_SIZE);
+        if (r != NULL && !r->answered)
+        { // a reply to a request sent more than once could answer any of the sends, so only first tries are timed
+            r->answered = 1;
+            if (r->tries == 1)
+                sampleRoundTrip(nowSeconds() - r->sent);
+        }
+        uint16_t length = ntohs(reply->header.length);
+        if (length > size - sizeof(reply->header))
+            length = size - sizeof(reply->header);
+        reply->payload[length] = '\0';
+        return 1;
     }
+}
 
-    bzero(&file_content_packet, sizeof(file_content_packet));
-    file_content_packet.type = 'E';
-    if (send(sockfd, &file_content_packet, sizeof(file_content_packet), 0) == -1)
-    {
-        perror("Error while sending file contents...\n");
+// MISC
+double nowSeconds()
+{ // Monotonic wall clock in seconds
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+void addStat(uint64_t *counter, uint64_t amount)
+{ // Add to a transfer counter. Several fetch threads of the daemon may finish at once, and it is once per transfer
+    __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+void countTransfer(struct transfer_stats *stats, uint64_t bytes, int completed, double seconds)
+{ // One upload or download is over after moving bytes in seconds
+    addStat(&stats->bytes, bytes);
+    addStat(completed ? &stats->completed : &stats->failed, 1);
+    if (!completed || seconds <= 0)
+        return;
+    uint64_t rate = (uint64_t)(bytes / 1e6 / seconds);
+    int bucket = rate == 0 ? 0 : 64 - __builtin_clzll(rate);
+    addStat(&stats->rate[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1], 1);
+    addStat(&stats->rate_sum, (uint64_t)(bytes / 1e3 / seconds));
+}
+void noteProgress(uint64_t have, uint64_t size)
+{ // The download this thread runs has have of size bytes. Only kept for daemon fetches, which report it to whoever asked for them
+    if (download_progress == NULL)
         return;
+    __atomic_store_n(&download_progress->have, have < size ? have : size, __ATOMIC_RELAXED);
+    __atomic_store_n(&download_progress->size, size, __ATOMIC_RELAXED);
+}
+int sendAll(int sockfd, const void *data, size_t length)
+{ // send() until everything is out. Returns 0 if the connection failed
+    const char *bytes = (const char*)data;
+    while (length > 0)
+    {
+        ssize_t n = send(sockfd, bytes, length, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        bytes += n;
+        length -= n;
     }
+    return 1;
 }
-int acceptNewClient(int socket)
-{ // Accept incoming TCP connection found by select multiplexing
-    int client_socket;
-    struct sockaddr_in client_addr;
-    int addr_size = sizeof(client_addr);
-
-    client_socket = accept(socket, (struct sockaddr *)&client_addr, &addr_size);
-    if (client_socket < 0)
+int recvAll(int sockfd, void *data, size_t length)
+{ // recv() until length bytes arrived. TCP may hand them over in any number of pieces. Returns 0 if the connection ended first
+    char *bytes = (char*)data;
+    while (length > 0)
     {
-        printf("Failed to accept new client connection...\n");
+        ssize_t n = recv(sockfd, bytes, length, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        bytes += n;
+        length -= n;
     }
-    return client_socket;
+    return 1;
 }
-void handleDownload(int sockfd)
-{ // INCOMING TCP connection being handled...
-    int new_sd = acceptNewClient(sockfd);
-    if (new_sd < 0)
+int pwriteAll(int fd, const void *data, size_t length, off_t offset)
+{ // pwrite() until everything is on its way to disk. Returns 0 on failure
+    const char *bytes = (const char*)data;
+    while (length > 0)
     {
-        printf("Cannot handle incoming TCP request...\n");
-        return;
+        ssize_t n = pwrite(fd, bytes, length, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        bytes += n;
+        offset += n;
+        length -= n;
     }
-    struct pdu content_name;
-    bzero(&content_name, sizeof(content_name));
-
-    if (recv(new_sd, &content_name, sizeof(content_name), 0) < 0)
+    return 1;
+}
+// HASHING
+// Content is identified by a Merkle root over the BLAKE3 hashes of its PIECE_SIZE pieces, which lets a downloader check every piece
+// on its own as it arrives. BLAKE3 is itself a tree over 1 KB chunks, so hashLanes compresses HASH_LANES of them side by side, one
+// per lane of a vector the compiler maps onto whatever SIMD registers the machine it builds for has
+typedef uint32_t hash_lanes __attribute__((vector_size(4 * HASH_LANES)));
+const uint32_t blake3_iv[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+const unsigned char blake3_schedule[7][16] = { // the order each round takes the message words in
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+const unsigned char merkle_key[HASH_SIZE] = "P2P file transfer merkle parent"; // inner nodes are keyed so no piece can pose as one
+#define ROTATE_LANES(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define MIX_LANES(a, b, c, d, x, y) \
+    a += b + x; d = ROTATE_LANES(d ^ a, 16); c += d; b = ROTATE_LANES(b ^ c, 12); \
+    a += b + y; d = ROTATE_LANES(d ^ a, 8); c += d; b = ROTATE_LANES(b ^ c, 7);
+void compressLanes(hash_lanes cv[8], const hash_lanes m[16], const hash_lanes parameters[4])
+{ // The BLAKE3 compression function in every lane at once. parameters are the counter's low and high words, the block length and
+  // the flags. Replaces cv with the new chaining values
+    hash_lanes v[16] = {cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7]};
+    for (int i = 0; i < 4; i++)
     {
-        printf("No filename received from content peer...\n");
-        return;
+        v[8 + i] = (hash_lanes){0} + blake3_iv[i];
+        v[12 + i] = parameters[i];
+    }
+#pragma GCC unroll 7
+    for (int round = 0; round < 7; round++)
+    { // columns, then diagonals
+        const unsigned char *s = blake3_schedule[round];
+        MIX_LANES(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);
+        MIX_LANES(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);
+        MIX_LANES(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);
+        MIX_LANES(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);
+        MIX_LANES(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);
+        MIX_LANES(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+        MIX_LANES(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);
+        MIX_LANES(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);
     }
-    processFileDownload(new_sd, content_name.data);
+    for (int i = 0; i < 8; i++)
+        cv[i] = v[i] ^ v[i + 8];
 }
-
-// R
-void addToHostedFiles(int newsockfd, struct rpdu h_file)
-{ // Track files which index_server is tracking as available at this content server
-    if (head == NULL)
+void hashLanes(const uint32_t key[8], const struct hash_job *jobs, int count, unsigned char out[][HASH_SIZE])
+{ // Run up to HASH_LANES jobs side by side and write each one's chaining value, or its hash if it has the ROOT flag, to out.
+  // out may overlap the inputs, it is only written at the end
+    hash_lanes cv[8], m[16], parameters[4], blocks, zero = {0};
+    hash_lanes *block_length = &parameters[2], *flags = &parameters[3];
+    size_t most = 1;
+    for (int w = 0; w < 8; w++)
+        cv[w] = zero + key[w];
+    parameters[0] = parameters[1] = blocks = zero;
+    for (int lane = 0; lane < count; lane++)
     {
-        head = (struct File*)malloc(sizeof(struct File));
-        head->s = newsockfd; // available
-        head->file_descriptor = h_file;
-        head->next = NULL;
-    } else
+        parameters[0][lane] = (uint32_t)jobs[lane].counter;
+        parameters[1][lane] = jobs[lane].counter >> 32;
+        blocks[lane] = jobs[lane].length > 0 ? (jobs[lane].length + 63) / 64 : 1;
+        most = blocks[lane] > most ? blocks[lane] : most;
+    }
+    for (size_t b = 0; b < most; b++)
     {
-        struct File* new_head = (struct File*)malloc(sizeof(struct File));
-        new_head->s = newsockfd;
-        new_head->file_descriptor = h_file;
-        new_head->next = head;
-        head = new_head;
+        *block_length = *flags = zero;
+        for (int w = 0; w < 16; w++)
+            m[w] = zero;
+        for (int lane = 0; lane < count; lane++)
+        { // lanes whose input already ended compress zeros, and their result is dropped below
+            unsigned char block[64];
+            size_t start = b * 64, length = start < jobs[lane].length ? jobs[lane].length - start : 0;
+            length = length < 64 ? length : 64;
+            memset(block + length, 0, 64 - length);
+            memcpy(block, jobs[lane].data + (length > 0 ? start : 0), length);
+            for (int w = 0; w < 16; w++)
+            {
+                uint32_t word;
+                memcpy(&word, block + 4 * w, 4);
+                m[w][lane] = le32toh(word);
+            }
+            (*block_length)[lane] = length;
+            (*flags)[lane] = jobs[lane].flags & ~BLAKE3_ROOT;
+            if (!(jobs[lane].flags & BLAKE3_PARENT) && b == 0)
+                (*flags)[lane] |= BLAKE3_CHUNK_START;
+            if (b + 1 == blocks[lane])
+                (*flags)[lane] |= (jobs[lane].flags & BLAKE3_ROOT) | (jobs[lane].flags & BLAKE3_PARENT ? 0 : BLAKE3_CHUNK_END);
+        }
+        hash_lanes next[8];
+        memcpy(next, cv, sizeof(next));
+        compressLanes(next, m, parameters);
+        hash_lanes active = (hash_lanes)((zero + (uint32_t)b) < blocks); // all ones in lanes that still had input
+        for (int w = 0; w < 8; w++)
+            cv[w] = (next[w] & active) | (cv[w] & ~active);
     }
+    for (int lane = 0; lane < count; lane++)
+        for (int w = 0; w < 8; w++)
+        {
+            uint32_t word = htole32(cv[w][lane]);
+            memcpy(out[lane] + 4 * w, &word, 4);
+        }
 }
-int waitRegisteredAcknowledgement(int sockfd, int *s, struct sockaddr_in socket_addr, int socket_addr_size)
-{ // Process server status response from corresponding file registration request
-    struct pdu server_response;
-    bzero(&server_response, sizeof(server_response));
-    if (recvfrom(sockfd, &server_response, sizeof(server_response), 0, (struct sockaddr*)&socket_addr, &socket_addr_size) < 0)
-    { // TO-DO: Critical errors are when the client and server lose sync. This will require a restart and will later be handled more robustly
-        printf("CRITICAL ERROR... Please try again later.\n");
-        close(*s);
-        return 0;
+void blake3(const unsigned char *key, const void *data, size_t length, unsigned char out[HASH_SIZE])
+{ // BLAKE3 of length bytes, keyed with HASH_SIZE bytes of key unless that is NULL. Chunks are hashed HASH_LANES at a time, then
+  // pairs of chaining values are merged level by level up to the root. Carrying an odd one up unchanged builds the same tree as the
+  // reference implementation
+    uint32_t words[8], keyed = key != NULL ? BLAKE3_KEYED_HASH : 0;
+    for (int w = 0; w < 8; w++)
+    {
+        words[w] = blake3_iv[w];
+        if (key != NULL)
+        {
+            memcpy(&words[w], key + 4 * w, 4);
+            words[w] = le32toh(words[w]);
+        }
     }
-    if (server_response.type == 'A')
-    { // Accept or reject file based on if the server successfully registered it or not. Return the corresponding boolean
-        printf("File accepted\n");
-        return 1;
-    } else if (server_response.type == 'E')
+    size_t count = length > 0 ? (length + BLAKE3_CHUNK_SIZE - 1) / BLAKE3_CHUNK_SIZE : 1;
+    struct hash_job jobs[HASH_LANES];
+    if (count == 1)
     {
-        printf("Something went wrong... %s\n", server_response.data);
-        close(*s);
-        return 0;
+        jobs[0] = (struct hash_job){ (const unsigned char*)data, length, 0, keyed | BLAKE3_ROOT };
+        hashLanes(words, jobs, 1, (unsigned char(*)[HASH_SIZE])out);
+        return;
     }
-    return 0;
+    unsigned char (*nodes)[HASH_SIZE] = (unsigned char(*)[HASH_SIZE])malloc(count * HASH_SIZE);
+    if (nodes == NULL)
+    { // no piece hashes to zeros
+        memset(out, 0, HASH_SIZE);
+        return;
+    }
+    for (size_t first = 0; first < count; first += HASH_LANES)
+    {
+        int lanes = count - first < HASH_LANES ? count - first : HASH_LANES;
+        for (int lane = 0; lane < lanes; lane++)
+        {
+            size_t start = (first + lane) * BLAKE3_CHUNK_SIZE;
+            jobs[lane] = (struct hash_job){ (const unsigned char*)data + start,
+                length - start < BLAKE3_CHUNK_SIZE ? length - start : BLAKE3_CHUNK_SIZE, first + lane, keyed };
+        }
+        hashLanes(words, jobs, lanes, nodes + first);
+    }
+    while (count > 1)
+    { // one level up. Its nodes overwrite the front of the one below, which has been read by then
+        size_t pairs = count / 2;
+        for (size_t first = 0; first < pairs; first += HASH_LANES)
+        {
+            int lanes = pairs - first < HASH_LANES ? pairs - first : HASH_LANES;
+            for (int lane = 0; lane < lanes; lane++)
+                jobs[lane] = (struct hash_job){ nodes[2 * (first + lane)], 2 * HASH_SIZE, 0, keyed | BLAKE3_PARENT | (count == 2 ? BLAKE3_ROOT : 0) };
+            hashLanes(words, jobs, lanes, nodes + first);
+        }
+        if (count % 2 == 1)
+            memcpy(nodes[pairs], nodes[count - 1], HASH_SIZE);
+        count = (count + 1) / 2;
+    }
+    memcpy(out, nodes[0], HASH_SIZE);
+    free(nodes);
 }
-void makePassiveSocket(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size)
-{ // Create TCP socket to host file with and create associated rpdu struct for the file.
-    struct rpdu this;
-    bzero(&this, sizeof(this));
-    this.type = 'R';
-    strcpy(this.peer_name, client_name);
-
-    printf("Which file would you like to register? \n");
-    scanf("%s", this.content_name);
-
-    /* Harasees Singh Gill's heuristic to get Ubuntu 20.04 private IP address
-        Essentially we write the output of "hostname -I" to a file, tokenize and split it, and then read the corresponding IP address for the machine*/
-    FILE *ls_cmd = popen("hostname -I", "r");
-    if (ls_cmd == NULL) {
-        fprintf(stderr, "popen(3) error");
-        exit(EXIT_FAILURE);
+void merkleRoot(const unsigned char *pieces, uint32_t count, unsigned char root[HASH_SIZE])
+{ // Root of the tree over count piece hashes. Pairs are hashed with merkle_key level by level and an odd one is carried up as it is.
+  // A single piece is its own root and a file with none has the hash of nothing
+    unsigned char (*level)[HASH_SIZE] = (unsigned char(*)[HASH_SIZE])malloc((count > 0 ? count : 1) * HASH_SIZE);
+    memset(root, 0, HASH_SIZE);
+    if (level == NULL)
+        return;
+    memcpy(level, pieces, count * HASH_SIZE);
+    if (count == 0)
+        blake3(NULL, "", 0, level[0]);
+    while (count > 1)
+    {
+        for (uint32_t i = 0; i < count / 2; i++)
+            blake3(merkle_key, level[2 * i], 2 * HASH_SIZE, level[i]);
+        if (count % 2 == 1)
+            memcpy(level[count / 2], level[count - 1], HASH_SIZE);
+        count = (count + 1) / 2;
     }
-
-    static char buff[1024];
-    size_t n;
-
-    while ((n = fread(buff, 1, sizeof(buff)-1, ls_cmd)) > 0) {
-        buff[n] = '\0';
+    memcpy(root, level[0], HASH_SIZE);
+    free(level);
+}
+int isZeroHash(const unsigned char *hash)
+{ // All zeros, how an unknown root is sent
+    for (int i = 0; i < HASH_SIZE; i++)
+        if (hash[i] != 0)
+            return 0;
+    return 1;
+}
+uint64_t pieceLength(uint64_t size, uint32_t index)
+{ // Bytes in piece index of a size byte file. Only the last one can be short
+    return size - (uint64_t)index * PIECE_SIZE < PIECE_SIZE ? size - (uint64_t)index * PIECE_SIZE : PIECE_SIZE;
+}
+int pieceMatches(const struct piece_hashes *hashes, uint32_t index, const void *data)
+{ // Whether data, all of piece index, is what hashes says it should be
+    unsigned char hash[HASH_SIZE];
+    blake3(NULL, data, pieceLength(hashes->size, index), hash);
+    return memcmp(hash, hashes->pieces + (size_t)index * HASH_SIZE, HASH_SIZE) == 0;
+}
+struct piece_hashes *allocPieceHashes(uint64_t size)
+{ // Room for the hashes of a size byte file, NULL if memory ran out
+    struct piece_hashes *hashes = (struct piece_hashes*)calloc(1, sizeof(struct piece_hashes));
+    if (hashes == NULL)
+        return NULL;
+    hashes->size = size;
+    hashes->count = (size + PIECE_SIZE - 1) / PIECE_SIZE;
+    if ((hashes->pieces = (unsigned char*)malloc(hashes->count > 0 ? (size_t)hashes->count * HASH_SIZE : 1)) == NULL)
+    {
+        free(hashes);
+        return NULL;
     }
-
-    char THIS_IP[INET_ADDRSTRLEN];
-    strcpy(THIS_IP, strtok(buff, " "));
-
-    // Create new socket with some available port and the machine IP we found above
-    struct sockaddr_in reg_addr;
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    bzero(&reg_addr, sizeof(reg_addr));
-    reg_addr.sin_family = AF_INET;
-    reg_addr.sin_port = htons(0);
-    inet_pton(AF_INET, THIS_IP, &(reg_addr.sin_addr));
-
-    bind(s, (struct sockaddr *)&reg_addr, sizeof(reg_addr));
-    listen(s, 1);
-
-    socklen_t alen = sizeof (struct sockaddr_in);  
-    getsockname(s, (struct sockaddr *) &reg_addr, &alen);     
-    bzero(&THIS_IP, INET_ADDRSTRLEN);
-    if (debug) // debug variable for testing. Globally initialized and available
-        printf("%s\n", inet_ntop(AF_INET, &(reg_addr.sin_addr), THIS_IP, INET_ADDRSTRLEN));
-    if (pclose(ls_cmd) < 0)
-        perror("pclose(3) error");
-
-    strcat(THIS_IP, ":");
-
-    char port[DEFAULT_NAME_SIZE];
-    sprintf(port, "%u", ntohs(reg_addr.sin_port));
-    strcpy(this.address, strcat(THIS_IP, port));
-    
-    // Send the file to register to the server and then depending on the result of the registration, add the file to a list of hosted files. 
-    sendto(sockfd, &this, sizeof(this), 0, (struct sockaddr*)&socket_addr, socket_addr_size);
-    int flag = waitRegisteredAcknowledgement(sockfd, &s, socket_addr, socket_addr_size);
-    if (flag)
-        addToHostedFiles(s, this);
-    else
-        close(s);
+    return hashes;
 }
-
-// S
-void downloadFile(int sockfd, char *content_name)
-{ // Downloading file from TCP socket as client_peer
-    int downloading = 1;
-    struct cpdu packet;
-    bzero(&packet, sizeof(packet));
-
-    FILE *fp = fopen(content_name, "w");
-    if (fp == NULL)
+void freePieceHashes(struct piece_hashes *hashes)
+{ // Give back hashes, which may be NULL
+    if (hashes == NULL)
+        return;
+    free(hashes->pieces);
+    free(hashes);
+}
+void *hashPieces(void *arg)
+{ // Hashing thread. Takes pieces until none are left
+    struct hash_work *work = (struct hash_work*)arg;
+    unsigned char *buffer = (unsigned char*)malloc(PIECE_SIZE);
+    uint32_t index;
+    while (buffer != NULL && (index = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) < work->hashes->count)
     {
-        printf("Error creating file...\n");
+        uint64_t length = pieceLength(work->hashes->size, index), got = 0;
+        while (got < length)
+        {
+            ssize_t n = pread(work->fd, buffer + got, length - got, (off_t)index * PIECE_SIZE + got);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            got += n;
+        }
+        if (got < length)
+        {
+            __atomic_store_n(&work->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        blake3(NULL, buffer, length, work->hashes->pieces + (size_t)index * HASH_SIZE);
+    }
+    if (buffer == NULL)
+        __atomic_store_n(&work->failed, 1, __ATOMIC_RELAXED);
+    free(buffer);
+    return NULL;
+}
+struct piece_hashes *loadHashCache(const char *path, const struct stat *info)
+{ // The cached hashes of the file at path if they were taken of it as it is now, NULL otherwise
+    char cache[PATH_MAX];
+    struct hash_cache_header header;
+    snprintf(cache, sizeof(cache), "%s%s", path, HASH_CACHE_SUFFIX);
+    int fd = open(cache, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct piece_hashes *hashes = NULL;
+    if (read(fd, &header, sizeof(header)) == sizeof(header) && memcmp(header.magic, HASH_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+        header.size == (uint64_t)info->st_size && header.mtime_seconds == info->st_mtim.tv_sec &&
+        header.mtime_nanoseconds == info->st_mtim.tv_nsec && header.piece_size == PIECE_SIZE && (hashes = allocPieceHashes(header.size)) != NULL)
+    {
+        size_t length = (size_t)hashes->count * HASH_SIZE;
+        if (header.count != hashes->count || read(fd, hashes->pieces, length) != (ssize_t)length)
+        {
+            freePieceHashes(hashes);
+            hashes = NULL;
+        } else
+        { // a damaged cache fails this and the file is hashed again
+            merkleRoot(hashes->pieces, hashes->count, hashes->root);
+            if (memcmp(hashes->root, header.root, HASH_SIZE) != 0)
+            {
+                freePieceHashes(hashes);
+                hashes = NULL;
+            }
+        }
+    }
+    close(fd);
+    return hashes;
+}
+void saveHashCache(const char *path, const struct piece_hashes *hashes)
+{ // Keep the hashes of the file at path next to it for the next time it is registered. Nothing happens if it has changed size since
+  // or the directory is not writable
+    char cache[PATH_MAX], temporary[PATH_MAX + 4];
+    struct hash_cache_header header;
+    struct stat info;
+    if (stat(path, &info) < 0 || (uint64_t)info.st_size != hashes->size)
+        return;
+    memcpy(header.magic, HASH_CACHE_MAGIC, sizeof(header.magic));
+    header.size = hashes->size;
+    header.mtime_seconds = info.st_mtim.tv_sec;
+    header.mtime_nanoseconds = info.st_mtim.tv_nsec;
+    header.piece_size = PIECE_SIZE;
+    header.count = hashes->count;
+    memcpy(header.root, hashes->root, HASH_SIZE);
+    snprintf(cache, sizeof(cache), "%s%s", path, HASH_CACHE_SUFFIX);
+    snprintf(temporary, sizeof(temporary), "%s.tmp", cache);
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
         return;
+    int written = write(fd, &header, sizeof(header)) == sizeof(header) &&
+        write(fd, hashes->pieces, (size_t)hashes->count * HASH_SIZE) == (ssize_t)hashes->count * HASH_SIZE;
+    if (close(fd) < 0 || !written || rename(temporary, cache) < 0)
+        unlink(temporary);
+}
+struct piece_hashes *hashFile(const char *path)
+{ // Piece hashes and Merkle root of the file at path. They come from its cache if that still matches the file's size and modification
+  // time, so registering it again is free. Otherwise the pieces are hashed by up to one thread per core and cached. NULL if the
+  // file cannot be read
+    struct stat info;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &info) < 0 || !S_ISREG(info.st_mode))
+    {
+        if (fd >= 0)
+            close(fd);
+        return NULL;
     }
-    while (downloading)
-    { // downloading until E packet is received
-        if (recv(sockfd, &packet, sizeof(packet), 0) < 0)
+    struct piece_hashes *hashes = loadHashCache(path, &info);
+    if (hashes != NULL || (hashes = allocPieceHashes(info.st_size)) == NULL)
+    {
+        close(fd);
+        return hashes;
+    }
+    if (info.st_size >= PIECE_SIZE)
+        printf("Hashing %s (%.1f MB)...\n", path, info.st_size / 1e6);
+
+    struct hash_work work = { fd, hashes, 0, 0 };
+    pthread_t threads[MAX_HASH_THREADS];
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int helpers = 0, wanted = cores < MAX_HASH_THREADS ? cores : MAX_HASH_THREADS;
+    wanted = (uint32_t)wanted < hashes->count ? wanted : (int)hashes->count;
+    while (helpers + 1 < wanted && pthread_create(&threads[helpers], NULL, hashPieces, &work) == 0)
+        helpers++;
+    hashPieces(&work);
+    for (int i = 0; i < helpers; i++)
+        pthread_join(threads[i], NULL);
+    close(fd);
+    if (work.failed)
+    {
+        freePieceHashes(hashes);
+        return NULL;
+    }
+    merkleRoot(hashes->pieces, hashes->count, hashes->root);
+    struct stat after;
+    if (stat(path, &after) == 0 && after.st_mtim.tv_sec == info.st_mtim.tv_sec && after.st_mtim.tv_nsec == info.st_mtim.tv_nsec)
+        saveHashCache(path, hashes); // not if it changed while we read it
+    return hashes;
+}
+// COMPRESSION
+// Transfers a downloader asks to have compressed go out as frames, each one compressed with an LZ77 codec in the LZ4 block layout
+// or sent as it is when that does not pay. Logs and text shrink several times over, media and archives are passed through
+uint32_t loadWord(const unsigned char *p)
+{ // 4 bytes from anywhere, in host order
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+uint64_t loadLong(const unsigned char *p)
+{ // 8 bytes from anywhere, least significant first whatever the machine
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return le64toh(word);
+}
+unsigned int hashWord(uint32_t word)
+{ // Multiplicative hash of 4 bytes into a COMPRESS_HASH_BITS bit slot
+    return (word * 2654435761u) >> (32 - COMPRESS_HASH_BITS);
+}
+int emitSequence(unsigned char **out, const unsigned char *out_end, const unsigned char *literals, size_t literal_length, size_t offset,
+    size_t match_length)
+{ // Append literal_length literals followed by a match of match_length bytes offset back. An offset of 0 leaves the match out, which
+  // is how the last sequence ends. Returns 0 if it does not fit before out_end
+    unsigned char *op = *out;
+    if (1 + literal_length / 255 + 1 + literal_length + (offset > 0 ? 2 + match_length / 255 + 1 : 0) > (size_t)(out_end - op))
+        return 0;
+    unsigned char *token = op++;
+    *token = (literal_length < 15 ? literal_length : 15) << 4;
+    if (literal_length >= 15)
+    { // lengths that do not fit in the token go on in bytes of 255 and a last one below that
+        size_t rest = literal_length - 15;
+        for (; rest >= 255; rest -= 255)
+            *op++ = 255;
+        *op++ = rest;
+    }
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+    if (offset > 0)
+    {
+        size_t extra = match_length - COMPRESS_MIN_MATCH;
+        *op++ = offset & 255;
+        *op++ = offset >> 8;
+        *token |= extra < 15 ? extra : 15;
+        if (extra >= 15)
         {
-            printf("Error receiving packet from server...\n");
-            return;
+            size_t rest = extra - 15;
+            for (; rest >= 255; rest -= 255)
+                *op++ = 255;
+            *op++ = rest;
         }
-        if (packet.type == 'E')
+    }
+    *out = op;
+    return 1;
+}
+size_t compressBlock(const unsigned char *in, size_t length, unsigned char *out, size_t room)
+{ // Compress length bytes of in as sequences of literals and back references of up to 64 KB. Matches are found through a table of
+  // where each 4 byte hash was last seen, and the search strides further the longer it goes without one, so data that does not
+  // compress is given up on cheaply. Returns the compressed length, 0 if it does not fit in room
+    uint32_t table[1 << COMPRESS_HASH_BITS];
+    const unsigned char *p = in, *anchor = in, *end = in + length;
+    const unsigned char *limit = length > COMPRESS_LAST_LITERALS ? end - COMPRESS_LAST_LITERALS : in; // the end is always literals
+    unsigned char *op = out, *out_end = out + room;
+    unsigned int misses = 0;
+    memset(table, 0, sizeof(table));
+    while (p + COMPRESS_MIN_MATCH <= limit)
+    {
+        uint32_t word = loadWord(p);
+        unsigned int slot = hashWord(word);
+        const unsigned char *candidate = in + table[slot];
+        table[slot] = p - in;
+        if (candidate >= p || p - candidate > 65535 || loadWord(candidate) != word)
         {
-            downloading = 0;
-            if (strlen(packet.data) != 0)
-            {
-                printf("%s\n", packet.data);
-            } else
+            p += 1 + (misses++ >> COMPRESS_SKIP_SHIFT);
+            continue;
+        }
+        misses = 0;
+        while (p > anchor && candidate > in && p[-1] == candidate[-1])
+        { // the match may have started before we noticed it
+            p--;
+            candidate--;
+        }
+        const unsigned char *q = p + COMPRESS_MIN_MATCH, *c = candidate + COMPRESS_MIN_MATCH;
+        while (q + 8 <= limit)
+        { // 8 bytes at a time, the first one that differs is the lowest set bit of the difference
+            uint64_t difference = loadLong(q) ^ loadLong(c);
+            if (difference != 0)
             {
-                printf("File successfully downloaded...\n");
+                q += __builtin_ctzll(difference) >> 3;
+                goto matched;
             }
+            q += 8;
+            c += 8;
+        }
+        while (q < limit && *q == *c)
+        {
+            q++;
+            c++;
+        }
+matched:
+        if (!emitSequence(&op, out_end, anchor, p - anchor, p - candidate, q - p))
+            return 0;
+        if (q - 2 > in)
+            table[hashWord(loadWord(q - 2))] = q - 2 - in; // so the next match can start right where this one ends
+        p = anchor = q;
+    }
+    return emitSequence(&op, out_end, anchor, end - anchor, 0, 0) ? (size_t)(op - out) : 0;
+}
+int readExtraLength(const unsigned char **ip, const unsigned char *end, size_t *length)
+{ // Add the length bytes that follow a full token half. Returns 0 if the input ends first
+    unsigned char byte;
+    do
+    {
+        if (*ip >= end)
+            return 0;
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return 1;
+}
+int decompressBlock(const unsigned char *in, size_t length, unsigned char *out, size_t out_length)
+{ // Undo compressBlock. The input comes off the network, so every length and back reference is checked against both buffers.
+  // Returns 1 if it unpacked to exactly out_length bytes
+    const unsigned char *ip = in, *end = in + length;
+    unsigned char *op = out, *out_end = out + out_length;
+    while (ip < end)
+    {
+        unsigned char token = *ip++;
+        size_t literals = token >> 4, match = token & 15;
+        if ((literals == 15 && !readExtraLength(&ip, end, &literals)) || literals > (size_t)(end - ip) || literals > (size_t)(out_end - op))
+            return 0;
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if (ip == end) // the last sequence has no match
+            break;
+        if (end - ip < 2)
+            return 0;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (match == 15 && !readExtraLength(&ip, end, &match))
+            return 0;
+        match += COMPRESS_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - out) || match > (size_t)(out_end - op))
+            return 0;
+        const unsigned char *from = op - offset;
+        if (offset >= 8 && match + 8 <= (size_t)(out_end - op))
+        { // copies of 8 bytes may run past the match, into space the next sequence overwrites
+            for (size_t copied = 0; copied < match; copied += 8)
+                memcpy(op + copied, from + copied, 8);
+            op += match;
+        } else
+        { // overlapping, a short offset repeats what was just written
+            for (size_t i = 0; i < match; i++)
+                op[i] = from[i];
+            op += match;
+        }
+    }
+    return op == out_end;
+}
+int receiveFrame(int sockfd, unsigned char *out, uint64_t room, unsigned char *scratch)
+{ // Read the next frame of a 'Z' transfer and unpack it into out, which has room for room bytes. scratch holds COMPRESS_FRAME_SIZE
+  // bytes for the frame as it was sent. Returns how many bytes it unpacked to, -1 if the connection failed or the frame is malformed
+    struct frame_header header;
+    if (!recvAll(sockfd, &header, sizeof(header)))
+        return -1;
+    uint32_t raw = ntohl(header.raw_length), stored = ntohl(header.stored_length);
+    if (raw == 0 || raw > COMPRESS_FRAME_SIZE || raw > room || stored > raw)
+        return -1;
+    if (stored == raw)
+        return recvAll(sockfd, out, raw) ? (int)raw : -1;
+    return recvAll(sockfd, scratch, stored) && decompressBlock(scratch, stored, out, raw) ? (int)raw : -1;
+}
+// RING
+// Optional io_uring for the upload engine, spoken through the raw system calls. Disk reads and socket sends are queued as they come
+// up and handed to the kernel in one batch per pass of the engine, and their completions wake the engine through its epoll set like
+// any socket. A cold file then no longer stalls every other upload while sendfile waits for the disk
+int startRing(int groups)
+{ // Set up upload_ring with a buffer group for each of groups uploads at once. Returns 0 if this kernel will not give us one
+    struct io_uring_params params;
+    bzero(&params, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (fd < 0)
+        return 0;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+    { // older than 5.5, the completion queue could drop entries
+        close(fd);
+        return 0;
+    }
+    size_t sq_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_bytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t buffer_bytes = (size_t)groups * RING_CHUNKS * RING_BUFFER_SIZE;
+    char *rings = (char*)mmap(NULL, sq_bytes > cq_bytes ? sq_bytes : cq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    char *buffers = (char*)mmap(NULL, buffer_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    int *free_groups = (int*)malloc(groups * sizeof(int));
+    struct iovec *iovecs = (struct iovec*)malloc(groups * RING_CHUNKS * sizeof(struct iovec));
+    if (rings == MAP_FAILED || sqes == MAP_FAILED || buffers == MAP_FAILED || free_groups == NULL || iovecs == NULL)
+    { // the mappings go with the process, this only happens at startup
+        close(fd);
+        free(free_groups);
+        free(iovecs);
+        return 0;
+    }
+    struct ring *r = &upload_ring;
+    r->entries = params.sq_entries;
+    r->sq_head = (unsigned*)(rings + params.sq_off.head);
+    r->sq_tail = (unsigned*)(rings + params.sq_off.tail);
+    r->sq_mask = (unsigned*)(rings + params.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(rings + params.sq_off.array);
+    r->cq_head = (unsigned*)(rings + params.cq_off.head);
+    r->cq_tail = (unsigned*)(rings + params.cq_off.tail);
+    r->cq_mask = (unsigned*)(rings + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+    r->sqes = (struct io_uring_sqe*)sqes;
+    r->buffers = buffers;
+    r->free_groups = free_groups;
+    for (int i = 0; i < groups; i++)
+        free_groups[r->free_count++] = groups - 1 - i;
+    // Registered buffers are pinned once instead of on every read. Without the locked memory for it reads still work, they pin as they go
+    for (int i = 0; i < groups * RING_CHUNKS; i++)
+    {
+        iovecs[i].iov_base = buffers + (size_t)i * RING_BUFFER_SIZE;
+        iovecs[i].iov_len = RING_BUFFER_SIZE;
+    }
+    r->registered = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iovecs, groups * RING_CHUNKS) == 0;
+    free(iovecs);
+    r->fd = fd;
+    return 1;
+}
+void submitRing()
+{ // Hand everything queued since the last call to the kernel in one system call
+    struct ring *r = &upload_ring;
+    while (r->queued > 0)
+    {
+        int submitted = syscall(__NR_io_uring_enter, r->fd, r->queued, 0, 0, NULL, 0);
+        if (submitted < 0 && errno == EINTR)
+            continue;
+        if (submitted <= 0)
+        { // EAGAIN or EBUSY, the kernel is short of memory or completions. They stay queued for the next pass
+            if (debug)
+                perror("Cannot submit to io_uring");
             return;
         }
-        printf("Downloading...\n");
-        fprintf(fp, "%s", packet.data);
-        bzero(&packet, sizeof(packet));
+        r->queued -= submitted;
+    }
+}
+int queueRingOp(uint8_t opcode, int fd, void *address, unsigned length, off_t offset, int buffer, uint64_t user_data)
+{ // Queue one operation for the next submitRing. buffer is the index of a registered buffer for IORING_OP_READ_FIXED.
+  // Returns 0 if the submission queue is full even after submitting what is in it
+    struct ring *r = &upload_ring;
+    unsigned tail = *r->sq_tail;
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries)
+    {
+        submitRing();
+        if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries)
+            return 0;
+    }
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    bzero(sqe, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)address;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    if (opcode == IORING_OP_READ_FIXED)
+        sqe->buf_index = buffer;
+    if (opcode == IORING_OP_SEND)
+        sqe->msg_flags = MSG_NOSIGNAL;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE); // the entry is complete before the kernel can see it
+    r->queued++;
+    return 1;
+}
+char *ringBuffer(int group, int chunk)
+{ // Buffer chunk of a group
+    return upload_ring.buffers + ((size_t)group * RING_CHUNKS + chunk) * RING_BUFFER_SIZE;
+}
+// UPLOADS
+// A thread of its own serves every downloader, so a slow one cannot hold up the others or the terminal. Each connection moves
+// through reading the request, waiting for an upload slot and sending, driven by epoll on non-blocking sockets
+unsigned int hashName(const char *name)
+{ // FNV-1a over a content name
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < DEFAULT_NAME_SIZE && name[i] != '\0'; i++)
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    return hash;
+}
+struct File *findHostedFile(const char *content_name)
+{ // The hosted file registered under content_name, NULL if we do not serve it. Caller holds upload_lock
+    if (hosted_buckets == 0)
+        return NULL;
+    struct File *n = hosted_table[hashName(content_name) & (hosted_buckets - 1)];
+    while (n != NULL && strncmp(n->file_descriptor.content_name, content_name, DEFAULT_NAME_SIZE) != 0)
+        n = n->next_in_bucket;
+    return n;
+}
+void touchStoreObject(struct store_object *o);
+int openHostedFile(const char *content_name)
+{ // Open what we serve under content_name. Files registered from a directory or manifest are not in the working directory.
+  // Called by the engine, which holds upload_lock. Returns -1 with errno ENOENT for a name we do not host
+    struct File *n = findHostedFile(content_name);
+    if (n == NULL)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    if (n->object != NULL)
+        touchStoreObject(n->object); // popular content is the last to be evicted
+    return open(n->path != NULL ? n->path : n->file_descriptor.content_name, O_RDONLY);
+}
+void watchListener(int s)
+{ // Hand a listening socket to the upload engine. Listeners are told apart from connections by the low bit, which a pointer never has
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = ((uint64_t)s << 1) | 1 };
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+    pthread_mutex_lock(&upload_lock);
+    epoll_ctl(upload_epoll, EPOLL_CTL_ADD, s, &event);
+    pthread_mutex_unlock(&upload_lock);
+}
+void watchUpload(struct upload *u, uint32_t events)
+{ // Change what wakes u up. No events at all while it waits for a slot, for upload budget or for the ring
+    struct epoll_event event = { .events = events, .data.ptr = u };
+    if (events == u->events)
+        return;
+    u->events = events;
+    epoll_ctl(upload_epoll, EPOLL_CTL_MOD, u->sockfd, &event);
+}
+void takeRingGroup(struct upload *u)
+{ // Give u a buffer group so its range goes through the ring, if there is a ring and a group is free
+    u->ring_group = upload_ring.fd >= 0 && upload_ring.free_count > 0 ? upload_ring.free_groups[--upload_ring.free_count] : -1;
+    u->chunk_head = u->chunk_count = 0;
+    u->read_offset = u->offset;
+    u->ring_error = 0;
+}
+struct upload *unlinkUpload(struct upload **list, struct upload *u)
+{ // Take u off a list chained through next_waiting. Returns the entry that was before it, NULL if it was first
+    struct upload **link = list, *previous = NULL;
+    while (*link != u)
+    {
+        previous = *link;
+        link = &(*link)->next_waiting;
     }
+    *link = u->next_waiting;
+    return previous;
+}
+const char *queuePieceHashes(struct upload *u)
+{ // Queue the answer to an 'H' request: a transfer header and the piece hashes we registered the file with, straight from memory.
+  // Returns why it cannot be answered, NULL once it is queued
+    struct File *n = findHostedFile(u->request.content_name);
+    if (n == NULL)
+        return "The content server does not host this file...";
+    if (n->hashes == NULL)
+        return "The content server has no piece hashes for this file...";
+    size_t length = (size_t)n->hashes->count * HASH_SIZE;
+    size_t needed = sizeof(struct transfer_header) + length;
+    char *buffer = (char*)malloc(needed > UPLOAD_BUFFER_SIZE ? needed : UPLOAD_BUFFER_SIZE); // big enough to copy uploads through too
+    if (buffer == NULL)
+        return "The content server is out of memory...";
+    struct transfer_header header = { 'C', htobe64(length), htobe64(n->hashes->size) };
+    memcpy(buffer, &header, sizeof(header));
+    memcpy(buffer + sizeof(header), n->hashes->pieces, length);
+    free(u->buffer);
+    u->buffer = u->pending = buffer;
+    u->pending_length = needed;
+    u->pending_sent = 0;
+    u->offset = u->end = 0;
     if (debug)
-        printf("Finished downloading...\n");
+        printf("Sending the piece hashes of %s...\n", u->request.content_name);
+    return NULL;
 }
-void establishConnection(char *my_name, char *content_name, char *ip, char *port)
-{ // connect to TCP socket of client_server as client_peer after receiving IP and port from index server
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in serv_addr;
-    if (sockfd == -1)
+void startUpload(struct upload *u)
+{ // The request is in. Take a slot if one is free, otherwise queue. Then queue the transfer header, 'C' with the exact length of
+  // the range or 'E' with the reason we cannot serve it
+    struct stat info;
+    if (uploads_active >= upload_slots)
     {
-        printf("Failed to create TCP socket...\n");
+        u->state = UPLOAD_WAITING;
+        u->next_waiting = NULL;
+        if (upload_queue_tail != NULL)
+            upload_queue_tail->next_waiting = u;
+        else
+            upload_queue = u;
+        upload_queue_tail = u;
+        watchUpload(u, 0);
         return;
-    } else if (debug)
-        printf("TCP Socket created...\n");
-
-    bzero(&serv_addr, sizeof(serv_addr));
+    }
+    uploads_active++;
+    u->state = UPLOAD_SENDING;
+    u->first = 0;
+    u->compressed = u->request.type == 'D' && (u->request.flags & DOWNLOAD_COMPRESSED);
+    uint64_t offset = be64toh(u->request.offset), length = be64toh(u->request.length);
+    struct transfer_header *header = (struct transfer_header*)u->header_space;
+    const char *reason = NULL;
+    if (u->request.type == 'H')
+    { // answered from memory
+        if ((reason = queuePieceHashes(u)) == NULL)
+        {
+            watchUpload(u, EPOLLOUT);
+            return;
+        }
+    } else if ((u->fd = openHostedFile(u->request.content_name)) < 0 || fstat(u->fd, &info) < 0 || !S_ISREG(info.st_mode))
+    {
+        reason = "The content server cannot open this file...";
+        if (findHostedFile(u->request.content_name) == NULL)
+            reason = "The content server does not host this file...";
+        else
+            printf("Cannot open %s to upload it...\n", u->request.content_name);
+    } else if (offset > (uint64_t)info.st_size)
+        reason = "The requested range is outside the file...";
+    if (reason != NULL)
+    {
+        header->type = 'E';
+        header->length = htobe64(strlen(reason));
+        header->size = 0;
+        memcpy(u->header_space + sizeof(*header), reason, strlen(reason));
+        u->pending_length = sizeof(*header) + strlen(reason);
+        u->offset = u->end = 0;
+    } else
+    { // a range running past the end of the file stops there
+        if (length == 0 || length > info.st_size - offset)
+            length = info.st_size - offset;
+        header->type = u->compressed ? 'Z' : 'C';
+        header->length = htobe64(length);
+        header->size = htobe64(info.st_size);
+        u->pending_length = sizeof(*header);
+        u->offset = offset;
+        u->end = offset + length;
+        if (!u->compressed)
+            takeRingGroup(u);
+    }
+    u->first = u->offset;
+    u->started = nowSeconds();
+    if (debug)
+        printf("Uploading %s [%lld, %lld)...\n", u->request.content_name, (long long)u->offset, (long long)u->end);
+    watchUpload(u, EPOLLOUT);
+}
+void releaseUpload(struct upload *u)
+{ // u is done with its current request, however that went. Close its file, take it off any list and give its slot to the longest
+  // waiting downloader
+    int had_slot = u->state == UPLOAD_SENDING;
+    if (had_slot && u->end > u->first)
+        countTransfer(&upload_stats, u->offset - u->first, u->offset == u->end, nowSeconds() - u->started);
+    if (debug && had_slot)
+        printf("Upload of %s stopped at %lld, the range ends at %lld...\n", u->request.content_name, (long long)u->offset, (long long)u->end);
+    if (u->ring_ops > 0)
+        submitRing(); // reads still queued must reach the kernel before their file number can be handed out again
+    if (u->fd >= 0)
+        close(u->fd);
+    u->fd = -1;
+    if (u->ring_group >= 0 && u->ring_ops == 0)
+    { // with operations in flight the buffers are still the kernel's, finishUpload comes back here once they are not
+        upload_ring.free_groups[upload_ring.free_count++] = u->ring_group;
+        u->ring_group = -1;
+    }
+    if (u->state == UPLOAD_WAITING) // only reached if its socket failed while it queued
+    {
+        struct upload *previous = unlinkUpload(&upload_queue, u);
+        if (upload_queue_tail == u)
+            upload_queue_tail = previous;
+    }
+    if (u->throttled)
+        unlinkUpload(&upload_throttled, u);
+    u->throttled = 0;
+    u->state = UPLOAD_REQUEST;
+    if (!had_slot)
+        return;
+    uploads_active--;
+    if (upload_queue != NULL)
+    {
+        struct upload *next = upload_queue;
+        upload_queue = next->next_waiting;
+        if (upload_queue == NULL)
+            upload_queue_tail = NULL;
+        startUpload(next);
+    }
+}
+void finishUpload(struct upload *u)
+{ // Close u whatever state it is in. Ring operations still in flight are ended by shutting the socket down, and u is only freed
+  // when the last of them is back, see completeRingOp
+    releaseUpload(u);
+    if (u->ring_ops > 0)
+    {
+        if (!u->closing)
+        {
+            u->closing = 1;
+            shutdown(u->sockfd, SHUT_RDWR);
+            epoll_ctl(upload_epoll, EPOLL_CTL_DEL, u->sockfd, NULL);
+        }
+        return;
+    }
+    close(u->sockfd);
+    free(u->buffer);
+    free(u->frame);
+    free(u);
+}
+void awaitNextRequest(struct upload *u)
+{ // The range went out in full. Keep the connection for another request, which is how a swarm download fetches piece after piece
+    releaseUpload(u);
+    u->request_received = 0;
+    u->pending = u->header_space;
+    u->pending_length = u->pending_sent = 0;
+    watchUpload(u, EPOLLIN);
+}
+int flushPending(struct upload *u)
+{ // Send what is queued in u->pending. Returns 1 once it is all out, 0 if the socket is full, -1 if the connection failed
+    while (u->pending_sent < u->pending_length)
+    {
+        ssize_t n = send(u->sockfd, u->pending + u->pending_sent, u->pending_length - u->pending_sent, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n <= 0)
+            return -1;
+        u->pending_sent += n;
+    }
+    u->pending_length = u->pending_sent = 0;
+    return 1;
+}
+int queueFrame(struct upload *u)
+{ // Read the next frame of a 'Z' upload and queue it, compressed unless that saves less than an eighth. Once COMPRESS_GIVE_UP
+  // frames in a row did not shrink, the file is likely compressed already and only every COMPRESS_PROBE_INTERVAL-th frame is tried,
+  // for as long as the connection lasts. Returns 0 once it is queued, -1 on failure
+    struct frame_header header;
+    size_t raw = u->end - u->offset < COMPRESS_FRAME_SIZE ? u->end - u->offset : COMPRESS_FRAME_SIZE, got = 0, stored = 0;
+    if (u->frame == NULL && (u->frame = (unsigned char*)malloc(sizeof(header) + 2 * COMPRESS_FRAME_SIZE)) == NULL)
+        return -1;
+    int attempt = u->incompressible < COMPRESS_GIVE_UP || u->incompressible % COMPRESS_PROBE_INTERVAL == 0;
+    unsigned char *body = u->frame + sizeof(header), *data = attempt ? body + COMPRESS_FRAME_SIZE : body;
+    while (got < raw)
+    {
+        ssize_t n = pread(u->fd, data + got, raw - got, u->offset + got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        got += n;
+    }
+    if (attempt && (stored = compressBlock(data, raw, body, raw - raw / 8 - 1)) == 0)
+        memcpy(body, data, raw);
+    u->incompressible = stored > 0 ? 0 : u->incompressible + 1;
+    header.raw_length = htonl(raw);
+    header.stored_length = htonl(stored > 0 ? stored : raw);
+    memcpy(u->frame, &header, sizeof(header));
+    u->pending = (char*)u->frame;
+    u->pending_length = sizeof(header) + (stored > 0 ? stored : raw);
+    u->offset += raw;
+    upload_budget -= u->pending_length; // what crosses the link, so a capped upload gets further through the file
+    return 0;
+}
+int pumpRing(struct upload *u)
+{ // Keep up to RING_CHUNKS disk reads ahead of the one send of u in flight on the ring, which takes them on the next submitRing.
+  // One send at a time keeps the bytes in order. Returns 1 when the range is out, 0 to wait for completions, 2 to wait for upload
+  // budget, -1 on failure
+    if (u->ring_error != 0)
+    {
+        errno = u->ring_error;
+        return -1;
+    }
+    uint64_t tag = (uint64_t)(uintptr_t)u; // allocations are aligned, so the low bits are free for the chunk
+    while (u->chunk_count < RING_CHUNKS && u->read_offset < u->end)
+    {
+        int index = (u->chunk_head + u->chunk_count) % RING_CHUNKS;
+        struct ring_chunk *chunk = &u->chunks[index];
+        chunk->offset = u->read_offset;
+        chunk->length = u->end - u->read_offset < RING_BUFFER_SIZE ? u->end - u->read_offset : RING_BUFFER_SIZE;
+        chunk->sent = 0;
+        if (!queueRingOp(upload_ring.registered ? IORING_OP_READ_FIXED : IORING_OP_READ, u->fd, ringBuffer(u->ring_group, index),
+            chunk->length, chunk->offset, u->ring_group * RING_CHUNKS + index, tag | index))
+            break;
+        chunk->state = RING_READING;
+        u->chunk_count++;
+        u->read_offset += chunk->length;
+        u->ring_ops++;
+    }
+    struct ring_chunk *head = &u->chunks[u->chunk_head];
+    if (u->chunk_count > 0 && head->state == RING_READ)
+    {
+        if (upload_rate > 0 && upload_budget < 1)
+            return 2;
+        if (queueRingOp(IORING_OP_SEND, u->sockfd, ringBuffer(u->ring_group, u->chunk_head) + head->sent, head->length - head->sent, 0, -1,
+            tag | u->chunk_head))
+        {
+            head->state = RING_SENDING;
+            u->ring_ops++;
+        }
+    }
+    if (u->ring_ops == 0)
+    { // done, or the queue was full and the socket being writable brings us back
+        if (u->offset >= u->end)
+            return 1;
+        watchUpload(u, EPOLLOUT);
+        return 0;
+    }
+    watchUpload(u, 0);
+    return 0;
+}
+int continueUpload(struct upload *u)
+{ // Push up to UPLOAD_TURN_SIZE more bytes, so one fast downloader cannot starve the rest. sendfile moves them from the page cache
+  // to the socket without passing through user space. Returns 1 when the range is out, 0 to wait for the socket, 2 to wait for
+  // upload budget, -1 on failure
+    off_t turn_end = u->offset + UPLOAD_TURN_SIZE;
+    while (1)
+    {
+        int flushed = flushPending(u);
+        if (flushed <= 0)
+            return flushed;
+        if (u->ring_group >= 0)
+            return pumpRing(u);
+        if (u->offset >= u->end || u->offset >= turn_end)
+            return u->offset >= u->end;
+        if (upload_rate > 0 && upload_budget < 1)
+            return 2;
+        if (u->compressed)
+        { // frames are whole, so the budget may go below zero and the next wait is longer
+            if (queueFrame(u) < 0)
+                return -1;
+            continue;
+        }
+        size_t chunk = u->end - u->offset;
+        if (upload_rate > 0 && chunk > upload_budget)
+            chunk = upload_budget;
+        if (upload_with_sendfile)
+        {
+            ssize_t n = sendfile(u->sockfd, u->fd, &u->offset, chunk);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+            { // this kernel or file system cannot do it, so stop trying
+                upload_with_sendfile = 0;
+                continue;
+            }
+            if (n <= 0)
+                return -1;
+            upload_budget -= n;
+            continue;
+        }
+        // Without sendfile: read the next piece into our buffer and send it from there
+        if (u->buffer == NULL && (u->buffer = (char*)malloc(UPLOAD_BUFFER_SIZE)) == NULL)
+            return -1;
+        ssize_t n = pread(u->fd, u->buffer, chunk < UPLOAD_BUFFER_SIZE ? chunk : UPLOAD_BUFFER_SIZE, u->offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        u->pending = u->buffer;
+        u->pending_length = n;
+        u->offset += n;
+        upload_budget -= n;
+    }
+}
+int refillUploadBudget()
+{ // Top up the token bucket for the time that passed, keeping at most UPLOAD_BURST_SECONDS worth, and wake the throttled connections
+  // once there is budget again. Returns how many milliseconds epoll may sleep before it has to come back here, -1 for as long as it likes
+    if (upload_rate <= 0)
+        return -1;
+    double now = nowSeconds();
+    upload_budget += (now - upload_budget_time) * upload_rate;
+    if (upload_budget > upload_rate * UPLOAD_BURST_SECONDS)
+        upload_budget = upload_rate * UPLOAD_BURST_SECONDS;
+    upload_budget_time = now;
+    if (upload_throttled == NULL)
+        return -1;
+    if (upload_budget < 1)
+        return 1 + (int)((1 - upload_budget) / upload_rate * 1000);
+    while (upload_throttled != NULL)
+    {
+        struct upload *u = upload_throttled;
+        upload_throttled = u->next_waiting;
+        u->throttled = 0;
+        watchUpload(u, EPOLLOUT);
+    }
+    return -1;
+}
+void acceptDownloaders(int s)
+{ // Take every connection waiting on a listener
+    while (1)
+    {
+        int sockfd = accept4(s, NULL, NULL, SOCK_NONBLOCK);
+        if (sockfd < 0)
+        {
+            if (debug && errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("Failed to accept new client connection...\n");
+            if (errno != EINTR)
+                return;
+            continue;
+        }
+        struct upload *u = (struct upload*)calloc(1, sizeof(struct upload));
+        if (u == NULL)
+        {
+            close(sockfd);
+            continue;
+        }
+        // A downloader asks for the hashes and then the data on one connection, so a short file's data would otherwise wait for
+        // the header before it to be acknowledged
+        int nodelay = 1;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        u->sockfd = sockfd;
+        u->fd = -1;
+        u->state = UPLOAD_REQUEST;
+        u->pending = u->header_space;
+        u->events = EPOLLIN;
+        u->ring_group = -1;
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = u };
+        if (epoll_ctl(upload_epoll, EPOLL_CTL_ADD, sockfd, &event) < 0)
+        {
+            close(sockfd);
+            free(u);
+        }
+    }
+}
+void advanceUpload(struct upload *u);
+void serviceUpload(struct upload *u, uint32_t events)
+{ // Move one connection along after epoll says its socket is ready
+    if (u->state == UPLOAD_REQUEST)
+    { // the D request may come in pieces, and the downloader hanging up here is the normal end of a connection
+        ssize_t n = recv(u->sockfd, (char*)&u->request + u->request_received, sizeof(u->request) - u->request_received, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return;
+        if (n <= 0)
+        {
+            finishUpload(u);
+            return;
+        }
+        u->request_received += n;
+        if (u->request_received == sizeof(u->request))
+        {
+            u->request.content_name[DEFAULT_NAME_SIZE - 1] = '\0';
+            startUpload(u);
+        }
+        return;
+    }
+    if (u->state == UPLOAD_WAITING || u->throttled || u->ring_ops > 0)
+    { // nothing to do until a slot, budget or the ring frees up, unless the downloader is gone
+        if (events & (EPOLLERR | EPOLLHUP))
+            finishUpload(u);
+        else if (u->ring_ops > 0)
+            watchUpload(u, 0); // woken from the budget wait while the ring still works for it, the completions move it along
+        return;
+    }
+    advanceUpload(u);
+}
+void advanceUpload(struct upload *u)
+{ // Send what u can send now and deal with how that went
+    int progress = continueUpload(u);
+    if (progress == 2)
+    { // parked until refillUploadBudget wakes it
+        u->throttled = 1;
+        u->next_waiting = upload_throttled;
+        upload_throttled = u;
+        watchUpload(u, 0);
+    } else if (progress == 1)
+        awaitNextRequest(u);
+    else if (progress < 0)
+    {
+        if (debug || (errno != EPIPE && errno != ECONNRESET)) // a swarm drops connections to pieces somebody else delivered
+            perror("Error while sending file contents...\n");
+        finishUpload(u);
+    }
+}
+void completeRingOp(struct upload *u, int index, int result)
+{ // The kernel finished the read or the send of chunk index of u with result, a byte count or minus an errno
+    struct ring_chunk *chunk = &u->chunks[index];
+    u->ring_ops--;
+    if (u->closing)
+    {
+        if (u->ring_ops == 0)
+            finishUpload(u);
+        return;
+    }
+    if (chunk->state == RING_READING)
+    { // a short read means the file shrank under us
+        if (result != (int)chunk->length)
+            u->ring_error = result < 0 ? -result : EIO;
+        chunk->state = RING_READ;
+    } else if (result == -EAGAIN || result == -EINTR)
+    { // kernels that do not wait for room on non-blocking sockets. Try again once epoll says there is
+        chunk->state = RING_READ;
+        if (u->ring_ops == 0)
+            watchUpload(u, EPOLLOUT);
+        return;
+    } else if (result <= 0)
+        u->ring_error = result < 0 ? -result : EPIPE;
+    else
+    {
+        chunk->sent += result;
+        u->offset += result;
+        upload_budget -= result;
+        chunk->state = RING_READ;
+        if (chunk->sent == chunk->length)
+        {
+            u->chunk_head = (u->chunk_head + 1) % RING_CHUNKS;
+            u->chunk_count--;
+        }
+    }
+    if (u->throttled || (u->ring_error != 0 && u->ring_ops > 0))
+        return; // refillUploadBudget wakes it, or it failed and the rest of its operations are waited for first
+    advanceUpload(u);
+}
+void reapRing()
+{ // Take every completion the kernel has posted
+    struct ring *r = &upload_ring;
+    unsigned head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        uint64_t tag = cqe->user_data;
+        int result = cqe->res;
+        __atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE); // the entry is copied, the kernel may reuse it
+        completeRingOp((struct upload*)(uintptr_t)(tag & ~(uint64_t)(RING_CHUNKS - 1)), tag & (RING_CHUNKS - 1), result);
+    }
+}
+void *uploadLoop(void *arg)
+{ // The upload engine. Runs for the life of the peer
+    struct epoll_event events[UPLOAD_EVENTS];
+    int timeout = -1;
+    while (1)
+    {
+        int ready = epoll_wait(upload_epoll, events, UPLOAD_EVENTS, timeout);
+        if (ready < 0 && errno != EINTR)
+        {
+            perror("error during epoll_wait...\n");
+            return NULL;
+        }
+        pthread_mutex_lock(&upload_lock); // the terminal side changes the hosted files under us otherwise
+        for (int i = 0; i < ready; i++)
+        {
+            if (events[i].data.u64 & 1)
+                acceptDownloaders(events[i].data.u64 >> 1);
+            else if (events[i].data.u64 == RING_EVENT_TAG)
+                reapRing();
+            else
+                serviceUpload((struct upload*)events[i].data.ptr, events[i].events);
+        }
+        timeout = refillUploadBudget();
+        if (upload_ring.fd >= 0)
+            submitRing(); // everything this pass queued, in one go
+        pthread_mutex_unlock(&upload_lock);
+    }
+    return NULL;
+}
+int startUploadEngine()
+{ // Create the epoll set and the thread behind it. Returns 0 on failure
+    pthread_t thread;
+    upload_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (upload_epoll < 0)
+        return 0;
+    if (upload_with_ring)
+    { // completions make the ring readable, which wakes the engine like a socket would
+        struct epoll_event event = { .events = EPOLLIN, .data.u64 = RING_EVENT_TAG };
+        if (!startRing(upload_slots) || epoll_ctl(upload_epoll, EPOLL_CTL_ADD, upload_ring.fd, &event) < 0)
+        {
+            printf("io_uring is not available here, uploads use epoll...\n");
+            upload_ring.fd = -1;
+        }
+    }
+    if (pthread_create(&thread, NULL, uploadLoop, NULL) != 0)
+        return 0;
+    pthread_detach(thread);
+    return 1;
+}
+
+// STORE
+// With --store DIR downloads go into a content store instead of the working directory. Every distinct content is kept once, as
+// DIR/objects/HEX where HEX spells its Merkle root, with its hash cache next to it, and DIR/names/NAME is a symbolic link to what
+// NAME was downloaded as. A name whose content is there already is linked without downloading anything, and a file we register is
+// linked in too so that getting the same content later under any name is free. Downloads are seeded from the store, and once it
+// holds more than --store-quota the least recently used content is evicted and its names are taken off the index
+int waitDeletionAcknowledgement(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size, char *request);
+void removeFromHostedFiles(char *file_name);
+void downloadPath(char *path, size_t size, const char *content_name, const char *suffix)
+{ // Where a download of content_name, or its sidecar file with suffix, is written: the working directory or the store's incoming one
+    if (store_directory != NULL)
+        snprintf(path, size, "%s/" STORE_INCOMING "/%s%s", store_directory, content_name, suffix);
+    else
+        snprintf(path, size, "%s%s", content_name, suffix);
+}
+void objectPath(char *path, size_t size, const unsigned char root[HASH_SIZE], const char *suffix)
+{ // Where the content with root is kept in the store, or its sidecar file with suffix
+    int length = snprintf(path, size, "%s/" STORE_OBJECTS "/", store_directory);
+    for (int i = 0; i < HASH_SIZE && length + 2 < size; i++)
+        length += snprintf(path + length, size - length, "%02x", root[i]);
+    snprintf(path + length, size - length, "%s", suffix);
+}
+int parseObjectName(const char *name, unsigned char root[HASH_SIZE])
+{ // The root an object file name spells. Returns 0 if it is not one
+    if (strlen(name) != 2 * HASH_SIZE)
+        return 0;
+    for (int i = 0; i < HASH_SIZE; i++)
+        if (sscanf(name + 2 * i, "%2hhx", &root[i]) != 1)
+            return 0;
+    return 1;
+}
+size_t storeBucket(const unsigned char root[HASH_SIZE], size_t buckets)
+{ // Where root goes in a store table of buckets. A root is a hash already, so its first bytes are spread well enough
+    size_t bits;
+    memcpy(&bits, root, sizeof(bits));
+    return bits & (buckets - 1);
+}
+struct store_object *findStoreObject(const unsigned char root[HASH_SIZE])
+{ // The stored content with root, NULL if the store does not have it
+    struct store_object *o = store_buckets > 0 ? store_table[storeBucket(root, store_buckets)] : NULL;
+    while (o != NULL && memcmp(o->root, root, HASH_SIZE) != 0)
+        o = o->next_in_bucket;
+    return o;
+}
+int growStoreTable()
+{ // Double the store table (or create it) and rechain every object. Caller holds upload_lock. Returns 0 if memory ran out
+    size_t buckets = store_buckets > 0 ? 2 * store_buckets : INITIAL_STORE_BUCKETS;
+    struct store_object **table = (struct store_object**)calloc(buckets, sizeof(struct store_object*));
+    if (table == NULL)
+        return 0;
+    for (size_t i = 0; i < store_buckets; i++)
+        for (struct store_object *o = store_table[i], *next; o != NULL; o = next)
+        {
+            next = o->next_in_bucket;
+            struct store_object **bucket = &table[storeBucket(o->root, buckets)];
+            o->next_in_bucket = *bucket;
+            *bucket = o;
+        }
+    free(store_table);
+    store_table = table;
+    store_buckets = buckets;
+    return 1;
+}
+void touchStoreObject(struct store_object *o)
+{ // o was just used. The disk only hears of it once every STORE_TOUCH_SECONDS, the engine may open it many times a second
+    time_t now = time(NULL);
+    __atomic_store_n(&o->last_used, now, __ATOMIC_RELAXED); // trimStore reads it without upload_lock
+    if (now - o->touched < STORE_TOUCH_SECONDS)
+        return;
+    char path[PATH_MAX];
+    objectPath(path, sizeof(path), o->root, HASH_CACHE_SUFFIX);
+    utimensat(AT_FDCWD, path, NULL, 0);
+    o->touched = now;
+}
+struct store_object *addStoreObject(const unsigned char root[HASH_SIZE])
+{ // Take stock of the object file of root, which is in place. Returns NULL if it is not there or memory ran out
+    char path[PATH_MAX];
+    struct stat info, cache;
+    struct store_object *o;
+    objectPath(path, sizeof(path), root, "");
+    if (stat(path, &info) < 0 || (o = (struct store_object*)calloc(1, sizeof(struct store_object))) == NULL)
+        return NULL;
+    memcpy(o->root, root, HASH_SIZE);
+    o->size = info.st_size;
+    o->pinned = info.st_nlink > 1;
+    objectPath(path, sizeof(path), root, HASH_CACHE_SUFFIX);
+    o->last_used = o->touched = stat(path, &cache) == 0 ? cache.st_mtime : info.st_mtime;
+    pthread_mutex_lock(&upload_lock);
+    if (store_count == store_buckets && !growStoreTable() && store_buckets == 0)
+    {
+        pthread_mutex_unlock(&upload_lock);
+        free(o);
+        return NULL;
+    }
+    struct store_object **bucket = &store_table[storeBucket(root, store_buckets)];
+    o->next_in_bucket = *bucket;
+    *bucket = o;
+    store_count++;
+    if (!o->pinned)
+        store_used += o->size;
+    pthread_mutex_unlock(&upload_lock);
+    return o;
+}
+void forgetStoreObject(struct store_object *o)
+{ // Delete o from the disk and from the store. Hosted files still served from it keep their path, so they fail like a deleted file
+    char path[PATH_MAX];
+    objectPath(path, sizeof(path), o->root, "");
+    unlink(path);
+    objectPath(path, sizeof(path), o->root, HASH_CACHE_SUFFIX);
+    unlink(path);
+    pthread_mutex_lock(&upload_lock);
+    struct store_object **link = &store_table[storeBucket(o->root, store_buckets)];
+    while (*link != o)
+        link = &(*link)->next_in_bucket;
+    *link = o->next_in_bucket;
+    store_count--;
+    if (!o->pinned)
+        store_used -= o->size;
+    for (struct File *n = head; n != NULL; n = n->next)
+        if (n->object == o)
+            n->object = NULL;
+    pthread_mutex_unlock(&upload_lock);
+    free(o);
+}
+int openStore()
+{ // Create the store's directories unless they exist and take stock of the content in it. Downloads interrupted in incoming stay and
+  // resume like they would in the working directory. Returns 0 if the store cannot be used
+    char path[PATH_MAX];
+    const char *parts[] = {"", STORE_OBJECTS, STORE_NAMES, STORE_INCOMING};
+    unsigned char root[HASH_SIZE];
+    for (int i = 0; i < sizeof(parts) / sizeof(parts[0]); i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", store_directory, parts[i]);
+        if (mkdir(path, 0755) < 0 && errno != EEXIST)
+            return 0;
+    }
+    snprintf(path, sizeof(path), "%s/" STORE_OBJECTS, store_directory);
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return 0;
+    for (struct dirent *entry = readdir(dir); entry != NULL; entry = readdir(dir))
+        if (parseObjectName(entry->d_name, root))
+            addStoreObject(root);
+    closedir(dir);
+    return 1;
+}
+struct piece_hashes *findStoredContent(const unsigned char root[HASH_SIZE])
+{ // The hashes of the content with root if the store has it intact, NULL if it has to be downloaded. Content linked in from a
+  // file that was changed since is dropped
+    struct store_object *o = isZeroHash(root) ? NULL : findStoreObject(root);
+    if (o == NULL)
+        return NULL;
+    char path[PATH_MAX];
+    objectPath(path, sizeof(path), root, "");
+    struct piece_hashes *hashes = hashFile(path);
+    if (hashes != NULL && memcmp(hashes->root, root, HASH_SIZE) == 0)
+        return hashes;
+    freePieceHashes(hashes);
+    forgetStoreObject(o);
+    return NULL;
+}
+void linkStoreName(const char *content_name, const unsigned char root[HASH_SIZE])
+{ // Point DIR/names/content_name at the content with root, replacing what it pointed at in one step
+    char object[PATH_MAX], target[PATH_MAX], name[PATH_MAX], temporary[PATH_MAX + 4];
+    objectPath(object, sizeof(object), root, "");
+    snprintf(target, sizeof(target), "../" STORE_OBJECTS "/%s", strrchr(object, '/') + 1);
+    snprintf(name, sizeof(name), "%s/" STORE_NAMES "/%s", store_directory, content_name);
+    snprintf(temporary, sizeof(temporary), "%s.tmp", name);
+    unlink(temporary);
+    if (symlink(target, temporary) < 0 || rename(temporary, name) < 0)
+        unlink(temporary);
+}
+struct piece_hashes *storeDownload(const char *content_name, struct piece_hashes *hashes, char **path)
+{ // File content_name in the store now that it was downloaded into incoming, or found there already if hashes is not NULL, and point
+  // the name at it. Content that arrived under another name before is kept once. Returns its hashes and in path the object it is
+  // served from, NULL if it could not be stored
+    char incoming[PATH_MAX], incoming_cache[PATH_MAX], object[PATH_MAX], object_cache[PATH_MAX];
+    downloadPath(incoming, sizeof(incoming), content_name, "");
+    downloadPath(incoming_cache, sizeof(incoming_cache), content_name, HASH_CACHE_SUFFIX);
+    if (hashes == NULL)
+    {
+        if ((hashes = hashFile(incoming)) == NULL) // the download cached them
+            return NULL;
+        objectPath(object, sizeof(object), hashes->root, "");
+        objectPath(object_cache, sizeof(object_cache), hashes->root, HASH_CACHE_SUFFIX);
+        if (findStoreObject(hashes->root) != NULL)
+        { // the same bytes under another name
+            printf("%s is the same content as one already in the store, it is kept once...\n", content_name);
+            unlink(incoming);
+            unlink(incoming_cache);
+        } else if (rename(incoming, object) < 0)
+        {
+            printf("Cannot move %s into the store...\n", content_name);
+            freePieceHashes(hashes);
+            return NULL;
+        } else
+        { // a rename keeps the modification time, so the cache still matches
+            if (rename(incoming_cache, object_cache) < 0)
+                saveHashCache(object, hashes);
+            addStoreObject(hashes->root);
+        }
+    }
+    struct store_object *o = findStoreObject(hashes->root);
+    if (o == NULL)
+    {
+        freePieceHashes(hashes);
+        return NULL;
+    }
+    o->touched = 0; // this use is written out right away
+    touchStoreObject(o);
+    linkStoreName(content_name, hashes->root);
+    objectPath(object, sizeof(object), hashes->root, "");
+    *path = strdup(object);
+    return hashes;
+}
+void importIntoStore(const char *path, const struct piece_hashes *hashes)
+{ // Link a file being registered into the store, so that downloading the same content later under any name costs nothing. A hard
+  // link shares the file and pins it, a reflink on file systems that have them shares its blocks. Without either it stays out
+    char object[PATH_MAX];
+    if (findStoreObject(hashes->root) != NULL)
+        return;
+    objectPath(object, sizeof(object), hashes->root, "");
+    if (link(path, object) < 0)
+    {
+        int source = open(path, O_RDONLY), copy = source < 0 ? -1 : open(object, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        int cloned = copy >= 0 && ioctl(copy, FICLONE, source) == 0;
+        if (source >= 0)
+            close(source);
+        if (copy >= 0 && (close(copy) < 0 || !cloned))
+            unlink(object);
+        if (!cloned)
+            return;
+    }
+    saveHashCache(object, hashes);
+    addStoreObject(hashes->root);
+}
+void evictStoreObject(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size, struct store_object *o)
+{ // Take every name served from o off the index and out of the store, then delete it. A name of o that is not hosted, because
+  // registering it failed, is left dangling until seedStore drops it at the next start
+    char request[STANDARD_BUF_SIZE], path[PATH_MAX], target[PATH_MAX], object[PATH_MAX];
+    objectPath(object, sizeof(object), o->root, "");
+    printf("Evicting %.1f MB of content from the store...\n", o->size / 1e6);
+    for (struct File *n = head, *next; n != NULL; n = next)
+    {
+        next = n->next;
+        if (n->object != o)
+            continue;
+        char name[DEFAULT_NAME_SIZE];
+        memcpy(name, n->file_descriptor.content_name, DEFAULT_NAME_SIZE);
+        snprintf(request, sizeof(request), "%.*s:%s", DEFAULT_NAME_SIZE - 1, name, client_name);
+        waitDeletionAcknowledgement(sockfd, socket_addr, socket_addr_size, request);
+        removeFromHostedFiles(name); // gone from here whatever the index said
+        snprintf(path, sizeof(path), "%s/" STORE_NAMES "/%s", store_directory, name);
+        ssize_t length = readlink(path, target, sizeof(target) - 1);
+        if (length <= 0)
+            continue;
+        target[length] = '\0';
+        if (strcmp(strrchr(target, '/') != NULL ? strrchr(target, '/') + 1 : target, strrchr(object, '/') + 1) == 0)
+            unlink(path); // unless the name was pointed at other content since
+    }
+    forgetStoreObject(o);
+}
+void trimStore(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size, const unsigned char keep[HASH_SIZE])
+{ // Evict the least recently used content until the store fits its quota. keep was just stored and stays, even if it alone is over.
+  // Only the victim is looked at on the disk, in case a file was linked to it since. Content whose pin went away counts again from
+  // the next start
+    char path[PATH_MAX];
+    struct stat info;
+    while (store_quota > 0 && store_used > store_quota)
+    {
+        struct store_object *victim = NULL;
+        for (size_t i = 0; i < store_buckets; i++)
+            for (struct store_object *o = store_table[i]; o != NULL; o = o->next_in_bucket)
+                if (!o->pinned && memcmp(o->root, keep, HASH_SIZE) != 0 &&
+                    (victim == NULL || __atomic_load_n(&o->last_used, __ATOMIC_RELAXED) < __atomic_load_n(&victim->last_used, __ATOMIC_RELAXED)))
+                    victim = o;
+        if (victim == NULL)
+            return;
+        objectPath(path, sizeof(path), victim->root, "");
+        if (stat(path, &info) == 0 && info.st_nlink > 1)
+        { // pinned now, so it takes no space of its own
+            pthread_mutex_lock(&upload_lock);
+            victim->pinned = 1;
+            store_used -= victim->size;
+            pthread_mutex_unlock(&upload_lock);
+            continue;
+        }
+        evictStoreObject(sockfd, socket_addr, socket_addr_size, victim);
+    }
+}
+// R
+int growHostedTable()
+{ // Double the hosted table (or create it) and rechain every file. Caller holds upload_lock. Returns 0 if memory ran out
+    size_t buckets = hosted_buckets > 0 ? 2 * hosted_buckets : INITIAL_HOSTED_BUCKETS;
+    struct File **table = (struct File**)calloc(buckets, sizeof(struct File*));
+    if (table == NULL)
+        return 0;
+    for (struct File *n = head; n != NULL; n = n->next)
+    {
+        struct File **bucket = &table[hashName(n->file_descriptor.content_name) & (buckets - 1)];
+        n->next_in_bucket = *bucket;
+        *bucket = n;
+    }
+    free(hosted_table);
+    hosted_table = table;
+    hosted_buckets = buckets;
+    return 1;
+}
+void addToHostedFiles(struct rpdu h_file, char *path, struct piece_hashes *hashes)
+{ // Track files which index_server is tracking as available at this content server. path is NULL for a file in the working directory.
+  // The hosted file owns path and hashes from here on
+    struct File* new_head = (struct File*)malloc(sizeof(struct File));
+    new_head->file_descriptor = h_file;
+    new_head->path = path;
+    new_head->hashes = hashes;
+    new_head->object = NULL;
+    if (store_directory != NULL && path != NULL && hashes != NULL)
+    { // served from the store when path is the object of its content
+        char object[PATH_MAX];
+        objectPath(object, sizeof(object), hashes->root, "");
+        if (strcmp(path, object) == 0)
+            new_head->object = findStoreObject(hashes->root);
+    }
+    pthread_mutex_lock(&upload_lock);
+    if (hosted_count == hosted_buckets)
+        growHostedTable(); // if this fails the chains just get longer
+    struct File **bucket = &hosted_table[hashName(h_file.content_name) & (hosted_buckets - 1)];
+    new_head->next_in_bucket = *bucket;
+    *bucket = new_head;
+    new_head->next = head;
+    head = new_head;
+    hosted_count++;
+    pthread_mutex_unlock(&upload_lock);
+}
+int waitRegisteredAcknowledgement(int sockfd, uint32_t request_id)
+{ // Process server status response from corresponding file registration request
+    struct message server_response;
+    if (request_id == 0 || !receiveReply(sockfd, request_id, &server_response))
+    { // the request was sent CONTROL_MAX_TRIES times without an answer
+        printf("The index server did not answer... Please try again later.\n");
+        return 0;
+    }
+    if (server_response.header.type == 'A')
+    { // Accept or reject file based on if the server successfully registered it or not. Return the corresponding boolean
+        printf("File accepted\n");
+        return 1;
+    } else if (server_response.header.type == 'E')
+    {
+        printf("Something went wrong... %s\n", server_response.payload);
+        return 0;
+    }
+    return 0;
+}
+int findLocalHost()
+{ // Pick the host to advertise from our interfaces: the first IPv4 address of one that is up and not loopback, else the first global
+  // IPv6 address of one, else loopback. Returns 1 if that is not the one local_host held
+    struct ifaddrs *interfaces;
+    char ipv4[INET6_ADDRSTRLEN] = "", ipv6[INET6_ADDRSTRLEN] = "";
+    if (getifaddrs(&interfaces) == 0)
+    {
+        for (struct ifaddrs *i = interfaces; i != NULL && ipv4[0] == '\0'; i = i->ifa_next)
+        {
+            if (i->ifa_addr == NULL || !(i->ifa_flags & IFF_UP) || (i->ifa_flags & IFF_LOOPBACK))
+                continue;
+            if (i->ifa_addr->sa_family == AF_INET)
+                inet_ntop(AF_INET, &((struct sockaddr_in*)i->ifa_addr)->sin_addr, ipv4, sizeof(ipv4));
+            else if (i->ifa_addr->sa_family == AF_INET6 && ipv6[0] == '\0')
+            { // link-local addresses need an interface to go with them, which another machine cannot know
+                struct in6_addr *host = &((struct sockaddr_in6*)i->ifa_addr)->sin6_addr;
+                if (!IN6_IS_ADDR_LINKLOCAL(host) && !IN6_IS_ADDR_LOOPBACK(host))
+                    inet_ntop(AF_INET6, host, ipv6, sizeof(ipv6));
+            }
+        }
+        freeifaddrs(interfaces);
+    }
+    const char *found = ipv4[0] != '\0' ? ipv4 : ipv6[0] != '\0' ? ipv6 : "127.0.0.1";
+    if (strcmp(found, local_host) == 0)
+        return 0;
+    strcpy(local_host, found);
+    return 1;
+}
+int watchInterfaces()
+{ // A netlink socket that becomes readable whenever an address or an interface comes or goes. Returns -1 if there is none, the host
+  // we advertise is then only found at startup
+    struct sockaddr_nl local;
+    bzero(&local, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    local.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+    int s = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (s >= 0 && bind(s, (struct sockaddr*)&local, sizeof(local)) < 0)
+    {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+void formatUploadAddress()
+{ // Spell local_host and our port the way the index expects them, IPv6 hosts in brackets
+    bzero(upload_address, sizeof(upload_address));
+    snprintf(upload_address, sizeof(upload_address), strchr(local_host, ':') != NULL ? "[%s]:%u" : "%s:%u", local_host, (unsigned int)upload_port);
+}
+int openListener(char address[ADDRESS_SIZE])
+{ // Write the address we serve every file on to address. The first time, create that TCP socket with some available port and hand
+  // it to the upload engine. It listens on every address, IPv4 ones included, so it keeps working whichever of them we advertise.
+  // Returns 0 if it cannot be opened
+    if (upload_listener < 0)
+    {
+        struct sockaddr_in6 any6;
+        struct sockaddr_in any4;
+        struct sockaddr_storage bound;
+        socklen_t length = sizeof(bound);
+        int off = 0, s = socket(AF_INET6, SOCK_STREAM, 0);
+        bzero(&any6, sizeof(any6));
+        bzero(&any4, sizeof(any4));
+        any6.sin6_family = AF_INET6;
+        any6.sin6_addr = in6addr_any;
+        any4.sin_family = AF_INET;
+        any4.sin_addr.s_addr = htonl(INADDR_ANY);
+        struct sockaddr *any = (struct sockaddr*)&any6;
+        socklen_t any_length = sizeof(any6);
+        if (s >= 0)
+            setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        else if ((s = socket(AF_INET, SOCK_STREAM, 0)) >= 0)
+        { // a kernel without IPv6
+            any = (struct sockaddr*)&any4;
+            any_length = sizeof(any4);
+        }
+        if (s < 0 || bind(s, any, any_length) < 0 || listen(s, SOMAXCONN) < 0 || getsockname(s, (struct sockaddr*)&bound, &length) < 0)
+        {
+            perror("Cannot open a socket to serve files on...\n");
+            if (s >= 0)
+                close(s);
+            return 0;
+        }
+        upload_port = ntohs(bound.ss_family == AF_INET6 ? ((struct sockaddr_in6*)&bound)->sin6_port : ((struct sockaddr_in*)&bound)->sin_port);
+        upload_listener = s;
+        watchListener(s);
+        formatUploadAddress();
+        if (debug) // debug variable for testing. Globally initialized and available
+            printf("%s\n", upload_address);
+    }
+    memcpy(address, upload_address, ADDRESS_SIZE);
+    return 1;
+}
+int resolveAddress(const char address[ADDRESS_SIZE], struct sockaddr_storage *addr, socklen_t *length)
+{ // Turn the "ip:port" or "[ipv6]:port" of a content server into a socket address. Returns 0 if it is neither
+    char text[ADDRESS_SIZE + 1];
+    memcpy(text, address, ADDRESS_SIZE);
+    text[ADDRESS_SIZE] = '\0';
+    char *port = strrchr(text, ':');
+    if (port == NULL)
+        return 0;
+    *port++ = '\0';
+    bzero(addr, sizeof(*addr));
+    if (text[0] == '[' && port - text > 2 && port[-2] == ']')
+    {
+        struct sockaddr_in6 *ipv6 = (struct sockaddr_in6*)addr;
+        port[-2] = '\0';
+        ipv6->sin6_family = AF_INET6;
+        ipv6->sin6_port = htons(atoi(port));
+        *length = sizeof(*ipv6);
+        return inet_pton(AF_INET6, text + 1, &ipv6->sin6_addr) == 1;
+    }
+    struct sockaddr_in *ipv4 = (struct sockaddr_in*)addr;
+    ipv4->sin_family = AF_INET;
+    ipv4->sin_port = htons(atoi(port));
+    *length = sizeof(*ipv4);
+    return inet_pton(AF_INET, text, &ipv4->sin_addr) == 1;
+}
+int isSidecarName(const char *name)
+{ // Whether name is one of the files a peer keeps next to its content: hash caches, partial downloads and their checkpoints
+    const char *suffixes[] = {HASH_CACHE_SUFFIX, PARTIAL_SUFFIX, CHECKPOINT_SUFFIX};
+    size_t length = strlen(name);
+    for (int i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++)
+        if (length > strlen(suffixes[i]) && strcmp(name + length - strlen(suffixes[i]), suffixes[i]) == 0)
+            return 1;
+    return 0;
+}
+int collectBulkItems(const char *source, struct bulk_item **items)
+{ // Find the files to register: every regular file in a directory, or every path listed in a manifest given as @FILE, and hash them.
+  // Content names are the file names, which have to fit in DEFAULT_NAME_SIZE - 1 characters. Returns how many were found
+    int count = 0, capacity = 64;
+    char path[PATH_MAX];
+    struct stat info;
+    DIR *dir = NULL;
+    FILE *manifest = NULL;
+    if (source[0] == '@')
+        manifest = fopen(source + 1, "r");
+    else
+        dir = opendir(source);
+    if (manifest == NULL && dir == NULL)
+    {
+        printf("Cannot read %s...\n", source[0] == '@' ? source + 1 : source);
+        return 0;
+    }
+
+    *items = (struct bulk_item*)malloc(capacity * sizeof(struct bulk_item));
+    while (*items != NULL)
+    {
+        if (manifest != NULL)
+        {
+            if (fgets(path, sizeof(path), manifest) == NULL)
+                break;
+            path[strcspn(path, "\r\n")] = '\0';
+        } else
+        {
+            struct dirent *entry = readdir(dir);
+            if (entry == NULL)
+                break;
+            snprintf(path, sizeof(path), "%s/%s", source, entry->d_name);
+        }
+        if (path[0] == '\0' || stat(path, &info) < 0 || !S_ISREG(info.st_mode))
+            continue;
+        const char *name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+        if (dir != NULL && isSidecarName(name))
+            continue;
+        if (strlen(name) >= DEFAULT_NAME_SIZE)
+        {
+            printf("Skipping %s, the name is longer than %d characters...\n", name, DEFAULT_NAME_SIZE - 1);
+            continue;
+        }
+        if (count == capacity)
+        {
+            struct bulk_item *bigger = (struct bulk_item*)realloc(*items, 2 * capacity * sizeof(struct bulk_item));
+            if (bigger == NULL)
+                break;
+            *items = bigger;
+            capacity *= 2;
+        }
+        if (((*items)[count].hashes = hashFile(path)) == NULL)
+        {
+            printf("Skipping %s, it cannot be read...\n", path);
+            continue;
+        }
+        bzero((*items)[count].content_name, DEFAULT_NAME_SIZE);
+        strcpy((*items)[count].content_name, name);
+        (*items)[count].path = strdup(path);
+        count++;
+    }
+    if (manifest != NULL)
+        fclose(manifest);
+    if (dir != NULL)
+        closedir(dir);
+    return count;
+}
+int registerItems(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size, struct bulk_item *items, int count)
+{ // Register count files with MAX_BATCH_ITEMS per B request, each answered by a bitmap of which files were accepted. Frees items.
+  // Returns how many were registered
+    int registered = 0;
+    struct bpdu batch;
+    bzero(&batch, sizeof(batch));
+    strncpy(batch.peer_name, client_name, DEFAULT_NAME_SIZE - 1);
+    batch.capacity = htons(upload_slots);
+    int listening = openListener(batch.address);
+
+    for (int first = 0; listening && first < count; first += MAX_BATCH_ITEMS)
+    {
+        batch.count = count - first < MAX_BATCH_ITEMS ? count - first : MAX_BATCH_ITEMS;
+        for (int i = 0; i < batch.count; i++)
+        {
+            memcpy(batch.items[i].content_name, items[first + i].content_name, DEFAULT_NAME_SIZE);
+            memcpy(batch.items[i].root, items[first + i].hashes->root, HASH_SIZE);
+        }
+
+        struct message reply;
+        uint32_t request_id = sendRequest(sockfd, 'B', &batch, offsetof(struct bpdu, items) + batch.count * sizeof(struct batch_item), socket_addr, socket_addr_size);
+        if (request_id == 0 || !receiveReply(sockfd, request_id, &reply))
+        {
+            printf("The index server did not answer... Please try again later.\n");
+            break;
+        }
+        if (reply.header.type != 'B' || ntohs(reply.header.length) < sizeof(struct batch_status))
+        {
+            printf("Something went wrong... %s\n", reply.header.type == 'E' ? reply.payload : "");
+            break;
+        }
+        struct batch_status status;
+        memcpy(&status, reply.payload, sizeof(status));
+        for (int i = 0; i < batch.count; i++)
+        {
+            struct bulk_item *item = &items[first + i];
+            if (!(status.registered[i / 8] & (1 << (i % 8))))
+            {
+                printf("%s was not accepted...\n", item->content_name);
+                continue;
+            }
+            registered++;
+            pthread_mutex_lock(&upload_lock);
+            int hosted = findHostedFile(item->content_name) != NULL;
+            pthread_mutex_unlock(&upload_lock);
+            if (hosted)
+                continue; // registered before, the index only took our current address
+            struct rpdu this;
+            bzero(&this, sizeof(this));
+            this.type = 'R';
+            memcpy(this.peer_name, batch.peer_name, DEFAULT_NAME_SIZE);
+            memcpy(this.content_name, item->content_name, DEFAULT_NAME_SIZE);
+            memcpy(this.address, batch.address, sizeof(this.address));
+            this.capacity = batch.capacity;
+            memcpy(this.root, item->hashes->root, HASH_SIZE);
+            addToHostedFiles(this, item->path, item->hashes);
+            item->path = NULL; // the hosted file owns them now
+            item->hashes = NULL;
+        }
+    }
+    for (int i = 0; i < count; i++)
+    {
+        free(items[i].path);
+        freePieceHashes(items[i].hashes);
+    }
+    free(items);
+    printf("%d of %d files registered...\n", registered, count);
+    return registered;
+}
+int registerBulk(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size, const char *source)
+{ // Register every file of a directory or manifest. Returns how many were registered
+    struct bulk_item *items = NULL;
+    int count = collectBulkItems(source, &items);
+    if (count == 0)
+    {
+        printf("No files to register...\n");
+        free(items);
+        return 0;
+    }
+    return registerItems(sockfd, socket_addr, socket_addr_size, items, count);
+}
+void seedStore(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size)
+{ // Register every name in the store again after a restart, served from the content it points at
+    char path[PATH_MAX], target[PATH_MAX];
+    unsigned char root[HASH_SIZE];
+    int count = 0, capacity = 64;
+    struct bulk_item *items = (struct bulk_item*)malloc(capacity * sizeof(struct bulk_item));
+    snprintf(path, sizeof(path), "%s/" STORE_NAMES, store_directory);
+    DIR *dir = opendir(path);
+    for (struct dirent *entry = dir != NULL ? readdir(dir) : NULL; entry != NULL && items != NULL; entry = readdir(dir))
+    {
+        snprintf(path, sizeof(path), "%s/" STORE_NAMES "/%s", store_directory, entry->d_name);
+        ssize_t length = readlink(path, target, sizeof(target) - 1);
+        if (length <= 0 || strlen(entry->d_name) >= DEFAULT_NAME_SIZE)
+            continue;
+        target[length] = '\0';
+        if (!parseObjectName(strrchr(target, '/') != NULL ? strrchr(target, '/') + 1 : target, root) || findStoreObject(root) == NULL)
+        { // its content was evicted or deleted
+            unlink(path);
+            continue;
+        }
+        if (count == capacity)
+        {
+            struct bulk_item *bigger = (struct bulk_item*)realloc(items, 2 * capacity * sizeof(struct bulk_item));
+            if (bigger == NULL)
+                break;
+            items = bigger;
+            capacity *= 2;
+        }
+        objectPath(path, sizeof(path), root, "");
+        if ((items[count].hashes = hashFile(path)) == NULL)
+            continue;
+        bzero(items[count].content_name, DEFAULT_NAME_SIZE);
+        strcpy(items[count].content_name, entry->d_name);
+        items[count].path = strdup(path);
+        count++;
+    }
+    if (dir != NULL)
+        closedir(dir);
+    if (count > 0)
+        registerItems(sockfd, socket_addr, socket_addr_size, items, count);
+    else
+        free(items);
+}
+int registerContent(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size, const char *target)
+{ // Register a file, served on our one TCP socket, with its associated rpdu struct. A directory or @MANIFEST registers every file in
+  // it. Returns how many files were registered
+    struct rpdu this;
+    struct stat info;
+    bzero(&this, sizeof(this));
+    this.type = 'R';
+    strcpy(this.peer_name, client_name);
+    this.capacity = htons(upload_slots);
+
+    if (target[0] == '@' || (stat(target, &info) == 0 && S_ISDIR(info.st_mode)))
+        return registerBulk(sockfd, socket_addr, socket_addr_size, target);
+    strncpy(this.content_name, target, DEFAULT_NAME_SIZE - 1);
+    struct piece_hashes *hashes = hashFile(this.content_name);
+    if (hashes == NULL)
+    {
+        printf("Cannot read %s...\n", this.content_name);
+        return 0;
+    }
+    memcpy(this.root, hashes->root, HASH_SIZE);
+    if (!openListener(this.address))
+    {
+        freePieceHashes(hashes);
+        return 0;
+    }
+    if (store_directory != NULL)
+        importIntoStore(this.content_name, hashes);
+
+    // Send the file to register to the server and then depending on the result of the registration, add the file to a list of hosted files. 
+    uint32_t request_id = sendRequest(sockfd, 'R', &this, sizeof(this), socket_addr, socket_addr_size);
+    int flag = waitRegisteredAcknowledgement(sockfd, request_id);
+    if (flag)
+        addToHostedFiles(this, NULL, hashes);
+    else
+        freePieceHashes(hashes);
+    return flag;
+}
+void makePassiveSocket(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size)
+{ // Main R function. Ask what to register
+    char target[PATH_MAX];
+    printf("Which file would you like to register? (a directory or @MANIFEST registers many)\n");
+    scanf("%4095s", target);
+    registerContent(sockfd, socket_addr, socket_addr_size, target);
+}
+
+// S
+uint64_t spliceSocketToFile(int sockfd, int fd, uint64_t length)
+{ // Move length bytes from the socket into the file through a pipe, so the data never enters user space. Returns how many made it,
+  // which stops short of length if the connection failed or if splice is not supported here (download_with_splice is then cleared)
+    int pipes[2];
+    uint64_t received = 0;
+    if (pipe(pipes) < 0)
+        return 0;
+    fcntl(pipes[1], F_SETPIPE_SZ, TRANSFER_BUFFER_SIZE); // a bigger pipe means fewer round trips, the default is fine too
+    while (received < length)
+    {
+        size_t chunk = length - received < TRANSFER_BUFFER_SIZE ? length - received : TRANSFER_BUFFER_SIZE;
+        ssize_t in = splice(sockfd, NULL, pipes[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR)
+            continue;
+        if (in < 0 && errno == EINVAL && received == 0)
+            download_with_splice = 0;
+        if (in <= 0)
+            break;
+        while (in > 0)
+        { // drain the pipe into the file at our position
+            ssize_t out = splice(pipes[0], NULL, fd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR)
+                continue;
+            if (out <= 0)
+                goto done;
+            in -= out;
+            received += out;
+        }
+    }
+done:
+    close(pipes[0]);
+    close(pipes[1]);
+    return received;
+}
+uint64_t copySocketToFile(int sockfd, int fd, uint64_t received, uint64_t length)
+{ // The same through one large buffer, continuing from received. Returns the new total
+    char *buffer = (char*)malloc(TRANSFER_BUFFER_SIZE);
+    if (buffer == NULL)
+        return received;
+    while (received < length)
+    {
+        ssize_t n = recv(sockfd, buffer, length - received < TRANSFER_BUFFER_SIZE ? length - received : TRANSFER_BUFFER_SIZE, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        for (ssize_t written = 0; written < n;)
+        {
+            ssize_t w = write(fd, buffer + written, n - written);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0)
+                goto done;
+            written += w;
+        }
+        received += n;
+    }
+done:
+    free(buffer);
+    return received;
+}
+uint64_t unpackSocketToFile(int sockfd, int fd, off_t offset, uint64_t length)
+{ // The same for length bytes of a 'Z' transfer, unpacking frame by frame into the file at offset. Returns how many bytes of the
+  // range made it
+    unsigned char *buffer = (unsigned char*)malloc(2 * COMPRESS_FRAME_SIZE);
+    uint64_t received = 0;
+    if (buffer == NULL)
+        return 0;
+    while (received < length)
+    {
+        int n = receiveFrame(sockfd, buffer, length - received, buffer + COMPRESS_FRAME_SIZE);
+        if (n < 0 || !pwriteAll(fd, buffer, n, offset + received))
+            break;
+        received += n;
+    }
+    free(buffer);
+    return received;
+}
+int requestRange(int sockfd, const char *content_name, uint64_t offset, uint64_t length)
+{ // Send a D request for length bytes of content_name from offset, 0 meaning the rest of the file, compressed if we were started
+  // with --compress. Returns 0 if it could not be sent
+    struct dpdu request;
+    bzero(&request, sizeof(request));
+    request.type = 'D';
+    strncpy(request.content_name, content_name, DEFAULT_NAME_SIZE - 1);
+    request.offset = htobe64(offset);
+    request.length = htobe64(length);
+    request.flags = download_compressed ? DOWNLOAD_COMPRESSED : 0;
+    return sendAll(sockfd, &request, sizeof(request));
+}
+int receiveRange(int sockfd, char type, unsigned char *buffer, uint64_t length)
+{ // Receive all length bytes of a 'C' or 'Z' transfer into buffer, which has COMPRESS_FRAME_SIZE bytes of scratch space after
+  // PIECE_SIZE. Returns 0 if the connection failed or sent something malformed
+    if (type != 'Z')
+        return recvAll(sockfd, buffer, length);
+    for (uint64_t received = 0; received < length; )
+    {
+        int n = receiveFrame(sockfd, buffer + received, length - received, buffer + PIECE_SIZE);
+        if (n < 0)
+            return 0;
+        received += n;
+    }
+    return 1;
+}
+int receiveTransferHeader(int sockfd, struct transfer_header *header)
+{ // Read the header a content server answers a D request with, in host byte order. An 'E' has its reason printed.
+  // Returns 1 if content follows, plain or compressed
+    if (!recvAll(sockfd, header, sizeof(*header)))
+    {
+        printf("Error receiving packet from server...\n");
+        return 0;
+    }
+    header->length = be64toh(header->length);
+    header->size = be64toh(header->size);
+    if (header->type == 'E')
+    {
+        char reason[STANDARD_BUF_SIZE + 1];
+        size_t reason_length = header->length < STANDARD_BUF_SIZE ? header->length : STANDARD_BUF_SIZE;
+        if (!recvAll(sockfd, reason, reason_length))
+            reason_length = 0;
+        reason[reason_length] = '\0';
+        printf("%s\n", reason);
+    }
+    return header->type == 'C' || header->type == 'Z';
+}
+uint32_t bitmapChecksum(const unsigned char *bitmap, size_t length)
+{ // FNV-1a over a checkpoint bitmap
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ bitmap[i]) * 16777619u;
+    return hash;
+}
+size_t bitmapBytes(uint64_t size)
+{ // Bytes in the checkpoint bitmap of a size byte file, never 0 so it can always be allocated
+    return ((size + PIECE_SIZE - 1) / PIECE_SIZE + 7) / 8 + 1;
+}
+unsigned char *loadCheckpoint(const char *content_name, uint64_t *size, unsigned char root[HASH_SIZE])
+{ // The bitmap of pieces an interrupted download of content_name already has on disk, and in size and root how long the file is and
+  // which content it was. NULL if there is no usable checkpoint, in which case the download starts over and size and root are untouched
+    char path[PATH_MAX];
+    struct checkpoint_header header;
+    struct stat info;
+    unsigned char *bitmap = NULL;
+    downloadPath(path, sizeof(path), content_name, CHECKPOINT_SUFFIX);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (read(fd, &header, sizeof(header)) == sizeof(header) && memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) == 0 &&
+        header.piece_size == PIECE_SIZE && (bitmap = (unsigned char*)malloc(bitmapBytes(header.size))) != NULL)
+    {
+        downloadPath(path, sizeof(path), content_name, PARTIAL_SUFFIX);
+        if (read(fd, bitmap, bitmapBytes(header.size)) != (ssize_t)bitmapBytes(header.size) ||
+            bitmapChecksum(bitmap, bitmapBytes(header.size)) != header.checksum || stat(path, &info) < 0 || (uint64_t)info.st_size != header.size)
+        { // torn, from another version, or the partial file it describes is gone
+            free(bitmap);
+            bitmap = NULL;
+        }
+    }
+    close(fd);
+    if (bitmap != NULL)
+    { // header was read in full and checked
+        *size = header.size;
+        memcpy(root, header.root, HASH_SIZE);
+    }
+    return bitmap;
+}
+int saveCheckpoint(const char *content_name, uint64_t size, const unsigned char *root, const unsigned char *bitmap)
+{ // Record which pieces are on disk, of the content with this root (NULL if unknown). Callers flush the partial file first.
+  // Returns 0 if it could not be written
+    char path[PATH_MAX], temporary[PATH_MAX + 4];
+    struct checkpoint_header header;
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.size = size;
+    header.piece_size = PIECE_SIZE;
+    header.checksum = bitmapChecksum(bitmap, bitmapBytes(size));
+    memset(header.root, 0, HASH_SIZE);
+    if (root != NULL)
+        memcpy(header.root, root, HASH_SIZE);
+    downloadPath(path, sizeof(path), content_name, CHECKPOINT_SUFFIX);
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return 0;
+    int written = write(fd, &header, sizeof(header)) == sizeof(header) && write(fd, bitmap, bitmapBytes(size)) == (ssize_t)bitmapBytes(size);
+    if (close(fd) < 0 || !written || rename(temporary, path) < 0)
+    {
+        unlink(temporary);
+        return 0;
+    }
+    return 1;
+}
+void removeCheckpoint(const char *content_name)
+{ // The download finished or cannot be resumed
+    char path[PATH_MAX];
+    downloadPath(path, sizeof(path), content_name, CHECKPOINT_SUFFIX);
+    unlink(path);
+}
+struct piece_hashes *fetchPieceHashes(int sockfd, const char *content_name, const unsigned char root[HASH_SIZE])
+{ // Ask a content server for the piece hashes of content_name and check that they add up to the root the index server gave us.
+  // Returns them, NULL if the server has none or sent others
+    struct dpdu request;
+    struct transfer_header header;
+    bzero(&request, sizeof(request));
+    request.type = 'H';
+    strncpy(request.content_name, content_name, DEFAULT_NAME_SIZE - 1);
+    if (!sendAll(sockfd, &request, sizeof(request)) || !receiveTransferHeader(sockfd, &header))
+        return NULL;
+    struct piece_hashes *hashes = allocPieceHashes(header.size);
+    if (hashes == NULL || header.type != 'C' || header.length != (uint64_t)hashes->count * HASH_SIZE || !recvAll(sockfd, hashes->pieces, header.length))
+    {
+        freePieceHashes(hashes);
+        return NULL;
+    }
+    merkleRoot(hashes->pieces, hashes->count, hashes->root);
+    if (memcmp(hashes->root, root, HASH_SIZE) != 0)
+    {
+        printf("The content server's piece hashes of %s do not match the index server's...\n", content_name);
+        freePieceHashes(hashes);
+        return NULL;
+    }
+    return hashes;
+}
+int checkStoredPiece(int fd, const struct piece_hashes *hashes, uint32_t index, unsigned char *buffer)
+{ // Read piece index back from the partial file, where splice left it without it passing through us, and check it
+    uint64_t length = pieceLength(hashes->size, index), got = 0;
+    while (got < length)
+    {
+        ssize_t n = pread(fd, buffer + got, length - got, (off_t)index * PIECE_SIZE + got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        got += n;
+    }
+    return pieceMatches(hashes, index, buffer);
+}
+int refetchPiece(int sockfd, const char *content_name, int fd, const struct piece_hashes *hashes, uint32_t index, unsigned char *buffer)
+{ // Fetch piece index on its own into buffer, see receiveRange, and write it into place if it checks out. Returns 1 if it did, 0 if
+  // it is still wrong, -1 if the connection failed
+    struct transfer_header header;
+    uint64_t length = pieceLength(hashes->size, index);
+    if (!requestRange(sockfd, content_name, (uint64_t)index * PIECE_SIZE, length) || !receiveTransferHeader(sockfd, &header) ||
+        header.length != length || !receiveRange(sockfd, header.type, buffer, length))
+        return -1;
+    if (!pieceMatches(hashes, index, buffer))
+        return 0;
+    return pwriteAll(fd, buffer, length, (off_t)index * PIECE_SIZE) ? 1 : -1;
+}
+int downloadFile(int sockfd, char *content_name, const unsigned char *root)
+{ // Request content_name on sockfd and download it as client_peer. The header says how long the file is, so the whole of it is reserved
+  // on disk up front and written to content_name.part (see downloadPath), which only takes the real name once every byte is there. Progress is
+  // checkpointed as it goes, and if an earlier attempt left a partial file behind only what follows its last piece is requested.
+  // Given the Merkle root from the index server (NULL or zeros if there is none), every piece is checked as it lands and one that
+  // is corrupt is fetched again on its own. Returns 1 if the whole file arrived
+    char partial[PATH_MAX], complete_path[PATH_MAX];
+    struct transfer_header header;
+    struct piece_hashes *hashes = NULL;
+    unsigned char checkpoint_root[HASH_SIZE], *done = NULL, *buffer = NULL;
+    uint64_t size = 0, offset = 0, received = 0, length = 0;
+    int fd = -1, downloaded = 0;
+    double start = nowSeconds(), checkpointed = start;
+    downloadPath(partial, sizeof(partial), content_name, PARTIAL_SUFFIX);
+    downloadPath(complete_path, sizeof(complete_path), content_name, "");
+    if (root != NULL && !isZeroHash(root) && ((hashes = fetchPieceHashes(sockfd, content_name, root)) == NULL ||
+        (buffer = (unsigned char*)malloc(PIECE_SIZE + COMPRESS_FRAME_SIZE)) == NULL))
+        goto finish;
+    done = loadCheckpoint(content_name, &size, checkpoint_root);
+    if (done != NULL && hashes != NULL && (size != hashes->size || memcmp(checkpoint_root, hashes->root, HASH_SIZE) != 0))
+    { // the hashes already tell us the old pieces belong to other content
+        printf("%s changed since the download was interrupted, it will start over...\n", content_name);
+        free(done);
+        done = NULL;
+    }
+    while (done != NULL && offset < size && (done[offset / PIECE_SIZE / 8] & (1 << (offset / PIECE_SIZE % 8))))
+        offset += PIECE_SIZE;
+    offset = offset < size ? offset : size;
+    if (!requestRange(sockfd, content_name, offset, 0) || !receiveTransferHeader(sockfd, &header))
+        goto finish;
+    if ((done != NULL && header.size != size) || (hashes != NULL && header.size != hashes->size))
+    { // not the file we have the start of, and this connection is busy with the rest of that one
+        printf("%s changed since the download was interrupted, it will start over...\n", content_name);
+        removeCheckpoint(content_name);
+        unlink(partial);
+        goto finish;
+    }
+    size = header.size;
+    length = header.length;
+    noteProgress(offset, size);
+    if (done == NULL && (done = (unsigned char*)calloc(1, bitmapBytes(size))) == NULL)
+        goto finish;
+    if (offset > 0)
+        printf("Resuming %s at %.1f of %.1f MB...\n", content_name, offset / 1e6, size / 1e6);
+
+    fd = open(partial, O_RDWR | O_CREAT | (offset == 0 ? O_TRUNC : 0), 0644);
+    if (fd < 0 || lseek(fd, offset, SEEK_SET) < 0)
+    {
+        printf("Error creating file...\n");
+        goto finish;
+    }
+    if (offset == 0 && size > 0 && fallocate(fd, 0, 0, size) < 0 && errno != EOPNOTSUPP && errno != ENOSYS)
+    { // out of space now rather than after most of the transfer
+        perror("Cannot make room for the download");
+        close(fd);
+        fd = -1;
+        unlink(partial);
+        goto finish;
+    }
+
+    // A piece at a time, so each one can be checked and the checkpoint can follow every CHECKPOINT_SECONDS
+    start = checkpointed = nowSeconds();
+    while (received < length)
+    {
+        uint32_t index = (offset + received) / PIECE_SIZE;
+        uint64_t segment = length - received < PIECE_SIZE ? length - received : PIECE_SIZE;
+        uint64_t got = 0;
+        if (header.type == 'Z')
+            got = unpackSocketToFile(sockfd, fd, offset + received, segment);
+        else if (download_with_splice)
+            got = spliceSocketToFile(sockfd, fd, segment);
+        if (got < segment && header.type != 'Z' && !download_with_splice)
+            got = copySocketToFile(sockfd, fd, got, segment);
+        received += got;
+        noteProgress(offset + received, size);
+        if (got == segment && (hashes == NULL || checkStoredPiece(fd, hashes, index, buffer)))
+            done[index / 8] |= 1 << (index % 8);
+        else if (got == segment)
+            printf("Piece %u of %s failed its check, it will be fetched again...\n", index, content_name);
+        if (got < segment || nowSeconds() - checkpointed >= CHECKPOINT_SECONDS)
+        {
+            if (fdatasync(fd) == 0)
+                saveCheckpoint(content_name, size, hashes != NULL ? hashes->root : NULL, done);
+            checkpointed = nowSeconds();
+        }
+        if (got < segment)
+            break;
+    }
+    // Pieces that failed their check, once the rest is in
+    int complete = received == length;
+    for (uint32_t index = offset / PIECE_SIZE; complete && index < (size + PIECE_SIZE - 1) / PIECE_SIZE; index++)
+    {
+        for (int attempt = 0; attempt < PIECE_RETRIES && !(done[index / 8] & (1 << (index % 8))); attempt++)
+        {
+            int fetched = refetchPiece(sockfd, content_name, fd, hashes, index, buffer);
+            if (fetched < 0)
+                break;
+            if (fetched)
+                done[index / 8] |= 1 << (index % 8);
+        }
+        complete = (done[index / 8] >> (index % 8)) & 1;
+    }
+    double elapsed = nowSeconds() - start;
+    if (!complete)
+    {
+        if (fdatasync(fd) == 0)
+            saveCheckpoint(content_name, size, hashes != NULL ? hashes->root : NULL, done);
+        uint64_t kept = 0;
+        for (uint32_t index = 0; index < (size + PIECE_SIZE - 1) / PIECE_SIZE; index++)
+            kept += (done[index / 8] >> (index % 8) & 1) ? pieceLength(size, index) : 0;
+        printf("Error receiving packet from server... %.1f of %.1f MB are kept, request it again to resume\n", kept / 1e6, size / 1e6);
+        goto finish;
+    }
+    int closed = close(fd);
+    fd = -1;
+    if (closed < 0 || rename(partial, complete_path) < 0)
+    {
+        printf("Error saving %s...\n", content_name);
+        goto finish;
+    }
+    removeCheckpoint(content_name);
+    if (hashes != NULL)
+        saveHashCache(complete_path, hashes); // registering it next needs them
+    printf("File successfully downloaded... %.1f MB in %.2f s (%.1f MB/s)\n", length / 1e6, elapsed, elapsed > 0 ? length / 1e6 / elapsed : 0);
+    downloaded = 1;
+finish:
+    if (length > 0)
+        countTransfer(&download_stats, received, downloaded, nowSeconds() - start);
+    if (fd >= 0)
+        close(fd);
+    free(done);
+    free(buffer);
+    freePieceHashes(hashes);
+    return downloaded;
+}
+int establishConnection(char *my_name, char *content_name, const char address[ADDRESS_SIZE], const unsigned char *root)
+{ // connect to TCP socket of client_server as client_peer at the address the index server gave us. root is what the pieces are
+  // checked against. Returns 1 if the download succeeded
+    struct sockaddr_storage serv_addr;
+    socklen_t length;
+    if (!resolveAddress(address, &serv_addr, &length))
+        return 0;
+    int sockfd = socket(serv_addr.ss_family, SOCK_STREAM, 0);
+    if (sockfd == -1)
+    {
+        printf("Failed to create TCP socket...\n");
+        return 0;
+    } else if (debug)
+        printf("TCP Socket created...\n");
+
+    if (connect(sockfd, (struct sockaddr *)&serv_addr, length) != 0)
+    {
+        printf("Connection to server failed...\n");
+        close(sockfd);
+        return 0;
+    }
+    int downloaded = downloadFile(sockfd, content_name, root);
+    close(sockfd);
+    return downloaded;
+}
+// SWARM
+int connectToSource(struct source *source)
+{ // Open a TCP connection to a content server from an S reply. Returns the socket, -1 on failure
+    struct sockaddr_storage serv_addr;
+    socklen_t length;
+    if (!resolveAddress(source->address, &serv_addr, &length))
+        return -1;
+    int sockfd = socket(serv_addr.ss_family, SOCK_STREAM, 0);
+    if (sockfd < 0 || connect(sockfd, (struct sockaddr *)&serv_addr, length) != 0)
+    {
+        if (sockfd >= 0)
+            close(sockfd);
+        return -1;
+    }
+    struct timeval stall = { SWARM_STALL_SECONDS, 0 }; // a source that goes quiet this long counts as failed
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &stall, sizeof(stall));
+    return sockfd;
+}
+void closeWorkerConnection(struct swarm_worker *w)
+{ // Under the swarm lock, so downloadSwarm never shuts down a socket number that was already handed out again
+    pthread_mutex_lock(&w->swarm->lock);
+    if (w->sockfd >= 0)
+        close(w->sockfd);
+    w->sockfd = -1;
+    pthread_mutex_unlock(&w->swarm->lock);
+}
+int claimPiece(struct swarm *swarm)
+{ // Hand out the lowest piece nobody is fetching or, once there is none, the unfinished piece with the fewest fetchers that started
+  // longest ago. Returns -1 when every piece is done
+    int claimed = -1;
+    pthread_mutex_lock(&swarm->lock);
+    for (uint32_t i = 0; i < swarm->count && claimed < 0; i++)
+        if (!swarm->pieces[i].done && swarm->pieces[i].active == 0)
+            claimed = i;
+    int endgame = claimed < 0;
+    for (uint32_t i = 0; endgame && i < swarm->count; i++)
+    {
+        struct swarm_piece *piece = &swarm->pieces[i], *best = claimed >= 0 ? &swarm->pieces[claimed] : NULL;
+        if (!piece->done && (best == NULL || piece->active < best->active || (piece->active == best->active && piece->started < best->started)))
+            claimed = i;
+    }
+    if (claimed >= 0)
+    {
+        swarm->pieces[claimed].active++;
+        swarm->pieces[claimed].started = nowSeconds();
+    }
+    pthread_mutex_unlock(&swarm->lock);
+    return claimed;
+}
+void releasePiece(struct swarm *swarm, int index, int completed)
+{ // A worker stopped fetching piece index, with all of it written if completed
+    pthread_mutex_lock(&swarm->lock);
+    swarm->pieces[index].active--;
+    if (completed && !swarm->pieces[index].done)
+    {
+        swarm->pieces[index].done = 1;
+        swarm->done++;
+        pthread_cond_signal(&swarm->finished);
+    }
+    pthread_mutex_unlock(&swarm->lock);
+}
+int fetchPiece(struct swarm_worker *w, int index, char *buffer)
+{ // Fetch one piece from this worker's source into buffer, see receiveRange, check it and write it into place. Compressed pieces
+  // are unpacked a frame at a time. Returns 1 once it is written, 0 if
+  // another worker finished it first (the connection is dropped, since the rest of the range is still on its way), -1 if the
+  // source failed and -2 if what it sent is not the piece
+    struct swarm *swarm = w->swarm;
+    uint64_t offset = (uint64_t)index * PIECE_SIZE, received = 0;
+    uint64_t length = swarm->size - offset < PIECE_SIZE ? swarm->size - offset : PIECE_SIZE;
+    struct transfer_header header;
+    if (w->sockfd < 0 && (w->sockfd = connectToSource(w->source)) < 0)
+        return -1;
+    if (!requestRange(w->sockfd, swarm->content_name, offset, length) || !receiveTransferHeader(w->sockfd, &header) ||
+        header.length != length || header.size != swarm->size)
+        return -1;
+    while (received < length)
+    {
+        size_t want = length - received < TRANSFER_BUFFER_SIZE ? length - received : TRANSFER_BUFFER_SIZE;
+        ssize_t n = header.type == 'Z' ? receiveFrame(w->sockfd, (unsigned char*)buffer + received, length - received,
+            (unsigned char*)buffer + PIECE_SIZE) : recv(w->sockfd, buffer + received, want, 0);
+        if (n < 0 && errno == EINTR && header.type != 'Z')
+            continue;
+        if (n <= 0)
+            return -1;
+        received += n;
+        w->received += n;
+        if (received < length && __atomic_load_n(&swarm->pieces[index].done, __ATOMIC_RELAXED))
+        {
+            closeWorkerConnection(w);
+            return 0;
+        }
+    }
+    if (swarm->hashes != NULL && !pieceMatches(swarm->hashes, index, buffer))
+        return -2;
+    return pwriteAll(swarm->fd, buffer, length, offset) ? 1 : -1;
+}
+void *runSwarmWorker(void *arg)
+{ // Fetch pieces from one source until every piece is done or the source fails or sent too many corrupt pieces
+    struct swarm_worker *w = (struct swarm_worker*)arg;
+    char *buffer = (char*)malloc(PIECE_SIZE + COMPRESS_FRAME_SIZE);
+    int index;
+    while (buffer != NULL && (index = claimPiece(w->swarm)) >= 0)
+    {
+        int fetched = fetchPiece(w, index, buffer);
+        releasePiece(w->swarm, index, fetched == 1);
+        if (fetched == -2)
+            printf("Piece %d of %s from %.*s failed its check, it will be fetched again...\n", index, w->swarm->content_name,
+                DEFAULT_NAME_SIZE, w->source->peer_name);
+        if (fetched == -1 || (fetched == -2 && ++w->corrupt >= MAX_CORRUPT_PIECES))
+        {
+            if (debug)
+                printf("Dropping %.*s from the swarm...\n", DEFAULT_NAME_SIZE, w->source->peer_name);
+            break;
+        }
+    }
+    closeWorkerConnection(w);
+    free(buffer);
+    pthread_mutex_lock(&w->swarm->lock);
+    w->swarm->running--;
+    pthread_cond_signal(&w->swarm->finished);
+    pthread_mutex_unlock(&w->swarm->lock);
+    return NULL;
+}
+int downloadSwarm(char *content_name, struct source_list *list)
+{ // Download from every source in list at once, see struct swarm. Like downloadFile the pieces land in content_name.part, which
+  // takes the real name once all of them are in, and the pieces a checkpoint says are already there are not fetched again.
+  // With a Merkle root in list every piece is checked against it. Returns 1 if the whole file arrived
+    struct swarm swarm;
+    struct swarm_worker workers[MAX_SOURCES];
+    struct transfer_header header;
+    char partial[PATH_MAX], complete_path[PATH_MAX], byte;
+    int count = list->count < MAX_SOURCES ? list->count : MAX_SOURCES, first = -1, started = 0;
+    bzero(&swarm, sizeof(swarm));
+    bzero(workers, sizeof(workers));
+
+    // Ask the sources for the piece hashes, or without a root for the first byte, until one answers, which tells us how big the file
+    // is. That connection stays open for its worker
+    int verified = !isZeroHash(list->root);
+    for (int i = 0; i < count && first < 0; i++)
+    {
+        workers[i].sockfd = connectToSource(&list->sources[i]);
+        if (workers[i].sockfd >= 0 && (verified ? (swarm.hashes = fetchPieceHashes(workers[i].sockfd, content_name, list->root)) != NULL :
+            requestRange(workers[i].sockfd, content_name, 0, 1) && receiveTransferHeader(workers[i].sockfd, &header) &&
+            header.length <= 1 && recvAll(workers[i].sockfd, &byte, header.length)))
+            first = i;
+        else if (workers[i].sockfd >= 0)
+            close(workers[i].sockfd);
+    }
+    if (first < 0)
+        return 0;
+
+    downloadPath(partial, sizeof(partial), content_name, PARTIAL_SUFFIX);
+    downloadPath(complete_path, sizeof(complete_path), content_name, "");
+    swarm.content_name = content_name;
+    swarm.size = verified ? swarm.hashes->size : header.size;
+    swarm.count = (swarm.size + PIECE_SIZE - 1) / PIECE_SIZE;
+    swarm.pieces = (struct swarm_piece*)calloc(swarm.count > 0 ? swarm.count : 1, sizeof(struct swarm_piece));
+    uint64_t checkpoint_size;
+    unsigned char checkpoint_root[HASH_SIZE];
+    unsigned char *done = loadCheckpoint(content_name, &checkpoint_size, checkpoint_root);
+    if (done != NULL && (checkpoint_size != swarm.size || (verified && memcmp(checkpoint_root, list->root, HASH_SIZE) != 0)))
+    {
+        printf("%s changed since the download was interrupted, it will start over...\n", content_name);
+        free(done);
+        done = NULL;
+    }
+    for (uint64_t i = 0; done != NULL && swarm.pieces != NULL && i < swarm.count; i++)
+        if (done[i / 8] & (1 << (i % 8)))
+        {
+            swarm.pieces[i].done = 1;
+            swarm.done++;
+        }
+    if (swarm.done > 0)
+        printf("Resuming %s with %llu of %llu pieces already here...\n", content_name, (unsigned long long)swarm.done, (unsigned long long)swarm.count);
+    if (done == NULL)
+        done = (unsigned char*)calloc(1, bitmapBytes(swarm.size));
+    swarm.fd = open(partial, O_WRONLY | O_CREAT | (swarm.done == 0 ? O_TRUNC : 0), 0644);
+    if (swarm.pieces == NULL || done == NULL || swarm.fd < 0 ||
+        (swarm.done == 0 && swarm.size > 0 && fallocate(swarm.fd, 0, 0, swarm.size) < 0 && errno != EOPNOTSUPP && errno != ENOSYS))
+    {
+        perror("Cannot make room for the download");
+        free(swarm.pieces);
+        free(done);
+        freePieceHashes(swarm.hashes);
+        close(workers[first].sockfd);
+        if (swarm.fd >= 0)
+        {
+            close(swarm.fd);
+            unlink(partial);
+        }
+        return 0;
+    }
+    pthread_mutex_init(&swarm.lock, NULL);
+    pthread_cond_init(&swarm.finished, NULL);
 
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(atoi(port));
-    inet_pton(AF_INET, ip, &(serv_addr.sin_addr));
-    if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) != 0)
+    double start = nowSeconds();
+    for (int i = first; i < count; i++)
     {
-        printf("Connection to server failed...\n");
-        return;
+        workers[i].swarm = &swarm;
+        workers[i].source = &list->sources[i];
+        workers[i].sockfd = i == first ? workers[i].sockfd : -1;
+        pthread_mutex_lock(&swarm.lock);
+        swarm.running++;
+        pthread_mutex_unlock(&swarm.lock);
+        if (pthread_create(&workers[i].thread, NULL, runSwarmWorker, &workers[i]) != 0)
+        {
+            closeWorkerConnection(&workers[i]);
+            pthread_mutex_lock(&swarm.lock);
+            swarm.running--;
+            pthread_mutex_unlock(&swarm.lock);
+            workers[i].swarm = NULL;
+        }
+        else
+            started++;
     }
-    // Send a D type PDU to tell the client a file is ready to download. 
-    struct pdu signal_packet = {'D'};
-    bzero(signal_packet.data, STANDARD_BUF_SIZE);
-    strcpy(signal_packet.data, content_name);
 
-    if (send(sockfd, &signal_packet, sizeof(signal_packet), 0) < 0)
+    // Wait for the last piece or the last worker, checkpointing the finished pieces every CHECKPOINT_SECONDS. Then wake any worker
+    // still stuck on a piece somebody else already delivered
+    double checkpointed = start;
+    pthread_mutex_lock(&swarm.lock);
+    while (swarm.done < swarm.count && swarm.running > 0)
     {
-        printf("Error establishing connection with the content server...\n");
-        return;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += CHECKPOINT_SECONDS;
+        pthread_cond_timedwait(&swarm.finished, &swarm.lock, &deadline);
+        noteProgress((uint64_t)swarm.done * PIECE_SIZE, swarm.size);
+        if (nowSeconds() - checkpointed >= CHECKPOINT_SECONDS)
+        { // the bitmap is taken before the flush, so it only names pieces the flush covers
+            checkpointed = nowSeconds();
+            for (uint64_t i = 0; i < swarm.count; i++)
+                if (swarm.pieces[i].done)
+                    done[i / 8] |= 1 << (i % 8);
+            pthread_mutex_unlock(&swarm.lock);
+            if (fdatasync(swarm.fd) == 0)
+                saveCheckpoint(content_name, swarm.size, verified ? list->root : NULL, done);
+            pthread_mutex_lock(&swarm.lock);
+        }
     }
+    for (int i = first; i < count; i++)
+        if (workers[i].swarm != NULL && workers[i].sockfd >= 0)
+            shutdown(workers[i].sockfd, SHUT_RDWR);
+    pthread_mutex_unlock(&swarm.lock);
+    for (int i = first; i < count; i++)
+        if (workers[i].swarm != NULL)
+            pthread_join(workers[i].thread, NULL);
+    double elapsed = nowSeconds() - start;
 
-    downloadFile(sockfd, content_name);
-    close(sockfd);
+    int complete = swarm.done == swarm.count;
+    uint64_t received = 0;
+    for (int i = first; i < count; i++)
+        received += workers[i].received;
+    countTransfer(&download_stats, received, complete, elapsed);
+    for (uint64_t i = 0; i < swarm.count; i++)
+        if (swarm.pieces[i].done)
+            done[i / 8] |= 1 << (i % 8);
+    if (!complete && fdatasync(swarm.fd) == 0)
+        saveCheckpoint(content_name, swarm.size, verified ? list->root : NULL, done);
+    free(done);
+    free(swarm.pieces);
+    pthread_mutex_destroy(&swarm.lock);
+    pthread_cond_destroy(&swarm.finished);
+    if (close(swarm.fd) < 0 || !complete || rename(partial, complete_path) < 0)
+    {
+        printf("Error receiving packet from server... %llu of %llu pieces are kept, request it again to resume\n",
+            (unsigned long long)swarm.done, (unsigned long long)swarm.count);
+        freePieceHashes(swarm.hashes);
+        return 0;
+    }
+    removeCheckpoint(content_name);
+    if (verified)
+        saveHashCache(complete_path, swarm.hashes); // registering it next needs them
+    freePieceHashes(swarm.hashes);
+    printf("File successfully downloaded from %d sources... %.1f MB in %.2f s (%.1f MB/s)\n", started, swarm.size / 1e6, elapsed,
+        elapsed > 0 ? swarm.size / 1e6 / elapsed : 0);
+    for (int i = first; debug && i < count; i++)
+        printf("  %.*s sent %.1f MB\n", DEFAULT_NAME_SIZE, list->sources[i].peer_name, workers[i].received / 1e6);
+    return 1;
 }
-void requestFileFromServer(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size, char *peer)
-{ // Get IP and port of content_server from index server with an SPDU
+int downloadFromSources(char *my_name, char *content_name, struct source_list *list)
+{ // With several content servers, fetch pieces from all of them at once. With one, or if that fails, try the content servers in the
+  // order the index ranked them until one of them delivers the file
+    if (list->count > 1 && downloadSwarm(content_name, list))
+        return 1;
+    for (int i = 0; i < list->count && i < MAX_SOURCES; i++)
+    {
+        if (debug)
+            printf("Trying %.*s at %.*s (%u of %u slots busy)...\n", DEFAULT_NAME_SIZE, list->sources[i].peer_name, ADDRESS_SIZE,
+                list->sources[i].address, ntohs(list->sources[i].in_flight), ntohs(list->sources[i].capacity));
+        if (establishConnection(my_name, content_name, list->sources[i].address, list->root))
+            return 1;
+    }
+    return 0;
+}
+void reportDownloadFinished(int sockfd, uint32_t ticket, int downloaded, struct sockaddr_in socket_addr, int socket_addr_size)
+{ // Tell the index server the download is over so it frees the content server's slot. The reply is not waited on.
+  // If this report is lost the server expires the download on its own
+    struct fpdu report;
+    report.ticket = ticket; // already in network order
+    report.status = downloaded ? 'A' : 'E';
+    sendRequest(sockfd, 'F', &report, sizeof(report), socket_addr, socket_addr_size);
+}
+int requestSources(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size, const char *content_name, struct source_list *sources, FILE *out)
+{ // Get IP and port of the content servers of content_name from index server with an SPDU. Returns 1 with them in sources, 0 after
+  // saying why not on out
     struct spdu request_packet = {'S'};
     bzero(request_packet.peer_name, DEFAULT_NAME_SIZE);
-    strcpy(request_packet.peer_name, peer);
+    strcpy(request_packet.peer_name, client_name);
     bzero(request_packet.content_name, DEFAULT_NAME_SIZE);
+    strncpy(request_packet.content_name, content_name, DEFAULT_NAME_SIZE - 1);
 
-    printf("Which file would you like to request for download from the server? \n");
-    scanf("%s", request_packet.content_name);
-    char content_name[DEFAULT_NAME_SIZE];
-    strcpy(content_name, request_packet.content_name);
-
-    sendto(sockfd, &request_packet, sizeof(request_packet), 0, (struct sockaddr *)&socket_addr, socket_addr_size);
+    uint32_t request_id = sendRequest(sockfd, 'S', &request_packet, sizeof(request_packet), socket_addr, socket_addr_size);
 
-    struct pdu receive_address;
-    bzero(&receive_address, sizeof(receive_address));
+    struct message receive_address;
 
     // If a content_server does not exist, print the index_server's provided error message. Otherwise, tokenize and get the parameters and download the file
-    recvfrom(sockfd, &receive_address, sizeof(receive_address), 0, (struct sockaddr *)&socket_addr, &socket_addr_size);
-    if (receive_address.type == 'E')
+    if (request_id == 0 || !receiveReply(sockfd, request_id, &receive_address))
     {
-        printf("%s", receive_address.data);
-        return;
+        fprintf(out, "Failed to request the file. Please try again later...\n");
+        return 0;
+    }
+    if (receive_address.header.type == 'E')
+    { // not every message of the index server ends its line
+        size_t length = strlen(receive_address.payload);
+        fprintf(out, "%s%s", receive_address.payload, length > 0 && receive_address.payload[length - 1] == '\n' ? "" : "\n");
+        return 0;
     }
 
-    char *token = strtok(receive_address.data, ":");
-    char content_server_ip[30], content_server_port[DEFAULT_NAME_SIZE];
-    strcpy(content_server_ip, token);
-    strcpy(content_server_port, strtok(NULL, ":"));
-    establishConnection(peer, content_name, content_server_ip, content_server_port);
-
-    char num = 'R';
-    sendto(sockfd, &num, sizeof(num), 0, (struct sockaddr *)&socket_addr, socket_addr_size);
+    bzero(sources, sizeof(*sources));
+    memcpy(sources, receive_address.payload, ntohs(receive_address.header.length) < sizeof(*sources) ? ntohs(receive_address.header.length) : sizeof(*sources));
+    return 1;
+}
+int hostDownload(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size, char *content_name, struct piece_hashes *hashes)
+{ // Register content_name, which was just downloaded or, if hashes is not NULL, found in the store, so we serve it from now on.
+  // Returns 1 if the index server took it
+    char *path = NULL;
+    if (store_directory != NULL)
+        hashes = storeDownload(content_name, hashes, &path);
+    else
+        hashes = hashFile(content_name); // cached by the download, which checked them
+    if (hashes == NULL)
+        return 0;
+    unsigned char root[HASH_SIZE];
+    memcpy(root, hashes->root, HASH_SIZE);
 
     struct rpdu this;
     bzero(&this, sizeof(this));
     this.type = 'R';
     strcpy(this.peer_name, client_name);
     strcpy(this.content_name, content_name);
+    this.capacity = htons(upload_slots);
+    memcpy(this.root, hashes->root, HASH_SIZE);
     printf("%s", this.content_name);
-
-    /* Harasees Singh Gill's heuristic to get Ubuntu 20.04 private IP address
-        Same thing...*/
-    FILE *ls_cmd = popen("hostname -I", "r");
-    if (ls_cmd == NULL) {
-        fprintf(stderr, "popen(3) error");
-        exit(EXIT_FAILURE);
-    }
-
-    static char buff[1024];
-    size_t n;
-
-    while ((n = fread(buff, 1, sizeof(buff)-1, ls_cmd)) > 0) {
-        buff[n] = '\0';
+    if (!openListener(this.address))
+    {
+        freePieceHashes(hashes);
+        free(path);
+        return 0;
     }
-
-    char THIS_IP[INET_ADDRSTRLEN];
-    strcpy(THIS_IP, strtok(buff, " "));
-
-    struct sockaddr_in reg_addr;
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    bzero(&reg_addr, sizeof(reg_addr));
-    reg_addr.sin_family = AF_INET;
-    reg_addr.sin_port = htons(0);
-    inet_pton(AF_INET, THIS_IP, &(reg_addr.sin_addr));
-
-    bind(s, (struct sockaddr *)&reg_addr, sizeof(reg_addr));
-    listen(s, 1);
-
-    socklen_t alen = sizeof (struct sockaddr_in);  
-    getsockname(s, (struct sockaddr *) &reg_addr, &alen);     
-    bzero(&THIS_IP, INET_ADDRSTRLEN);
-    printf("%s\n", inet_ntop(AF_INET, &(reg_addr.sin_addr), THIS_IP, INET_ADDRSTRLEN));
-    if (pclose(ls_cmd) < 0)
-        perror("pclose(3) error");
-
-    strcat(THIS_IP, ":");
-
-    char port[DEFAULT_NAME_SIZE];
-    sprintf(port, "%u", ntohs(reg_addr.sin_port));
-    strcpy(this.address, strcat(THIS_IP, port));
+    printf("%s\n", this.address);
     
-    sendto(sockfd, &this, sizeof(this), 0, (struct sockaddr*)&socket_addr, socket_addr_size);
-    int flag = waitRegisteredAcknowledgement(sockfd, &s, socket_addr, socket_addr_size);
+    uint32_t request_id = sendRequest(sockfd, 'R', &this, sizeof(this), socket_addr, socket_addr_size);
+    int flag = waitRegisteredAcknowledgement(sockfd, request_id);
     if (flag)
-        addToHostedFiles(s, this);
+        addToHostedFiles(this, path, hashes);
+    else
+    {
+        freePieceHashes(hashes);
+        free(path);
+    }
+    if (store_directory != NULL)
+        trimStore(sockfd, socket_addr, socket_addr_size, root);
+    return flag;
 }
+void requestFileFromServer(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size, char *peer)
+{ // Main S function. Ask what to download, download it and serve it from then on
+    char content_name[DEFAULT_NAME_SIZE];
+    struct source_list sources;
+    printf("Which file would you like to request for download from the server? \n");
+    scanf("%19s", content_name);
+    if (!requestSources(sockfd, socket_addr, socket_addr_size, content_name, &sources, stdout))
+        return;
 
-// T
-void removeFromHostedFiles(char *file_name)
-{ // Terminate a file by removing it from the linked list of files hosted by this content_server
-    struct File *temp = head, *prev;
-    if (temp != NULL && 
-        strcmp(temp->file_descriptor.content_name, file_name) == 0)
-    { // If it is the first item in the list
-        head = temp->next;
-        free(temp);
-        printf("%s was removed from the server and removed from local list of hosted files...\n", file_name);
+    struct piece_hashes *hashes = store_directory != NULL ? findStoredContent(sources.root) : NULL;
+    int downloaded = hashes != NULL || downloadFromSources(peer, content_name, &sources);
+    reportDownloadFinished(sockfd, sources.ticket, downloaded, socket_addr, socket_addr_size);
+    if (!downloaded)
+    {
+        printf("No content server could deliver %s...\n", content_name);
         return;
     }
+    if (hashes != NULL)
+        printf("%s is already in the store, nothing to download...\n", content_name);
+    hostDownload(sockfd, socket_addr, socket_addr_size, content_name, hashes);
+}
 
-    while (temp != NULL && 
-        strcmp(temp->file_descriptor.content_name, file_name) != 0)
+// T
+void removeFromHostedFiles(char *file_name)
+{ // Terminate a file by removing it from the linked list of files hosted by this content_server and from the hosted table
+    struct File *temp = head, *prev = NULL;
+    pthread_mutex_lock(&upload_lock);
+    while (temp != NULL && strcmp(temp->file_descriptor.content_name, file_name) != 0)
     { // while it is not the item by name and the linked list has not reached its end
         prev = temp;
         temp = temp->next;
     }
-
-    if (temp == NULL) // If the item was not found in the list of hosted files
+    if (temp == NULL)
+    { // If the item was not found in the list of hosted files
+        pthread_mutex_unlock(&upload_lock);
         printf("%s was not found in the list of hosted files...\n", file_name);
         return;
+    }
+    if (prev == NULL)
+        head = temp->next;
+    else
+        prev->next = temp->next;
+    struct File *in_bucket = hosted_table[hashName(file_name) & (hosted_buckets - 1)], *bucket_prev = NULL;
+    while (in_bucket != temp)
+    {
+        bucket_prev = in_bucket;
+        in_bucket = in_bucket->next_in_bucket;
+    }
+    if (bucket_prev == NULL)
+        hosted_table[hashName(file_name) & (hosted_buckets - 1)] = temp->next_in_bucket;
+    else
+        bucket_prev->next_in_bucket = temp->next_in_bucket;
+    hosted_count--;
+    pthread_mutex_unlock(&upload_lock);
 
-    // Item was found and was not the first item in the list
-    prev->next = temp->next;
+    free(temp->path);
+    freePieceHashes(temp->hashes);
     free(temp);
     printf("%s was removed from the server and removed from local list of hosted files...\n", file_name);
 }
-int waitDeletionAcknowledgement(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size, struct pdu packet)
+int waitDeletionAcknowledgement(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size, char *request)
 { // Same for waiting for acknowledgement of registration. This time we wait to hear that our file was removed from the server and we can close the socket. 
-    if (sendto(sockfd, &packet, sizeof(packet), 0, (struct sockaddr*)&socket_addr, socket_addr_size) < 0)
+    struct message packet;
+    uint32_t request_id = sendRequest(sockfd, 'T', request, strlen(request), socket_addr, socket_addr_size);
+    if (request_id == 0)
     {
         printf("ERROR: Could not request file deletion from server...\n");
         return 0;
     }
 
-    bzero(&packet, sizeof(packet));
-    if (recvfrom(sockfd, &packet, sizeof(packet), 0, (struct sockaddr*)&socket_addr, &socket_addr_size) < 0)
-    { 
-        printf("CRITICAL ERROR... Please try again later.\n");
+    if (!receiveReply(sockfd, request_id, &packet))
+    {
+        printf("The index server did not answer... Please try again later.\n");
         return 0;
     }
-    if (packet.type == 'A')
+    if (packet.header.type == 'A')
     {
         printf("File deleted\n");
         return 1;
-    } else if (packet.type == 'E')
+    } else if (packet.header.type == 'E')
     {
-        printf("Something went wrong... %s\n", packet.data);
+        printf("Something went wrong... %s\n", packet.payload);
         return 0;
     }
     return 0;
 }
-void destroyExistingSocket(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size)
-{ // Main T function. Send request and wait for server response with status of request. 
+int deregisterContent(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size, const char *content_name)
+{ // Send request and wait for server response with status of request. Returns 1 if the file was taken off the index
     struct pdu packet = {'T'};
     char file_to_delete[DEFAULT_NAME_SIZE];
     bzero(packet.data, STANDARD_BUF_SIZE);
-
-    printf("Please type the file you would like to delete...\n");
-    scanf("%s", file_to_delete);
+    bzero(file_to_delete, DEFAULT_NAME_SIZE);
+    strncpy(file_to_delete, content_name, DEFAULT_NAME_SIZE - 1);
 
     strcpy(packet.data, file_to_delete);
     strcat(packet.data, ":");
     strcat(packet.data, client_name);
 
-    int x = waitDeletionAcknowledgement(sockfd, socket_addr, socket_addr_size, packet);
+    int x = waitDeletionAcknowledgement(sockfd, socket_addr, socket_addr_size, packet.data);
     if (x)
         removeFromHostedFiles(file_to_delete);
+    return x;
+}
+void destroyExistingSocket(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size)
+{ // Main T function. Ask which file to take off the index
+    char file_to_delete[DEFAULT_NAME_SIZE];
+    printf("Please type the file you would like to delete...\n");
+    scanf("%19s", file_to_delete);
+    deregisterContent(sockfd, socket_addr, socket_addr_size, file_to_delete);
+}
+// H
+void sendHeartbeat(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size)
+{ // Renew the lease on everything we host with one datagram. The reply is picked up later by handleServerMessage
+    if (head == NULL)
+        return;
+    heartbeat_request_id = sendRequest(sockfd, 'H', client_name, DEFAULT_NAME_SIZE, socket_addr, socket_addr_size);
+    if (debug)
+        printf("Heartbeat %u sent...\n", heartbeat_request_id);
+}
+int announceHostedFiles(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size)
+{ // Send the registration of every hosted file again without waiting on each reply. Returns how many were sent
+    int files = 0;
+    for (struct File *n = head; n != NULL; n = n->next, files++)
+        sendRequest(sockfd, 'R', &n->file_descriptor, sizeof(n->file_descriptor), socket_addr, socket_addr_size);
+    return files;
+}
+void reregisterHostedFiles(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size)
+{ // The index forgot us (our lease ran out or it restarted)
+    printf("Index server lost our registrations. %d files registered again...\n", announceHostedFiles(sockfd, socket_addr, socket_addr_size));
+}
+void refreshLocalHost(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size)
+{ // Our interfaces changed. The notifications only say that, so drain them and pick the host to advertise again. If it moved, every
+  // hosted file is registered again from there, which moves all of our files at the index
+    char notifications[8192];
+    while (recv(interface_watch, notifications, sizeof(notifications), 0) > 0)
+        ;
+    if (!findLocalHost() || upload_listener < 0)
+        return;
+    formatUploadAddress();
+    pthread_mutex_lock(&upload_lock);
+    for (struct File *n = head; n != NULL; n = n->next)
+        memcpy(n->file_descriptor.address, upload_address, ADDRESS_SIZE);
+    pthread_mutex_unlock(&upload_lock);
+    if (head != NULL)
+        printf("Now serving on %s. %d files registered again...\n", upload_address, announceHostedFiles(sockfd, socket_addr, socket_addr_size));
+}
+void handleServerMessage(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size)
+{ // A datagram arrived while no request was waiting on one, e.g. a heartbeat reply or the late reply to an earlier request
+    struct message reply;
+    ssize_t size = recvfrom(sockfd, &reply, sizeof(reply) - 1, 0, NULL, NULL);
+    if (size < (ssize_t)sizeof(reply.header) || reply.header.version != PROTOCOL_VERSION)
+        return;
+    if (heartbeat_request_id != 0 && ntohl(reply.header.request_id) == heartbeat_request_id)
+    {
+        heartbeat_request_id = 0;
+        if (reply.header.type == 'E')
+            reregisterHostedFiles(sockfd, socket_addr, socket_addr_size);
+    } else if (debug)
+        printf("Dropping reply to stale request %u...\n", ntohl(reply.header.request_id));
 }
+
 // O
-void printHostedFiles(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size)
-{ // Request list of files and then receive the incoming 'O' pdu until an 'E' pdu is witnessed. Then stop printing and return.
-    struct pdu available_file = {'O'};
-    bzero(available_file.data, STANDARD_BUF_SIZE);
-    if (sendto(sockfd, &available_file, sizeof(available_file), 0, (struct sockaddr*)&socket_addr, socket_addr_size) < 0)
+int listContent(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size, const char *prefix, FILE *out)
+{ // Request the listing of names starting with prefix (* for everything) page by page and print it on out. Each page arrives as a
+  // known number of 'O' replies with many entries packed in each, and the last entry of the page is sent back as the cursor for
+  // the next one. Returns 1 once the whole listing was printed
+    struct opdu query;
+    struct message available_file;
+    bzero(&query, sizeof(query));
+    if (strcmp(prefix, "*") != 0)
+        strncpy(query.prefix, prefix, DEFAULT_NAME_SIZE - 1);
+
+    int more = 1;
+    while (more)
     {
-        printf("Failed to request files. Please try again later...\n");
-        return;
+        uint32_t request_id = sendRequest(sockfd, 'O', &query, sizeof(query), socket_addr, socket_addr_size);
+        if (request_id == 0)
+        {
+            fprintf(out, "Failed to request files. Please try again later...\n");
+            return 0;
+        }
+
+        int received = 0, count = 1;
+        uint64_t seen = 0; // datagrams of the page already printed, the whole page comes again when the request is resent
+        more = 0;
+        while (received < count)
+        { // Get replies from index server until every datagram of the page has been seen
+            if (!receiveReply(sockfd, request_id, &available_file))
+            {
+                fprintf(out, "Failed to receive file from server. Please try again later...\n");
+                return 0;
+            }
+            if (available_file.header.type == 'E')
+            {
+                fprintf(out, "%s\n", available_file.payload);
+                return 0;
+            }
+            if (ntohs(available_file.header.length) < sizeof(struct listing_header))
+                continue;
+
+            struct listing_header page;
+            memcpy(&page, available_file.payload, sizeof(page));
+            count = ntohs(page.count);
+            if (ntohs(page.index) >= MAX_LISTING_DATAGRAMS || (seen & (1ULL << ntohs(page.index))))
+                continue;
+            seen |= 1ULL << ntohs(page.index);
+            received++;
+
+            // For every entry obtained, tokenize, split, obtain the character arrays, and print them as a formatted string on the terminal. 
+            char *saveptr, *line = strtok_r(available_file.payload + sizeof(page), "\n", &saveptr);
+            while (line != NULL)
+            {
+                char *separator = strchr(line, ':');
+                if (separator != NULL)
+                {
+                    *separator = '\0';
+                    fprintf(out, "PEER: %s    CONTENT: %s\n", line, separator + 1);
+                    if (ntohs(page.index) == count - 1)
+                    { // remember where this page ended
+                        strncpy(query.cursor_peer, line, DEFAULT_NAME_SIZE);
+                        strncpy(query.cursor_content, separator + 1, DEFAULT_NAME_SIZE);
+                    }
+                }
+                line = strtok_r(NULL, "\n", &saveptr);
+            }
+            if (ntohs(page.index) == count - 1)
+                more = page.more;
+        }
     }
+    return 1;
+}
+void printHostedFiles(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size)
+{ // Main O function. Ask which names to list
+    char prefix[DEFAULT_NAME_SIZE];
+    printf("Which name prefix would you like to list? (* for everything)\n");
+    scanf("%19s", prefix);
+    if (listContent(sockfd, socket_addr, socket_addr_size, prefix, stdout))
+        printf("\n");
+}
+
+// Q
+void searchContent(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size)
+{ // Ask the index server for content names by prefix or substring, one page of matches at a time
+    struct qpdu query;
+    struct message reply;
+    char answer[DEFAULT_NAME_SIZE];
+    bzero(&query, sizeof(query));
+
+    printf("Search names that (P)start with or (C)ontain the text?\n");
+    scanf("%19s", answer);
+    query.mode = answer[0] == 'P' || answer[0] == 'p' ? 'P' : 'C';
+    printf("Which text would you like to search for? (* for everything)\n");
+    scanf("%19s", query.pattern);
+    if (strcmp(query.pattern, "*") == 0)
+        bzero(query.pattern, DEFAULT_NAME_SIZE);
 
     while (1)
-    { // Get PDUs from index server until an E packet is contained. 
-        bzero(&available_file, sizeof(available_file));
-        if (recvfrom(sockfd, &available_file, sizeof(available_file), 0, (struct sockaddr*)&socket_addr, &socket_addr_size) < 0)
+    {
+        uint32_t request_id = sendRequest(sockfd, 'Q', &query, sizeof(query), socket_addr, socket_addr_size);
+        if (request_id == 0 || !receiveReply(sockfd, request_id, &reply))
         {
-            printf("Failed to receive file from server. Please try again later...\n");
+            printf("Failed to search. Please try again later...\n");
             return;
         }
-        if (available_file.type == 'E')
+        if (reply.header.type == 'E')
         {
-            if (strlen(available_file.data) > 0)
-            {
-                printf("%s\n", available_file.data);
-            }
-            printf("\n");
+            printf("%s\n", reply.payload);
             return;
         }
+        struct query_reply result;
+        bzero(&result, sizeof(result));
+        memcpy(&result, reply.payload, ntohs(reply.header.length) < sizeof(result) ? ntohs(reply.header.length) : sizeof(result));
+        if (result.count > MAX_QUERY_RESULTS)
+            result.count = MAX_QUERY_RESULTS;
+        for (int i = 0; i < result.count; i++)
+            printf("CONTENT: %.*s    HOLDERS: %d\n", DEFAULT_NAME_SIZE, result.matches[i].content_name, ntohs(result.matches[i].holders));
+        if (result.count == 0)
+            printf("No content matches...\n");
+        if (!result.more || result.count == 0)
+            break;
 
-        // For every PDU obtained, tokenize, split, obtain the character arrays, and print them as a formatted string on the terminal. 
-        char *token = strtok(available_file.data, ":");
-        char peer_name[DEFAULT_NAME_SIZE], content_name[DEFAULT_NAME_SIZE];
-        int i = 0;
-        while(token != NULL)
+        printf("More results? (y/n)\n");
+        scanf("%19s", answer);
+        if (answer[0] != 'y' && answer[0] != 'Y')
+            break;
+        memcpy(query.cursor, result.matches[result.count - 1].content_name, DEFAULT_NAME_SIZE);
+    }
+    printf("\n");
+}
+
+// X
+void writeTransferStats(FILE *out, const char *direction, struct transfer_stats *stats)
+{ // The Prometheus series of one direction of transfers
+    uint64_t cumulative = 0;
+    fprintf(out, "p2p_peer_transfer_bytes_total{direction=\"%s\"} %llu\n", direction, (unsigned long long)__atomic_load_n(&stats->bytes, __ATOMIC_RELAXED));
+    fprintf(out, "p2p_peer_transfers_total{direction=\"%s\",result=\"completed\"} %llu\n", direction,
+        (unsigned long long)__atomic_load_n(&stats->completed, __ATOMIC_RELAXED));
+    fprintf(out, "p2p_peer_transfers_total{direction=\"%s\",result=\"failed\"} %llu\n", direction,
+        (unsigned long long)__atomic_load_n(&stats->failed, __ATOMIC_RELAXED));
+    for (int b = 0; b < STATS_BUCKETS; b++)
+    {
+        cumulative += __atomic_load_n(&stats->rate[b], __ATOMIC_RELAXED);
+        if (b < STATS_BUCKETS - 1)
+            fprintf(out, "p2p_peer_transfer_mbps_bucket{direction=\"%s\",le=\"%llu\"} %llu\n", direction, 1ULL << b, (unsigned long long)cumulative);
+        else
+            fprintf(out, "p2p_peer_transfer_mbps_bucket{direction=\"%s\",le=\"+Inf\"} %llu\n", direction, (unsigned long long)cumulative);
+    }
+    fprintf(out, "p2p_peer_transfer_mbps_sum{direction=\"%s\"} %.3f\n", direction, __atomic_load_n(&stats->rate_sum, __ATOMIC_RELAXED) / 1e3);
+    fprintf(out, "p2p_peer_transfer_mbps_count{direction=\"%s\"} %llu\n", direction, (unsigned long long)cumulative);
+}
+void writePeerMetrics(FILE *out)
+{ // Our counters in the Prometheus text format
+    fprintf(out, "# HELP p2p_peer_transfer_bytes_total File bytes uploaded to other peers and downloaded from them\n");
+    fprintf(out, "# TYPE p2p_peer_transfer_bytes_total counter\n");
+    fprintf(out, "# HELP p2p_peer_transfers_total Uploads and downloads that delivered their whole range, and those that did not\n");
+    fprintf(out, "# TYPE p2p_peer_transfers_total counter\n");
+    fprintf(out, "# HELP p2p_peer_transfer_mbps Throughput of single completed transfers in MB/s\n");
+    fprintf(out, "# TYPE p2p_peer_transfer_mbps histogram\n");
+    writeTransferStats(out, "upload", &upload_stats);
+    writeTransferStats(out, "download", &download_stats);
+    fprintf(out, "# TYPE p2p_peer_uploads_active gauge\np2p_peer_uploads_active %d\n", __atomic_load_n(&uploads_active, __ATOMIC_RELAXED));
+    fprintf(out, "# TYPE p2p_peer_hosted_files gauge\np2p_peer_hosted_files %zu\n", __atomic_load_n(&hosted_count, __ATOMIC_RELAXED));
+    fprintf(out, "# TYPE p2p_peer_control_rtt_seconds gauge\np2p_peer_control_rtt_seconds %.6f\n", control_srtt);
+}
+void writeMetricsFile()
+{ // Replace the --metrics file with our counters as of now, in one step so a scraper never reads half of it
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", metrics_path);
+    FILE *out = fopen(temporary, "w");
+    if (out == NULL)
+        return;
+    writePeerMetrics(out);
+    if (fclose(out) != 0 || rename(temporary, metrics_path) < 0)
+        unlink(temporary);
+}
+time_t runTimers(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size, time_t *next_heartbeat, time_t *next_metrics)
+{ // Send the heartbeat and write the metrics file if they are due. Returns when the next of them is, to wake up in time for it
+    if (time(NULL) >= *next_heartbeat)
+    {
+        sendHeartbeat(sockfd, socket_addr, socket_addr_size);
+        *next_heartbeat = time(NULL) + HEARTBEAT_INTERVAL;
+    }
+    if (metrics_path != NULL && time(NULL) >= *next_metrics)
+    {
+        writeMetricsFile();
+        *next_metrics = time(NULL) + METRICS_INTERVAL;
+    }
+    return metrics_path != NULL && *next_metrics < *next_heartbeat ? *next_metrics : *next_heartbeat;
+}
+void showStatistics(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size)
+{ // Print our counters, then the index server's, which come a datagram at a time
+    struct stats_page page;
+    struct message reply;
+    writePeerMetrics(stdout);
+    printf("\n");
+    uint32_t offset = 0, total = 1;
+    while (offset < total)
+    {
+        page.offset = htonl(offset);
+        page.total = 0;
+        uint32_t request_id = sendRequest(sockfd, 'X', &page, sizeof(page), socket_addr, socket_addr_size);
+        if (request_id == 0 || !receiveReply(sockfd, request_id, &reply))
         {
-            if (i == 0)
-            {
-                strcpy(peer_name, token);
-            } else if (i == 1)
+            printf("The index server did not answer... Please try again later.\n");
+            return;
+        }
+        uint16_t length = ntohs(reply.header.length);
+        if (reply.header.type != 'X' || length < sizeof(page))
+        {
+            printf("Something went wrong... %s\n", reply.header.type == 'E' ? reply.payload : "");
+            return;
+        }
+        memcpy(&page, reply.payload, sizeof(page));
+        if (ntohl(page.offset) != offset || length == sizeof(page))
+            break; // the text shrank under us
+        fwrite(reply.payload + sizeof(page), 1, length - sizeof(page), stdout);
+        offset += length - sizeof(page);
+        total = ntohl(page.total);
+    }
+    printf("\n");
+}
+
+// DAEMON
+// With --daemon the peer runs without a terminal and takes commands from a Unix socket instead, one per line: register PATH,
+// fetch NAME, deregister NAME, list [PREFIX], status and leave. Each is answered with what it printed and a last line starting with
+// ok or error. A fetch is answered as soon as the index server named its sources and then downloads on a thread of its own, so
+// any number can be in flight, with a progress line every DAEMON_PROGRESS_SECONDS until a done or failed line. Everything else
+// runs on the main loop one command at a time, like from the terminal. './client --control SOCKET COMMAND...' is the other end
+void stopDaemon(int signum)
+{ // SIGTERM or SIGINT. The main loop leaves the peer group on its next pass
+    (void)signum;
+    daemon_stopping = 1;
+}
+void leavePeerGroup(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size)
+{ // Tell the index server we are gone, so it drops everything we registered
+    struct message reply;
+    uint32_t request_id = sendRequest(sockfd, 'L', client_name, DEFAULT_NAME_SIZE, socket_addr, socket_addr_size);
+    if (request_id == 0 || !receiveReply(sockfd, request_id, &reply))
+    {
+        printf("CRITICAL ERROR: Server was not informed of the peer leaving\n\n");
+    };
+    printf("Exiting from server...\n");
+    close(sockfd);
+}
+int openControlSocket(const char *path)
+{ // Listen on a Unix socket at path that only our user may connect to, replacing one a daemon that died left behind. Returns it,
+  // -1 with errno set if that fails or another daemon still serves there
+    struct sockaddr_un addr;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    int taken = probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    if (probe >= 0)
+        close(probe);
+    if (taken)
+    {
+        errno = EADDRINUSE;
+        return -1;
+    }
+    unlink(path);
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t mask = umask(0077);
+    int listening = s >= 0 && bind(s, (struct sockaddr*)&addr, sizeof(addr)) == 0 && listen(s, DAEMON_CONNECTIONS) == 0;
+    umask(mask);
+    if (!listening && s >= 0)
+    {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+void closeControl(struct control *c)
+{ // Hang up on a control connection. Its fetches carry on without anyone to report to
+    close(c->fd);
+    c->fd = -1;
+    c->length = 0;
+    for (struct fetch *f = fetches; f != NULL; f = f->next)
+        if (f->control == c)
+            f->control = NULL;
+}
+void sendControl(struct control *c, const char *format, ...)
+{ // Send lines to a control connection. One that does not take them within DAEMON_SEND_TIMEOUT is closed, so a client that stopped
+  // reading cannot hold up the daemon for longer
+    char *text;
+    va_list arguments;
+    if (c == NULL || c->fd < 0)
+        return;
+    va_start(arguments, format);
+    int length = vasprintf(&text, format, arguments);
+    va_end(arguments);
+    if (length < 0)
+        return;
+    if (!sendAll(c->fd, text, length))
+        closeControl(c);
+    free(text);
+}
+void acceptControl(int listener)
+{ // A client connected to the control socket
+    int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+    struct timeval timeout = { DAEMON_SEND_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    for (int i = 0; i < DAEMON_CONNECTIONS; i++)
+        if (controls[i].fd < 0)
+        {
+            controls[i].fd = fd;
+            controls[i].length = 0;
+            return;
+        }
+    sendAll(fd, "error too many control connections\n", 35);
+    close(fd);
+}
+void *runFetch(void *arg)
+{ // Thread body of a fetch. The hashes are worked out here too, so registering the file from the main loop finds them cached
+    struct fetch *f = (struct fetch*)arg;
+    char path[PATH_MAX], byte = 0;
+    download_progress = &f->progress;
+    f->downloaded = downloadFromSources(client_name, f->content_name, &f->sources);
+    downloadPath(path, sizeof(path), f->content_name, "");
+    if (f->downloaded)
+        freePieceHashes(hashFile(path));
+    __atomic_store_n(&f->finished, 1, __ATOMIC_RELEASE);
+    if (write(fetch_wakeup[1], &byte, 1) < 0 && debug)
+        perror("Cannot wake the main loop");
+    return NULL;
+}
+void startFetch(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size, struct control *c, const char *content_name, FILE *out)
+{ // Ask the index server for the sources of content_name and download it from them on a thread of its own
+    struct fetch *f = fetches;
+    while (f != NULL && strcmp(f->content_name, content_name) != 0)
+        f = f->next;
+    if (f != NULL || strlen(content_name) >= DEFAULT_NAME_SIZE)
+    { // two downloads into the same partial file would ruin each other
+        fprintf(out, "error fetch %s %s\n", content_name, f != NULL ? "is already in flight" : "is too long a name");
+        return;
+    }
+    if ((f = (struct fetch*)calloc(1, sizeof(struct fetch))) == NULL)
+    {
+        fprintf(out, "error fetch %s out of memory\n", content_name);
+        return;
+    }
+    strcpy(f->content_name, content_name);
+    f->control = c;
+    if (!requestSources(sockfd, socket_addr, socket_addr_size, content_name, &f->sources, out))
+    {
+        fprintf(out, "error fetch %s\n", content_name);
+        free(f);
+        return;
+    }
+
+    struct piece_hashes *hashes = store_directory != NULL ? findStoredContent(f->sources.root) : NULL;
+    if (hashes != NULL)
+    {
+        reportDownloadFinished(sockfd, f->sources.ticket, 1, socket_addr, socket_addr_size);
+        printf("%s is already in the store, nothing to download...\n", content_name);
+        hostDownload(sockfd, socket_addr, socket_addr_size, f->content_name, hashes);
+        fprintf(out, "ok fetch %s\ndone fetch %s\n", content_name, content_name);
+        free(f);
+        return;
+    }
+    if (pthread_create(&f->thread, NULL, runFetch, f) != 0)
+    {
+        reportDownloadFinished(sockfd, f->sources.ticket, 0, socket_addr, socket_addr_size);
+        fprintf(out, "error fetch %s cannot start a thread\n", content_name);
+        free(f);
+        return;
+    }
+    f->next = fetches;
+    fetches = f;
+    fprintf(out, "ok fetch %s\n", content_name);
+}
+void finishFetches(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size)
+{ // Wrap up every fetch whose thread is done: free the content server's slot at the index server, serve the file from now on and
+  // tell whoever asked for it
+    char drain[64];
+    while (read(fetch_wakeup[0], drain, sizeof(drain)) > 0)
+        ;
+    struct fetch **link = &fetches;
+    while (*link != NULL)
+    {
+        struct fetch *f = *link;
+        if (!__atomic_load_n(&f->finished, __ATOMIC_ACQUIRE))
+        {
+            link = &f->next;
+            continue;
+        }
+        pthread_join(f->thread, NULL);
+        *link = f->next;
+        reportDownloadFinished(sockfd, f->sources.ticket, f->downloaded, socket_addr, socket_addr_size);
+        if (f->downloaded)
+            hostDownload(sockfd, socket_addr, socket_addr_size, f->content_name, NULL);
+        else
+            printf("No content server could deliver %s...\n", f->content_name);
+        sendControl(f->control, "%s fetch %s\n", f->downloaded ? "done" : "failed", f->content_name);
+        free(f);
+    }
+}
+void reportFetchProgress()
+{ // How far every fetch got, to whoever asked for it
+    for (struct fetch *f = fetches; f != NULL; f = f->next)
+        if (f->control != NULL && !__atomic_load_n(&f->finished, __ATOMIC_ACQUIRE))
+            sendControl(f->control, "progress fetch %s %llu %llu\n", f->content_name,
+                (unsigned long long)__atomic_load_n(&f->progress.have, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&f->progress.size, __ATOMIC_RELAXED));
+}
+void writeStatus(FILE *out)
+{ // What the daemon is up to, a "key value" line each, and a line for every fetch in flight with how many of how many bytes it has
+    fprintf(out, "peer %s\n", client_name);
+    fprintf(out, "address %s\n", upload_address[0] != '\0' ? upload_address : "-");
+    fprintf(out, "hosted_files %zu\n", __atomic_load_n(&hosted_count, __ATOMIC_RELAXED));
+    fprintf(out, "uploads_active %d\n", __atomic_load_n(&uploads_active, __ATOMIC_RELAXED));
+    fprintf(out, "uploaded_bytes %llu\n", (unsigned long long)__atomic_load_n(&upload_stats.bytes, __ATOMIC_RELAXED));
+    fprintf(out, "downloaded_bytes %llu\n", (unsigned long long)__atomic_load_n(&download_stats.bytes, __ATOMIC_RELAXED));
+    fprintf(out, "downloads_completed %llu\n", (unsigned long long)__atomic_load_n(&download_stats.completed, __ATOMIC_RELAXED));
+    fprintf(out, "downloads_failed %llu\n", (unsigned long long)__atomic_load_n(&download_stats.failed, __ATOMIC_RELAXED));
+    for (struct fetch *f = fetches; f != NULL; f = f->next)
+        fprintf(out, "fetch %s %llu %llu\n", f->content_name, (unsigned long long)__atomic_load_n(&f->progress.have, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&f->progress.size, __ATOMIC_RELAXED));
+}
+void runCommand(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size, struct control *c, char *line)
+{ // Carry out one command line from c and answer it
+    char *saveptr, *text = NULL;
+    char *command = strtok_r(line, " \t\r", &saveptr), *argument = strtok_r(NULL, " \t\r", &saveptr);
+    size_t length = 0;
+    if (command == NULL)
+        return; // an empty line
+    FILE *out = open_memstream(&text, &length);
+    if (out == NULL)
+    {
+        sendControl(c, "error out of memory\n");
+        return;
+    }
+    if (debug)
+        printf("Control command: %s %s\n", command, argument != NULL ? argument : "");
+
+    if (strcmp(command, "register") == 0 && argument != NULL)
+    {
+        int registered = registerContent(sockfd, socket_addr, socket_addr_size, argument);
+        if (registered > 0)
+            fprintf(out, "ok register %s %d\n", argument, registered);
+        else
+            fprintf(out, "error register %s\n", argument);
+    } else if (strcmp(command, "fetch") == 0 && argument != NULL)
+        startFetch(sockfd, socket_addr, socket_addr_size, c, argument, out);
+    else if (strcmp(command, "deregister") == 0 && argument != NULL)
+    {
+        int removed = deregisterContent(sockfd, socket_addr, socket_addr_size, argument);
+        fprintf(out, "%s deregister %s\n", removed ? "ok" : "error", argument);
+    } else if (strcmp(command, "list") == 0)
+    {
+        int listed = listContent(sockfd, socket_addr, socket_addr_size, argument != NULL ? argument : "*", out);
+        fprintf(out, "%s list\n", listed ? "ok" : "error");
+    } else if (strcmp(command, "status") == 0)
+    {
+        writeStatus(out);
+        fprintf(out, "ok status\n");
+    } else if (strcmp(command, "leave") == 0)
+    {
+        daemon_stopping = 1;
+        fprintf(out, "ok leave\n");
+    } else
+        fprintf(out, "error %s is not one of register PATH, fetch NAME, deregister NAME, list [PREFIX], status or leave\n", command);
+    fclose(out);
+    sendControl(c, "%s", text);
+    free(text);
+}
+void readControl(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size, struct control *c)
+{ // Take in what a control connection sent and carry out every whole line of it
+    ssize_t n = recv(c->fd, c->line + c->length, sizeof(c->line) - 1 - c->length, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0)
+    {
+        closeControl(c);
+        return;
+    }
+    c->length += n;
+    char *newline, command[DAEMON_LINE_SIZE];
+    while (c->fd >= 0 && (newline = (char*)memchr(c->line, '\n', c->length)) != NULL)
+    {
+        size_t used = newline + 1 - c->line;
+        memcpy(command, c->line, used - 1);
+        command[used - 1] = '\0';
+        memmove(c->line, newline + 1, c->length - used);
+        c->length -= used;
+        runCommand(sockfd, socket_addr, socket_addr_size, c, command);
+    }
+    if (c->fd >= 0 && c->length == sizeof(c->line) - 1)
+    {
+        sendControl(c, "error command too long\n");
+        closeControl(c);
+    }
+}
+int serveDaemon(int sockfd, struct sockaddr_in socket_addr, int socket_addr_size)
+{ // The main loop without a terminal. Besides what it always waits on, it waits on the control socket, on every connection to it
+  // and on fetch threads finishing. Runs until told to leave or signalled
+    int listener = openControlSocket(daemon_path);
+    if (listener < 0 || pipe2(fetch_wakeup, O_CLOEXEC | O_NONBLOCK) < 0)
+    {
+        perror("Cannot open the control socket");
+        return 1;
+    }
+    for (int i = 0; i < DAEMON_CONNECTIONS; i++)
+        controls[i].fd = -1;
+    signal(SIGTERM, stopDaemon);
+    signal(SIGINT, stopDaemon);
+    setvbuf(stdout, NULL, _IOLBF, 0); // the log should keep up when it goes to a file
+    printf("(%s) Taking commands on %s...\n", client_name, daemon_path);
+
+    time_t next_heartbeat = time(NULL) + HEARTBEAT_INTERVAL, next_metrics = time(NULL);
+    double next_progress = 0;
+    while (!daemon_stopping)
+    {
+        fd_set ready_sockets;
+        FD_ZERO(&ready_sockets);
+        FD_SET(sockfd, &ready_sockets);
+        FD_SET(listener, &ready_sockets);
+        FD_SET(fetch_wakeup[0], &ready_sockets);
+        int highest = sockfd > listener ? sockfd : listener;
+        highest = highest > fetch_wakeup[0] ? highest : fetch_wakeup[0];
+        if (interface_watch >= 0)
+            FD_SET(interface_watch, &ready_sockets);
+        highest = highest > interface_watch ? highest : interface_watch;
+        for (int i = 0; i < DAEMON_CONNECTIONS; i++)
+            if (controls[i].fd >= 0)
             {
-                strcpy(content_name, token);
+                FD_SET(controls[i].fd, &ready_sockets);
+                highest = highest > controls[i].fd ? highest : controls[i].fd;
             }
-            i++;
-            token = strtok(NULL, ":");
+        // Wake up in time for the next heartbeat or metrics file, and for the next progress report while anything is downloading
+        time_t wake = runTimers(sockfd, socket_addr, socket_addr_size, &next_heartbeat, &next_metrics), now = time(NULL);
+        struct timeval timeout = { wake > now ? wake - now : 0, 0 };
+        if (fetches != NULL && timeout.tv_sec > DAEMON_PROGRESS_SECONDS)
+            timeout.tv_sec = DAEMON_PROGRESS_SECONDS;
+        int ready = select(highest + 1, &ready_sockets, NULL, NULL, &timeout);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready < 0)
+        {
+            perror("error during select...\n");
+            break;
+        }
+        if (fetches != NULL && nowSeconds() >= next_progress)
+        {
+            reportFetchProgress();
+            next_progress = nowSeconds() + DAEMON_PROGRESS_SECONDS;
+        }
+        if (ready == 0)
+            continue;
+        if (FD_ISSET(fetch_wakeup[0], &ready_sockets))
+            finishFetches(sockfd, socket_addr, socket_addr_size);
+        if (interface_watch >= 0 && FD_ISSET(interface_watch, &ready_sockets))
+            refreshLocalHost(sockfd, socket_addr, socket_addr_size);
+        if (FD_ISSET(sockfd, &ready_sockets))
+            handleServerMessage(sockfd, socket_addr, socket_addr_size);
+        if (FD_ISSET(listener, &ready_sockets))
+            acceptControl(listener);
+        for (int i = 0; i < DAEMON_CONNECTIONS; i++)
+            if (controls[i].fd >= 0 && FD_ISSET(controls[i].fd, &ready_sockets))
+                readControl(sockfd, socket_addr, socket_addr_size, &controls[i]);
+    }
+    // Fetches still running are cut off, they resume from their checkpoints the next time they are asked for
+    close(listener);
+    unlink(daemon_path);
+    leavePeerGroup(sockfd, socket_addr, socket_addr_size);
+    return 0;
+}
+int runControl(const char *path, int count, char *words[])
+{ // ./client --control SOCKET COMMAND [ARGUMENT]...: hand a command to a running daemon and print what it answers. register, fetch
+  // and deregister take any number of arguments, each sent as a command of its own, so many fetches run at once. Waits for every
+  // fetch to end. Returns 0 if everything succeeded
+    struct sockaddr_un addr;
+    char line[DAEMON_LINE_SIZE];
+    int pending = 0, failed = 0;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (count < 1)
+    {
+        printf("Incorrect usage: ./client --control SOCKET register PATH... | fetch NAME... | deregister NAME... | list [PREFIX] | status | leave\n");
+        return 2;
+    }
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0 || connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        printf("No daemon is taking commands on %s...\n", path);
+        return 1;
+    }
+    int each = count > 1 && (strcmp(words[0], "register") == 0 || strcmp(words[0], "fetch") == 0 || strcmp(words[0], "deregister") == 0);
+    for (int i = each ? 1 : 0; i < count; i++)
+    {
+        int length = each ? snprintf(line, sizeof(line), "%s %s\n", words[0], words[i]) : snprintf(line, sizeof(line), "%s %s\n", words[0], count > 1 ? words[1] : "");
+        if (length >= (int)sizeof(line) || !sendAll(sockfd, line, length))
+        {
+            printf("Cannot send %s to the daemon...\n", words[0]);
+            return 1;
         }
+        pending++;
+        if (!each)
+            break;
+    }
 
-        printf("PEER: %s    CONTENT: %s\n", peer_name, content_name);
+    // Every command ends with an ok or error line, except that a fetch which got under way ends with its done or failed line
+    FILE *in = fdopen(sockfd, "r");
+    while (pending > 0 && in != NULL && fgets(line, sizeof(line), in) != NULL)
+    {
+        fputs(line, stdout);
+        fflush(stdout);
+        if (strncmp(line, "ok fetch ", 9) == 0)
+            continue;
+        if (strncmp(line, "ok ", 3) == 0 || strncmp(line, "done ", 5) == 0)
+            pending--;
+        else if (strncmp(line, "error ", 6) == 0 || strncmp(line, "failed ", 7) == 0)
+        {
+            pending--;
+            failed++;
+        }
     }
+    if (pending > 0)
+        printf("The daemon went away before answering everything...\n");
+    return pending > 0 || failed > 0;
 }
 
 
 /* MAIN FUNCTION */
 int main(int argc, char *argv[])
 { 
-    if (argc != 4)
+    if (argc >= 3 && strcmp(argv[1], "--control") == 0)
+        return runControl(argv[2], argc - 3, argv + 3);
+    if (argc < 4)
+    {
+        printf("Incorrect usage: ./client SERVER_IP_ADDR SERVER_PORT CLIENT_NAME [--slots N] [--upload-rate MB_PER_SECOND] [--compress] [--io-uring] [--advertise HOST] [--store DIR] [--store-quota MB] [--metrics FILE] [--daemon SOCKET] [--debug]\n");
+        printf("   or: ./client --control SOCKET COMMAND [ARGUMENT]...");
+        exit(1);
+    }
+    for (int i = 4; i < argc; i++)
+    { // Options after the positional arguments
+        if (strcmp(argv[i], "--slots") == 0 && i + 1 < argc)
+            upload_slots = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--upload-rate") == 0 && i + 1 < argc)
+            upload_rate = atof(argv[++i]) * 1e6;
+        else if (strcmp(argv[i], "--compress") == 0)
+            download_compressed = 1;
+        else if (strcmp(argv[i], "--io-uring") == 0)
+            upload_with_ring = 1;
+        else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
+            metrics_path = argv[++i];
+        else if (strcmp(argv[i], "--debug") == 0)
+            debug = 1;
+        else if (strcmp(argv[i], "--daemon") == 0 && i + 1 < argc)
+            daemon_path = argv[++i];
+        else if (strcmp(argv[i], "--store") == 0 && i + 1 < argc)
+            store_directory = argv[++i];
+        else if (strcmp(argv[i], "--store-quota") == 0 && i + 1 < argc)
+            store_quota = (off_t)(atof(argv[++i]) * 1e6);
+        else if (strcmp(argv[i], "--advertise") == 0 && i + 1 < argc)
+        { // for when the address peers reach us on is not one of ours, behind NAT or port forwarding in a container
+            struct in6_addr check;
+            strncpy(local_host, argv[++i], sizeof(local_host) - 1);
+            if (inet_pton(AF_INET, local_host, &check) != 1 && inet_pton(AF_INET6, local_host, &check) != 1)
+            {
+                printf("%s is not an IPv4 or IPv6 address\n", local_host);
+                exit(1);
+            }
+        }
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            exit(1);
+        }
+    }
+    if (upload_slots < 1)
+        upload_slots = 1;
+    if (store_directory != NULL && !openStore())
+    {
+        printf("Cannot use %s as the content store...\n", store_directory);
+        exit(1);
+    }
+    if (local_host[0] == '\0')
+    { // found once here, after that only when the kernel tells us our addresses changed
+        findLocalHost();
+        interface_watch = watchInterfaces();
+    }
+    // A downloader hanging up mid-upload should fail that upload, not kill the whole peer
+    signal(SIGPIPE, SIG_IGN);
+    if (!startUploadEngine())
     {
-        printf("Incorrect usage: ./client SERVER_IP_ADDR SERVER_PORT CLIENT_NAME");
+        printf("Could not start the upload engine...\n");
         exit(1);
     }
     char* SERVER_IP_ADDR = argv[1];
     int SERVER_PORT = atoi(argv[2]);
     strcpy(client_name, argv[3]);
+    next_request_id = ((uint32_t)time(NULL) << 16 ^ (uint32_t)getpid()) | 1;
     // Quick prototyping
     // char* SERVER_IP_ADDR = "127.0.0.1";
     // strcpy(client_name, "Jeff");
@@ -536,41 +4294,54 @@ int main(int argc, char *argv[])
     socket_addr.sin_port = htons(SERVER_PORT);
     socket_addr.sin_addr.s_addr = inet_addr(SERVER_IP_ADDR);
     from_length = sizeof(socket_addr);
+    if (store_directory != NULL)
+        seedStore(sockfd, socket_addr, from_length);
+    if (daemon_path != NULL)
+        return serveDaemon(sockfd, socket_addr, from_length);
 
     int choice = 'R';
-    struct File *n;
-    printf("(%s) Enter:\nR: Register content\nS: Make download request\nT: Deregister content\nO: Request list of registered content\nL: Leave\n", client_name);
+    time_t next_heartbeat = time(NULL) + HEARTBEAT_INTERVAL, next_metrics = time(NULL);
+    printf("(%s) Enter:\nR: Register content\nS: Make download request\nT: Deregister content\nO: Request list of registered content\nQ: Search content names\nX: Show statistics\nL: Leave\n", client_name);
     while (choice != 'L')
     { // We begin the main loop. We wait for a socket in ready sockets to fire. 0 represents terminal input. We process terminal or socket... whichever is first
         int continue_flag = 0;
-        n = head;
 
         fd_set ready_sockets;
         FD_ZERO(&ready_sockets);
         FD_SET(0, &ready_sockets);
-
-        while (n != NULL)
-        { // If there are sockets to monitor in the linked list, store them in ready sockets now. Select is destructive***
-            if (debug)
-                printf("Socket belongs to: %s. The file being served is %s...\n", n->file_descriptor.peer_name, n->file_descriptor.content_name);
-
-            FD_SET(n->s, &ready_sockets);
-            n = n->next;
-        }
-        if (select(FD_SETSIZE, &ready_sockets, NULL, NULL, NULL) < 0)
+        FD_SET(sockfd, &ready_sockets); // our listeners belong to the upload engine
+        if (interface_watch >= 0)
+            FD_SET(interface_watch, &ready_sockets);
+        // Wake up in time for the next heartbeat, or metrics file, even if nothing else happens
+        time_t wake = runTimers(sockfd, socket_addr, from_length, &next_heartbeat, &next_metrics), now = time(NULL);
+        struct timeval timeout = { wake > now ? wake - now : 0, 0 };
+        int ready = select((sockfd > interface_watch ? sockfd : interface_watch) + 1, &ready_sockets, NULL, NULL, &timeout);
+        if (ready < 0)
         {
             perror("error during select...\n");
             exit(-1);
         }
+        if (ready == 0)
+            continue;
+        if (interface_watch >= 0 && FD_ISSET(interface_watch, &ready_sockets))
+        {
+            refreshLocalHost(sockfd, socket_addr, from_length);
+            if (!FD_ISSET(0, &ready_sockets) && !FD_ISSET(sockfd, &ready_sockets))
+                continue;
+        }
 
-        if (FD_ISSET(0, &ready_sockets))
+        if (FD_ISSET(sockfd, &ready_sockets) && !FD_ISSET(0, &ready_sockets))
+        { // Nothing for the user to see, so skip reprinting the options
+            handleServerMessage(sockfd, socket_addr, from_length);
+            continue;
+        } else if (FD_ISSET(0, &ready_sockets))
         { // If the input came from a terminal...
-            scanf("%ls", &choice);
+            char input[DEFAULT_NAME_SIZE];
+            if (scanf("%19s", input) != 1) // a single character command, read as a string so the newline is consumed
+                exit(0);
+            choice = input[0];
             printf("\n");
 
-            char num = choice;
-            sendto(sockfd, &num, sizeof(num), 0, (struct sockaddr *)&socket_addr, sizeof(struct sockaddr));
-
             switch(choice)
             {
                 case 'R':
@@ -585,32 +4356,18 @@ int main(int argc, char *argv[])
                 case 'O':
                     printHostedFiles(sockfd, socket_addr, from_length);
                     break;
+                case 'Q':
+                    searchContent(sockfd, socket_addr, from_length);
+                    break;
+                case 'X':
+                    showStatistics(sockfd, socket_addr, from_length);
+                    break;
                 case 'L':
-                    if (sendto(sockfd, &client_name, DEFAULT_NAME_SIZE, 0, (struct sockaddr *)&socket_addr, from_length) < 0)
-                    {
-                        printf("CRITICAL ERROR: Server was not informed of the peer leaving\n\n");
-                    };
-                    printf("Exiting from server...\n");
-                    close(sockfd);
+                    leavePeerGroup(sockfd, socket_addr, from_length);
                     exit(0);
             }
-        } else
-        { // INCOMING TCP REQUEST
-            printf("Serving new client...\n");
-            int clientfd;
-            n = head;
-            while (n != NULL)
-            {
-                if (FD_ISSET(n->s, &ready_sockets))
-                {
-                    clientfd = n->s;
-                    break;
-                }
-                n = n -> next;
-            }
-            handleDownload(clientfd);
         }
         // We reprint our options at the end of every loop
-        printf("\n(%s) Enter:\nR: Register content\nS: Make download request\nT: Deregister content\nO: Request list of registered content\nL: Leave\n", client_name);
+        printf("\n(%s) Enter:\nR: Register content\nS: Make download request\nT: Deregister content\nO: Request list of registered content\nQ: Search content names\nX: Show statistics\nL: Leave\n", client_name);
     }
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 /* DEFINITIONS */
 
+#define _GNU_SOURCE // sendmmsg
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -13,25 +14,340 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
 
 #define DEFAULT_NAME_SIZE 20
 #define STANDARD_BUF_SIZE 99
 #define CONTENT_BUF_SIZE 1280
+#define INITIAL_TABLE_SIZE 1024
+#define REGISTRY_SHARD_BITS 6
+#define REGISTRY_SHARDS (1 << REGISTRY_SHARD_BITS)
+#define SLAB_CHUNK_BYTES 65536
+#define PEER_CHUNK_BITS 10
+#define PEER_CHUNK_SIZE (1 << PEER_CHUNK_BITS)
+#define PEER_CHUNKS 65536
+#define NO_PEER UINT32_MAX
+#define MAX_WORKERS 256
+#define PROTOCOL_VERSION 3
+#define MAX_PAYLOAD_SIZE 1400
+#define LISTING_PAGE_ENTRIES 1024
+#define MAX_LISTING_DATAGRAMS 64
+#define MAX_SOURCES 8
+#define MAX_TICKETS 65536
+#define DOWNLOAD_TIMEOUT 300
+#define LEASE_SECONDS 90
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 3
+#define MAX_QUERY_RESULTS 63
+#define MAX_BATCH_ITEMS 24
+#define NAME_GRAM_BITS 16
+#define NAME_GRAM_BUCKETS (1 << NAME_GRAM_BITS)
+#define NAME_INDEX_REFRESH 2
+#define SNAPSHOT_INTERVAL 60
+#define SNAPSHOT_WAL_RECORDS 100000
+#define SNAPSHOT_MAGIC "P2PSNAP3"
+#define ADDRESS_SIZE 54
+#define ENDPOINT_BUCKETS 4096
+#define HASH_SIZE 32
+#define REPLY_CACHE_SLOTS 4096
+#define REPLY_CACHE_LOCKS 64
+#define REPLY_CACHE_SECONDS 30
+#define STATS_OPS 11
+#define STATS_BUCKETS 24
+#define STATS_TOP_PEERS 16
+#define METRICS_INTERVAL 10
 
 
 /* STRUCTS */
 struct __attribute__((__packed__)) rpdu {
-    // Struct for registering new files
+    // Struct for registering new files. root is the Merkle root of the file's piece hashes, all zeros if the peer has none
     char type;
     char peer_name[DEFAULT_NAME_SIZE];
     char content_name[DEFAULT_NAME_SIZE];
-    char address[30];
+    char address[ADDRESS_SIZE];
+    uint16_t capacity;
+    unsigned char root[HASH_SIZE];
 };
-struct __attribute__((__packed__)) hosted_file {
-    // Linked list struct for maintaining files. Note: status will be 'A'(ctive) or 'B'(usy) and only 'A' peers will be recommended as content servers
+struct __attribute__((__packed__)) batch_item {
+    // One file of a B request
+    char content_name[DEFAULT_NAME_SIZE];
+    unsigned char root[HASH_SIZE];
+};
+struct __attribute__((__packed__)) bpdu {
+    // Payload of a B request: count files registered at once by peer_name, all served on address. Only the used part of items is sent
+    char peer_name[DEFAULT_NAME_SIZE];
+    char address[ADDRESS_SIZE];
+    uint16_t capacity;
+    unsigned char count;
+    struct batch_item items[MAX_BATCH_ITEMS];
+};
+struct __attribute__((__packed__)) batch_status {
+    // Payload of a B reply. Bit i of registered, least significant bit of byte 0 first, is set if item i is now
+    // registered to the peer, which includes one it had registered before
+    unsigned char count;
+    unsigned char registered[(MAX_BATCH_ITEMS + 7) / 8];
+};
+struct hosted_file {
+    // One (peer, content) registration. Note: busy peers are not skipped but ranked behind idle ones, see getHostedFile
+    // Every entry sits on two doubly linked lists, the holders of its content and the files of its peer, so it can be unlinked in O(1).
+    // Names are kept once in the content and peer entries and the address once in the interned peer, since a peer serves all of
+    // its files from one listener. peer is the peer's index in the peer table. 48 bytes, carved from the peer shard's slab
+    struct content_entry *content;
+    struct hosted_file *next_holder, *prev_holder;
+    struct hosted_file *next_of_peer, *prev_of_peer;
+    uint32_t peer;
+};
+struct name_node {
+    // Common header of everything stored in a name_table. Chained per bucket
+    struct name_node *next;
+    unsigned int hash;
+    char name[DEFAULT_NAME_SIZE];
+};
+struct content_entry {
+    // All holders of one content name and the Merkle root they all registered it with, all zeros until one of them had one
+    struct name_node node;
+    int holders;
+    struct hosted_file *holders_head;
+    unsigned char root[HASH_SIZE];
+};
+struct endpoint {
+    // An address peers serve their files on, interned so a peer moving to another one is a single pointer store that readers never
+    // see half of. host is IPv6, IPv4 hosts are kept mapped into it. text is how S replies and snapshots spell it. Endpoints are
+    // never freed, there are only as many as distinct addresses ever registered
+    struct endpoint *next;
+    struct in6_addr host;
+    uint16_t port;
+    char text[ADDRESS_SIZE];
+};
+struct endpoint_table {
+    // Every endpoint seen, chained per bucket. lock only covers interning, endpoints do not change once published
+    pthread_mutex_t lock;
+    struct endpoint *buckets[ENDPOINT_BUCKETS];
+};
+struct peer_entry {
+    // All files registered by one peer name. in_flight counts downloads the index has sent to this peer and not yet seen finish,
+    // capacity is the number of simultaneous uploads the peer advertised when registering. endpoint is where all of its files are
+    // served. index is its slot in the peer table and next_free chains the slot once the peer is gone
+    struct name_node node;
+    int files;
+    struct hosted_file *files_head;
+    int in_flight;
+    int capacity;
+    time_t lease_expires;
+    struct lease_timer *timer;
+    struct endpoint *endpoint;
+    uint32_t index;
+    uint32_t next_free;
+};
+struct slab {
+    // Fixed-size objects carved out of SLAB_CHUNK_BYTES chunks. Freed objects are chained through their first bytes for reuse
+    // and chunks are never given back. A slab has no lock of its own, it belongs to one shard and is only used under its write lock
+    size_t object_size;
+    char *chunk;
+    size_t chunk_used;
+    void *free_list;
+    size_t chunks;
+};
+struct peer_table {
+    // Every registered peer, interned so a file refers to its peer with a 32 bit index. Chunks are published once and never move
+    // so an index is turned into a peer without a lock. lock only covers handing out and taking back slots
+    pthread_mutex_t lock;
+    struct peer_entry *chunks[PEER_CHUNKS];
+    uint32_t next;
+    uint32_t free_list;
+};
+struct lease_timer {
+    // A peer's slot in the timer wheel. It holds a copy of the name rather than a pointer so the expiry thread can look the peer up
+    // under its shard lock. slot is the wheel slot it sits in and armed is cleared once the timer has been taken off the wheel
+    struct lease_timer *next, *prev;
+    struct lease_timer **slot;
+    uint64_t expires;
+    char peer_name[DEFAULT_NAME_SIZE];
+    int armed;
+};
+struct timer_wheel {
+    // Hierarchical timing wheel with one second ticks. Level 0 covers the next WHEEL_SLOTS seconds and every further level covers
+    // WHEEL_SLOTS times more. Timers cascade down a level as their time comes closer, so a tick only touches timers that are due
+    pthread_mutex_t lock;
+    uint64_t now;
+    struct lease_timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+struct __attribute__((__packed__)) wal_record {
+    // One registry change in the write-ahead log. op is the request that made it: R carries the whole registration,
+    // T the content and peer name and L only the peer name. checksum covers op and entry so a torn last write is detected
+    char op;
+    struct rpdu entry;
+    uint32_t checksum;
+};
+struct __attribute__((__packed__)) snapshot_header {
+    // Start of a snapshot file, followed by count registrations sorted by content then peer name so the file can be searched
+    // straight from an mmap. Every change made after the snapshot was cut is in WAL segment first_segment or later.
+    // Snapshots are only read back by the host that wrote them so the fields are in host byte order
+    char magic[8];
+    uint64_t count;
+    uint64_t first_segment;
+};
+struct name_table {
+    // Hash table keyed by name. Doubles whenever the load factor passes 1 so chains stay short at any registry size
+    struct name_node **buckets;
+    size_t size;
+    size_t count;
+};
+struct registry_shard {
+    // One slice of a name index with its own lock so workers touching different names do not contend. entries allocates
+    // the content entries of a content shard and the hosted files of a peer shard
+    pthread_rwlock_t lock;
+    struct name_table table;
+    struct slab entries;
+};
+struct __attribute__((__packed__)) message_header {
+    // Header of every control datagram. The client picks request_id and every response to that request echoes it, so a client
+    // can keep many requests outstanding and match replies to them. length counts the payload bytes after the header.
+    // Multi-byte fields are in network byte order
+    unsigned char version;
+    char type;
+    uint32_t request_id;
+    uint16_t length;
+};
+struct __attribute__((__packed__)) message {
+    // One complete request or response. Payloads: R rpdu, S spdu, F fpdu, T "CONTENT_NAME:PEER_NAME", L and H peer name, O opdu (or empty),
+    // Q qpdu, B bpdu. Responses carry a batch_status for B, a source_list for S, a query_reply for Q, a listing_header and entries for O, a reason for E, or nothing for A
+    struct message_header header;
+    char payload[MAX_PAYLOAD_SIZE];
+};
+struct listing_entry {
+    // One registration in the cached listing. offset and length locate its "peer:content\n" line in the listing text
+    char content_name[DEFAULT_NAME_SIZE];
+    char peer_name[DEFAULT_NAME_SIZE];
+    uint32_t offset;
+    uint16_t length;
+};
+struct listing_cache {
+    // Pre-serialized O reply body, sorted by content name then peer name so prefixes and cursors are a binary search away.
+    // Consecutive entries are contiguous in text, so a reply datagram is a single slice of it. Rebuilt only when registry_version moves
+    pthread_rwlock_t lock;
+    uint64_t version;
+    struct listing_entry *entries;
+    size_t count;
+    char *text;
+};
+struct __attribute__((__packed__)) source {
+    // One candidate content server in an S reply
+    char peer_name[DEFAULT_NAME_SIZE];
+    char address[ADDRESS_SIZE];
+    uint16_t in_flight;
+    uint16_t capacity;
+};
+struct __attribute__((__packed__)) source_list {
+    // Payload of an S reply: count holders of the content ranked least loaded first. ticket names the download the server charged
+    // to every listed source. The client hands it back in an F request when the download ends so the charge is released. root is what
+    // the content was registered with, to check it against as it arrives
+    uint32_t ticket;
+    unsigned char count;
+    unsigned char root[HASH_SIZE];
+    struct source sources[MAX_SOURCES];
+};
+struct __attribute__((__packed__)) fpdu {
+    // Payload of an F request reporting that the download behind ticket finished. status is 'A' for success or 'E' for failure
+    uint32_t ticket;
     char status;
-    struct rpdu file_description;
-    struct hosted_file* next;
+};
+struct download_ticket {
+    // An in-flight download charged to each of the peers named in peer_names. Released by an F request or when it expires
+    uint32_t id;
+    time_t expires;
+    char peer_names[MAX_SOURCES][DEFAULT_NAME_SIZE];
+    int peers;
+    int active;
+};
+struct __attribute__((__packed__)) opdu {
+    // Payload of an O request. Lists registrations whose content name starts with prefix, sorted by content then peer name,
+    // beginning after the cursor entry (empty cursor for the first page), at most limit entries (0 for the server's page size)
+    uint32_t limit;
+    char prefix[DEFAULT_NAME_SIZE];
+    char cursor_content[DEFAULT_NAME_SIZE];
+    char cursor_peer[DEFAULT_NAME_SIZE];
+};
+struct __attribute__((__packed__)) qpdu {
+    // Payload of a Q request. Finds content names that start with (mode 'P') or contain (mode 'C') pattern, in name order after
+    // cursor (empty for the first page), at most limit of them (0 for as many as fit in one reply)
+    char mode;
+    unsigned char limit;
+    char pattern[DEFAULT_NAME_SIZE];
+    char cursor[DEFAULT_NAME_SIZE];
+};
+struct __attribute__((__packed__)) name_match {
+    // One content name found by a Q request and how many peers hold it
+    char content_name[DEFAULT_NAME_SIZE];
+    uint16_t holders;
+};
+struct __attribute__((__packed__)) query_reply {
+    // Payload of a Q reply. more is set when further names match, and the last one here is the cursor for the next page
+    unsigned char count;
+    unsigned char more;
+    struct name_match matches[MAX_QUERY_RESULTS];
+};
+struct name_index {
+    // Every distinct content name, sorted, with a trigram index over the table. postings[offsets[g]..offsets[g + 1]) are the
+    // ascending table positions of the names containing a trigram that hashes to g. Rebuilt in the background when names come or go
+    pthread_rwlock_t lock;
+    uint64_t version;
+    char (*names)[DEFAULT_NAME_SIZE];
+    size_t count;
+    uint32_t *offsets;
+    uint32_t *postings;
+};
+struct __attribute__((__packed__)) listing_header {
+    // Start of every O reply payload, followed by entries "peer:content\n". One page is count datagrams and the client has it all once
+    // it has seen every index. more is set when matching entries remain, and the last entry of datagram count-1 is the next cursor
+    uint16_t index;
+    uint16_t count;
+    uint16_t entries;
+    unsigned char more;
+};
+struct __attribute__((__packed__)) listing_reply_head {
+    // Everything in an O reply datagram before the entry text
+    struct message_header header;
+    struct listing_header listing;
+};
+struct __attribute__((__packed__)) stats_page {
+    // Payload of an X request, and start of an X reply followed by the metrics text from offset on. total is the length of the
+    // whole text, so the client asks for what follows until it is all in. Network byte order
+    uint32_t offset;
+    uint32_t total;
+};
+struct worker_stats {
+    // Counters of one worker, only ever written by it and in cache lines of its own, so counting a request is a few plain adds that
+    // never contend. Indexed by request type, see stats_ops. latency is a histogram of how long requests took from arriving to being
+    // answered, bucket b counting those under 2^b microseconds, and latency_ns adds them up. kernel_drops is how many datagrams the
+    // kernel dropped on the worker's socket because it was full, as the socket last reported it
+    uint64_t requests[STATS_OPS];
+    uint64_t errors[STATS_OPS];
+    uint64_t latency[STATS_OPS][STATS_BUCKETS];
+    uint64_t latency_ns[STATS_OPS];
+    uint64_t malformed;
+    uint64_t retransmitted;
+    uint64_t send_failures;
+    uint64_t kernel_drops;
+} __attribute__((aligned(64)));
+struct cached_reply {
+    // The last reply sent to one request. A client that does not hear back sends the same request again with the same request_id,
+    // and gets this instead of having it carried out twice. Keyed by the client's address and port and the request_id
+    struct in_addr host;
+    uint16_t port;
+    uint32_t request_id;
+    time_t sent;
+    size_t size;
+    struct message datagram;
 };
 struct __attribute__((__packed__)) pdu { 
     // Struct for standard datagram 
@@ -50,405 +366,2259 @@ struct __attribute__((__packed__)) spdu {
     char content_name[DEFAULT_NAME_SIZE];
 };
 
-// Making linked list globally available and setting a debug flag to determine whether print statements are shown
+// Making the registry globally available and setting a debug flag to determine whether print statements are shown
+// content_shards map a content name to its holders and peer_shards map a peer name to its files.
+// Lock order for writers is always peer shard then content shard. S and O only take content shard read locks
 int debug = 0;
-struct hosted_file* head = NULL;
+struct registry_shard content_shards[REGISTRY_SHARDS];
+struct registry_shard peer_shards[REGISTRY_SHARDS];
+struct peer_table peers;
+struct endpoint_table endpoints = { .lock = PTHREAD_MUTEX_INITIALIZER };
+size_t registry_size = 0;
+uint64_t registry_version = 0; // bumped on every registry change so cached views know when to rebuild
+struct listing_cache listing;
+uint64_t names_version = 0; // bumped only when a content name appears or disappears, which is all the name index depends on
+struct name_index names;
+// Download tickets live in a ring indexed by id. Ids are handed out in order and all expire after the same timeout,
+// so the oldest live ticket is always at tickets_tail and expiry only ever looks at the front of the ring
+struct download_ticket tickets[MAX_TICKETS];
+uint32_t tickets_head = 1, tickets_tail = 1;
+uint32_t tickets_active = 0; // tickets issued and not yet released, read without the lock by the metrics writer
+uint64_t stale_releases = 0; // releases that would have taken a peer's in_flight below zero, see chargePeer
+pthread_mutex_t tickets_lock = PTHREAD_MUTEX_INITIALIZER;
+// Peers that stop renewing their lease with heartbeats are expired by the wheel. Lock order is peer shard then wheel
+struct timer_wheel lease_wheel;
+int lease_seconds = LEASE_SECONDS;
+// With --state the registry survives restarts: every change is appended to the current WAL segment while holding the shard locks
+// that made it, so the log order is the order changes were applied. A snapshot rotates to a new segment first and then copies
+// the registry, so it holds at least everything in the older segments and they can go. Replaying a newer segment over it is safe
+// since R, T and L only ever set whether a (content, peer) pair is present
+char *state_dir = NULL;
+int wal_fd = -1;
+uint64_t wal_segment = 0, wal_records = 0;
+pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+// While the loader replays the snapshot and the log, S requests the registry cannot answer yet are served straight from the mapped
+// snapshot and changes are refused. recovery_lock keeps the mapping alive while a worker searches it
+int recovering = 0;
+pthread_rwlock_t recovery_lock = PTHREAD_RWLOCK_INITIALIZER;
+struct rpdu *recovery_snapshot = NULL;
+size_t recovery_count = 0, recovery_map_size = 0;
+uint64_t recovery_first_segment = 0, recovery_last_segment = 0;
+// Every single datagram reply is kept in the slot its client and request_id hash to until another one takes it. Workers share it,
+// one lock per REPLY_CACHE_SLOTS / REPLY_CACHE_LOCKS slots. O replies span many datagrams and are not kept, a listing is simply made again
+struct cached_reply reply_cache[REPLY_CACHE_SLOTS];
+pthread_mutex_t reply_cache_locks[REPLY_CACHE_LOCKS];
+// Every worker counts what it serves in a worker_stats of its own. X requests and the --metrics file add them all up
+const char stats_ops[STATS_OPS] = {'R', 'B', 'S', 'F', 'H', 'T', 'O', 'Q', 'L', 'X', '?'};
+struct worker_stats worker_stats[MAX_WORKERS];
+int stats_workers = 0;
+__thread struct worker_stats *my_stats = NULL;
+char *metrics_path = NULL;
 
 
 /* UTILITY FUNCTIONS */
+// LEASES
+void wheelInsert(struct lease_timer *timer)
+{ // Put timer in the slot for its expiry. Caller holds the wheel lock
+    uint64_t expires = timer->expires > lease_wheel.now ? timer->expires : lease_wheel.now + 1;
+    uint64_t delta = expires - lease_wheel.now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1))))
+        level++;
+    if (delta >= (1ULL << (WHEEL_BITS * WHEEL_LEVELS)))
+        expires = lease_wheel.now + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1; // beyond the top level, fire early and get re-armed
+
+    struct lease_timer **slot = &lease_wheel.slots[level][(expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot != NULL)
+        (*slot)->prev = timer;
+    *slot = timer;
+    timer->slot = slot;
+    timer->armed = 1;
+}
+void wheelRemove(struct lease_timer *timer)
+{ // Take timer off whatever slot it is in. Caller holds the wheel lock
+    if (timer->prev != NULL)
+        timer->prev->next = timer->next;
+    else
+        *timer->slot = timer->next;
+    if (timer->next != NULL)
+        timer->next->prev = timer->prev;
+    timer->armed = 0;
+}
+struct lease_timer* wheelAdvance(uint64_t now)
+{ // Move the wheel forward to now and return the timers that came due, unlinked and chained through next. Caller holds the wheel lock
+    struct lease_timer *due = NULL;
+    while (lease_wheel.now < now)
+    {
+        lease_wheel.now++;
+        for (int level = 1; level < WHEEL_LEVELS; level++)
+        { // When a lower level wraps around, the matching slot of the level above is spread back down
+            if ((lease_wheel.now & ((1ULL << (WHEEL_BITS * level)) - 1)) != 0)
+                break;
+            struct lease_timer **slot = &lease_wheel.slots[level][(lease_wheel.now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+            struct lease_timer *timer = *slot;
+            *slot = NULL;
+            while (timer != NULL)
+            {
+                struct lease_timer *next = timer->next;
+                if (timer->expires <= lease_wheel.now)
+                { // due this very tick
+                    timer->armed = 0;
+                    timer->next = due;
+                    due = timer;
+                } else
+                    wheelInsert(timer);
+                timer = next;
+            }
+        }
+        struct lease_timer **slot = &lease_wheel.slots[0][lease_wheel.now & (WHEEL_SLOTS - 1)];
+        while (*slot != NULL)
+        {
+            struct lease_timer *timer = *slot;
+            *slot = timer->next;
+            timer->armed = 0;
+            timer->next = due;
+            due = timer;
+        }
+    }
+    return due;
+}
+void armLease(struct peer_entry *peer)
+{ // Give a new peer its lease timer. Caller holds the peer shard lock. Without memory the peer simply never expires
+    struct lease_timer *timer = (struct lease_timer*)calloc(1, sizeof(struct lease_timer));
+    peer->timer = timer;
+    if (timer == NULL)
+        return;
+    memcpy(timer->peer_name, peer->node.name, DEFAULT_NAME_SIZE);
+    timer->expires = peer->lease_expires;
+    pthread_mutex_lock(&lease_wheel.lock);
+    wheelInsert(timer);
+    pthread_mutex_unlock(&lease_wheel.lock);
+}
+void cancelLease(struct peer_entry *peer)
+{ // The peer is going away. If its timer is still on the wheel free it here, otherwise the expiry thread owns it and frees it
+    if (peer->timer == NULL)
+        return;
+    pthread_mutex_lock(&lease_wheel.lock);
+    if (peer->timer->armed)
+    {
+        wheelRemove(peer->timer);
+        free(peer->timer);
+    }
+    pthread_mutex_unlock(&lease_wheel.lock);
+    peer->timer = NULL;
+}
+
+// WAL
+uint32_t walChecksum(const struct wal_record *record)
+{ // FNV-1a over every byte of the record before the checksum
+    const unsigned char *bytes = (const unsigned char*)record;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(struct wal_record, checksum); i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+void walAppend(char op, const struct rpdu *entry)
+{ // Log one registry change. Callers hold the shard locks of the change. The write lands in the page cache, which survives the
+  // server process dying. Segments are fsynced when a snapshot retires them
+    if (__atomic_load_n(&wal_fd, __ATOMIC_RELAXED) < 0)
+        return;
+    struct wal_record record;
+    record.op = op;
+    record.entry = *entry;
+    record.checksum = walChecksum(&record);
+    pthread_mutex_lock(&wal_lock);
+    if (wal_fd >= 0)
+    {
+        if (write(wal_fd, &record, sizeof(record)) != sizeof(record))
+            perror("Could not append to the write-ahead log");
+        wal_records++;
+    }
+    pthread_mutex_unlock(&wal_lock);
+}
+
+// ALLOCATION
+void* slabAlloc(struct slab *slab)
+{ // A zeroed object from the slab, or NULL if memory ran out
+    void *object = slab->free_list;
+    if (object != NULL)
+        slab->free_list = *(void**)object;
+    else
+    {
+        if (slab->chunk == NULL || slab->chunk_used + slab->object_size > SLAB_CHUNK_BYTES)
+        {
+            if ((slab->chunk = (char*)malloc(SLAB_CHUNK_BYTES)) == NULL)
+                return NULL;
+            slab->chunk_used = 0;
+            slab->chunks++;
+        }
+        object = slab->chunk + slab->chunk_used;
+        slab->chunk_used += slab->object_size;
+    }
+    memset(object, 0, slab->object_size);
+    return object;
+}
+void slabFree(struct slab *slab, void *object)
+{ // Put object back for the next slabAlloc
+    *(void**)object = slab->free_list;
+    slab->free_list = object;
+}
+struct peer_entry* peerAt(uint32_t index)
+{ // The peer in slot index of the peer table
+    return &peers.chunks[index >> PEER_CHUNK_BITS][index & (PEER_CHUNK_SIZE - 1)];
+}
+struct peer_entry* allocPeer()
+{ // A zeroed peer with its index set, or NULL if memory or the index space ran out
+    struct peer_entry *peer = NULL;
+    uint32_t index;
+    pthread_mutex_lock(&peers.lock);
+    if (peers.free_list != NO_PEER)
+    {
+        index = peers.free_list;
+        peers.free_list = peerAt(index)->next_free;
+    } else if ((index = peers.next) >> PEER_CHUNK_BITS < PEER_CHUNKS)
+    {
+        if (peers.chunks[index >> PEER_CHUNK_BITS] == NULL)
+        {
+            struct peer_entry *chunk = (struct peer_entry*)malloc(PEER_CHUNK_SIZE * sizeof(struct peer_entry));
+            if (chunk == NULL)
+                goto unlock;
+            __atomic_store_n(&peers.chunks[index >> PEER_CHUNK_BITS], chunk, __ATOMIC_RELEASE);
+        }
+        peers.next++;
+    } else
+        goto unlock;
+    peer = peerAt(index);
+    memset(peer, 0, sizeof(*peer));
+    peer->index = index;
+unlock:
+    pthread_mutex_unlock(&peers.lock);
+    return peer;
+}
+void freePeer(struct peer_entry *peer)
+{ // Give the peer's slot back for reuse
+    pthread_mutex_lock(&peers.lock);
+    peer->next_free = peers.free_list;
+    peers.free_list = peer->index;
+    pthread_mutex_unlock(&peers.lock);
+}
+int parseAddress(const char *address, struct in6_addr *host, uint16_t *port)
+{ // Split a registered "ip:port" or "[ipv6]:port" into its binary parts, either of which may be NULL to only check it. An IPv4 host
+  // comes back mapped into IPv6. Returns 0 if it is neither
+    char text[ADDRESS_SIZE + 1];
+    memcpy(text, address, ADDRESS_SIZE);
+    text[ADDRESS_SIZE] = '\0';
+    char *separator = strrchr(text, ':'), *start = text;
+    if (separator == NULL)
+        return 0;
+    *separator = '\0';
+    int number = atoi(separator + 1);
+    struct in6_addr parsed;
+    struct in_addr ipv4;
+    if (text[0] == '[' && separator > text + 1 && separator[-1] == ']')
+    { // IPv6 hosts are bracketed so their colons are not taken for the port's
+        separator[-1] = '\0';
+        start++;
+    }
+    if (number <= 0 || number > 65535)
+        return 0;
+    if (start == text && inet_pton(AF_INET, text, &ipv4) == 1)
+    {
+        bzero(&parsed, sizeof(parsed));
+        parsed.s6_addr[10] = parsed.s6_addr[11] = 0xff;
+        memcpy(&parsed.s6_addr[12], &ipv4, sizeof(ipv4));
+    } else if (start == text || inet_pton(AF_INET6, start, &parsed) != 1)
+        return 0;
+    if (host != NULL)
+        *host = parsed;
+    if (port != NULL)
+        *port = number;
+    return 1;
+}
+int isZeroHash(const unsigned char *hash)
+{ // All zeros, how a peer without piece hashes registers
+    for (int i = 0; i < HASH_SIZE; i++)
+        if (hash[i] != 0)
+            return 0;
+    return 1;
+}
+
+// REGISTRY
+unsigned int hashName(const char *name)
+{ // FNV-1a over the name. Names are at most DEFAULT_NAME_SIZE bytes and may not be null terminated when they fill the field
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < DEFAULT_NAME_SIZE && name[i] != '\0'; i++)
+    {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+struct registry_shard* shardFor(struct registry_shard *shards, unsigned int hash)
+{ // Shards are picked with the top bits of the hash since the bucket index inside a table uses the bottom bits
+    return &shards[hash >> (32 - REGISTRY_SHARD_BITS)];
+}
+struct name_node* tableFind(struct name_table *table, const char *name)
+{ // Return the node stored under name or NULL
+    if (table->size == 0)
+        return NULL;
+    unsigned int hash = hashName(name);
+    struct name_node *n = table->buckets[hash & (table->size - 1)];
+    while (n != NULL)
+    {
+        if (n->hash == hash && strncmp(n->name, name, DEFAULT_NAME_SIZE) == 0)
+            return n;
+        n = n->next;
+    }
+    return NULL;
+}
+int tableGrow(struct name_table *table)
+{ // Double the bucket array and rehash every node into it. Returns 0 if the new array could not be allocated
+    size_t new_size = table->size == 0 ? INITIAL_TABLE_SIZE : table->size * 2;
+    struct name_node **buckets = (struct name_node**)calloc(new_size, sizeof(struct name_node*));
+    if (buckets == NULL)
+        return 0;
+
+    for (size_t i = 0; i < table->size; i++)
+    {
+        struct name_node *n = table->buckets[i];
+        while (n != NULL)
+        {
+            struct name_node *next = n->next;
+            n->next = buckets[n->hash & (new_size - 1)];
+            buckets[n->hash & (new_size - 1)] = n;
+            n = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->size = new_size;
+    return 1;
+}
+int tableInsert(struct name_table *table, struct name_node *node, const char *name)
+{ // Store node under name. The caller has already checked that the name is not in the table
+    if (table->count >= table->size && !tableGrow(table) && table->size == 0)
+        return 0;
+    bzero(node->name, DEFAULT_NAME_SIZE);
+    strncpy(node->name, name, DEFAULT_NAME_SIZE);
+    node->hash = hashName(name);
+    node->next = table->buckets[node->hash & (table->size - 1)];
+    table->buckets[node->hash & (table->size - 1)] = node;
+    table->count++;
+    return 1;
+}
+void tableRemove(struct name_table *table, struct name_node *node)
+{ // Unlink node from its bucket chain. It does not free the node
+    struct name_node **n = &table->buckets[node->hash & (table->size - 1)];
+    while (*n != node)
+        n = &(*n)->next;
+    *n = node->next;
+    table->count--;
+}
+void initRegistry()
+{ // Set up the shard locks. Must run before any worker starts
+    for (int i = 0; i < REGISTRY_SHARDS; i++)
+    {
+        pthread_rwlock_init(&content_shards[i].lock, NULL);
+        pthread_rwlock_init(&peer_shards[i].lock, NULL);
+        content_shards[i].entries.object_size = sizeof(struct content_entry);
+        peer_shards[i].entries.object_size = sizeof(struct hosted_file);
+    }
+    pthread_mutex_init(&peers.lock, NULL);
+    peers.free_list = NO_PEER;
+    pthread_rwlock_init(&listing.lock, NULL);
+    pthread_rwlock_init(&names.lock, NULL);
+    names.version = (uint64_t)-1;
+    pthread_mutex_init(&lease_wheel.lock, NULL);
+    lease_wheel.now = time(NULL);
+    listing.version = (uint64_t)-1; // stale until the first O request builds it
+}
+struct hosted_file* findHolder(struct content_entry *content, uint32_t peer)
+{ // Return the registration of this content by the peer with index peer or NULL. Caller holds the content shard lock
+    struct hosted_file *n = content->holders_head;
+    while (n != NULL)
+    {
+        if (n->peer == peer)
+            return n;
+        n = n->next_holder;
+    }
+    return NULL;
+}
+void unlinkHolder(struct hosted_file *file)
+{ // Take a registration off its content's holder list and drop the content once nobody holds it. Caller holds the content shard lock
+    struct content_entry *content = file->content;
+    if (file->prev_holder != NULL)
+        file->prev_holder->next_holder = file->next_holder;
+    else
+        content->holders_head = file->next_holder;
+    if (file->next_holder != NULL)
+        file->next_holder->prev_holder = file->prev_holder;
+    if (--content->holders == 0)
+    {
+        struct registry_shard *content_shard = shardFor(content_shards, content->node.hash);
+        tableRemove(&content_shard->table, &content->node);
+        __atomic_add_fetch(&names_version, 1, __ATOMIC_RELEASE);
+        slabFree(&content_shard->entries, content);
+    }
+}
+void unlinkFromPeer(struct hosted_file *file)
+{ // Take a registration off its peer's file list and drop the peer once it has no files. Caller holds the peer shard lock
+    struct peer_entry *peer = peerAt(file->peer);
+    if (file->prev_of_peer != NULL)
+        file->prev_of_peer->next_of_peer = file->next_of_peer;
+    else
+        peer->files_head = file->next_of_peer;
+    if (file->next_of_peer != NULL)
+        file->next_of_peer->prev_of_peer = file->prev_of_peer;
+    if (--peer->files == 0)
+    {
+        tableRemove(&shardFor(peer_shards, peer->node.hash)->table, &peer->node);
+        cancelLease(peer);
+        freePeer(peer);
+    }
+}
+struct endpoint *internEndpoint(const struct in6_addr *host, uint16_t port)
+{ // The one endpoint for host and port, created the first time it is seen. Returns NULL if memory ran out
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < sizeof(host->s6_addr); i++)
+        hash = (hash ^ host->s6_addr[i]) * 16777619u;
+    hash = (hash ^ port) * 16777619u;
+    pthread_mutex_lock(&endpoints.lock);
+    struct endpoint **bucket = &endpoints.buckets[hash % ENDPOINT_BUCKETS], *endpoint;
+    for (endpoint = *bucket; endpoint != NULL; endpoint = endpoint->next)
+        if (endpoint->port == port && memcmp(&endpoint->host, host, sizeof(*host)) == 0)
+            goto unlock;
+    if ((endpoint = (struct endpoint*)calloc(1, sizeof(struct endpoint))) == NULL)
+        goto unlock;
+    endpoint->host = *host;
+    endpoint->port = port;
+    char text[INET6_ADDRSTRLEN];
+    if (IN6_IS_ADDR_V4MAPPED(host))
+    {
+        inet_ntop(AF_INET, &host->s6_addr[12], text, sizeof(text));
+        snprintf(endpoint->text, ADDRESS_SIZE, "%s:%u", text, (unsigned int)port);
+    } else
+    {
+        inet_ntop(AF_INET6, host, text, sizeof(text));
+        snprintf(endpoint->text, ADDRESS_SIZE, "[%s]:%u", text, (unsigned int)port);
+    }
+    endpoint->next = *bucket;
+    *bucket = endpoint;
+unlock:
+    pthread_mutex_unlock(&endpoints.lock);
+    return endpoint;
+}
+void formatAddress(struct hosted_file *file, char address[ADDRESS_SIZE])
+{ // The address a file is served on, from its peer's endpoint
+    struct endpoint *endpoint = __atomic_load_n(&peerAt(file->peer)->endpoint, __ATOMIC_ACQUIRE);
+    bzero(address, ADDRESS_SIZE);
+    if (endpoint != NULL)
+        memcpy(address, endpoint->text, ADDRESS_SIZE);
+}
+void describeFile(struct hosted_file *file, struct rpdu *description)
+{ // Rebuild the registration a file came from, for the snapshot. Caller holds a lock on the file's content shard
+    struct peer_entry *peer = peerAt(file->peer);
+    bzero(description, sizeof(*description));
+    description->type = 'R';
+    memcpy(description->peer_name, peer->node.name, DEFAULT_NAME_SIZE);
+    memcpy(description->content_name, file->content->node.name, DEFAULT_NAME_SIZE);
+    formatAddress(file, description->address);
+    description->capacity = htons(peer->capacity);
+    memcpy(description->root, file->content->root, HASH_SIZE);
+}
+struct hosted_file* addHostedFile(struct rpdu *description, int *duplicate)
+{ // Insert a new registration, creating the content and peer entries if this is their first file. Returns NULL and sets duplicate
+  // to 1 if the peer already registered this content or to 2 if its root differs from the one the content has, or NULL alone if
+  // memory ran out or the address is not "ip:port" or "[ipv6]:port". Registering a file again from another address moves the peer
+  // there and sets duplicate to 3 instead, which is how a peer whose interfaces changed tells us.
+  // Writers always lock the peer shard before the content shard
+    struct registry_shard *peer_shard = shardFor(peer_shards, hashName(description->peer_name));
+    struct registry_shard *content_shard = shardFor(content_shards, hashName(description->content_name));
+    struct hosted_file *file = NULL;
+    struct in6_addr host;
+    uint16_t port;
+    *duplicate = 0;
+    struct endpoint *endpoint;
+    if (!parseAddress(description->address, &host, &port) || (endpoint = internEndpoint(&host, port)) == NULL)
+        return NULL;
+
+    pthread_rwlock_wrlock(&peer_shard->lock);
+    pthread_rwlock_wrlock(&content_shard->lock);
+    struct content_entry *content = (struct content_entry*)tableFind(&content_shard->table, description->content_name);
+    struct peer_entry *peer = (struct peer_entry*)tableFind(&peer_shard->table, description->peer_name);
+    if (content != NULL && peer != NULL && findHolder(content, peer->index) != NULL)
+    {
+        *duplicate = 1;
+        if (peer->endpoint != endpoint)
+        { // logged like any registration so a replay moves it too
+            *duplicate = 3;
+            __atomic_store_n(&peer->endpoint, endpoint, __ATOMIC_RELEASE);
+            walAppend('R', description);
+        }
+        goto unlock;
+    }
+    if (content != NULL && !isZeroHash(content->root) && !isZeroHash(description->root) &&
+        memcmp(content->root, description->root, HASH_SIZE) != 0)
+    { // a different file under a name that is taken
+        *duplicate = 2;
+        goto unlock;
+    }
+    if ((file = (struct hosted_file*)slabAlloc(&peer_shard->entries)) == NULL)
+        goto unlock;
+
+    if (content == NULL)
+    {
+        content = (struct content_entry*)slabAlloc(&content_shard->entries);
+        if (content == NULL || !tableInsert(&content_shard->table, &content->node, description->content_name))
+        {
+            if (content != NULL)
+                slabFree(&content_shard->entries, content);
+            slabFree(&peer_shard->entries, file);
+            file = NULL;
+            goto unlock;
+        }
+        __atomic_add_fetch(&names_version, 1, __ATOMIC_RELEASE);
+    }
+    if (peer == NULL)
+    {
+        peer = allocPeer();
+        if (peer == NULL || !tableInsert(&peer_shard->table, &peer->node, description->peer_name))
+        {
+            if (peer != NULL)
+                freePeer(peer);
+            slabFree(&peer_shard->entries, file);
+            file = NULL;
+            if (content->holders == 0)
+            {
+                tableRemove(&content_shard->table, &content->node);
+                slabFree(&content_shard->entries, content);
+            }
+            goto unlock;
+        }
+        peer->lease_expires = time(NULL) + lease_seconds;
+        armLease(peer);
+    }
+
+    file->content = content;
+    file->peer = peer->index;
+    if (isZeroHash(content->root))
+        memcpy(content->root, description->root, HASH_SIZE);
+    // A peer serves everything from one listener, so the address of its latest registration applies to all of its files
+    __atomic_store_n(&peer->endpoint, endpoint, __ATOMIC_RELEASE);
+    // The latest registration's advertised capacity wins. Peers that do not say get a single slot
+    peer->capacity = ntohs(description->capacity) > 0 ? ntohs(description->capacity) : 1;
+    // Registering counts as a heartbeat
+    __atomic_store_n(&peer->lease_expires, time(NULL) + lease_seconds, __ATOMIC_RELAXED);
+
+    // Newest registrations go first, which is the order the old linked list recommended content servers in
+    file->next_holder = content->holders_head;
+    if (content->holders_head != NULL)
+        content->holders_head->prev_holder = file;
+    content->holders_head = file;
+    content->holders++;
+
+    file->next_of_peer = peer->files_head;
+    if (peer->files_head != NULL)
+        peer->files_head->prev_of_peer = file;
+    peer->files_head = file;
+    peer->files++;
+
+    walAppend('R', description);
+    __atomic_add_fetch(&registry_size, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&registry_version, 1, __ATOMIC_RELEASE);
+unlock:
+    pthread_rwlock_unlock(&content_shard->lock);
+    pthread_rwlock_unlock(&peer_shard->lock);
+    return file;
+}
+int removeHostedFile(const char *content_name, const char *peer_name)
+{ // Remove the registration of content_name by peer_name. Returns 1 if it existed
+    struct registry_shard *peer_shard = shardFor(peer_shards, hashName(peer_name));
+    struct registry_shard *content_shard = shardFor(content_shards, hashName(content_name));
+    struct hosted_file *file = NULL;
+
+    pthread_rwlock_wrlock(&peer_shard->lock);
+    pthread_rwlock_wrlock(&content_shard->lock);
+    struct content_entry *content = (struct content_entry*)tableFind(&content_shard->table, content_name);
+    struct peer_entry *peer = (struct peer_entry*)tableFind(&peer_shard->table, peer_name);
+    if (content != NULL && peer != NULL && (file = findHolder(content, peer->index)) != NULL)
+    {
+        struct rpdu removed;
+        bzero(&removed, sizeof(removed));
+        memcpy(removed.content_name, content->node.name, DEFAULT_NAME_SIZE);
+        memcpy(removed.peer_name, peer->node.name, DEFAULT_NAME_SIZE);
+        walAppend('T', &removed);
+        unlinkHolder(file);
+        unlinkFromPeer(file);
+        slabFree(&peer_shard->entries, file);
+        __atomic_sub_fetch(&registry_size, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&registry_version, 1, __ATOMIC_RELEASE);
+    }
+    pthread_rwlock_unlock(&content_shard->lock);
+    pthread_rwlock_unlock(&peer_shard->lock);
+    return file != NULL;
+}
+int removePeerEntry(struct peer_entry *peer)
+{ // Remove every registration of peer, which frees the peer entry too. Caller holds the peer shard write lock.
+  // Each content shard is only held while its holder list is being edited so S requests keep flowing during a large leave
+    int files = peer->files, removed;
+    struct registry_shard *peer_shard = shardFor(peer_shards, peer->node.hash);
+    struct rpdu leaving;
+    bzero(&leaving, sizeof(leaving));
+    memcpy(leaving.peer_name, peer->node.name, DEFAULT_NAME_SIZE);
+    walAppend('L', &leaving);
+    for (removed = 0; removed < files; removed++) // the last removal frees the peer entry itself
+    {
+        struct hosted_file *file = peer->files_head;
+        struct registry_shard *content_shard = shardFor(content_shards, file->content->node.hash);
+        pthread_rwlock_wrlock(&content_shard->lock);
+        unlinkHolder(file);
+        pthread_rwlock_unlock(&content_shard->lock);
+        unlinkFromPeer(file);
+        slabFree(&peer_shard->entries, file);
+    }
+    __atomic_sub_fetch(&registry_size, removed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&registry_version, 1, __ATOMIC_RELEASE);
+    return removed;
+}
+int removePeerFiles(const char *peer_name)
+{ // Remove every registration of peer_name. Costs O(files of the peer) and returns how many were removed
+    struct registry_shard *peer_shard = shardFor(peer_shards, hashName(peer_name));
+    int removed = 0;
+
+    pthread_rwlock_wrlock(&peer_shard->lock);
+    struct peer_entry *peer = (struct peer_entry*)tableFind(&peer_shard->table, peer_name);
+    if (peer != NULL)
+        removed = removePeerEntry(peer);
+    pthread_rwlock_unlock(&peer_shard->lock);
+    return removed;
+}
+int renewLease(const char *peer_name)
+{ // Heartbeat. Pushing lease_expires forward is all it takes: the wheel timer notices the new expiry when it fires and re-arms itself.
+  // Returns 0 if the peer is not registered (it expired, or the server restarted)
+    struct registry_shard *peer_shard = shardFor(peer_shards, hashName(peer_name));
+    pthread_rwlock_rdlock(&peer_shard->lock);
+    struct peer_entry *peer = (struct peer_entry*)tableFind(&peer_shard->table, peer_name);
+    if (peer != NULL)
+        __atomic_store_n(&peer->lease_expires, time(NULL) + lease_seconds, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&peer_shard->lock);
+    return peer != NULL;
+}
+void expireLease(struct lease_timer *timer, time_t now)
+{ // A lease timer came due. Either the peer renewed in the meantime and the timer goes back on the wheel, or the peer is dropped
+    struct registry_shard *peer_shard = shardFor(peer_shards, hashName(timer->peer_name));
+    char peer_name[DEFAULT_NAME_SIZE];
+    int removed = -1;
+    memcpy(peer_name, timer->peer_name, DEFAULT_NAME_SIZE);
+
+    pthread_rwlock_wrlock(&peer_shard->lock);
+    struct peer_entry *peer = (struct peer_entry*)tableFind(&peer_shard->table, timer->peer_name);
+    if (peer == NULL || peer->timer != timer)
+    { // The peer left (or left and came back with a new timer) after this one was taken off the wheel
+        free(timer);
+    } else if (__atomic_load_n(&peer->lease_expires, __ATOMIC_RELAXED) > now)
+    {
+        timer->expires = peer->lease_expires;
+        pthread_mutex_lock(&lease_wheel.lock);
+        wheelInsert(timer);
+        pthread_mutex_unlock(&lease_wheel.lock);
+    } else
+    {
+        peer->timer = NULL;
+        free(timer);
+        removed = removePeerEntry(peer);
+    }
+    pthread_rwlock_unlock(&peer_shard->lock);
+    if (removed >= 0)
+        printf("Lease of %.*s expired, %d files removed...\n", DEFAULT_NAME_SIZE, peer_name, removed);
+}
+void* leaseExpiryLoop(void *arg)
+{ // Ticks the lease wheel once a second. The work per tick depends on how many leases are due, not on how big the registry is
+    while (1)
+    {
+        sleep(1);
+        time_t now = time(NULL);
+        pthread_mutex_lock(&lease_wheel.lock);
+        struct lease_timer *due = wheelAdvance(now);
+        pthread_mutex_unlock(&lease_wheel.lock);
+        while (due != NULL)
+        {
+            struct lease_timer *next = due->next;
+            expireLease(due, now);
+            due = next;
+        }
+    }
+    return NULL;
+}
+
+// SNAPSHOTS
+void statePath(char *path, size_t size, const char *name, uint64_t segment)
+{ // Path of a file in the state directory. WAL segments are numbered, the snapshot files are not
+    if (segment > 0)
+        snprintf(path, size, "%s/%s.%08llu", state_dir, name, (unsigned long long)segment);
+    else
+        snprintf(path, size, "%s/%s", state_dir, name);
+}
+int writeAll(int fd, const void *data, size_t length)
+{ // write() until everything is out. Returns 0 on error
+    const char *bytes = (const char*)data;
+    while (length > 0)
+    {
+        ssize_t n = write(fd, bytes, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        bytes += n;
+        length -= n;
+    }
+    return 1;
+}
+int compareRegistrations(const void *a, const void *b)
+{ // Snapshot order: content name then peer name
+    const struct rpdu *x = (const struct rpdu*)a, *y = (const struct rpdu*)b;
+    int c = strncmp(x->content_name, y->content_name, DEFAULT_NAME_SIZE);
+    return c != 0 ? c : strncmp(x->peer_name, y->peer_name, DEFAULT_NAME_SIZE);
+}
+int openWalSegment(uint64_t segment)
+{ // Start logging into a fresh segment and close the previous one. Returns 0 if the segment could not be created
+    char path[PATH_MAX];
+    statePath(path, sizeof(path), "wal", segment);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        perror("Could not open the write-ahead log");
+        return 0;
+    }
+    pthread_mutex_lock(&wal_lock);
+    int old_fd = wal_fd;
+    __atomic_store_n(&wal_fd, fd, __ATOMIC_RELAXED);
+    wal_segment = segment;
+    wal_records = 0;
+    pthread_mutex_unlock(&wal_lock);
+    if (old_fd >= 0)
+    { // Any write to it finished under wal_lock above
+        fsync(old_fd);
+        close(old_fd);
+    }
+    return 1;
+}
+int takeSnapshot()
+{ // Cut a snapshot. The log moves to a new segment first so everything in the older ones is already in the registry we copy.
+  // The file is written next to the old snapshot and renamed over it, so a crash at any point leaves a snapshot the segments still cover
+    uint64_t first_segment = wal_segment + 1;
+    if (!openWalSegment(first_segment))
+        return 0;
+
+    size_t capacity = __atomic_load_n(&registry_size, __ATOMIC_RELAXED) + 64, count = 0;
+    struct rpdu *entries = (struct rpdu*)malloc(capacity * sizeof(struct rpdu));
+    if (entries == NULL)
+        return 0;
+    for (int s = 0; s < REGISTRY_SHARDS; s++)
+    {
+        pthread_rwlock_rdlock(&content_shards[s].lock);
+        for (size_t i = 0; i < content_shards[s].table.size; i++)
+        {
+            struct content_entry *c = (struct content_entry*)content_shards[s].table.buckets[i];
+            for (; c != NULL; c = (struct content_entry*)c->node.next)
+            {
+                for (struct hosted_file *n = c->holders_head; n != NULL; n = n->next_holder)
+                {
+                    if (count == capacity)
+                    { // the registry grew while we were walking it
+                        struct rpdu *bigger = (struct rpdu*)realloc(entries, 2 * capacity * sizeof(struct rpdu));
+                        if (bigger == NULL)
+                        {
+                            pthread_rwlock_unlock(&content_shards[s].lock);
+                            free(entries);
+                            return 0;
+                        }
+                        entries = bigger;
+                        capacity *= 2;
+                    }
+                    describeFile(n, &entries[count++]);
+                }
+            }
+        }
+        pthread_rwlock_unlock(&content_shards[s].lock);
+    }
+    qsort(entries, count, sizeof(struct rpdu), compareRegistrations);
+
+    char path[PATH_MAX], temporary[PATH_MAX];
+    statePath(path, sizeof(path), "snapshot", 0);
+    statePath(temporary, sizeof(temporary), "snapshot.tmp", 0);
+    struct snapshot_header header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.count = count;
+    header.first_segment = first_segment;
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int written = fd >= 0 && writeAll(fd, &header, sizeof(header)) && writeAll(fd, entries, count * sizeof(struct rpdu)) && fsync(fd) == 0;
+    free(entries);
+    if (fd >= 0)
+        close(fd);
+    if (!written || rename(temporary, path) < 0)
+    {
+        perror("Could not write the snapshot");
+        unlink(temporary);
+        return 0;
+    }
+    if ((fd = open(state_dir, O_RDONLY)) >= 0)
+    { // make the rename itself durable
+        fsync(fd);
+        close(fd);
+    }
+
+    for (uint64_t segment = recovery_first_segment; segment < first_segment; segment++)
+    { // Retired segments. Gaps are fine, unlink just fails
+        statePath(path, sizeof(path), "wal", segment);
+        unlink(path);
+    }
+    recovery_first_segment = first_segment;
+    if (debug)
+        printf("Snapshot of %zu registrations written, log continues in segment %llu\n", count, (unsigned long long)first_segment);
+    return 1;
+}
+int openState()
+{ // Find the snapshot and log segments in state_dir and map the snapshot so S requests can be answered before the loader is done.
+  // Sets recovering. Returns 0 if the directory cannot be used
+    char path[PATH_MAX];
+    if (mkdir(state_dir, 0755) < 0 && errno != EEXIST)
+    {
+        perror("Could not create the state directory");
+        return 0;
+    }
+    DIR *dir = opendir(state_dir);
+    if (dir == NULL)
+    {
+        perror("Could not open the state directory");
+        return 0;
+    }
+    struct dirent *file;
+    uint64_t first = 0, last = 0;
+    while ((file = readdir(dir)) != NULL)
+    {
+        unsigned long long segment;
+        if (sscanf(file->d_name, "wal.%llu", &segment) == 1 && segment > 0)
+        {
+            if (first == 0 || segment < first)
+                first = segment;
+            if (segment > last)
+                last = segment;
+        }
+    }
+    closedir(dir);
+
+    statePath(path, sizeof(path), "snapshot", 0);
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(struct snapshot_header))
+    {
+        void *map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        struct snapshot_header *header = (struct snapshot_header*)map;
+        if (map == MAP_FAILED)
+            perror("Could not map the snapshot");
+        else if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+            (size_t)info.st_size != sizeof(*header) + header->count * sizeof(struct rpdu))
+        {
+            printf("Ignoring the damaged snapshot %s...\n", path);
+            munmap(map, info.st_size);
+        } else
+        {
+            recovery_snapshot = (struct rpdu*)(header + 1);
+            recovery_count = header->count;
+            recovery_map_size = info.st_size;
+            first = header->first_segment;
+        }
+    }
+    if (fd >= 0)
+        close(fd); // the mapping stays valid
+    recovery_first_segment = first;
+    recovery_last_segment = last;
+    wal_segment = last;
+    __atomic_store_n(&recovering, 1, __ATOMIC_RELEASE);
+    return 1;
+}
+int replaySegment(uint64_t segment)
+{ // Apply one log segment to the registry. Stops at the first torn or corrupt record, which can only be the tail of the newest segment
+    char path[PATH_MAX];
+    statePath(path, sizeof(path), "wal", segment);
+    FILE *log = fopen(path, "rb");
+    if (log == NULL)
+        return 0;
+    struct wal_record record;
+    int applied = 0, duplicate;
+    while (fread(&record, sizeof(record), 1, log) == 1)
+    {
+        if (record.checksum != walChecksum(&record))
+        {
+            printf("Write-ahead log %s is damaged after %d records, ignoring the rest...\n", path, applied);
+            break;
+        }
+        if (record.op == 'R')
+            addHostedFile(&record.entry, &duplicate);
+        else if (record.op == 'T')
+            removeHostedFile(record.entry.content_name, record.entry.peer_name);
+        else if (record.op == 'L')
+            removePeerFiles(record.entry.peer_name);
+        applied++;
+    }
+    fclose(log);
+    return applied;
+}
+void loadState()
+{ // Rebuild the registry from the mapped snapshot and the log, then start logging and take changes again. Nothing is logged while
+  // loading since wal_fd is still closed. Every recovered peer gets a full lease to send its next heartbeat
+    struct rpdu entry;
+    int duplicate;
+    size_t replayed = 0;
+    for (size_t i = 0; i < recovery_count; i++)
+    {
+        entry = recovery_snapshot[i];
+        addHostedFile(&entry, &duplicate);
+    }
+    for (uint64_t segment = recovery_first_segment; segment != 0 && segment <= recovery_last_segment; segment++)
+        replayed += replaySegment(segment);
+    // Never append after a record that may be torn
+    if (!openWalSegment(recovery_last_segment + 1))
+        printf("Changes will not be saved...\n");
+    if (recovery_first_segment == 0)
+        recovery_first_segment = recovery_last_segment + 1;
+    __atomic_store_n(&recovering, 0, __ATOMIC_RELEASE);
+
+    pthread_rwlock_wrlock(&recovery_lock);
+    if (recovery_snapshot != NULL)
+        munmap((struct snapshot_header*)recovery_snapshot - 1, recovery_map_size);
+    recovery_snapshot = NULL;
+    pthread_rwlock_unlock(&recovery_lock);
+    printf("Recovered %zu registrations from the snapshot and %zu logged changes...\n", recovery_count, replayed);
+}
+int findSnapshotSources(struct spdu *packet, struct source_list *list)
+{ // S during recovery for content the registry does not have yet. The holders are a binary search away in the snapshot.
+  // Load is unknown so they come back unranked and no download is charged
+    int count = 0;
+    bzero(list->root, HASH_SIZE);
+    pthread_rwlock_rdlock(&recovery_lock);
+    if (recovery_snapshot != NULL)
+    {
+        size_t low = 0, high = recovery_count;
+        while (low < high)
+        {
+            size_t mid = (low + high) / 2;
+            if (strncmp(recovery_snapshot[mid].content_name, packet->content_name, DEFAULT_NAME_SIZE) < 0)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        for (; low < recovery_count && count < MAX_SOURCES &&
+            strncmp(recovery_snapshot[low].content_name, packet->content_name, DEFAULT_NAME_SIZE) == 0; low++)
+        {
+            struct source *source = &list->sources[count++];
+            memcpy(source->peer_name, recovery_snapshot[low].peer_name, DEFAULT_NAME_SIZE);
+            memcpy(source->address, recovery_snapshot[low].address, sizeof(source->address));
+            source->in_flight = 0;
+            source->capacity = recovery_snapshot[low].capacity; // both in network order
+            memcpy(list->root, recovery_snapshot[low].root, HASH_SIZE);
+        }
+    }
+    pthread_rwlock_unlock(&recovery_lock);
+    list->count = count;
+    list->ticket = 0;
+    return count;
+}
+void* stateLoop(void *arg)
+{ // Recover, then snapshot whenever the log has grown by SNAPSHOT_WAL_RECORDS or has had changes for SNAPSHOT_INTERVAL seconds
+    loadState();
+    time_t last_snapshot = time(NULL);
+    while (1)
+    {
+        sleep(1);
+        uint64_t records = __atomic_load_n(&wal_records, __ATOMIC_RELAXED);
+        if (records >= SNAPSHOT_WAL_RECORDS || (records > 0 && time(NULL) - last_snapshot >= SNAPSHOT_INTERVAL))
+        {
+            if (!takeSnapshot())
+                printf("Snapshot failed, the log keeps growing until the next one...\n");
+            last_snapshot = time(NULL);
+        }
+    }
+    return NULL;
+}
+
 // MISC
-void localFilePrint(struct hosted_file * n)
-{ // print the remaining files in the linked list after removing orphans
-    if (n == NULL)
+void localFilePrint()
+{ // print the remaining files in the registry after removing orphans
+    if (__atomic_load_n(&registry_size, __ATOMIC_RELAXED) == 0)
     {
         printf("PEER:     CONTENT:     ADDRESS: \n");
         return;
     }
-    while (n != NULL)
+    for (int s = 0; s < REGISTRY_SHARDS; s++)
+    {
+        pthread_rwlock_rdlock(&content_shards[s].lock);
+        for (size_t i = 0; i < content_shards[s].table.size; i++)
+        {
+            struct content_entry *c = (struct content_entry*)content_shards[s].table.buckets[i];
+            for (; c != NULL; c = (struct content_entry*)c->node.next)
+            {
+                struct hosted_file *n = c->holders_head;
+                while (n != NULL)
+                {
+                    char address[ADDRESS_SIZE];
+                    formatAddress(n, address);
+                    printf("PEER: %.*s    CONTENT: %.*s    ADDRESS: %s\n", DEFAULT_NAME_SIZE, peerAt(n->peer)->node.name, DEFAULT_NAME_SIZE, c->node.name, address);
+                    n = n->next_holder;
+                }
+            }
+        }
+        pthread_rwlock_unlock(&content_shards[s].lock);
+    }
+}
+
+// STATS
+uint64_t nowNanoseconds()
+{ // Monotonic clock in nanoseconds
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+void addStat(uint64_t *counter, uint64_t amount)
+{ // Add to a counter only this thread writes. No locked instruction is needed, the store is only atomic so readers never see it torn
+    __atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
+int statsOp(char type)
+{ // Where requests of type are counted. Unknown types share the last slot
+    const char *op = memchr(stats_ops, type, STATS_OPS - 1);
+    return op != NULL ? op - stats_ops : STATS_OPS - 1;
+}
+void countRequest(char type, uint64_t started)
+{ // A request of type that arrived at started was answered
+    if (my_stats == NULL)
+        return;
+    int op = statsOp(type);
+    uint64_t us = (nowNanoseconds() - started) / 1000;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    addStat(&my_stats->requests[op], 1);
+    addStat(&my_stats->latency[op][bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1], 1);
+    addStat(&my_stats->latency_ns[op], us * 1000);
+}
+uint64_t sumStat(size_t offset)
+{ // A counter added up over every worker. offset is where it sits in struct worker_stats
+    uint64_t sum = 0;
+    int workers = __atomic_load_n(&stats_workers, __ATOMIC_RELAXED);
+    for (int i = 0; i < workers && i < MAX_WORKERS; i++)
+        sum += __atomic_load_n((uint64_t*)((char*)&worker_stats[i] + offset), __ATOMIC_RELAXED);
+    return sum;
+}
+void writePeerEntries(FILE *out, int limit)
+{ // How many files each peer has registered, only the limit peers with the most unless limit is 0. Also counts the peers
+    struct peer_entry top[STATS_TOP_PEERS];
+    int kept = 0;
+    uint64_t count = 0;
+    if (limit > STATS_TOP_PEERS)
+        limit = STATS_TOP_PEERS;
+    fprintf(out, "# HELP p2p_index_peer_registrations Files registered by a peer%s\n", limit > 0 ? ", the peers with the most only" : "");
+    fprintf(out, "# TYPE p2p_index_peer_registrations gauge\n");
+    for (int s = 0; s < REGISTRY_SHARDS; s++)
+    {
+        pthread_rwlock_rdlock(&peer_shards[s].lock);
+        for (size_t i = 0; i < peer_shards[s].table.size; i++)
+            for (struct peer_entry *p = (struct peer_entry*)peer_shards[s].table.buckets[i]; p != NULL; p = (struct peer_entry*)p->node.next)
+            {
+                count++;
+                if (limit == 0)
+                {
+                    fprintf(out, "p2p_index_peer_registrations{peer=\"%.*s\"} %d\n", DEFAULT_NAME_SIZE, p->node.name, p->files);
+                    continue;
+                }
+                int at = kept < limit ? kept++ : limit;
+                while (at > 0 && top[at - 1].files < p->files)
+                { // kept sorted by files, most first, the last one drops off
+                    if (at < limit)
+                        top[at] = top[at - 1];
+                    at--;
+                }
+                if (at < limit)
+                    top[at] = *p;
+            }
+        pthread_rwlock_unlock(&peer_shards[s].lock);
+    }
+    for (int i = 0; i < kept; i++)
+        fprintf(out, "p2p_index_peer_registrations{peer=\"%.*s\"} %d\n", DEFAULT_NAME_SIZE, top[i].node.name, top[i].files);
+    fprintf(out, "# TYPE p2p_index_peers gauge\np2p_index_peers %llu\n", (unsigned long long)count);
+}
+void writeServerMetrics(FILE *out, int peer_limit)
+{ // Every counter in the Prometheus text format. peer_limit is passed on to writePeerEntries
+    fprintf(out, "# HELP p2p_index_requests_total Requests answered, by type\n# TYPE p2p_index_requests_total counter\n");
+    for (int op = 0; op < STATS_OPS; op++)
+        fprintf(out, "p2p_index_requests_total{op=\"%c\"} %llu\n", stats_ops[op],
+            (unsigned long long)sumStat(offsetof(struct worker_stats, requests) + op * sizeof(uint64_t)));
+    fprintf(out, "# HELP p2p_index_errors_total Requests answered with an error, by type\n# TYPE p2p_index_errors_total counter\n");
+    for (int op = 0; op < STATS_OPS; op++)
+        fprintf(out, "p2p_index_errors_total{op=\"%c\"} %llu\n", stats_ops[op],
+            (unsigned long long)sumStat(offsetof(struct worker_stats, errors) + op * sizeof(uint64_t)));
+    fprintf(out, "# HELP p2p_index_request_seconds Time from a request arriving to its answer going out\n");
+    fprintf(out, "# TYPE p2p_index_request_seconds histogram\n");
+    for (int op = 0; op < STATS_OPS; op++)
+    {
+        uint64_t cumulative = 0;
+        if (sumStat(offsetof(struct worker_stats, requests) + op * sizeof(uint64_t)) == 0)
+            continue; // types nobody sent would only add noise
+        for (int b = 0; b < STATS_BUCKETS; b++)
+        {
+            cumulative += sumStat(offsetof(struct worker_stats, latency) + (op * STATS_BUCKETS + b) * sizeof(uint64_t));
+            if (b < STATS_BUCKETS - 1)
+                fprintf(out, "p2p_index_request_seconds_bucket{op=\"%c\",le=\"%g\"} %llu\n", stats_ops[op], (double)(1ULL << b) / 1e6,
+                    (unsigned long long)cumulative);
+            else
+                fprintf(out, "p2p_index_request_seconds_bucket{op=\"%c\",le=\"+Inf\"} %llu\n", stats_ops[op], (unsigned long long)cumulative);
+        }
+        fprintf(out, "p2p_index_request_seconds_sum{op=\"%c\"} %.6f\n", stats_ops[op],
+            sumStat(offsetof(struct worker_stats, latency_ns) + op * sizeof(uint64_t)) / 1e9);
+        fprintf(out, "p2p_index_request_seconds_count{op=\"%c\"} %llu\n", stats_ops[op], (unsigned long long)cumulative);
+    }
+    fprintf(out, "# HELP p2p_index_dropped_total Datagrams not served: malformed ones, replies that could not be sent, and those the kernel dropped on full sockets\n");
+    fprintf(out, "# TYPE p2p_index_dropped_total counter\n");
+    fprintf(out, "p2p_index_dropped_total{reason=\"malformed\"} %llu\n", (unsigned long long)sumStat(offsetof(struct worker_stats, malformed)));
+    fprintf(out, "p2p_index_dropped_total{reason=\"send\"} %llu\n", (unsigned long long)sumStat(offsetof(struct worker_stats, send_failures)));
+    fprintf(out, "p2p_index_dropped_total{reason=\"socket\"} %llu\n", (unsigned long long)sumStat(offsetof(struct worker_stats, kernel_drops)));
+    fprintf(out, "# HELP p2p_index_stale_releases_total Download releases that found the peer with nothing in flight\n");
+    fprintf(out, "# TYPE p2p_index_stale_releases_total counter\np2p_index_stale_releases_total %llu\n",
+        (unsigned long long)__atomic_load_n(&stale_releases, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP p2p_index_retransmissions_total Requests sent again by clients and answered from the reply cache\n");
+    fprintf(out, "# TYPE p2p_index_retransmissions_total counter\np2p_index_retransmissions_total %llu\n",
+        (unsigned long long)sumStat(offsetof(struct worker_stats, retransmitted)));
+    fprintf(out, "# TYPE p2p_index_registrations gauge\np2p_index_registrations %zu\n", __atomic_load_n(&registry_size, __ATOMIC_RELAXED));
+    fprintf(out, "# TYPE p2p_index_downloads_in_flight gauge\np2p_index_downloads_in_flight %u\n",
+        __atomic_load_n(&tickets_active, __ATOMIC_RELAXED));
+    writePeerEntries(out, peer_limit);
+}
+void* metricsLoop(void *arg)
+{ // Replace the --metrics file every METRICS_INTERVAL seconds, in one step so a scraper never reads half of it. Every peer is in it
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", metrics_path);
+    while (1)
+    {
+        FILE *out = fopen(temporary, "w");
+        if (out != NULL)
+        {
+            writeServerMetrics(out, 0);
+            if (fclose(out) != 0 || rename(temporary, metrics_path) < 0)
+                unlink(temporary);
+        }
+        sleep(METRICS_INTERVAL);
+    }
+    return NULL;
+}
+
+// REPLIES
+struct cached_reply *replySlot(struct sockaddr_in *client_addr, uint32_t request_id)
+{ // The reply cache slot of request_id from client_addr. Its lock is reply_cache_locks[slot % REPLY_CACHE_LOCKS]
+    uint64_t key = (uint64_t)client_addr->sin_addr.s_addr << 16 ^ client_addr->sin_port;
+    key = (key ^ (uint64_t)request_id << 24) * 0x9E3779B97F4A7C15ULL;
+    return &reply_cache[key >> 52 & (REPLY_CACHE_SLOTS - 1)];
+}
+ssize_t sendDatagram(int sockfd, struct message *request, const void *datagram, size_t size, struct sockaddr_in *client_addr, int client_addr_size)
+{ // Send the reply to request and keep it in the reply cache. Returns what sendto returned
+    struct cached_reply *slot = replySlot(client_addr, request->header.request_id);
+    pthread_mutex_t *lock = &reply_cache_locks[(slot - reply_cache) % REPLY_CACHE_LOCKS];
+    if (size <= sizeof(slot->datagram))
+    {
+        pthread_mutex_lock(lock);
+        slot->host = client_addr->sin_addr;
+        slot->port = client_addr->sin_port;
+        slot->request_id = request->header.request_id;
+        slot->sent = time(NULL);
+        slot->size = size;
+        memcpy(&slot->datagram, datagram, size);
+        pthread_mutex_unlock(lock);
+    }
+    ssize_t sent = sendto(sockfd, datagram, size, 0, (struct sockaddr*)client_addr, client_addr_size);
+    if (my_stats != NULL && ((const struct message_header*)datagram)->type == 'E')
+        addStat(&my_stats->errors[statsOp(request->header.type)], 1);
+    if (my_stats != NULL && sent < 0)
+        addStat(&my_stats->send_failures, 1);
+    return sent;
+}
+int resendCachedReply(int sockfd, struct message *request, struct sockaddr_in *client_addr, int client_addr_size)
+{ // If request was answered already and the client sent it again, answer it the same way again. Returns 0 if it is new
+    struct cached_reply *slot = replySlot(client_addr, request->header.request_id);
+    pthread_mutex_t *lock = &reply_cache_locks[(slot - reply_cache) % REPLY_CACHE_LOCKS];
+    int found = 0;
+    pthread_mutex_lock(lock);
+    if (slot->size > 0 && slot->request_id == request->header.request_id && slot->port == client_addr->sin_port &&
+        slot->host.s_addr == client_addr->sin_addr.s_addr && time(NULL) - slot->sent < REPLY_CACHE_SECONDS)
     {
-        printf("PEER: %s    CONTENT: %s    ADDRESS: %s\n", n->file_description.peer_name, n->file_description.content_name, n->file_description.address);
-        n = n->next;
+        found = 1;
+        if (sendto(sockfd, &slot->datagram, slot->size, 0, (struct sockaddr*)client_addr, client_addr_size) < 0 && debug)
+            perror("Could not send reply again");
     }
+    pthread_mutex_unlock(lock);
+    if (found && my_stats != NULL)
+        addStat(&my_stats->retransmitted, 1);
+    if (found && debug)
+        printf("Answered retransmitted request %u again...\n", ntohl(request->header.request_id));
+    return found;
+}
+void sendReply(int sockfd, struct message *request, char type, const char *text, struct sockaddr_in *client_addr, int client_addr_size)
+{ // Answer request with a single datagram of the given type. text may be NULL for an empty payload
+    struct message reply;
+    size_t length = text == NULL ? 0 : strlen(text);
+    if (length > MAX_PAYLOAD_SIZE)
+        length = MAX_PAYLOAD_SIZE;
+
+    reply.header.version = PROTOCOL_VERSION;
+    reply.header.type = type;
+    reply.header.request_id = request->header.request_id; // already in network order
+    reply.header.length = htons(length);
+    memcpy(reply.payload, text, length);
+    if (sendDatagram(sockfd, request, &reply, sizeof(reply.header) + length, client_addr, client_addr_size) < 0 && debug)
+        perror("Could not send reply");
 }
 
 // L
 void removeOrphanFiles(char disconnecting_peer[DEFAULT_NAME_SIZE])
-{ // Remove orphan files that are leftover when a peer disconnecs
-    while (1)
-    { // Basically runs until the linked list has removed every file belonging to the user with the given name
-      // If the first element is a hit, we shift the list. If not, we look for a hit and shift that part of that list. Otherwise, we finish
-        struct hosted_file *temp = head, *prev;
-        if (temp != NULL && strcmp(temp->file_description.peer_name, disconnecting_peer) == 0)
+{ // Remove orphan files that are leftover when a peer disconnecs. The peer index holds exactly its files so nothing else is scanned
+    int removed = removePeerFiles(disconnecting_peer);
+    if (debug)
+    {
+        printf("Orphans have been murdered...\n"); // Printing the whole registry is O(n) so it only happens while debugging
+        printf("%d files removed\n", removed);
+        localFilePrint();
+    }
+}
+
+// O
+int compareListingKey(const struct listing_entry *entry, const char *content_name, const char *peer_name)
+{ // Order of the listing. Compares entry against (content_name, peer_name)
+    int c = strncmp(entry->content_name, content_name, DEFAULT_NAME_SIZE);
+    return c != 0 ? c : strncmp(entry->peer_name, peer_name, DEFAULT_NAME_SIZE);
+}
+int compareListingEntries(const void *a, const void *b)
+{ // qsort adapter for compareListingKey
+    const struct listing_entry *y = (const struct listing_entry*)b;
+    return compareListingKey((const struct listing_entry*)a, y->content_name, y->peer_name);
+}
+int rebuildListing()
+{ // Snapshot the registry into the listing cache. Caller holds the listing write lock. Returns 0 and keeps the old cache if memory ran out
+    uint64_t version = __atomic_load_n(&registry_version, __ATOMIC_ACQUIRE);
+    size_t capacity = __atomic_load_n(&registry_size, __ATOMIC_RELAXED) + 64, count = 0;
+    struct listing_entry *entries = (struct listing_entry*)malloc(capacity * sizeof(struct listing_entry));
+    if (entries == NULL)
+        return 0;
+
+    for (int s = 0; s < REGISTRY_SHARDS; s++)
+    {
+        pthread_rwlock_rdlock(&content_shards[s].lock);
+        for (size_t i = 0; i < content_shards[s].table.size; i++)
         {
-            head = temp->next;
-            free(temp);
-            continue;
+            struct content_entry *c = (struct content_entry*)content_shards[s].table.buckets[i];
+            for (; c != NULL; c = (struct content_entry*)c->node.next)
+            {
+                for (struct hosted_file *n = c->holders_head; n != NULL; n = n->next_holder)
+                {
+                    if (count == capacity)
+                    { // the registry grew while we were walking it
+                        struct listing_entry *bigger = (struct listing_entry*)realloc(entries, 2 * capacity * sizeof(struct listing_entry));
+                        if (bigger == NULL)
+                        {
+                            pthread_rwlock_unlock(&content_shards[s].lock);
+                            free(entries);
+                            return 0;
+                        }
+                        entries = bigger;
+                        capacity *= 2;
+                    }
+                    memcpy(entries[count].content_name, c->node.name, DEFAULT_NAME_SIZE);
+                    memcpy(entries[count].peer_name, peerAt(n->peer)->node.name, DEFAULT_NAME_SIZE);
+                    count++;
+                }
+            }
         }
+        pthread_rwlock_unlock(&content_shards[s].lock);
+    }
+    qsort(entries, count, sizeof(struct listing_entry), compareListingEntries);
+
+    char *text = (char*)malloc(count * (2 * DEFAULT_NAME_SIZE + 2) + 1);
+    if (text == NULL)
+    {
+        free(entries);
+        return 0;
+    }
+    uint32_t offset = 0;
+    for (size_t i = 0; i < count; i++)
+    { // The string building happens here once per registry version instead of once per entry per request
+        entries[i].offset = offset;
+        entries[i].length = sprintf(text + offset, "%.*s:%.*s\n", DEFAULT_NAME_SIZE, entries[i].peer_name, DEFAULT_NAME_SIZE, entries[i].content_name);
+        offset += entries[i].length;
+    }
+
+    free(listing.entries);
+    free(listing.text);
+    listing.entries = entries;
+    listing.text = text;
+    listing.count = count;
+    listing.version = version;
+    if (debug)
+        printf("Listing rebuilt with %zu entries at version %llu\n", count, (unsigned long long)version);
+    return 1;
+}
+size_t findListingStart(struct opdu *query)
+{ // Index of the first entry at or after the prefix and strictly after the cursor. Caller holds the listing lock
+    size_t low = 0, high = listing.count;
+    while (low < high)
+    { // first entry whose content name is >= prefix
+        size_t mid = (low + high) / 2;
+        if (strncmp(listing.entries[mid].content_name, query->prefix, DEFAULT_NAME_SIZE) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (query->cursor_content[0] == '\0' && query->cursor_peer[0] == '\0')
+        return low;
 
-        while (temp != NULL && strcmp(temp->file_description.peer_name, disconnecting_peer) != 0)
+    size_t after = 0;
+    high = listing.count;
+    while (after < high)
+    { // first entry > cursor
+        size_t mid = (after + high) / 2;
+        if (compareListingKey(&listing.entries[mid], query->cursor_content, query->cursor_peer) <= 0)
+            after = mid + 1;
+        else
+            high = mid;
+    }
+    return after > low ? after : low;
+}
+void printHostedFiles(int sockfd, struct message *request, struct sockaddr_in client_addr, int client_addr_size)
+{ // Send one page of the listing, packing as many "peer:content" entries into each 'O' reply as fit and sending the whole page with one sendmmsg
+    struct opdu query;
+    bzero(&query, sizeof(query));
+    if (ntohs(request->header.length) == sizeof(query))
+        memcpy(&query, request->payload, sizeof(query));
+    else if (ntohs(request->header.length) != 0)
+    {
+        sendReply(sockfd, request, 'E', "Malformed listing request...", &client_addr, client_addr_size);
+        return;
+    }
+    size_t limit = ntohl(query.limit);
+    if (limit == 0 || limit > LISTING_PAGE_ENTRIES * MAX_LISTING_DATAGRAMS)
+        limit = LISTING_PAGE_ENTRIES;
+    size_t prefix_length = strnlen(query.prefix, DEFAULT_NAME_SIZE);
+
+    pthread_rwlock_rdlock(&listing.lock);
+    if (listing.version != __atomic_load_n(&registry_version, __ATOMIC_ACQUIRE))
+    { // Upgrade to rebuild. Another worker may have beaten us to it, and at worst we serve a listing one change behind
+        pthread_rwlock_unlock(&listing.lock);
+        pthread_rwlock_wrlock(&listing.lock);
+        if (listing.version != __atomic_load_n(&registry_version, __ATOMIC_ACQUIRE) && !rebuildListing())
+            printf("Out of memory while rebuilding the listing...\n");
+        pthread_rwlock_unlock(&listing.lock);
+        pthread_rwlock_rdlock(&listing.lock);
+    }
+
+    struct listing_reply_head heads[MAX_LISTING_DATAGRAMS];
+    struct iovec iov[MAX_LISTING_DATAGRAMS][2];
+    struct mmsghdr msgs[MAX_LISTING_DATAGRAMS];
+    size_t next = findListingStart(&query), sent = 0;
+    int count = 0;
+    const size_t room = MAX_PAYLOAD_SIZE - sizeof(struct listing_header);
+    while (count < MAX_LISTING_DATAGRAMS)
+    { // Each datagram is the longest run of matching entries that fits
+        size_t first = next, bytes = 0;
+        while (next < listing.count && sent < limit &&
+            strncmp(listing.entries[next].content_name, query.prefix, prefix_length) == 0 &&
+            bytes + listing.entries[next].length <= room)
         {
-            prev = temp;
-            temp = temp->next;
+            bytes += listing.entries[next++].length;
+            sent++;
         }
-        if (temp == NULL)
+        if (next == first && count > 0)
+            break;
+
+        heads[count].listing.entries = htons(next - first);
+        iov[count][0].iov_base = &heads[count];
+        iov[count][0].iov_len = sizeof(struct listing_reply_head);
+        iov[count][1].iov_base = next > first ? listing.text + listing.entries[first].offset : listing.text;
+        iov[count][1].iov_len = bytes;
+        count++;
+        if (next == first)
+            break; // nothing matched at all. The page is a single empty datagram
+    }
+    unsigned char more = next < listing.count && strncmp(listing.entries[next].content_name, query.prefix, prefix_length) == 0;
+
+    bzero(msgs, count * sizeof(struct mmsghdr));
+    for (int i = 0; i < count; i++)
+    {
+        heads[i].header.version = PROTOCOL_VERSION;
+        heads[i].header.type = 'O';
+        heads[i].header.request_id = request->header.request_id;
+        heads[i].header.length = htons(sizeof(struct listing_header) + iov[i][1].iov_len);
+        heads[i].listing.index = htons(i);
+        heads[i].listing.count = htons(count);
+        heads[i].listing.more = more;
+        msgs[i].msg_hdr.msg_name = &client_addr;
+        msgs[i].msg_hdr.msg_namelen = client_addr_size;
+        msgs[i].msg_hdr.msg_iov = iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 2;
+    }
+    for (int done = 0; done < count;)
+    { // sendmmsg may stop early if the socket buffer fills up
+        int n = sendmmsg(sockfd, msgs + done, count - done, 0);
+        if (n <= 0)
         {
-            printf("Orphans have been murdered...\n");
+            if (debug)
+                perror("Could not send listing");
             break;
         }
-        prev->next = temp->next;
-        free(temp);
+        done += n;
     }
-    if (!debug)
-        localFilePrint(head);
+    if (debug)
+        printf("Listed %zu entries in %d datagrams\n", sent, count);
+    pthread_rwlock_unlock(&listing.lock);
 }
 
-// O
-void printHostedFiles(int sockfd, struct hosted_file * n, struct sockaddr_in socket_addr, int socket_addr_size)
-{ // For every node in the linked list, send the information in a 'O' type pdu. The client stops receiving when it gets an 'E' type pdu
-    struct pdu packet;
-    bzero(&packet, sizeof(packet));
-    if (recvfrom(sockfd, &packet, sizeof(packet), 0, (struct sockaddr *)&socket_addr, &socket_addr_size) < 0)
-    {
-        printf("Failed to receive packet...\n");
-        struct pdu error_packet = {'E'};
-        bzero(error_packet.data, STANDARD_BUF_SIZE);
-        strcpy(error_packet.data, "Error. Please try again later...\n");
-        sendto(sockfd, &error_packet, sizeof(error_packet), 0, (struct sockaddr *)&socket_addr, socket_addr_size);
-        return;
+// Q
+unsigned int gramBucket(const char *gram)
+{ // Posting list of a trigram. Different trigrams may share a list since every candidate is checked against the pattern anyway
+    uint32_t key = ((unsigned char)gram[0] << 16) | ((unsigned char)gram[1] << 8) | (unsigned char)gram[2];
+    return (key * 2654435761u) >> (32 - NAME_GRAM_BITS);
+}
+int compareNames(const void *a, const void *b)
+{ // qsort adapter for content names
+    return strncmp((const char*)a, (const char*)b, DEFAULT_NAME_SIZE);
+}
+int rebuildNameIndex()
+{ // Build a new name index off to the side and swap it in. Returns 0 and keeps the old one if memory ran out
+    uint64_t version = __atomic_load_n(&names_version, __ATOMIC_ACQUIRE);
+    size_t capacity = 64, count = 0;
+    for (int s = 0; s < REGISTRY_SHARDS; s++)
+        capacity += content_shards[s].table.count; // only a sizing hint, the walk below grows the array if needed
+    char (*table)[DEFAULT_NAME_SIZE] = malloc(capacity * DEFAULT_NAME_SIZE);
+    if (table == NULL)
+        return 0;
+
+    for (int s = 0; s < REGISTRY_SHARDS; s++)
+    {
+        pthread_rwlock_rdlock(&content_shards[s].lock);
+        for (size_t i = 0; i < content_shards[s].table.size; i++)
+        {
+            for (struct name_node *n = content_shards[s].table.buckets[i]; n != NULL; n = n->next)
+            {
+                if (count == capacity)
+                {
+                    char (*bigger)[DEFAULT_NAME_SIZE] = realloc(table, 2 * capacity * DEFAULT_NAME_SIZE);
+                    if (bigger == NULL)
+                    {
+                        pthread_rwlock_unlock(&content_shards[s].lock);
+                        free(table);
+                        return 0;
+                    }
+                    table = bigger;
+                    capacity *= 2;
+                }
+                memcpy(table[count++], n->name, DEFAULT_NAME_SIZE);
+            }
+        }
+        pthread_rwlock_unlock(&content_shards[s].lock);
     }
+    qsort(table, count, DEFAULT_NAME_SIZE, compareNames);
 
-    while (n != NULL)
-    { // Some string operations happen to append all the information in the buffer separated with a ":"
-        bzero(&packet, sizeof(packet));
-        packet.type = 'O';
-        strcat(strcpy(packet.data, n->file_description.peer_name), ":");
-        strcat(packet.data, n->file_description.content_name);
-        if (debug)
-            printf("%s\n", packet.data);
+    // Two passes over the trigrams: count each list, then fill it. last[g] remembers the latest name added to list g
+    // so a name with a repeated trigram is only listed once
+    uint32_t *offsets = (uint32_t*)calloc(NAME_GRAM_BUCKETS + 1, sizeof(uint32_t));
+    uint32_t *last = (uint32_t*)malloc(NAME_GRAM_BUCKETS * sizeof(uint32_t));
+    uint32_t *postings = NULL;
+    if (offsets == NULL || last == NULL)
+        goto fail;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        memset(last, 0xff, NAME_GRAM_BUCKETS * sizeof(uint32_t));
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t length = strnlen(table[i], DEFAULT_NAME_SIZE);
+            for (size_t j = 0; j + 3 <= length; j++)
+            {
+                unsigned int g = gramBucket(table[i] + j);
+                if (last[g] == i)
+                    continue;
+                last[g] = i;
+                if (pass == 0)
+                    offsets[g + 1]++;
+                else
+                    postings[offsets[g]++] = i;
+            }
+        }
+        if (pass == 0)
+        {
+            for (int g = 0; g < NAME_GRAM_BUCKETS; g++)
+                offsets[g + 1] += offsets[g];
+            if ((postings = (uint32_t*)malloc((offsets[NAME_GRAM_BUCKETS] + 1) * sizeof(uint32_t))) == NULL)
+                goto fail;
+        } else
+        { // filling moved every offset to the end of its list, which is the start of the next
+            memmove(offsets + 1, offsets, NAME_GRAM_BUCKETS * sizeof(uint32_t));
+            offsets[0] = 0;
+        }
+    }
+    free(last);
 
-        sendto(sockfd, &packet, sizeof(packet), 0, (struct sockaddr *)&socket_addr, socket_addr_size);
-        n = n->next;
+    pthread_rwlock_wrlock(&names.lock);
+    free(names.names);
+    free(names.offsets);
+    free(names.postings);
+    names.names = table;
+    names.count = count;
+    names.offsets = offsets;
+    names.postings = postings;
+    names.version = version;
+    pthread_rwlock_unlock(&names.lock);
+    if (debug)
+        printf("Name index rebuilt with %zu names at version %llu\n", count, (unsigned long long)version);
+    return 1;
+fail:
+    free(table);
+    free(offsets);
+    free(last);
+    return 0;
+}
+void* nameIndexLoop(void *arg)
+{ // Rebuild the name index at most every NAME_INDEX_REFRESH seconds and only if names came or went, so searches never pay for it.
+  // A new name shows up in searches within that delay and a name whose last holder left is skipped right away
+    while (1)
+    {
+        if (names.version != __atomic_load_n(&names_version, __ATOMIC_ACQUIRE) && !rebuildNameIndex())
+            printf("Out of memory while rebuilding the name index...\n");
+        sleep(NAME_INDEX_REFRESH);
+    }
+    return NULL;
+}
+size_t findName(const char *name, int after)
+{ // Table position of the first name >= name, or > name when after is set. Caller holds the name index lock
+    size_t low = 0, high = names.count;
+    while (low < high)
+    {
+        size_t mid = (low + high) / 2;
+        int c = strncmp(names.names[mid], name, DEFAULT_NAME_SIZE);
+        if (c < 0 || (after && c == 0))
+            low = mid + 1;
+        else
+            high = mid;
     }
-    bzero(&packet, sizeof(packet));
-    packet.type = 'E';
-    sendto(sockfd, &packet, sizeof(packet), 0, (struct sockaddr *)&socket_addr, socket_addr_size);
+    return low;
+}
+int contentHolders(const char *content_name)
+{ // Current number of holders of a content name, 0 if it went away since the index was built
+    struct registry_shard *shard = shardFor(content_shards, hashName(content_name));
+    pthread_rwlock_rdlock(&shard->lock);
+    struct content_entry *content = (struct content_entry*)tableFind(&shard->table, content_name);
+    int holders = content != NULL ? content->holders : 0;
+    pthread_rwlock_unlock(&shard->lock);
+    return holders;
 }
+int searchNames(struct qpdu *query, struct query_reply *result, int limit)
+{ // Fill result with up to limit names matching query. Prefix matches are one contiguous run of the table. Substring searches of
+  // three or more characters only look at the shortest posting list among the pattern's trigrams, shorter ones scan the table
+    size_t pattern_length = strnlen(query->pattern, DEFAULT_NAME_SIZE);
+    uint32_t *candidates = NULL;
+    size_t candidate_count = 0, next = 0;
+    int count = 0;
+    result->more = 0;
 
-// T
-int removeItemFromList(struct rpdu *file_to_remove)
-{ // Similar logic for removal but this time we know there can only be one matching rpdu so we specifically look for it
-    struct hosted_file *temp = head, *prev;
-    if (temp != NULL && 
-        strcmp(temp->file_description.content_name, file_to_remove->content_name) == 0 && 
-        strcmp(temp->file_description.peer_name, file_to_remove->peer_name) == 0)
-    {
-        head = temp->next;
-        free(temp);
-        return 1;
+    pthread_rwlock_rdlock(&names.lock);
+    size_t position = query->cursor[0] != '\0' ? findName(query->cursor, 1) : 0;
+    if (query->mode == 'P')
+    {
+        size_t first = findName(query->pattern, 0);
+        if (first > position)
+            position = first;
+    } else if (pattern_length >= 3 && names.postings != NULL)
+    {
+        for (size_t j = 0; j + 3 <= pattern_length; j++)
+        {
+            unsigned int g = gramBucket(query->pattern + j);
+            if (candidates == NULL || names.offsets[g + 1] - names.offsets[g] < candidate_count)
+            {
+                candidates = names.postings + names.offsets[g];
+                candidate_count = names.offsets[g + 1] - names.offsets[g];
+            }
+        }
+        size_t high = candidate_count;
+        while (next < high)
+        { // first candidate at or after the cursor
+            size_t mid = (next + high) / 2;
+            if (candidates[mid] < position)
+                next = mid + 1;
+            else
+                high = mid;
+        }
     }
 
-    while (temp != NULL && 
-        (strcmp(temp->file_description.content_name, file_to_remove->content_name) != 0 || 
-        strcmp(temp->file_description.peer_name, file_to_remove->peer_name) != 0))
+    while (1)
+    {
+        if (candidates != NULL)
+        {
+            if (next == candidate_count)
+                break;
+            position = candidates[next++];
+        } else if (position == names.count)
+            break;
+        const char *name = names.names[candidates != NULL ? position : position++];
+        if (query->mode == 'P' ? strncmp(name, query->pattern, pattern_length) != 0 :
+            memmem(name, strnlen(name, DEFAULT_NAME_SIZE), query->pattern, pattern_length) == NULL)
+        {
+            if (query->mode == 'P')
+                break; // past the run of names with this prefix
+            continue;
+        }
+        int holders = contentHolders(name);
+        if (holders == 0)
+            continue;
+        if (count == limit)
+        { // one match past the page is how we know there is another
+            result->more = 1;
+            break;
+        }
+        memcpy(result->matches[count].content_name, name, DEFAULT_NAME_SIZE);
+        result->matches[count].holders = htons(holders > 65535 ? 65535 : holders);
+        count++;
+    }
+    pthread_rwlock_unlock(&names.lock);
+    result->count = count;
+    return count;
+}
+void searchContent(int sockfd, struct message *request, struct sockaddr_in client_addr, int client_addr_size)
+{ // Main Q function. Sends back one datagram with the matching content names and their holder counts
+    struct qpdu query;
+    if (ntohs(request->header.length) != sizeof(query))
+    {
+        sendReply(sockfd, request, 'E', "Malformed search request...", &client_addr, client_addr_size);
+        return;
+    }
+    memcpy(&query, request->payload, sizeof(query));
+    if (query.mode != 'P' && query.mode != 'C')
     {
-        prev = temp;
-        temp = temp->next;
+        sendReply(sockfd, request, 'E', "Unknown search mode...", &client_addr, client_addr_size);
+        return;
     }
+    int limit = query.limit == 0 || query.limit > MAX_QUERY_RESULTS ? MAX_QUERY_RESULTS : query.limit;
 
-    if (temp == NULL)
-        return 0;
+    struct message reply;
+    struct query_reply *result = (struct query_reply*)reply.payload;
+    int count = searchNames(&query, result, limit);
+    size_t length = sizeof(*result) - sizeof(result->matches) + count * sizeof(struct name_match);
+    reply.header.version = PROTOCOL_VERSION;
+    reply.header.type = 'Q';
+    reply.header.request_id = request->header.request_id;
+    reply.header.length = htons(length);
+    if (sendDatagram(sockfd, request, &reply, sizeof(reply.header) + length, &client_addr, client_addr_size) < 0 && debug)
+        perror("Could not send search results");
+    if (debug)
+        printf("Search for %.*s found %d names\n", DEFAULT_NAME_SIZE, query.pattern, count);
+}
 
-    prev->next = temp->next;
-    free(temp);
-    return 1;
+// T
+int removeItemFromList(struct rpdu *file_to_remove)
+{ // We know there can only be one matching registration so we look it up under its content and drop it
+    return removeHostedFile(file_to_remove->content_name, file_to_remove->peer_name);
 }
-int itemInList(struct hosted_file * n, char content[99]) // PEER_NAME:CONTENT_NAME
-{ // Checks if the item already exists in the linked list before deleting and returns 1 if the item is in the linked list
-    char *token = strtok(content, ":");
-    char content_name[DEFAULT_NAME_SIZE], peer_name[DEFAULT_NAME_SIZE];
+int itemInList(char content[99]) // CONTENT_NAME:PEER_NAME
+{ // Parses the request and removes the item if it is in the registry. Returns 1 if the item was removed
+    char *saveptr;
+    char *token = strtok_r(content, ":", &saveptr);
+    struct rpdu file_to_remove;
     int i = 0;
+    bzero(&file_to_remove, sizeof(file_to_remove));
     while(token != NULL)
     {
         if (i++ == 0)
         {
-            strcpy(content_name, token);
+            strncpy(file_to_remove.content_name, token, DEFAULT_NAME_SIZE - 1);
         } else
         {
-            strcpy(peer_name, token);
-        }
-        token = strtok(NULL, ":");
-    }
-
-    while (n != NULL)
-    {
-        if (strcmp(n->file_description.content_name, content_name) == 0 && strcmp(n->file_description.peer_name, peer_name) == 0)
-        {
-            return removeItemFromList(&n->file_description);
+            strncpy(file_to_remove.peer_name, token, DEFAULT_NAME_SIZE - 1);
         }
-        n = n->next;
+        token = strtok_r(NULL, ":", &saveptr);
     }
-    return 0;
+    return removeItemFromList(&file_to_remove);
 }
-void deRegisterContent(int sockfd, struct sockaddr_in client_addr, int *client_addr_size)
-{ // Base function for T. Received peer name and file to delete in the pdu buffer as "%s:%s" and then respond to client with status of request
-    struct pdu file_to_delete;
-    bzero(&file_to_delete, sizeof(file_to_delete));
-    if (recvfrom(sockfd, &file_to_delete, sizeof(file_to_delete), 0, (struct sockaddr *)&client_addr, client_addr_size) < 0)
+void deRegisterContent(int sockfd, struct message *request, struct sockaddr_in client_addr, int client_addr_size)
+{ // Base function for T. Received file to delete and peer name in the payload as "%s:%s" and then respond to client with status of request
+    char file_to_delete[STANDARD_BUF_SIZE + 1];
+    int length = ntohs(request->header.length);
+    if (length > STANDARD_BUF_SIZE)
     {
-        printf("Error receiving file name from client. Please try again later...\n");
+        sendReply(sockfd, request, 'E', "ERROR: Malformed request", &client_addr, client_addr_size);
         return;
     }
-    int flag = head != NULL ? itemInList(head, file_to_delete.data) : 0;
-    bzero(&file_to_delete, sizeof(file_to_delete));
+    memcpy(file_to_delete, request->payload, length);
+    file_to_delete[length] = '\0';
+    int flag = itemInList(file_to_delete);
 
     if (debug)
         printf("%d\n", flag);
 
     if (flag)
     {
-        file_to_delete.type = 'A';
-        sendto(sockfd, &file_to_delete, sizeof(file_to_delete), 0, (struct sockaddr*)&client_addr, *client_addr_size);
+        sendReply(sockfd, request, 'A', NULL, &client_addr, client_addr_size);
         if (debug)
             printf("ITEM SUCCESSFULLY DELETED\n");
     } else
     {
-        file_to_delete.type = 'E';
-        strcpy(file_to_delete.data, "ERROR: Node was not found in list");
-        sendto(sockfd, &file_to_delete, sizeof(file_to_delete), 0, (struct sockaddr*)&client_addr, *client_addr_size);
+        sendReply(sockfd, request, 'E', "ERROR: Node was not found in list", &client_addr, client_addr_size);
     }
 }
 
 
 // S
-void sendFileInfo(int sockfd, struct sockaddr_in client_addr, int *client_addr_size, struct hosted_file file, char *peer_name)
-{ // Send content_server TCP IP and port for requested file in a string formatted as %s:%s to the requesting peer 
-    struct pdu file_info_packet;
-    bzero(&file_info_packet, sizeof(file_info_packet));
-    file_info_packet.type = 'S';
-    strcpy(file_info_packet.data, file.file_description.address);
-    if (sendto(sockfd, &file_info_packet, sizeof(file_info_packet), 0, (struct sockaddr*)&client_addr, *client_addr_size) < 0)
-    { // If the request could not be sent, send an E PDU instead to note the error on both ends
-        struct pdu error_packet = {'E'};
-        bzero(error_packet.data, STANDARD_BUF_SIZE);
-        strcpy(error_packet.data, "Could not receive address...\n");
-        sendto(sockfd, &error_packet, sizeof(error_packet), 0, (struct sockaddr*)&client_addr, *client_addr_size);
-    }
-    // Set the file.status to busy after it has been sent to a requesting peer
-    file.status = 'B';
-}
-struct hosted_file* getHostedFile(struct hosted_file *n, struct spdu packet)
-{ // Return specified file
-    while (n != NULL)
-    { // While the file is in the linked list 
-        if (strcmp(n->file_description.content_name, packet.content_name) == 0)
+void chargePeer(const char *peer_name, int delta)
+{ // Add delta to the peer's in-flight downloads if it is still registered. Peer entries are only freed under the peer shard write lock
+    struct registry_shard *shard = shardFor(peer_shards, hashName(peer_name));
+    pthread_rwlock_rdlock(&shard->lock);
+    struct peer_entry *peer = (struct peer_entry*)tableFind(&shard->table, peer_name);
+    if (peer != NULL && __atomic_add_fetch(&peer->in_flight, delta, __ATOMIC_RELAXED) < 0)
+    { // A late release after the peer left and registered again with a fresh count. Counted so a double release still shows
+        __atomic_store_n(&peer->in_flight, 0, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stale_releases, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+}
+void releaseTicket(struct download_ticket *ticket)
+{ // Give the ticket's download slots back to its peers. Caller holds tickets_lock
+    if (!ticket->active)
+        return;
+    ticket->active = 0;
+    __atomic_sub_fetch(&tickets_active, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < ticket->peers; i++)
+        chargePeer(ticket->peer_names[i], -1);
+}
+void expireTickets(time_t now)
+{ // Release every ticket whose download never reported back. Caller holds tickets_lock
+    while (tickets_tail != tickets_head && tickets[tickets_tail % MAX_TICKETS].expires <= now)
+        releaseTicket(&tickets[tickets_tail++ % MAX_TICKETS]);
+}
+uint32_t issueTicket(struct source *sources, int count)
+{ // Record a download charged to each of the count sources and return its ticket id. When the ring is full the oldest download is assumed finished
+    time_t now = time(NULL);
+    pthread_mutex_lock(&tickets_lock);
+    expireTickets(now);
+    if (tickets_head - tickets_tail == MAX_TICKETS)
+        releaseTicket(&tickets[tickets_tail++ % MAX_TICKETS]);
+
+    uint32_t id = tickets_head++;
+    struct download_ticket *ticket = &tickets[id % MAX_TICKETS];
+    ticket->id = id;
+    ticket->expires = now + DOWNLOAD_TIMEOUT;
+    for (int i = 0; i < count; i++)
+        memcpy(ticket->peer_names[i], sources[i].peer_name, DEFAULT_NAME_SIZE);
+    ticket->peers = count;
+    ticket->active = 1;
+    __atomic_add_fetch(&tickets_active, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&tickets_lock);
+    return id;
+}
+int finishTicket(uint32_t id)
+{ // Release ticket id after the client reported its download finished. Returns 0 if it was unknown or had already expired
+    int found = 0;
+    pthread_mutex_lock(&tickets_lock);
+    expireTickets(time(NULL));
+    struct download_ticket *ticket = &tickets[id % MAX_TICKETS];
+    if (ticket->id == id && ticket->active)
+    {
+        releaseTicket(ticket);
+        found = 1;
+    }
+    pthread_mutex_unlock(&tickets_lock);
+    return found;
+}
+int sourceLoadBefore(struct hosted_file *a, struct hosted_file *b)
+{ // Ranking of candidate content servers: lowest in_flight/capacity first, then fewest in-flight downloads, then newest registration
+    struct peer_entry *a_peer = peerAt(a->peer), *b_peer = peerAt(b->peer);
+    int a_in_flight = __atomic_load_n(&a_peer->in_flight, __ATOMIC_RELAXED);
+    int b_in_flight = __atomic_load_n(&b_peer->in_flight, __ATOMIC_RELAXED);
+    long a_load = (long)a_in_flight * b_peer->capacity, b_load = (long)b_in_flight * a_peer->capacity;
+    if (a_load != b_load)
+        return a_load < b_load;
+    return a_in_flight < b_in_flight;
+}
+void sendFileInfo(int sockfd, struct message *request, struct sockaddr_in client_addr, int client_addr_size, struct source_list *list, char *peer_name)
+{ // Send the ranked content servers for the requested file to the requesting peer 
+    size_t length = sizeof(*list) - sizeof(list->sources) + list->count * sizeof(struct source);
+    struct message reply;
+    reply.header.version = PROTOCOL_VERSION;
+    reply.header.type = 'S';
+    reply.header.request_id = request->header.request_id;
+    reply.header.length = htons(length);
+    memcpy(reply.payload, list, length);
+    if (sendDatagram(sockfd, request, &reply, sizeof(reply.header) + length, &client_addr, client_addr_size) < 0)
+    { // Nobody will report this download back, so let its charge go now
+        finishTicket(ntohl(list->ticket));
+        if (debug)
+            perror("Could not send content servers");
+    }
+}
+int getHostedFile(struct spdu packet, struct source_list *list)
+{ // Fill list with up to MAX_SOURCES holders of the specified file ranked least loaded first, charge a download to every one of them
+  // since the client fetches chunks from all of them, and return how many were found. Everything is copied under the shard's read lock because entries may be freed as soon as it is released
+    struct registry_shard *shard = shardFor(content_shards, hashName(packet.content_name));
+    struct hosted_file *ranked[MAX_SOURCES];
+    int count = 0;
+
+    pthread_rwlock_rdlock(&shard->lock);
+    struct content_entry *content = (struct content_entry*)tableFind(&shard->table, packet.content_name);
+    if (content != NULL)
+        memcpy(list->root, content->root, HASH_SIZE);
+    else
+        bzero(list->root, HASH_SIZE);
+    for (struct hosted_file *n = content != NULL ? content->holders_head : NULL; n != NULL; n = n->next_holder)
+    { // Insertion into a short sorted array keeps this a single pass over the holders
+        int i = count < MAX_SOURCES ? count++ : MAX_SOURCES;
+        while (i > 0 && sourceLoadBefore(n, ranked[i - 1]))
         {
-            if (n->status == 'A')
-            { // and is available for download
-                return n;                
-            }
+            if (i < MAX_SOURCES)
+                ranked[i] = ranked[i - 1];
+            i--;
         }
-        n = n->next;
+        if (i < MAX_SOURCES)
+            ranked[i] = n;
     }
-    return NULL;
+    for (int i = 0; i < count; i++)
+    {
+        struct source *source = &list->sources[i];
+        struct peer_entry *peer = peerAt(ranked[i]->peer);
+        memcpy(source->peer_name, peer->node.name, DEFAULT_NAME_SIZE);
+        formatAddress(ranked[i], source->address);
+        source->in_flight = htons(__atomic_fetch_add(&peer->in_flight, 1, __ATOMIC_RELAXED));
+        source->capacity = htons(peer->capacity);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    list->count = count;
+    list->ticket = count > 0 ? htonl(issueTicket(list->sources, count)) : 0;
+    return count;
 }
-void processDownloadRequest(int sockfd, struct sockaddr_in client_addr, int *client_addr_size)
+void processDownloadRequest(int sockfd, struct message *request, struct sockaddr_in client_addr, int client_addr_size)
 { // This is the main function for S type requests from a peer. It checks to see if the file exists, and sends the information if it does.
-  // If the information does not exist, it sends an E type error PDU instead to note the error at both ends
-    if (head == NULL)
+  // If the information does not exist, it sends an E type error reply instead to note the error at both ends
+    struct spdu request_packet;
+    if (ntohs(request->header.length) != sizeof(request_packet))
     {
-        struct pdu error_packet = {'E'};
-        bzero(error_packet.data, STANDARD_BUF_SIZE);
-        strcpy(error_packet.data, "There are no content servers serving this file...\n");
-        sendto(sockfd, &error_packet, sizeof(error_packet), 0, (struct sockaddr*)&client_addr, *client_addr_size);
+        sendReply(sockfd, request, 'E', "Malformed download request...\n", &client_addr, client_addr_size);
         return;
     }
+    memcpy(&request_packet, request->payload, sizeof(request_packet));
+    char peer[DEFAULT_NAME_SIZE + 1];
+    bzero(peer, sizeof(peer));
+    strncpy(peer, request_packet.peer_name, DEFAULT_NAME_SIZE);
+    struct source_list sources;
 
-    struct spdu request_packet;
-    bzero(&request_packet, sizeof(request_packet));
-    recvfrom(sockfd, &request_packet, sizeof(request_packet), 0, (struct sockaddr *)&client_addr, client_addr_size);
-    char *peer;
-    strcpy(peer, request_packet.peer_name);
-    struct hosted_file *requested_file = getHostedFile(head, request_packet);
-
-    if (requested_file == NULL)
-    {
-        struct pdu error_packet = {'E'};
-        bzero(error_packet.data, STANDARD_BUF_SIZE);
-        strcpy(error_packet.data, "There are no content servers serving this file...\n");
-        sendto(sockfd, &error_packet, sizeof(error_packet), 0, (struct sockaddr*)&client_addr, *client_addr_size);
+    if (!getHostedFile(request_packet, &sources) &&
+        !(__atomic_load_n(&recovering, __ATOMIC_ACQUIRE) && findSnapshotSources(&request_packet, &sources)))
+    {
+        sendReply(sockfd, request, 'E', "There are no content servers serving this file...\n", &client_addr, client_addr_size);
         return;
     } else
     {
-        sendFileInfo(sockfd, client_addr, client_addr_size, *requested_file, peer);
+        sendFileInfo(sockfd, request, client_addr, client_addr_size, &sources, peer);
+    }
+}
+void processDownloadFinished(int sockfd, struct message *request, struct sockaddr_in client_addr, int client_addr_size)
+{ // Main F function. The client finished (or gave up on) a download so the content server it was charged to has a free slot again
+    struct fpdu report;
+    if (ntohs(request->header.length) != sizeof(report))
+    {
+        sendReply(sockfd, request, 'E', "Malformed download report...\n", &client_addr, client_addr_size);
+        return;
+    }
+    memcpy(&report, request->payload, sizeof(report));
+    if (!finishTicket(ntohl(report.ticket)))
+    {
+        sendReply(sockfd, request, 'E', "Unknown or expired download...\n", &client_addr, client_addr_size);
+        return;
     }
+    if (debug)
+        printf("Download %u finished with status %c\n", ntohl(report.ticket), report.status);
+    sendReply(sockfd, request, 'A', NULL, &client_addr, client_addr_size);
 }
 
 
 // R
-int findMatchingContent(struct hosted_file* n, struct rpdu curr_file)
-{ // Find if this content already exists under this peer in the node. Return 0 if it does exist. 
-    while (n != NULL)
+void rejectClient(int sockfd, struct message *request, char *msg, struct sockaddr_in* client_addr, int client_addr_size)
+{ // Reject the client from registering the files. If the msg is err, something went wrong during the acknowledgement and the caller has removed the faulty node
+    if (strcmp(msg, "pname") == 0)
     {
-        if (strcmp(n->file_description.content_name, curr_file.content_name) == 0)
-        {
-            if (strcmp(n->file_description.peer_name, curr_file.peer_name) == 0)
-            {
-                return 0;
-            }
-        }
-        n = n->next;
-    }
-    return 1;
-}
-void rejectClient(int sockfd, char *msg, struct sockaddr_in* client_addr, int *client_addr_size)
-{ // Reject the client from registering the files. If the msg is err, something went wrong during the acknowledgement. In this case we remove the faulty node we just added
-    struct pdu packet;
-    packet.type = 'E'; 
-    if (msg == "pname")
+        sendReply(sockfd, request, 'E', "Select a different name...", client_addr, client_addr_size);
+    } else if (strcmp(msg, "err") == 0)
     {
-        strcpy(packet.data, "Select a different name...");
-    } else if (msg == "err")
+        sendReply(sockfd, request, 'E', "Critical error... Exiting.", client_addr, client_addr_size);
+    } else
     {
-        struct hosted_file* temp = head;
-        head = temp->next;
-        free(temp);
-        strcpy(packet.data, "Critical error... Exiting.");
+        sendReply(sockfd, request, 'E', msg, client_addr, client_addr_size);
     }
-    sendto(sockfd, &packet, sizeof(packet), 0, (struct sockaddr*)client_addr, *client_addr_size);
 }
-void acknowledgeClient(int sockfd, struct sockaddr_in* client_addr, int *client_addr_size)
+int acknowledgeClient(int sockfd, struct message *request, struct sockaddr_in* client_addr, int client_addr_size)
 { // Simple acknowledgement that the request was received, is registered with the server, and the given port should be ready to take requests
-    struct pdu packet = { 'A' };
+    struct message_header packet;
+    packet.version = PROTOCOL_VERSION;
+    packet.type = 'A';
+    packet.request_id = request->header.request_id;
+    packet.length = 0;
     
-    if (sendto(sockfd, &packet, sizeof(packet), 0, (struct sockaddr*)client_addr, *client_addr_size) < 0)
+    if (sendDatagram(sockfd, request, &packet, sizeof(packet), client_addr, client_addr_size) < 0)
     {
         printf("CRITICAL ERROR. COULD NOT ACKNOWLEDGE CLIENT...\n");
-        rejectClient(sockfd, "err", client_addr, client_addr_size);
+        rejectClient(sockfd, request, "err", client_addr, client_addr_size);
+        return 0;
     }
+    return 1;
 }
-void registerContent(int sockfd, struct sockaddr_in client_addr, int *client_addr_size)
-{ // Main R function. Receives registration request and adds it to the linked list. Informs the client of the status of their request upon completion
+void registerContent(int sockfd, struct message *request, struct sockaddr_in client_addr, int client_addr_size)
+{ // Main R function. Receives registration request and adds it to the registry. Informs the client of the status of their request upon completion
     struct rpdu curr_content;
-    bzero(&curr_content, sizeof(curr_content));
-    if (recvfrom(sockfd, &curr_content, sizeof(curr_content), 0, (struct sockaddr *)&client_addr, client_addr_size) < 0)
+    if (ntohs(request->header.length) != sizeof(curr_content))
     {
-        fprintf(stderr, "\n%s\n", strerror(errno));
+        rejectClient(sockfd, request, "Malformed registration...", &client_addr, client_addr_size);
         return;
-    } else
+    }
+    memcpy(&curr_content, request->payload, sizeof(curr_content));
+    if (debug)
     {
-        if (debug)
+        printf("Testing: %c\n", curr_content.type);
+        printf("Testing: %.*s\n", DEFAULT_NAME_SIZE, curr_content.peer_name);
+        printf("Testing: %.*s\n", DEFAULT_NAME_SIZE, curr_content.content_name);
+        printf("Testing: %.*s\n\n", (int)sizeof(curr_content.address), curr_content.address);
+    }
+    if (!parseAddress(curr_content.address, NULL, NULL))
+    { // the index only stores the binary form
+        rejectClient(sockfd, request, "The address must be IP:PORT or [IPv6]:PORT...", &client_addr, client_addr_size);
+        return;
+    }
+    // The duplicate check and the insert happen under the same locks so two workers cannot both register the same file
+    int duplicate;
+    if (addHostedFile(&curr_content, &duplicate) == NULL && duplicate != 3)
+    {
+        if (duplicate == 2)
+        { // someone else's file has this name
+            rejectClient(sockfd, request, "Another file is registered under this name...", &client_addr, client_addr_size);
+        } else if (duplicate)
+        { // this peer already registered this content
+            rejectClient(sockfd, request, "pname", &client_addr, client_addr_size);
+        } else
         {
-            printf("Testing: %c\n", curr_content.type);
-            printf("Testing: %s\n", curr_content.peer_name);
-            printf("Testing: %s\n", curr_content.content_name);
-            printf("Testing: %s\n\n", curr_content.address);
+            printf("Out of memory while registering content...\n");
+            rejectClient(sockfd, request, "err", &client_addr, client_addr_size);
         }
+        return;
     }
-    if (head == NULL)
+    // A file the peer registered before has moved to this address, which is acknowledged too but was not added by this request
+    if (!acknowledgeClient(sockfd, request, &client_addr, client_addr_size) && duplicate != 3)
+        removeHostedFile(curr_content.content_name, curr_content.peer_name);
+}
+
+void registerBatch(int sockfd, struct message *request, struct sockaddr_in client_addr, int client_addr_size)
+{ // Main B function. Registers every item of a batch like an R would and answers with one bitmap of which ones made it
+    struct bpdu batch;
+    size_t header_size = offsetof(struct bpdu, items);
+    size_t length = ntohs(request->header.length);
+    bzero(&batch, sizeof(batch));
+    memcpy(&batch, request->payload, length < sizeof(batch) ? length : sizeof(batch));
+    if (length < header_size || batch.count > MAX_BATCH_ITEMS || length != header_size + batch.count * sizeof(struct batch_item))
     {
-        head = (struct hosted_file*)malloc(sizeof(struct hosted_file));
-        head->status = 'A'; // available
-        head->file_description = curr_content;
-        head->next = NULL;
-        acknowledgeClient(sockfd, &client_addr, client_addr_size);
-    } else
+        rejectClient(sockfd, request, "Malformed registration...", &client_addr, client_addr_size);
+        return;
+    }
+    struct rpdu item;
+    bzero(&item, sizeof(item));
+    item.type = 'R';
+    memcpy(item.peer_name, batch.peer_name, DEFAULT_NAME_SIZE);
+    memcpy(item.address, batch.address, sizeof(item.address));
+    item.capacity = batch.capacity;
+    if (!parseAddress(item.address, NULL, NULL))
     {
-        int flag = findMatchingContent(head, curr_content);
-        if (flag)
-        { // no matching content
-            struct hosted_file* new_head = (struct hosted_file*)malloc(sizeof(struct hosted_file));
-            new_head->status = 'A';
-            new_head->file_description = curr_content;
-            new_head->next = head;
-            head = new_head;
+        rejectClient(sockfd, request, "The address must be IP:PORT or [IPv6]:PORT...", &client_addr, client_addr_size);
+        return;
+    }
 
-            acknowledgeClient(sockfd, &client_addr, client_addr_size);
-        } else
+    struct batch_status status;
+    unsigned char added[sizeof(status.registered)];
+    int duplicate, registered = 0;
+    bzero(&status, sizeof(status));
+    bzero(added, sizeof(added));
+    status.count = batch.count;
+    for (int i = 0; i < batch.count; i++)
+    { // A file the peer registered before counts as registered too: it holds it, and addHostedFile moved it to this address
+        memcpy(item.content_name, batch.items[i].content_name, DEFAULT_NAME_SIZE);
+        memcpy(item.root, batch.items[i].root, HASH_SIZE);
+        if (item.content_name[0] == '\0')
+            continue;
+        if (addHostedFile(&item, &duplicate) != NULL)
+            added[i / 8] |= 1 << (i % 8);
+        else if (duplicate != 1 && duplicate != 3)
+            continue;
+        status.registered[i / 8] |= 1 << (i % 8);
+        registered++;
+    }
+
+    struct message reply;
+    reply.header.version = PROTOCOL_VERSION;
+    reply.header.type = 'B';
+    reply.header.request_id = request->header.request_id;
+    reply.header.length = htons(sizeof(status));
+    memcpy(reply.payload, &status, sizeof(status));
+    if (sendDatagram(sockfd, request, &reply, sizeof(reply.header) + sizeof(status), &client_addr, client_addr_size) < 0)
+    { // Same as a lost R acknowledgement: the peer will not serve what it does not know was registered
+        printf("CRITICAL ERROR. COULD NOT ACKNOWLEDGE CLIENT...\n");
+        for (int i = 0; i < batch.count; i++)
         {
-            rejectClient(sockfd, "pname", &client_addr, client_addr_size);
+            if (added[i / 8] & (1 << (i % 8)))
+                removeHostedFile(batch.items[i].content_name, batch.peer_name);
         }
+        return;
     }
+    if (debug)
+        printf("Batch of %d files from %.*s, %d registered\n", batch.count, DEFAULT_NAME_SIZE, batch.peer_name, registered);
 }
 
-/* MAIN */
-int main(int argc, char *argv[])
-{ // We comment out the arguments so that we can use "./server" and "./client_{i}" and such to run the programs. UDP runs on 127.0.0.1:8080 for debugging
-    if (argc != 2)
+// X
+void sendStats(int sockfd, struct message *request, struct sockaddr_in client_addr, int client_addr_size)
+{ // Answer with as much of the metrics text as fits in one datagram, starting at the offset asked for. The text is made again for
+  // every datagram, so one read in several of them mixes moments a few milliseconds apart. Only the busiest peers are listed
+    struct stats_page page;
+    struct message reply;
+    char *text = NULL;
+    size_t length = 0;
+    bzero(&page, sizeof(page));
+    memcpy(&page, request->payload, ntohs(request->header.length) < sizeof(page) ? ntohs(request->header.length) : sizeof(page));
+    FILE *out = open_memstream(&text, &length);
+    if (out == NULL)
     {
-        printf("You have passed in an invalid input. Please run in the format: ./server portNumber.\n");
-        exit(1);
+        sendReply(sockfd, request, 'E', "Out of memory...", &client_addr, client_addr_size);
+        return;
     }
-    int port = atoi(argv[1]);
-    // int port = 8008;
-    int sockfd, num, binding;
-    long file_size;
-    char requested_file_path[STANDARD_BUF_SIZE];
+    writeServerMetrics(out, STATS_TOP_PEERS);
+    fclose(out);
 
-    struct sockaddr_in server_addr, client_addr;
-    ssize_t recv_size;
-    socklen_t from_length;
+    uint32_t offset = ntohl(page.offset) < length ? ntohl(page.offset) : length;
+    size_t slice = length - offset < MAX_PAYLOAD_SIZE - sizeof(page) ? length - offset : MAX_PAYLOAD_SIZE - sizeof(page);
+    page.offset = htonl(offset);
+    page.total = htonl(length);
+    reply.header.version = PROTOCOL_VERSION;
+    reply.header.type = 'X';
+    reply.header.request_id = request->header.request_id;
+    reply.header.length = htons(sizeof(page) + slice);
+    memcpy(reply.payload, &page, sizeof(page));
+    memcpy(reply.payload + sizeof(page), text + offset, slice);
+    free(text);
+    if (sendDatagram(sockfd, request, &reply, sizeof(reply.header) + sizeof(page) + slice, &client_addr, client_addr_size) < 0 && debug)
+        perror("Could not send statistics");
+}
 
+// WORKERS
+int openServerSocket(int port)
+{ // Create UDP socket listener on specified port on available IP in the network. SO_REUSEPORT lets every worker bind its own
+  // socket to the same port and the kernel spreads datagrams across them by source address
+    struct sockaddr_in server_addr;
+    int reuse = 1;
     bzero(&server_addr, sizeof(server_addr));
-
-    // Create UDP socket listener on specified port on available IP in the network.
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
     server_addr.sin_port = htons(port);
-    from_length = sizeof(server_addr);
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if (sockfd < 0)
     {
         printf("Error creating socket...\n");
-        return 1;
+        return -1;
     }
-
-    printf("Server is starting...\n");
-    if ((binding = bind(sockfd, (struct sockaddr*)&server_addr, from_length)) < 0)
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
+        perror("Could not set SO_REUSEPORT");
+    setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &reuse, sizeof(reuse)); // every datagram then says how many the socket dropped
+    if (bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0)
     {
         printf("\n Error binding socket...\n");
         close(sockfd);
-        return 1;
+        return -1;
     }
-
-    printf("Server has binded... Server is now running.\n");
-    int len = sizeof(client_addr);
+    return sockfd;
+}
+void* serveRequests(void *arg)
+{ // Worker loop. Each request is one self-contained datagram so workers never have to wait for a second read from the same peer
+    int sockfd = *(int*)arg;
+    struct sockaddr_in client_addr;
+    struct message request;
+    char control[CMSG_SPACE(sizeof(uint32_t))];
+    my_stats = &worker_stats[__atomic_fetch_add(&stats_workers, 1, __ATOMIC_RELAXED) % MAX_WORKERS];
 
     while(1)
     {
-        char num;
-        recvfrom(sockfd, &num, sizeof(num), 0, (struct sockaddr *)&client_addr, &len);
-        printf("Request: %c\n\n", num);
+        struct iovec vector = { &request, sizeof(request) };
+        struct msghdr header = { .msg_name = &client_addr, .msg_namelen = sizeof(client_addr), .msg_iov = &vector, .msg_iovlen = 1,
+            .msg_control = control, .msg_controllen = sizeof(control) };
+        ssize_t size = recvmsg(sockfd, &header, 0);
+        int len = header.msg_namelen;
+        uint64_t started = nowNanoseconds();
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&header); size >= 0 && c != NULL; c = CMSG_NXTHDR(&header, c))
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL)
+            {
+                uint32_t dropped;
+                memcpy(&dropped, CMSG_DATA(c), sizeof(dropped));
+                __atomic_store_n(&my_stats->kernel_drops, dropped, __ATOMIC_RELAXED);
+            }
+        if (size < (ssize_t)sizeof(request.header))
+            continue;
+        if (request.header.version != PROTOCOL_VERSION || ntohs(request.header.length) != size - sizeof(request.header))
+        { // Datagrams from an older client or truncated ones are refused rather than guessed at
+            addStat(&my_stats->malformed, 1);
+            sendReply(sockfd, &request, 'E', "Unsupported protocol version or malformed request...\n", &client_addr, len);
+            continue;
+        }
+        if (resendCachedReply(sockfd, &request, &client_addr, len))
+            continue; // the client did not hear the answer, carrying the request out again could register or charge twice
+        if (debug)
+            printf("Request: %c\n\n", request.header.type);
+        if (__atomic_load_n(&recovering, __ATOMIC_ACQUIRE) &&
+            (request.header.type == 'R' || request.header.type == 'B' || request.header.type == 'T' || request.header.type == 'L'))
+        { // A change made now could be undone by the replay still running behind it
+            sendReply(sockfd, &request, 'E', "Index server is recovering, try again shortly...", &client_addr, len);
+            countRequest(request.header.type, started);
+            continue;
+        }
 
-        int i = 0;
-        switch(num)
+        switch(request.header.type)
         {
             case 'R':
-                registerContent(sockfd, client_addr, &len);
+                registerContent(sockfd, &request, client_addr, len);
+                break;
+            case 'B':
+                registerBatch(sockfd, &request, client_addr, len);
                 break;
             case 'S':
-                processDownloadRequest(sockfd, client_addr, &len);
+                processDownloadRequest(sockfd, &request, client_addr, len);
                 break;
+            case 'F':
+                processDownloadFinished(sockfd, &request, client_addr, len);
+                break;
+            case 'H':
+            { // Heartbeat renewing the lease on all of a peer's registrations at once
+                char peer_name[DEFAULT_NAME_SIZE];
+                bzero(peer_name, DEFAULT_NAME_SIZE);
+                memcpy(peer_name, request.payload, ntohs(request.header.length) < DEFAULT_NAME_SIZE ? ntohs(request.header.length) : DEFAULT_NAME_SIZE);
+                if (renewLease(peer_name) || __atomic_load_n(&recovering, __ATOMIC_ACQUIRE)) // recovered peers get a fresh lease anyway
+                    sendReply(sockfd, &request, 'A', NULL, &client_addr, len);
+                else
+                    sendReply(sockfd, &request, 'E', "Unknown peer, register again...", &client_addr, len);
+                break;
+            }
             case 'T':
             {
-                deRegisterContent(sockfd, client_addr, &len);
+                deRegisterContent(sockfd, &request, client_addr, len);
                 break;
             }
             case 'O':
-                printHostedFiles(sockfd, head, client_addr, len);
+                printHostedFiles(sockfd, &request, client_addr, len);
+                break;
+            case 'Q':
+                searchContent(sockfd, &request, client_addr, len);
                 break;
             case 'L':
             {
                 char leaving_peer[DEFAULT_NAME_SIZE];
-                if (recvfrom(sockfd, &leaving_peer, DEFAULT_NAME_SIZE, 0, (struct sockaddr *)&client_addr, &len) < 0)
-                { // CRITICAL errors occur when the peer and server lose sink (because of UDP unreliability most of the time). Requires a restart...
-                    printf("CRITICAL ERROR: Peer left without notice...\n\n");
-                }
-                // When a client leaves, note it and remove their orphan files from the linked list. 
-                printf("Client has left the peer group...\n");
+                bzero(leaving_peer, DEFAULT_NAME_SIZE);
+                memcpy(leaving_peer, request.payload, ntohs(request.header.length) < DEFAULT_NAME_SIZE ? ntohs(request.header.length) : DEFAULT_NAME_SIZE);
+                // When a client leaves, note it and remove their orphan files from the registry. 
+                if (debug)
+                    printf("Client has left the peer group...\n");
                 removeOrphanFiles(leaving_peer);
+                sendReply(sockfd, &request, 'A', NULL, &client_addr, len);
                 break;
             }
+            case 'X':
+                sendStats(sockfd, &request, client_addr, len);
+                break;
+            default:
+                sendReply(sockfd, &request, 'E', "Unknown request type...\n", &client_addr, len);
+        }
+        countRequest(request.header.type, started);
+    }
+    return NULL;
+}
+
+/* MAIN */
+int main(int argc, char *argv[])
+{ // We comment out the arguments so that we can use "./server" and "./client_{i}" and such to run the programs. UDP runs on 127.0.0.1:8080 for debugging
+    int port = 0, workers = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+            workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--lease") == 0 && i + 1 < argc)
+            lease_seconds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--state") == 0 && i + 1 < argc)
+            state_dir = argv[++i];
+        else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
+            metrics_path = argv[++i];
+        else if (strcmp(argv[i], "--debug") == 0)
+            debug = 1;
+        else if (port == 0)
+            port = atoi(argv[i]);
+        else
+            port = -1;
+    }
+    if (port <= 0 || workers < 1 || workers > MAX_WORKERS || lease_seconds < 1)
+    {
+        printf("You have passed in an invalid input. Please run in the format: ./server portNumber [--workers N] [--lease SECONDS] [--state DIRECTORY] [--metrics FILE] [--debug].\n");
+        exit(1);
+    }
+    // int port = 8008;
+    initRegistry();
+    for (int i = 0; i < REPLY_CACHE_LOCKS; i++)
+        pthread_mutex_init(&reply_cache_locks[i], NULL);
+    if (state_dir != NULL && !openState())
+        return 1;
+
+    printf("Server is starting...\n");
+    int sockets[MAX_WORKERS];
+    pthread_t threads[MAX_WORKERS];
+    for (int i = 0; i < workers; i++)
+    {
+        if ((sockets[i] = openServerSocket(port)) < 0)
+            return 1;
+    }
+
+    printf("Server has binded... Server is now running with %d worker%s.\n", workers, workers == 1 ? "" : "s");
+    pthread_t expiry_thread;
+    if (pthread_create(&expiry_thread, NULL, leaseExpiryLoop, NULL) != 0)
+    {
+        printf("Error starting lease expiry...\n");
+        return 1;
+    }
+    pthread_t name_index_thread;
+    if (pthread_create(&name_index_thread, NULL, nameIndexLoop, NULL) != 0)
+    {
+        printf("Error starting the name index...\n");
+        return 1;
+    }
+    pthread_t metrics_thread;
+    if (metrics_path != NULL && pthread_create(&metrics_thread, NULL, metricsLoop, NULL) != 0)
+    {
+        printf("Error starting the metrics file...\n");
+        return 1;
+    }
+    pthread_t state_thread;
+    if (state_dir != NULL && pthread_create(&state_thread, NULL, stateLoop, NULL) != 0)
+    {
+        printf("Error starting recovery...\n");
+        return 1;
+    }
+    for (int i = 1; i < workers; i++)
+    {
+        if (pthread_create(&threads[i], NULL, serveRequests, &sockets[i]) != 0)
+        {
+            printf("Error starting worker %d...\n", i);
+            return 1;
         }
     }
+    serveRequests(&sockets[0]);
 }
@@ -1 +1 @@
-gcc -o client/client client/client.c -lnsl && gcc -o server/server server/server.c -lnsl
+gcc -O2 -march=native -pthread -o client/client client/client.c -lnsl && gcc -O2 -march=native -pthread -o server/server server/server.c -lnsl
@@ -0,0 +1,184 @@
+// Registration test: a peer that registers the same batch again from another address, as it does after a restart, hears that every
+// file is registered and downloaders are sent to the new address. An R from yet another address moves a file the same way, and only
+// the same R again is refused as a duplicate. A file another peer holds under a different root is still refused. A download from two
+// holders is charged to both until it is reported finished
+// Build from the repository root with 'gcc -O2 -pthread -o tests/register_test tests/register_test.c' and run './tests/register_test'.
+// Exits 0 if everything holds
+
+/* DEFINITIONS */
+// Pull in the index server as a library. Its main is renamed so this file can provide its own
+#define main server_main
+#include "../server/server.c"
+#undef main
+
+#define TEST_FILES 3
+
+
+/* UTILITY FUNCTIONS */
+int openLoopbackSocket(struct sockaddr_in *addr)
+{ // A UDP socket on a free loopback port it writes to addr, that gives up on a reply after a second. Returns -1 on failure
+    socklen_t length = sizeof(*addr);
+    struct timeval timeout = { 1, 0 };
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    bzero(addr, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sockfd < 0 || bind(sockfd, (struct sockaddr*)addr, sizeof(*addr)) < 0 || getsockname(sockfd, (struct sockaddr*)addr, &length) < 0)
+        return -1;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return sockfd;
+}
+int registerTestBatch(int server, int peer, struct sockaddr_in peer_addr, uint32_t request_id, const char *peer_name,
+    const char *address, unsigned char root_seed, struct batch_status *status)
+{ // Have the server take a batch of TEST_FILES files "f<i>" from peer_name at address, their roots made from root_seed, and read its
+  // answer into status. Returns 0 if it did not answer with one
+    struct bpdu batch;
+    struct message request, reply;
+    bzero(&batch, sizeof(batch));
+    strncpy(batch.peer_name, peer_name, DEFAULT_NAME_SIZE - 1);
+    strncpy(batch.address, address, sizeof(batch.address) - 1);
+    batch.capacity = htons(4);
+    batch.count = TEST_FILES;
+    for (int i = 0; i < TEST_FILES; i++)
+    {
+        snprintf(batch.items[i].content_name, DEFAULT_NAME_SIZE, "f%d", i);
+        memset(batch.items[i].root, root_seed + i, HASH_SIZE);
+    }
+    size_t length = offsetof(struct bpdu, items) + TEST_FILES * sizeof(struct batch_item);
+    request.header.version = PROTOCOL_VERSION;
+    request.header.type = 'B';
+    request.header.request_id = htonl(request_id);
+    request.header.length = htons(length);
+    memcpy(request.payload, &batch, length);
+    registerBatch(server, &request, peer_addr, sizeof(peer_addr));
+
+    ssize_t size = recv(peer, &reply, sizeof(reply), 0);
+    if (size < (ssize_t)(sizeof(reply.header) + sizeof(*status)) || reply.header.type != 'B')
+        return 0;
+    memcpy(status, reply.payload, sizeof(*status));
+    return 1;
+}
+int registerTestFile(int server, int peer, struct sockaddr_in peer_addr, uint32_t request_id, const char *peer_name,
+    const char *content_name, const char *address, struct message *reply)
+{ // Have the server take an R for content_name from peer_name at address and read its answer into reply. Returns 0 if it did not
+  // answer
+    struct rpdu file;
+    struct message request;
+    bzero(&file, sizeof(file));
+    file.type = 'R';
+    strncpy(file.peer_name, peer_name, DEFAULT_NAME_SIZE - 1);
+    strncpy(file.content_name, content_name, DEFAULT_NAME_SIZE - 1);
+    strncpy(file.address, address, sizeof(file.address) - 1);
+    file.capacity = htons(4);
+    request.header.version = PROTOCOL_VERSION;
+    request.header.type = 'R';
+    request.header.request_id = htonl(request_id);
+    request.header.length = htons(sizeof(file));
+    memcpy(request.payload, &file, sizeof(file));
+    registerContent(server, &request, peer_addr, sizeof(peer_addr));
+    bzero(reply, sizeof(*reply)); // error texts come without their terminator
+    return recv(peer, reply, sizeof(*reply), 0) >= (ssize_t)sizeof(reply->header);
+}
+int countRegistered(const struct batch_status *status)
+{ // How many bits of status are set
+    int registered = 0;
+    for (int i = 0; i < status->count; i++)
+        registered += (status->registered[i / 8] >> (i % 8)) & 1;
+    return registered;
+}
+int peerInFlight(const char *peer_name)
+{ // The downloads the index counts against peer_name, -1 if it is not registered
+    struct registry_shard *shard = shardFor(peer_shards, hashName(peer_name));
+    pthread_rwlock_rdlock(&shard->lock);
+    struct peer_entry *peer = (struct peer_entry*)tableFind(&shard->table, peer_name);
+    int in_flight = peer != NULL ? __atomic_load_n(&peer->in_flight, __ATOMIC_RELAXED) : -1;
+    pthread_rwlock_unlock(&shard->lock);
+    return in_flight;
+}
+
+
+/* MAIN */
+int main(int argc, char *argv[])
+{ // Register a batch, register it again from a new address, check where downloaders go, move a file with R, clash with another
+  // peer's roots, then download from two holders
+    struct sockaddr_in server_addr, peer_addr;
+    struct batch_status status;
+    struct message reply;
+    struct source_list sources;
+    struct spdu query;
+    int failures = 0;
+    initRegistry();
+    for (int i = 0; i < REPLY_CACHE_LOCKS; i++)
+        pthread_mutex_init(&reply_cache_locks[i], NULL);
+    int server = openLoopbackSocket(&server_addr), peer = openLoopbackSocket(&peer_addr);
+    if (server < 0 || peer < 0)
+    {
+        printf("Cannot open loopback sockets...\n");
+        return 1;
+    }
+
+    if (!registerTestBatch(server, peer, peer_addr, 1, "alice", "127.0.0.1:4000", 1, &status) || countRegistered(&status) != TEST_FILES)
+    {
+        printf("FAIL: the first batch was not registered\n");
+        failures++;
+    }
+    if (!registerTestBatch(server, peer, peer_addr, 2, "alice", "127.0.0.1:4001", 1, &status) || countRegistered(&status) != TEST_FILES)
+    {
+        printf("FAIL: the same batch again got %d of %d files registered\n", countRegistered(&status), TEST_FILES);
+        failures++;
+    }
+    bzero(&query, sizeof(query));
+    strcpy(query.peer_name, "bob");
+    strcpy(query.content_name, "f1");
+    if (getHostedFile(query, &sources) != 1 || strncmp(sources.sources[0].address, "127.0.0.1:4001", sizeof(sources.sources[0].address)) != 0)
+    {
+        printf("FAIL: downloaders of f1 are not sent to the new address\n");
+        failures++;
+    }
+    finishTicket(ntohl(sources.ticket));
+    if (!registerTestFile(server, peer, peer_addr, 3, "alice", "f0", "127.0.0.1:4002", &reply) || reply.header.type != 'A')
+    {
+        printf("FAIL: f0 registered again from a new address was not acknowledged\n");
+        failures++;
+    }
+    if (!registerTestFile(server, peer, peer_addr, 4, "alice", "f0", "127.0.0.1:4002", &reply) || reply.header.type != 'E' ||
+        strcmp(reply.payload, "Select a different name...") != 0)
+    {
+        printf("FAIL: f0 registered again from the same address was not refused as a duplicate\n");
+        failures++;
+    }
+    if (!registerTestBatch(server, peer, peer_addr, 5, "bob", "127.0.0.1:5000", 101, &status) || countRegistered(&status) != 0)
+    {
+        printf("FAIL: other content under names alice holds was registered\n");
+        failures++;
+    }
+    if (!registerTestBatch(server, peer, peer_addr, 6, "carol", "127.0.0.1:6000", 1, &status) || countRegistered(&status) != TEST_FILES)
+    {
+        printf("FAIL: a second holder of the same content was refused\n");
+        failures++;
+    }
+    if (getHostedFile(query, &sources) != 2 || peerInFlight("alice") != 1 || peerInFlight("carol") != 1)
+    {
+        printf("FAIL: a download from %d sources was not charged to each of them\n", sources.count);
+        failures++;
+    }
+    finishTicket(ntohl(sources.ticket));
+    if (peerInFlight("alice") != 0 || peerInFlight("carol") != 0)
+    {
+        printf("FAIL: finishing the download left alice at %d and carol at %d\n", peerInFlight("alice"), peerInFlight("carol"));
+        failures++;
+    }
+    if (tickets_active != 0)
+    {
+        printf("FAIL: %u downloads still counted in flight after all were finished\n", tickets_active);
+        failures++;
+    }
+    if (stale_releases != 0)
+    {
+        printf("FAIL: %llu releases found a peer with nothing in flight\n", (unsigned long long)stale_releases);
+        failures++;
+    }
+
+    printf(failures == 0 ? "PASS\n" : "%d checks failed\n", failures);
+    return failures != 0;
+}